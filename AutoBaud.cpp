@@ -0,0 +1,167 @@
+/*
+ * AutoBaud.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "AutoBaud.h"
+#include "Buses.h"
+#include "Logger.h"
+#include <EEPROM.h>
+
+//most common rates first so the usual cases lock quickly
+static const uint32_t candidates[] = {500000, 250000, 125000, 1000000, 33333, 83333, 100000, 800000, 50000, 20000, 10000};
+#define AUTOBAUD_NUM_CANDIDATES	(sizeof(candidates) / sizeof(candidates[0]))
+
+AUTOBAUD_BUS AutoBaud::buses[NUM_BUSES];
+
+//start a search on every bus whose bit is set in busMask. A mask of 0 cancels all of them
+void AutoBaud::start(uint8_t busMask)
+{
+    if (busMask == 0) {
+        for (int bus = 0; bus < Buses::count(); bus++) cancel(bus);
+        return;
+    }
+
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        if (!(busMask & (1 << bus)) || buses[bus].active) continue;
+        AUTOBAUD_BUS *ab = &buses[bus];
+        BUS_SETTINGS *bs = &settings.buses[bus];
+
+        ab->oldSpeed = bs->speed;
+        ab->oldEnabled = bs->enabled;
+        ab->oldListenOnly = bs->listenOnly;
+        ab->active = true;
+        ab->startedAt = millis();
+        ab->candidate = AUTOBAUD_NUM_CANDIDATES - 1; //so tryNext() wraps to the first one
+
+        Buses::setListenOnly(bus, true); //we must never ACK or send error frames at a wrong rate
+        if (!bs->enabled) {
+            bs->speed = candidates[0];
+            Buses::setEnabled(bus, true);
+        }
+        tryNext(bus);
+    }
+}
+
+void AutoBaud::cancel(int bus)
+{
+    if (!isRunning(bus)) return;
+    finish(bus, RESULT_CANCELLED);
+}
+
+boolean AutoBaud::isRunning(int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return false;
+    return buses[bus].active;
+}
+
+//apply the next candidate the bus can run at. Returns false once the search has gone on too long
+boolean AutoBaud::tryNext(int bus)
+{
+    AUTOBAUD_BUS *ab = &buses[bus];
+
+    if ((millis() - ab->startedAt) > AUTOBAUD_TIMEOUT) return false;
+
+    do {
+        ab->candidate = (ab->candidate + 1) % AUTOBAUD_NUM_CANDIDATES;
+    } while (candidates[ab->candidate] > Buses::maxSpeed(bus));
+
+    Buses::setSpeed(bus, candidates[ab->candidate]);
+    Buses::takeProtocolErrors(bus); //anything flagged while the controller restarted doesn't count
+    ab->trialAt = millis();
+    ab->rxAtTrial = Buses::getStats(bus)->rxFrames;
+    return true;
+}
+
+/*
+ * A candidate is rejected as soon as the controller reports a bit, stuff, form or CRC error,
+ * which a wrong rate produces within a frame or two on a busy bus. It wins once AUTOBAUD_MIN_FRAMES
+ * frames have come in cleanly, and is skipped if the window passes without enough traffic.
+ */
+void AutoBaud::loop()
+{
+    static uint32_t lastCheck;
+    uint32_t now = millis();
+
+    if (now == lastCheck) return; //error flags are polled once a millisecond, the MCP2515 costs an SPI transfer
+    lastCheck = now;
+
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        AUTOBAUD_BUS *ab = &buses[bus];
+        if (!ab->active) continue;
+
+        boolean errors = Buses::takeProtocolErrors(bus);
+        uint32_t frames = Buses::getStats(bus)->rxFrames - ab->rxAtTrial;
+
+        if (!errors && frames >= AUTOBAUD_MIN_FRAMES) finish(bus, RESULT_LOCKED);
+        else if (errors || (now - ab->trialAt) >= AUTOBAUD_WINDOW) {
+            if (!tryNext(bus)) finish(bus, RESULT_NO_TRAFFIC);
+        }
+    }
+}
+
+/*
+ * Settle the bus and report. On a lock the rate found is kept and saved along with the
+ * listen only setting the bus had before. Otherwise the bus goes back to how it was.
+ * Binary reply: F1 28 bus result speed (32 bit)
+ */
+void AutoBaud::finish(int bus, uint8_t result)
+{
+    AUTOBAUD_BUS *ab = &buses[bus];
+    uint32_t speed;
+    uint8_t buff[8];
+
+    ab->active = false;
+    Buses::setListenOnly(bus, ab->oldListenOnly);
+    if (result == RESULT_LOCKED) {
+        speed = candidates[ab->candidate];
+        Buses::setSpeed(bus, speed); //restart so the listen only change takes on the MCP2515 as well
+        EEPROM.write(EEPROM_PAGE, settings);
+    } else {
+        speed = ab->oldSpeed;
+        if (ab->oldEnabled) Buses::setSpeed(bus, speed);
+        else {
+            settings.buses[bus].speed = speed;
+            Buses::setEnabled(bus, false);
+        }
+    }
+
+    if (settings.useBinarySerialComm) {
+        buff[0] = 0xF1;
+        buff[1] = PROTO_AUTOBAUD;
+        buff[2] = bus;
+        buff[3] = result;
+        buff[4] = (uint8_t)(speed & 0xFF);
+        buff[5] = (uint8_t)(speed >> 8);
+        buff[6] = (uint8_t)(speed >> 16);
+        buff[7] = (uint8_t)(speed >> 24);
+        bufferUSBBytes(buff, 8);
+    } else if (!SysSettings.lawicelMode) {
+        if (result == RESULT_LOCKED)
+            Logger::console("%s autobaud locked at %i baud after %ims", Buses::name(bus), speed, millis() - ab->startedAt);
+        else if (result == RESULT_NO_TRAFFIC)
+            Logger::console("%s autobaud found no clean traffic, back to %i baud", Buses::name(bus), speed);
+        else Logger::console("%s autobaud cancelled", Buses::name(bus));
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * AutoBaud.h
+ *
+ * Finds the speed of an unknown bus. The controller is put in listen only mode and stepped
+ * through a list of common bitrates until one of them receives frames without any protocol errors.
+ * Every bus runs its own search at the same time.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef AUTOBAUD_H_
+#define AUTOBAUD_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct AUTOBAUD_BUS {
+    boolean active;
+    uint8_t candidate; //index into the candidate table
+    uint32_t startedAt; //millis() when the search began
+    uint32_t trialAt; //millis() when the current candidate was applied
+    uint32_t rxAtTrial; //bus RX count when the current candidate was applied
+    //put back if nothing is found
+    uint32_t oldSpeed;
+    boolean oldEnabled;
+    boolean oldListenOnly;
+};
+
+class AutoBaud
+{
+public:
+    enum AUTOBAUD_RESULT {
+        RESULT_LOCKED = 0,
+        RESULT_NO_TRAFFIC = 1, //timed out, old settings restored
+        RESULT_CANCELLED = 2
+    };
+
+    static void start(uint8_t busMask);
+    static void cancel(int bus);
+    static boolean isRunning(int bus);
+    static void loop();
+
+private:
+    static AUTOBAUD_BUS buses[NUM_BUSES];
+
+    static boolean tryNext(int bus);
+    static void finish(int bus, uint8_t result);
+};
+
+#endif /* AUTOBAUD_H_ */
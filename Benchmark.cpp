@@ -0,0 +1,200 @@
+/*
+ * Benchmark.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Benchmark.h"
+#include "Logger.h"
+
+static const char *modeNames[Benchmark::NUM_MODES] = {"usb_binary", "usb_ascii", "usb_lawicel", "file_binary", "file_gvret", "file_crtd"};
+
+//a repeatable mix of standard and extended IDs and every length from 0 to 8
+void Benchmark::makeFrame(CAN_FRAME &frame, uint32_t i)
+{
+    frame.extended = (i % 4) == 3;
+    frame.id = frame.extended ? 0x18DA00F1 + ((i & 0xFF) << 8) : 0x100 + (i % 0x600);
+    frame.rtr = 0;
+    frame.length = i % 9;
+    for (int c = 0; c < 8; c++) frame.data.bytes[c] = (uint8_t)(i * 37 + c);
+}
+
+//stands in for USB and the card during a run. Bytes are copied so the cost of moving them is still counted
+class BenchSink : public Print
+{
+public:
+    uint8_t scratch[BENCH_SCRATCH_SIZE];
+    uint32_t pos;
+
+    BenchSink() : pos(0) {}
+
+    virtual size_t write(uint8_t c)
+    {
+        scratch[pos++ % BENCH_SCRATCH_SIZE] = c;
+        return 1;
+    }
+
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        for (size_t done = 0; done < size; ) {
+            size_t at = pos % BENCH_SCRATCH_SIZE;
+            size_t chunk = size - done;
+            if (chunk > BENCH_SCRATCH_SIZE - at) chunk = BENCH_SCRATCH_SIZE - at;
+            memcpy(scratch + at, buffer + done, chunk);
+            done += chunk;
+            pos += chunk;
+        }
+        return size;
+    }
+};
+
+/*
+ * Runs with loop() held up, the receive rings keep filling meanwhile. Output goes into a
+ * scratch buffer instead of USB or the card, so neither the host stream nor the log is
+ * touched and the figures are the cost of formatting and copying each record. The file modes
+ * are skipped while logging is on since they have to switch the file format under it.
+ */
+void Benchmark::run(uint16_t frames)
+{
+    BENCH_RESULT results[NUM_MODES];
+    boolean oldBinary = settings.useBinarySerialComm;
+    boolean oldLawicel = SysSettings.lawicelMode;
+    uint8_t oldFileType = settings.fileOutputType;
+    CAN_FRAME frame;
+
+    BenchSink sink;
+
+    if (frames == 0) frames = BENCH_DEFAULT_FRAMES;
+    flushUSBBuffer();
+    usbOut = &sink;
+    Logger::setFileSink(&sink);
+
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+        BENCH_RESULT *r = &results[mode];
+        r->skipped = false;
+        r->frames = 0;
+        r->bytes = 0;
+        r->cycles = 0;
+        if (mode >= MODE_FILE_BINARY && SysSettings.logToFile) {
+            r->skipped = true;
+            continue;
+        }
+
+        SysSettings.lawicelMode = (mode == MODE_USB_LAWICEL);
+        settings.useBinarySerialComm = (mode == MODE_USB_BINARY);
+        if (mode == MODE_FILE_BINARY) settings.fileOutputType = BINARYFILE;
+        if (mode == MODE_FILE_GVRET) settings.fileOutputType = GVRET;
+        if (mode == MODE_FILE_CRTD) settings.fileOutputType = CRTD;
+
+        uint32_t start = DWT->CYCCNT;
+        for (uint32_t i = 0; i < frames; i++) {
+            makeFrame(frame, i);
+            if (mode >= MODE_FILE_BINARY) r->bytes += sendFrameToFile(frame, i & 1);
+            else {
+                if (mode == MODE_USB_BINARY && usbBufferFree() < 32) flushUSBBuffer(); //sendFrameToUSB doesn't check for room
+                r->bytes += sendFrameToUSB(frame, i & 1);
+            }
+        }
+        if (mode == MODE_USB_BINARY) flushUSBBuffer();
+        r->cycles = DWT->CYCCNT - start;
+        r->frames = frames;
+    }
+
+    usbOut = &SerialUSB;
+    Logger::setFileSink(NULL);
+    settings.useBinarySerialComm = oldBinary;
+    SysSettings.lawicelMode = oldLawicel;
+    settings.fileOutputType = oldFileType;
+
+    if (oldBinary) sendResults(results);
+    else printResults(results);
+}
+
+//number of data bytes that follow each sub command byte
+int Benchmark::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_RUN:
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_RUN - frames per mode (2 bytes, 0 = BENCH_DEFAULT_FRAMES)
+ */
+void Benchmark::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_RUN:
+        run(data[1] + ((uint16_t)data[2] << 8));
+        break;
+    }
+}
+
+/*
+ * 0xF1, PROTO_BENCHMARK, CMD_RUN, CYCLES_PER_US, NUM_MODES
+ * then per mode: mode, skipped, frames, bytes, cycles (4 bytes each)
+ */
+void Benchmark::sendResults(BENCH_RESULT *results)
+{
+    uint8_t buff[14];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_BENCHMARK;
+    buff[2] = CMD_RUN;
+    buff[3] = CYCLES_PER_US;
+    buff[4] = NUM_MODES;
+    bufferUSBBytes(buff, 5);
+
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+        uint32_t vals[3] = {results[mode].frames, results[mode].bytes, results[mode].cycles};
+        buff[0] = mode;
+        buff[1] = results[mode].skipped;
+        for (int v = 0; v < 3; v++) {
+            buff[2 + v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[4 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[5 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        bufferUSBBytes(buff, 14);
+    }
+}
+
+//comma separated so a script can pick the lines starting with BENCH out of the console output
+void Benchmark::printResults(BENCH_RESULT *results)
+{
+    SerialUSB.println();
+    SerialUSB.println("BENCH,mode,frames,bytes,cycles,frames_per_sec,bytes_per_frame,cycles_per_frame");
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+        BENCH_RESULT *r = &results[mode];
+        if (r->skipped) {
+            Logger::console("BENCH,%s,skipped", modeNames[mode]);
+            continue;
+        }
+        uint32_t fps = r->cycles ? (uint32_t)((uint64_t)r->frames * VARIANT_MCK / r->cycles) : 0;
+        Logger::console("BENCH,%s,%i,%i,%i,%i,%i,%i", modeNames[mode], r->frames, r->bytes, r->cycles, fps,
+                        r->bytes / r->frames, r->cycles / r->frames);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Benchmark.h
+ *
+ * Output path throughput test. Pushes synthetic frames through sendFrameToUSB() in binary,
+ * ASCII and Lawicel form and through sendFrameToFile() in each file format, with the output
+ * caught in a scratch buffer, then reports frames per second, bytes per frame and cycles per
+ * frame for every mode.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct BENCH_RESULT {
+    boolean skipped; //file modes are skipped while logging is on
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t cycles;
+};
+
+class Benchmark
+{
+public:
+    enum BENCH_CMD {
+        CMD_RUN = 0
+    };
+
+    enum BENCH_MODES {
+        MODE_USB_BINARY = 0,
+        MODE_USB_ASCII = 1,
+        MODE_USB_LAWICEL = 2,
+        MODE_FILE_BINARY = 3,
+        MODE_FILE_GVRET = 4,
+        MODE_FILE_CRTD = 5,
+        NUM_MODES = 6
+    };
+
+    static void run(uint16_t frames);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+
+private:
+    static void makeFrame(CAN_FRAME &frame, uint32_t i);
+    static void sendResults(BENCH_RESULT *results);
+    static void printResults(BENCH_RESULT *results);
+};
+
+#endif /* BENCHMARK_H_ */
@@ -0,0 +1,253 @@
+/*
+ * BitTracker.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "BitTracker.h"
+#include "sys_io.h"
+
+BITTRACK_ENTRY BitTracker::entries[BITTRACK_MAX_IDS];
+uint16_t BitTracker::toggles[BITTRACK_MAX_COUNTED][64];
+uint8_t BitTracker::numCounted = 0;
+boolean BitTracker::enabled = false;
+uint8_t BitTracker::resetPin = 255;
+boolean BitTracker::lastPinState = false;
+uint32_t BitTracker::untracked = 0;
+uint16_t BitTracker::uncounted = 0;
+uint32_t BitTracker::resetTime = 0;
+
+void BitTracker::setEnabled(boolean en)
+{
+    if (en && !enabled) reset();
+    enabled = en;
+}
+
+boolean BitTracker::isEnabled()
+{
+    return enabled;
+}
+
+/*
+ * Forget everything that has changed so far. The table is emptied so the next frame
+ * of each ID becomes the new reference point. Counter sets are cleared as they are handed out.
+ */
+void BitTracker::reset()
+{
+    for (int i = 0; i < BITTRACK_MAX_IDS; i++) {
+        entries[i].used = false;
+        entries[i].seen = false;
+        entries[i].changed = 0;
+    }
+    numCounted = 0;
+    untracked = 0;
+    uncounted = 0;
+    resetTime = millis();
+}
+
+/*
+ * Open addressed hash table with linear probing. Entries are only ever removed all at once
+ * by reset() so an empty slot always terminates the search. The search gives up after
+ * BITTRACK_MAX_PROBES slots so a nearly full table can't make every frame walk all of it.
+ */
+BITTRACK_ENTRY *BitTracker::findEntry(uint32_t id, uint8_t bus)
+{
+    uint32_t hash = (id ^ (id >> 7) ^ ((uint32_t)bus << 5)) % BITTRACK_MAX_IDS;
+
+    for (int probe = 0; probe < BITTRACK_MAX_PROBES; probe++) {
+        BITTRACK_ENTRY *entry = &entries[hash];
+        if (!entry->used) {
+            entry->used = true;
+            entry->seen = false;
+            entry->counters = COUNTERS_NONE;
+            entry->id = id;
+            entry->bus = bus;
+            return entry;
+        }
+        if (entry->id == id && entry->bus == bus) return entry;
+        if (++hash == BITTRACK_MAX_IDS) hash = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Called for every received frame. The common case (nothing changed) is a hash, an XOR and a compare.
+ * Only bits that actually toggled cost anything more than that.
+ */
+void BitTracker::processFrame(CAN_FRAME &frame, int whichBus)
+{
+    if (!enabled) return;
+
+    uint32_t id = frame.id;
+    if (frame.extended) id |= 1ul << 31;
+
+    BITTRACK_ENTRY *entry = findEntry(id, whichBus);
+    if (!entry) {
+        untracked++;
+        return;
+    }
+
+    uint64_t data = frame.data.value;
+    if (frame.length < 8) data &= (1ull << (frame.length * 8)) - 1;
+
+    if (!entry->seen) {
+        entry->seen = true;
+        entry->lastData = data;
+        return;
+    }
+
+    uint64_t diff = data ^ entry->lastData;
+    if (!diff) return;
+    entry->lastData = data;
+    entry->changed |= diff;
+
+    if (entry->counters == COUNTERS_NONE) {
+        if (numCounted < BITTRACK_MAX_COUNTED) {
+            entry->counters = numCounted++;
+            for (int b = 0; b < 64; b++) toggles[entry->counters][b] = 0;
+        } else {
+            entry->counters = COUNTERS_FULL;
+            uncounted++;
+        }
+    }
+    if (entry->counters == COUNTERS_FULL) return;
+
+    uint16_t *counts = toggles[entry->counters];
+    while (diff) {
+        int bit = __builtin_ctzll(diff);
+        if (counts[bit] != 0xFFFF) counts[bit]++;
+        diff &= diff - 1;
+    }
+}
+
+//0 for IDs that never got a counter set
+uint16_t BitTracker::toggleCount(BITTRACK_ENTRY *entry, int bit)
+{
+    if (entry->counters >= BITTRACK_MAX_COUNTED) return 0;
+    return toggles[entry->counters][bit];
+}
+
+void BitTracker::setResetPin(uint8_t which)
+{
+    if (which >= NUM_DIGITAL) which = 255;
+    resetPin = which;
+    if (resetPin != 255) lastPinState = getDigital(resetPin);
+}
+
+uint8_t BitTracker::getResetPin()
+{
+    return resetPin;
+}
+
+//watch the reset input and start a fresh capture window on each activation
+void BitTracker::loop()
+{
+    if (!enabled || resetPin == 255) return;
+
+    boolean pinState = getDigital(resetPin);
+    if (pinState && !lastPinState) {
+        reset();
+        if (!settings.useBinarySerialComm) Logger::console("Bit tracker reset by digital input %i", resetPin);
+    }
+    lastPinState = pinState;
+}
+
+/*
+ * Human readable report. One line per ID that had at least one bit change:
+ * bus, ID, changed mask (byte 0 first) then bit:count pairs. Bit numbers are byte * 8 + bit.
+ */
+void BitTracker::dumpConsole()
+{
+    char buff[24];
+
+    Logger::console("Bit tracker report - %i ms since reset, %i frames not tracked, %i IDs without toggle counts",
+                    millis() - resetTime, untracked, uncounted);
+    for (int i = 0; i < BITTRACK_MAX_IDS; i++) {
+        BITTRACK_ENTRY *entry = &entries[i];
+        if (!entry->used || !entry->changed) continue;
+
+        SerialUSB.print(entry->bus);
+        SerialUSB.print(" ");
+        SerialUSB.print(entry->id & 0x7FFFFFFF, HEX);
+        SerialUSB.print((entry->id & (1ul << 31)) ? " X " : " S ");
+        for (int b = 0; b < 8; b++) {
+            sprintf(buff, "%02X", (uint8_t)(entry->changed >> (b * 8)));
+            SerialUSB.print(buff);
+        }
+        uint64_t mask = entry->changed;
+        while (mask) {
+            int bit = __builtin_ctzll(mask);
+            sprintf(buff, " %i:%u", bit, toggleCount(entry, bit));
+            SerialUSB.print(buff);
+            mask &= mask - 1;
+        }
+        SerialUSB.println();
+    }
+}
+
+/*
+ * Binary report:
+ * 0xF1, PROTO_BITTRACK, CMD_DUMP, count (2 bytes)
+ * then per entry: bus, ID (4 bytes, bit 31 = extended), changed mask (8 bytes, byte 0 first),
+ * then a 16 bit toggle count for each set bit of the mask starting with the lowest.
+ * The counts are 0 for IDs that changed after all BITTRACK_MAX_COUNTED counter sets were in use.
+ */
+void BitTracker::dumpBinary()
+{
+    uint8_t buff[16];
+    uint16_t count = 0;
+
+    for (int i = 0; i < BITTRACK_MAX_IDS; i++) {
+        if (entries[i].used && entries[i].changed) count++;
+    }
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_BITTRACK;
+    buff[2] = CMD_DUMP;
+    buff[3] = (uint8_t)(count & 0xFF);
+    buff[4] = (uint8_t)(count >> 8);
+    SerialUSB.write(buff, 5);
+
+    for (int i = 0; i < BITTRACK_MAX_IDS; i++) {
+        BITTRACK_ENTRY *entry = &entries[i];
+        if (!entry->used || !entry->changed) continue;
+
+        buff[0] = entry->bus;
+        buff[1] = (uint8_t)(entry->id & 0xFF);
+        buff[2] = (uint8_t)(entry->id >> 8);
+        buff[3] = (uint8_t)(entry->id >> 16);
+        buff[4] = (uint8_t)(entry->id >> 24);
+        for (int b = 0; b < 8; b++) buff[5 + b] = (uint8_t)(entry->changed >> (b * 8));
+        SerialUSB.write(buff, 13);
+
+        uint64_t mask = entry->changed;
+        while (mask) {
+            int bit = __builtin_ctzll(mask);
+            uint16_t toggled = toggleCount(entry, bit);
+            buff[0] = (uint8_t)(toggled & 0xFF);
+            buff[1] = (uint8_t)(toggled >> 8);
+            SerialUSB.write(buff, 2);
+            mask &= mask - 1;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * BitTracker.h
+ *
+ * Accumulates which payload bits change for each (bus, ID) pair so that the
+ * "which bit moved when I pushed the button" question can be answered on the device.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BITTRACKER_H_
+#define BITTRACKER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct BITTRACK_ENTRY {
+    uint32_t id; //bit 31 set for extended frames, same as the binary protocol
+    uint8_t bus;
+    boolean used;
+    boolean seen; //false until the first frame has given us a baseline to diff against
+    uint8_t counters; //set of toggle counters in BitTracker::toggles, or one of BitTracker::COUNTERS
+    uint64_t lastData;
+    uint64_t changed; //OR of every XOR between consecutive frames since the last reset
+};
+
+class BitTracker
+{
+public:
+    enum BITTRACK_CMD {
+        CMD_DISABLE = 0,
+        CMD_ENABLE = 1,
+        CMD_RESET = 2,
+        CMD_DUMP = 3
+    };
+
+    enum COUNTERS {
+        COUNTERS_NONE = 255, //nothing has changed yet
+        COUNTERS_FULL = 254 //changed after every counter set was taken, only the changed mask is kept
+    };
+
+    static void setEnabled(boolean en);
+    static boolean isEnabled();
+    static void reset();
+    static void processFrame(CAN_FRAME &frame, int whichBus);
+    static void setResetPin(uint8_t which);
+    static uint8_t getResetPin();
+    static void loop();
+    static void dumpConsole();
+    static void dumpBinary();
+
+private:
+    static BITTRACK_ENTRY entries[BITTRACK_MAX_IDS];
+    static uint16_t toggles[BITTRACK_MAX_COUNTED][64]; //per bit toggle counters (saturating)
+    static uint8_t numCounted;
+    static boolean enabled;
+    static uint8_t resetPin; //index for getDigital(), 255 = no reset input
+    static boolean lastPinState;
+    static uint32_t untracked; //frames that didn't fit in the table
+    static uint16_t uncounted; //IDs that changed without a counter set to count in
+    static uint32_t resetTime;
+
+    static BITTRACK_ENTRY *findEntry(uint32_t id, uint8_t bus);
+    static uint16_t toggleCount(BITTRACK_ENTRY *entry, int bit);
+};
+
+#endif /* BITTRACKER_H_ */
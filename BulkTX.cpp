@@ -0,0 +1,204 @@
+/*
+ * BulkTX.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "BulkTX.h"
+#include "TxQueue.h"
+
+uint8_t BulkTX::buffer[BULK_BUFF_SIZE];
+uint16_t BulkTX::expected = 0;
+uint16_t BulkTX::received = 0;
+boolean BulkTX::gotLength = false;
+boolean BulkTX::discard = false;
+
+BULK_FRAME BulkTX::staged[BULK_MAX_FRAMES];
+uint16_t BulkTX::stagedCount = 0;
+uint16_t BulkTX::releasePtr = 0;
+uint32_t BulkTX::batchStart = 0;
+
+/*
+ * CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) - cheap to do on the host in any language.
+ */
+uint16_t BulkTX::crc16(uint8_t *data, int length)
+{
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            if (crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+            else crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+//called when PROTO_BULK_TX has been seen
+void BulkTX::begin()
+{
+    received = 0;
+    expected = 0;
+    gotLength = false;
+    discard = false;
+}
+
+/*
+ * Command layout after 0xF1, PROTO_BULK_TX:
+ * payload length (2 bytes), payload, CRC16 of the payload (2 bytes)
+ * Payload: flags (bit 0 = every frame starts with a 4 byte send offset in uS), then per frame:
+ * [offset (4 bytes)], ID (4 bytes, bit 31 = extended), bus, length, data bytes
+ *
+ * The command parser hands over whatever it has buffered and the batch is copied straight in,
+ * so a batch spread over several USB packets is simply fed in several calls. used says how
+ * many bytes were taken. Returns true when the command is complete.
+ */
+boolean BulkTX::receive(uint8_t *data, int length, int &used)
+{
+    used = 0;
+    while (used < length) {
+        if (!gotLength) {
+            buffer[received++] = data[used++];
+            if (received < 2) continue;
+            expected = buffer[0] + ((uint16_t)buffer[1] << 8) + 2;
+            received = 0;
+            gotLength = true;
+            discard = (expected > BULK_BUFF_SIZE); //too big to hold, but still eat it so the parser stays in sync
+            continue;
+        }
+
+        int take = expected - received;
+        if (take > length - used) take = length - used;
+        if (!discard) memcpy(buffer + received, data + used, take);
+        received += take;
+        used += take;
+        if (received < expected) return false;
+
+        if (discard) sendStatus(BULK_BAD_FORMAT, 0);
+        else processBatch();
+        return true;
+    }
+    return false;
+}
+
+void BulkTX::processBatch()
+{
+    int payloadLen = expected - 2;
+    uint16_t crc = buffer[payloadLen] + ((uint16_t)buffer[payloadLen + 1] << 8);
+    if (crc16(buffer, payloadLen) != crc) {
+        sendStatus(BULK_BAD_CRC, 0);
+        return;
+    }
+
+    if (payloadLen < 1) {
+        sendStatus(BULK_BAD_FORMAT, 0);
+        return;
+    }
+
+    boolean timed = buffer[0] & 1;
+    if (releasePtr < stagedCount) {
+        sendStatus(BULK_BUSY, 0);
+        return;
+    }
+
+    //parse everything before queueing anything so a bad batch has no effect at all
+    int needed[NUM_BUSES];
+    for (int b = 0; b < NUM_BUSES; b++) needed[b] = 0;
+    int pos = 1;
+    uint16_t count = 0;
+    uint32_t lastOffset = 0;
+    while (pos < payloadLen) {
+        if (count >= BULK_MAX_FRAMES) {
+            sendStatus(BULK_BAD_FORMAT, count);
+            return;
+        }
+        BULK_FRAME *bf = &staged[count];
+        bf->offset = 0;
+        if (timed) {
+            if (pos + 4 > payloadLen) break;
+            bf->offset = buffer[pos] + ((uint32_t)buffer[pos + 1] << 8) + ((uint32_t)buffer[pos + 2] << 16) + ((uint32_t)buffer[pos + 3] << 24);
+            pos += 4;
+            if (bf->offset < lastOffset) break; //must be in send order
+            lastOffset = bf->offset;
+        }
+        if (pos + 6 > payloadLen) break;
+        uint32_t id = buffer[pos] + ((uint32_t)buffer[pos + 1] << 8) + ((uint32_t)buffer[pos + 2] << 16) + ((uint32_t)buffer[pos + 3] << 24);
+        bf->frame.extended = (id & (1ul << 31)) ? true : false;
+        bf->frame.id = id & 0x7FFFFFFF;
+        bf->frame.rtr = 0;
+        bf->bus = buffer[pos + 4];
+        bf->frame.length = buffer[pos + 5];
+        pos += 6;
+        if (bf->bus >= NUM_BUSES || bf->frame.length > 8 || pos + bf->frame.length > payloadLen) break;
+        for (int c = 0; c < bf->frame.length; c++) bf->frame.data.bytes[c] = buffer[pos + c];
+        pos += bf->frame.length;
+        needed[bf->bus]++;
+        count++;
+    }
+    if (pos != payloadLen) {
+        stagedCount = releasePtr = 0;
+        sendStatus(BULK_BAD_FORMAT, count);
+        return;
+    }
+
+    if (!timed) {
+        for (int b = 0; b < NUM_BUSES; b++) {
+            if (needed[b] > TxQueue::getDepth() - TxQueue::pending(b)) {
+                stagedCount = releasePtr = 0;
+                sendStatus(BULK_NO_ROOM, count);
+                return;
+            }
+        }
+        for (int i = 0; i < count; i++) TxQueue::queueFrame(staged[i].frame, staged[i].bus);
+        stagedCount = releasePtr = 0;
+    } else {
+        stagedCount = count;
+        releasePtr = 0;
+        batchStart = micros();
+        loop(); //anything with a zero offset goes now
+    }
+    sendStatus(BULK_OK, count);
+}
+
+//release timed frames into the transmit queues as they come due
+void BulkTX::loop()
+{
+    if (releasePtr >= stagedCount) return;
+    uint32_t elapsed = micros() - batchStart;
+    while (releasePtr < stagedCount && staged[releasePtr].offset <= elapsed) {
+        TxQueue::queueFrame(staged[releasePtr].frame, staged[releasePtr].bus);
+        releasePtr++;
+    }
+}
+
+//0xF1, PROTO_BULK_TX, status (BULK_STATUS), number of frames parsed (2 bytes)
+void BulkTX::sendStatus(uint8_t status, uint16_t count)
+{
+    uint8_t buff[5];
+    buff[0] = 0xF1;
+    buff[1] = PROTO_BULK_TX;
+    buff[2] = status;
+    buff[3] = (uint8_t)(count & 0xFF);
+    buff[4] = (uint8_t)(count >> 8);
+    bufferUSBBytes(buff, 5);
+}
@@ -0,0 +1,75 @@
+/*
+ * BulkTX.h
+ *
+ * Receives batches of frames in a single binary command, checks them with one CRC and
+ * either queues them all at once or releases them against their relative send times.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BULKTX_H_
+#define BULKTX_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct BULK_FRAME {
+    CAN_FRAME frame;
+    uint32_t offset; //uS after the batch was accepted
+    uint8_t bus;
+};
+
+class BulkTX
+{
+public:
+    enum BULK_STATUS {
+        BULK_OK = 0,
+        BULK_BAD_CRC = 1,
+        BULK_NO_ROOM = 2, //not enough transmit queue space to take the whole batch
+        BULK_BAD_FORMAT = 3,
+        BULK_BUSY = 4 //a timed batch is still being sent
+    };
+
+    static void begin();
+    static boolean receive(uint8_t *data, int length, int &used);
+    static void loop();
+    static uint16_t crc16(uint8_t *data, int length);
+
+private:
+    static uint8_t buffer[BULK_BUFF_SIZE];
+    static uint16_t expected; //payload length plus the two CRC bytes
+    static uint16_t received;
+    static boolean gotLength;
+    static boolean discard;
+
+    static BULK_FRAME staged[BULK_MAX_FRAMES];
+    static uint16_t stagedCount;
+    static uint16_t releasePtr;
+    static uint32_t batchStart;
+
+    static void processBatch();
+    static void sendStatus(uint8_t status, uint16_t count);
+};
+
+#endif /* BULKTX_H_ */
@@ -0,0 +1,806 @@
+/*
+ * Buses.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Buses.h"
+#include "Logger.h"
+#include "TxQueue.h"
+#include "Gateway.h"
+#include <due_can.h>
+#include <MCP2515.h>
+#include <SPI.h>
+
+//Only used by CANDue V2.2 boards
+MCP2515 SWCAN(CANDUE22_SW_CS, CANDUE22_SW_INT);
+
+static void SWCAN_Int()
+{
+    Buses::mcp2515Interrupt();
+}
+
+//called by due_can from the mailbox interrupt for every received frame
+static void CAN0_RX(CAN_FRAME *frame)
+{
+    Buses::pushRX(0, *frame);
+}
+
+static void CAN1_RX(CAN_FRAME *frame)
+{
+    Buses::pushRX(1, *frame);
+}
+
+//Bus numbers are positions in this table. SysSettings.numBuses says how many of them the board really has
+CAN_BUS Buses::table[NUM_BUSES] = {
+    {DRIVER_NATIVE, &Can0, 1000000, "CAN0", CAN0_RX},
+    {DRIVER_NATIVE, &Can1, 1000000, "CAN1", CAN1_RX},
+    {DRIVER_MCP2515, &SWCAN, 100000, "SWCAN", NULL}
+};
+BUS_STATS Buses::stats[NUM_BUSES];
+BUS_RX_RING Buses::rings[NUM_BUSES];
+BUS_HEALTH Buses::health[NUM_BUSES];
+uint32_t Buses::lastSlotTime;
+uint16_t Buses::rxSeq[NUM_BUSES];
+int8_t Buses::mcp2515Bus = -1;
+boolean Buses::mcp2515Attached = false;
+uint8_t Buses::spiLockDepth = 0;
+volatile boolean Buses::held[NUM_BUSES];
+
+//bring up every bus the settings say should be running
+void Buses::setup()
+{
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        if (SysSettings.busEnablePin[bus] != 255) pinMode(SysSettings.busEnablePin[bus], OUTPUT);
+    }
+    resetStats();
+
+    //free running cycle counter for receive stamps and latency figures
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    for (int bus = 0; bus < count(); bus++) {
+        if (table[bus].driver == DRIVER_MCP2515) mcp2515Bus = bus;
+    }
+    for (int bus = 0; bus < count(); bus++) {
+        if (settings.buses[bus].enabled) start(bus);
+        else stop(bus);
+    }
+}
+
+int Buses::count()
+{
+    return SysSettings.numBuses;
+}
+
+const char *Buses::name(int bus)
+{
+    if (bus < 0 || bus >= count()) return "NONE";
+    return table[bus].name;
+}
+
+uint32_t Buses::maxSpeed(int bus)
+{
+    if (bus < 0 || bus >= count()) return 0;
+    return table[bus].maxSpeed;
+}
+
+boolean Buses::isNative(int bus)
+{
+    if (bus < 0 || bus >= count()) return false;
+    return table[bus].driver == DRIVER_NATIVE;
+}
+
+boolean Buses::isEnabled(int bus)
+{
+    if (bus < 0 || bus >= count()) return false;
+    return settings.buses[bus].enabled;
+}
+
+void Buses::start(int bus)
+{
+    BUS_SETTINGS *bs = &settings.buses[bus];
+
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE: {
+        CANRaw *can = (CANRaw *)table[bus].dev;
+        if (bs->listenOnly) can->enable_autobaud_listen_mode();
+        else can->disable_autobaud_listen_mode();
+        can->enable();
+        can->begin(bs->speed, SysSettings.busEnablePin[bus]);
+        can->setGeneralCallback(table[bus].rxHandler); //frames go straight into our ring instead of the library's
+        //older boards turn CAN1 into the single wire bus with an external transceiver
+        if (bus == 1 && !SysSettings.dedicatedSWCAN) {
+            if (settings.singleWire_Enabled) setSWCANEnabled();
+            else setSWCANSleep();
+        }
+        break;
+    }
+    case DRIVER_MCP2515:
+        lockSPI();
+        SPI.begin();
+        mcp2515Attached = SWCAN.Init(bs->speed, 16); //the handler goes on when the lock is let go
+        unlockSPI();
+        if (mcp2515Attached) {
+            Logger::debug("MCP2515 Init OK ..."); //autobaud restarts the chip often, keep this off a binary stream
+            setSWCANEnabled();
+        } else {
+            Logger::error("MCP2515 Init Failed ...");
+        }
+        break;
+    }
+    applyFilters(bus);
+}
+
+void Buses::stop(int bus)
+{
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE:
+        if (bus == 1 && !SysSettings.dedicatedSWCAN) setSWCANSleep();
+        ((CANRaw *)table[bus].dev)->disable();
+        break;
+    case DRIVER_MCP2515:
+        setSWCANSleep();
+        break;
+    }
+}
+
+void Buses::applyFilters(int bus)
+{
+    BUS_SETTINGS *bs = &settings.buses[bus];
+
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE:
+        for (int i = 0; i < 7; i++) { //the eighth mailbox is kept for transmit
+            if (bs->filters[i].enabled) {
+                table[bus].dev->setRXFilter(i, bs->filters[i].id, bs->filters[i].mask, bs->filters[i].extended);
+            }
+        }
+        break;
+    case DRIVER_MCP2515:
+        applyMCP2515Filters(bus);
+        break;
+    }
+}
+
+/*
+ * The MCP2515 has two receive buffers with one mask each. Filters 0 - 1 of the bus settings go to
+ * buffer 0 and filters 2 - 5 to buffer 1; 6 and 7 have no hardware to go to. A buffer's mask is the AND
+ * of the masks of its enabled filters so it never rejects something one of them asked for, and it is
+ * laid out as a standard or extended mask following the first enabled filter of that buffer.
+ * A disabled filter repeats an enabled one so it can't let anything extra in.
+ */
+void Buses::applyMCP2515Filters(int bus)
+{
+    static const uint8_t filterRegs[6] = {FILTER0, FILTER1, FILTER2, FILTER3, FILTER4, FILTER5};
+    static const uint8_t bankStart[3] = {0, 2, 6};
+    BUS_SETTINGS *bs = &settings.buses[bus];
+    int fallback = -1;
+
+    for (int i = 0; i < 6; i++) {
+        if (bs->filters[i].enabled) {
+            fallback = i;
+            break;
+        }
+    }
+
+    lockSPI();
+    if (fallback < 0) SWCAN.InitFilters(true); //nothing set up, let everything through
+    else {
+        SWCAN.Mode(MODE_CONFIG);
+        for (int bank = 0; bank < 2; bank++) {
+            int use = -1;
+            uint32_t mask = 0x1FFFFFFF;
+            for (int i = bankStart[bank]; i < bankStart[bank + 1]; i++) {
+                if (!bs->filters[i].enabled) continue;
+                if (use < 0) use = i;
+                mask &= bs->filters[i].mask;
+            }
+            if (use < 0) {
+                use = fallback;
+                mask = bs->filters[fallback].mask;
+            }
+            SWCAN.SetRXMask(bank ? MASK1 : MASK0, mask, bs->filters[use].extended);
+            for (int i = bankStart[bank]; i < bankStart[bank + 1]; i++) {
+                int src = bs->filters[i].enabled ? i : use;
+                SWCAN.SetRXFilter(filterRegs[i], bs->filters[src].id, bs->filters[src].extended);
+            }
+        }
+    }
+    SWCAN.Mode(bs->listenOnly ? MODE_LISTEN : MODE_NORMAL);
+    unlockSPI();
+}
+
+/*
+ * INT pin handler for the MCP2515. Both receive buffers are emptied here with one SPI burst each
+ * so the controller's two frame deep buffer can't overflow while loop() is busy elsewhere.
+ * Transmit complete and error interrupts are left to the library.
+ */
+void Buses::mcp2515Interrupt()
+{
+    uint8_t flags;
+
+    while ((flags = SWCAN.Read(CANINTF)) & (RX0IF | RX1IF)) {
+        if (flags & RX0IF) readMCP2515Buffer(RXB0, RX0IF);
+        if (flags & RX1IF) readMCP2515Buffer(RXB1, RX1IF);
+    }
+
+    uint8_t errFlags = SWCAN.Read(EFLG);
+    if (errFlags & 0xC0) { //RX0OVR, RX1OVR - a frame arrived with the buffer still full
+        if (mcp2515Bus >= 0) {
+            if (errFlags & 0x40) stats[mcp2515Bus].hwOverrun++;
+            if (errFlags & 0x80) stats[mcp2515Bus].hwOverrun++;
+        }
+        SWCAN.BitModify(EFLG, 0xC0, 0);
+    }
+
+    if (flags) SWCAN.intHandler();
+}
+
+//reads SIDH, SIDL, EID8, EID0, DLC and the 8 data bytes of one receive buffer in a single transfer
+void Buses::readMCP2515Buffer(uint8_t reg, uint8_t flag)
+{
+    uint8_t raw[13];
+    CAN_FRAME frame;
+
+    SWCAN.Read(reg + 1, raw, 13);
+    SWCAN.BitModify(CANINTF, flag, 0); //buffer is free for the next frame
+
+    if (raw[1] & 0x08) { //IDE
+        frame.extended = true;
+        frame.id = ((uint32_t)raw[0] << 21) + ((uint32_t)(raw[1] & 0xE0) << 13) + ((uint32_t)(raw[1] & 3) << 16)
+                   + ((uint32_t)raw[2] << 8) + raw[3];
+        frame.rtr = (raw[4] & 0x40) ? 1 : 0;
+    } else {
+        frame.extended = false;
+        frame.id = ((uint32_t)raw[0] << 3) + (raw[1] >> 5);
+        frame.rtr = (raw[1] & 0x10) ? 1 : 0;
+    }
+    frame.length = raw[4] & 0x0F;
+    if (frame.length > 8) frame.length = 8;
+    memcpy(frame.data.bytes, raw + 5, 8);
+
+    if (mcp2515Bus >= 0) pushRX(mcp2515Bus, frame);
+}
+
+/*
+ * The MCP2515 interrupt handler does SPI transfers, so anything in loop() that uses SPI (the MCP2515
+ * itself or the SD card) holds this lock. It takes the handler off the INT pin rather than turning
+ * interrupts off so the native receive interrupts keep running through long card writes. Nests.
+ */
+void Buses::lockSPI()
+{
+    if (spiLockDepth++ == 0 && mcp2515Attached) detachInterrupt(CANDUE22_SW_INT);
+}
+
+//edges that came while the handler was off are lost, so the pin level is checked before and after putting it back
+void Buses::unlockSPI()
+{
+    if (spiLockDepth == 0 || --spiLockDepth > 0 || !mcp2515Attached) return;
+    for (int tries = 0; tries < 4; tries++) {
+        if (digitalRead(CANDUE22_SW_INT) == LOW) mcp2515Interrupt();
+        attachInterrupt(CANDUE22_SW_INT, SWCAN_Int, FALLING);
+        if (digitalRead(CANDUE22_SW_INT) == HIGH) return;
+        detachInterrupt(CANDUE22_SW_INT);
+    }
+    attachInterrupt(CANDUE22_SW_INT, SWCAN_Int, FALLING);
+}
+
+//interrupt context. The gateway fast path sees the frame first, then it is dropped and counted if loop() has fallen that far behind
+void Buses::pushRX(int bus, CAN_FRAME &frame)
+{
+    BUS_RX_RING *ring = &rings[bus];
+    uint16_t next = (ring->head + 1) % BUS_RX_RING_LEN;
+    uint32_t stamp = DWT->CYCCNT;
+
+    uint16_t seq = rxSeq[bus]++;
+
+    Gateway::processFrameISR(frame, bus, stamp);
+
+    if (next == ring->tail) {
+        stats[bus].rxOverflow++;
+        return;
+    }
+    ring->frames[ring->head] = frame;
+    ring->stamps[ring->head] = stamp;
+    ring->seqs[ring->head] = seq;
+    ring->head = next;
+}
+
+void Buses::setEnabled(int bus, boolean en)
+{
+    if (bus < 0 || bus >= count()) return;
+    settings.buses[bus].enabled = en;
+    if (table[bus].driver == DRIVER_MCP2515) settings.singleWire_Enabled = en;
+    if (en) start(bus);
+    else stop(bus);
+}
+
+void Buses::setSpeed(int bus, uint32_t speed)
+{
+    if (bus < 0 || bus >= count()) return;
+    if (speed > table[bus].maxSpeed) speed = table[bus].maxSpeed;
+    settings.buses[bus].speed = speed;
+    if (settings.buses[bus].enabled) start(bus);
+}
+
+void Buses::setListenOnly(int bus, boolean en)
+{
+    if (bus < 0 || bus >= count()) return;
+    settings.buses[bus].listenOnly = en;
+    if (table[bus].driver == DRIVER_NATIVE) {
+        if (en) ((CANRaw *)table[bus].dev)->enable_autobaud_listen_mode();
+        else ((CANRaw *)table[bus].dev)->disable_autobaud_listen_mode();
+    } else if (table[bus].driver == DRIVER_MCP2515 && settings.buses[bus].enabled) {
+        lockSPI();
+        SWCAN.Mode(en ? MODE_LISTEN : MODE_NORMAL);
+        unlockSPI();
+    }
+}
+
+void Buses::setFilter(int bus, int filter, uint32_t id, uint32_t mask, boolean extended, boolean enabled)
+{
+    if (bus < 0 || bus >= count() || filter < 0 || filter >= NUM_BUS_FILTERS) return;
+    FILTER *f = &settings.buses[bus].filters[filter];
+    f->id = id;
+    f->mask = mask;
+    f->extended = extended;
+    f->enabled = enabled;
+    if (table[bus].driver == DRIVER_NATIVE) table[bus].dev->setRXFilter(filter, id, mask, extended);
+    else if (table[bus].driver == DRIVER_MCP2515 && settings.buses[bus].enabled) applyMCP2515Filters(bus);
+}
+
+//open every receive mailbox without touching the stored filters
+void Buses::setPromiscuous(int bus)
+{
+    if (bus < 0 || bus >= count() || table[bus].driver != DRIVER_NATIVE) return;
+    for (int filter = 0; filter < 3; filter++) table[bus].dev->setRXFilter(filter, 0, 0, true);
+    for (int filter = 3; filter < 7; filter++) table[bus].dev->setRXFilter(filter, 0, 0, false);
+}
+
+/*
+ * Apply a bus setup word as the binary protocol sends it. 0 turns the bus off.
+ * Bit 31 set means bit 30 (enabled) and bit 29 (listen only) are valid, otherwise the bus is just enabled.
+ * The low 20 bits are the speed.
+ */
+void Buses::configure(int bus, uint32_t value)
+{
+    if (bus < 0 || bus >= count()) return;
+    BUS_SETTINGS *bs = &settings.buses[bus];
+
+    if (value == 0) {
+        setEnabled(bus, false);
+        return;
+    }
+    boolean en = true;
+    if (value & 0x80000000) {
+        en = (value & 0x40000000) ? true : false;
+        bs->listenOnly = (value & 0x20000000) ? true : false;
+    }
+    uint32_t speed = value & 0xFFFFF;
+    if (speed > table[bus].maxSpeed) speed = table[bus].maxSpeed;
+    bs->speed = speed;
+    setEnabled(bus, en);
+}
+
+int Buses::available(int bus)
+{
+    if (bus < 0 || bus >= count()) return 0;
+    BUS_RX_RING *ring = &rings[bus];
+    return (ring->head + BUS_RX_RING_LEN - ring->tail) % BUS_RX_RING_LEN;
+}
+
+//stamp, if given, gets the cycle count the frame was received at
+boolean Buses::read(int bus, CAN_FRAME &frame, uint32_t *stamp, uint16_t *seq)
+{
+    if (bus < 0 || bus >= count()) return false;
+    BUS_RX_RING *ring = &rings[bus];
+
+    if (ring->tail == ring->head) {
+        //the library's own handler can still pick up a frame that lands while it deals with a transmit interrupt
+        if (table[bus].driver != DRIVER_MCP2515) return false;
+        lockSPI();
+        boolean got = SWCAN.GetRXFrame(frame);
+        unlockSPI();
+        if (!got) return false;
+        if (stamp) *stamp = DWT->CYCCNT;
+        noInterrupts(); //the receive interrupt numbers frames too
+        if (seq) *seq = rxSeq[bus];
+        rxSeq[bus]++;
+        interrupts();
+    } else {
+        frame = ring->frames[ring->tail];
+        if (stamp) *stamp = ring->stamps[ring->tail];
+        if (seq) *seq = ring->seqs[ring->tail];
+        ring->tail = (ring->tail + 1) % BUS_RX_RING_LEN;
+    }
+    uint16_t bits = frameBits(frame);
+    noInterrupts(); //the gateway and periodic interrupts send on native buses and count into the same bits
+    health[bus].bits += bits;
+    interrupts();
+    stats[bus].rxFrames++;
+    return true;
+}
+
+/*
+ * Hand a frame to the controller for the given bus. Returns false if it could not be accepted.
+ * Interrupt handlers may call this for native buses only, the MCP2515 needs the SPI lock.
+ * A held bus refuses everything but the sender that holds it, which passes ignoreHold.
+ * The receive interrupts (gateway fast path), the periodic timer and loop() all send on the
+ * native controllers, so the mailbox check and the hand over run with interrupts off. PRIMASK
+ * is saved rather than blindly cleared as callers can already be in a critical section.
+ */
+boolean Buses::send(CAN_FRAME &frame, int bus, boolean ignoreHold)
+{
+    if (!isEnabled(bus)) return false;
+    if (held[bus] && !ignoreHold) return false;
+    //both drivers keep a software queue behind a full controller and still report success, so only hand over when it can go straight out
+    boolean spi = (table[bus].driver == DRIVER_MCP2515);
+    boolean sent = false;
+    uint16_t bits = frameBits(frame);
+    if (spi) { //only loop() sends here, SPI is too slow to do with interrupts off
+        lockSPI();
+        sent = txFree(bus) && table[bus].dev->sendFrame(frame);
+        unlockSPI();
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!spi) sent = txFree(bus) && table[bus].dev->sendFrame(frame);
+    if (sent) {
+        stats[bus].txFrames++;
+        health[bus].bits += bits;
+    } else stats[bus].txRefused++;
+    __set_PRIMASK(primask);
+    return sent;
+}
+
+void Buses::hold(int bus, boolean en)
+{
+    if (bus < 0 || bus >= count()) return;
+    held[bus] = en;
+}
+
+//true once every frame handed to the controller has left it
+boolean Buses::txIdle(int bus)
+{
+    if (bus < 0 || bus >= count()) return true;
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE: {
+        Can *regs = (table[bus].dev == &Can0) ? CAN0 : CAN1;
+        for (int mb = 0; mb < 8; mb++) {
+            if ((regs->CAN_MB[mb].CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_TX) continue;
+            if (!(regs->CAN_MB[mb].CAN_MSR & CAN_MSR_MRDY)) return false;
+        }
+        return true;
+    }
+    case DRIVER_MCP2515: {
+        lockSPI();
+        boolean idle = !(SWCAN.Status() & 0x54);
+        unlockSPI();
+        return idle;
+    }
+    }
+    return true;
+}
+
+//true if the controller has an empty transmit mailbox. Called with the SPI lock held for the MCP2515
+boolean Buses::txFree(int bus)
+{
+    if (bus < 0 || bus >= count()) return false;
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE: {
+        Can *regs = (table[bus].dev == &Can0) ? CAN0 : CAN1;
+        for (int mb = 0; mb < 8; mb++) {
+            if ((regs->CAN_MB[mb].CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_TX) continue;
+            if (regs->CAN_MB[mb].CAN_MSR & CAN_MSR_MRDY) return true;
+        }
+        return false;
+    }
+    case DRIVER_MCP2515:
+        return (SWCAN.Status() & 0x54) != 0x54; //TXREQ of all three transmit buffers
+    }
+    return false;
+}
+
+BUS_STATS *Buses::getStats(int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return NULL;
+    return &stats[bus];
+}
+
+void Buses::resetStats()
+{
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        stats[bus].rxFrames = 0;
+        stats[bus].txFrames = 0;
+        stats[bus].txRefused = 0;
+        stats[bus].rxOverflow = 0;
+        stats[bus].hwOverrun = 0;
+        memset(&health[bus], 0, sizeof(BUS_HEALTH));
+    }
+}
+
+void Buses::printStatus()
+{
+    static const char *stateNames[4] = {"error active", "error warning", "error passive", "bus off"};
+
+    for (int bus = 0; bus < count(); bus++) {
+        BUS_SETTINGS *bs = &settings.buses[bus];
+        BUS_HEALTH *h = &health[bus];
+        Logger::console("Bus %i (%s): %s, %i baud%s, RX %i, TX %i, TX refused %i, RX ring overflows %i, controller overruns %i",
+                        bus, table[bus].name, bs->enabled ? "enabled" : "disabled", bs->speed, bs->listenOnly ? ", listen only" : "",
+                        stats[bus].rxFrames, stats[bus].txFrames, stats[bus].txRefused, stats[bus].rxOverflow, stats[bus].hwOverrun);
+        Logger::console("    load %i.%i%% now, %i.%i%% avg, %i.%i%% peak. %s, TEC %i, REC %i, %i times error passive, %i times bus off",
+                        h->loadNow / 10, h->loadNow % 10, h->loadAvg / 10, h->loadAvg % 10, h->loadPeak / 10, h->loadPeak % 10,
+                        stateNames[h->errorState], h->tec, h->rec, h->passiveCount, h->busOffCount);
+    }
+}
+
+BUS_HEALTH *Buses::getHealth(int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return NULL;
+    return &health[bus];
+}
+
+//closes a load slot and samples the error counters every BUS_LOAD_SLOT_MS
+void Buses::loop()
+{
+    uint32_t now = millis();
+
+    if ((now - lastSlotTime) < BUS_LOAD_SLOT_MS) return;
+    lastSlotTime += BUS_LOAD_SLOT_MS;
+    if ((now - lastSlotTime) >= BUS_LOAD_SLOT_MS) lastSlotTime = now; //fell a whole slot behind, don't try to catch up
+
+    for (int bus = 0; bus < count(); bus++) {
+        closeLoadSlot(bus);
+        sampleErrors(bus);
+    }
+}
+
+void Buses::closeLoadSlot(int bus)
+{
+    BUS_HEALTH *h = &health[bus];
+    uint32_t slotCapacity = settings.buses[bus].speed / (1000 / BUS_LOAD_SLOT_MS); //bits the bus could carry in one slot
+    uint32_t total = 0;
+    uint32_t load;
+
+    noInterrupts();
+    h->slotBits[h->slot] = h->bits;
+    h->bits = 0;
+    interrupts();
+    h->slot = (h->slot + 1) % BUS_LOAD_SLOTS;
+    if (slotCapacity == 0) return;
+
+    for (int i = 0; i < BUS_LOAD_SLOTS; i++) total += h->slotBits[i];
+    //the stuffing estimate can run a little over a saturated bus, so clamp at 100%
+    load = h->slotBits[(h->slot + BUS_LOAD_SLOTS - 1) % BUS_LOAD_SLOTS] * 1000 / slotCapacity;
+    h->loadNow = load > 1000 ? 1000 : load;
+    load = total * 1000 / (slotCapacity * BUS_LOAD_SLOTS);
+    h->loadAvg = load > 1000 ? 1000 : load;
+    if (h->loadNow > h->loadPeak) h->loadPeak = h->loadNow;
+}
+
+void Buses::sampleErrors(int bus)
+{
+    BUS_HEALTH *h = &health[bus];
+    uint8_t newState = ERROR_ACTIVE;
+
+    if (!settings.buses[bus].enabled) {
+        h->errorState = ERROR_ACTIVE;
+        h->tec = 0;
+        h->rec = 0;
+        return;
+    }
+
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE: {
+        CANRaw *can = (CANRaw *)table[bus].dev;
+        uint32_t status = can->get_status();
+        //reading the status register clears the error flags, keep them for takeProtocolErrors()
+        if (status & (CAN_SR_BERR | CAN_SR_SERR | CAN_SR_FERR | CAN_SR_CERR)) h->protocolError = true;
+        uint32_t tec = can->get_tx_error_cnt();
+        uint32_t rec = can->get_rx_error_cnt();
+        h->tec = tec > 255 ? 255 : tec; //TEC can count to 256 on the way to bus off
+        h->rec = rec > 255 ? 255 : rec;
+        if (status & CAN_SR_BOFF) newState = ERROR_BUS_OFF;
+        else if (status & CAN_SR_ERRP) newState = ERROR_PASSIVE;
+        else if (status & CAN_SR_WARN) newState = ERROR_WARNING;
+        break;
+    }
+    case DRIVER_MCP2515: {
+        lockSPI();
+        h->tec = SWCAN.Read(TEC);
+        h->rec = SWCAN.Read(REC);
+        uint8_t errFlags = SWCAN.Read(EFLG);
+        unlockSPI();
+        if (errFlags & 0x20) newState = ERROR_BUS_OFF; //TXBO
+        else if (errFlags & 0x18) newState = ERROR_PASSIVE; //TXEP, RXEP
+        else if (errFlags & 0x01) newState = ERROR_WARNING; //EWARN
+        break;
+    }
+    }
+
+    if (newState != h->errorState) {
+        if (newState == ERROR_PASSIVE) h->passiveCount++;
+        if (newState == ERROR_BUS_OFF) h->busOffCount++;
+        h->errorState = newState;
+    }
+}
+
+/*
+ * True if the controller has seen a bit, stuff, form or CRC error since the last call.
+ * ACK errors don't count, a listen only node on a bus with one other node sees those at the right rate too.
+ */
+boolean Buses::takeProtocolErrors(int bus)
+{
+    if (bus < 0 || bus >= count()) return false;
+    BUS_HEALTH *h = &health[bus];
+    boolean seen;
+
+    readProtocolErrors(bus);
+    seen = h->protocolError;
+    h->protocolError = false;
+    return seen;
+}
+
+void Buses::readProtocolErrors(int bus)
+{
+    BUS_HEALTH *h = &health[bus];
+
+    if (!settings.buses[bus].enabled) return;
+    switch (table[bus].driver) {
+    case DRIVER_NATIVE:
+        if (((CANRaw *)table[bus].dev)->get_status() & (CAN_SR_BERR | CAN_SR_SERR | CAN_SR_FERR | CAN_SR_CERR))
+            h->protocolError = true;
+        break;
+    case DRIVER_MCP2515: {
+        lockSPI();
+        uint8_t flags = SWCAN.Read(CANINTF);
+        if (flags & 0x80) SWCAN.BitModify(CANINTF, 0x80, 0); //MERRF - the only error report we get in listen only mode
+        unlockSPI();
+        if (flags & 0x80) h->protocolError = true;
+        break;
+    }
+    }
+}
+
+/*
+ * Bits a frame took on the wire, including the stuff bits and the 3 bit intermission.
+ * Stuffing depends on the actual bit pattern so the frame is walked bit by bit, CRC included,
+ * rather than using the worst case formula that reads up to 20% high on a busy bus.
+ */
+struct STUFF_STATE {
+    uint16_t crc;
+    uint16_t bits;
+    uint8_t last;
+    uint8_t run;
+};
+
+static void stuffBits(STUFF_STATE &s, uint32_t value, int count, boolean addToCRC)
+{
+    for (int i = count - 1; i >= 0; i--) {
+        uint8_t bit = (value >> i) & 1;
+        if (addToCRC) {
+            boolean feedback = bit ^ ((s.crc >> 14) & 1);
+            s.crc = (s.crc << 1) & 0x7FFF;
+            if (feedback) s.crc ^= 0x4599;
+        }
+        s.bits++;
+        if (bit == s.last) {
+            if (++s.run == 5) { //a stuff bit of the opposite level goes in and starts the next run
+                s.bits++;
+                s.last = !bit;
+                s.run = 1;
+            }
+        } else {
+            s.last = bit;
+            s.run = 1;
+        }
+    }
+}
+
+uint16_t Buses::frameBits(CAN_FRAME &frame)
+{
+    STUFF_STATE s = {0, 0, 2, 0};
+    uint32_t id = frame.id & 0x1FFFFFFF;
+    uint8_t length = frame.length > 8 ? 8 : frame.length;
+
+    stuffBits(s, 0, 1, true); //SOF
+    if (frame.extended) {
+        stuffBits(s, id >> 18, 11, true);
+        stuffBits(s, 3, 2, true); //SRR, IDE
+        stuffBits(s, id & 0x3FFFF, 18, true);
+        stuffBits(s, frame.rtr ? 4 : 0, 3, true); //RTR, r1, r0
+    } else {
+        stuffBits(s, id & 0x7FF, 11, true);
+        stuffBits(s, frame.rtr ? 4 : 0, 3, true); //RTR, IDE, r0
+    }
+    stuffBits(s, length, 4, true);
+    if (!frame.rtr) {
+        for (int i = 0; i < length; i++) stuffBits(s, frame.data.bytes[i], 8, true);
+    }
+    stuffBits(s, s.crc, 15, false);
+
+    return s.bits + 13; //CRC delimiter, ACK slot and delimiter, EOF, intermission
+}
+
+/*
+ * Binary reply to PROTO_BUS_STATUS: F1 27 numBuses then 21 bytes per bus -
+ * state, TEC, REC, load now, load average, load peak (16 bit tenths of a percent),
+ * RX overflows, controller overruns (32 bit), times error passive, times bus off (16 bit).
+ */
+void Buses::sendHealth()
+{
+    uint8_t buff[24];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_BUS_STATUS;
+    buff[2] = count();
+    SerialUSB.write(buff, 3);
+
+    for (int bus = 0; bus < count(); bus++) {
+        BUS_HEALTH *h = &health[bus];
+        uint16_t vals16[3] = {h->loadNow, h->loadAvg, h->loadPeak};
+        uint32_t vals32[2] = {stats[bus].rxOverflow, stats[bus].hwOverrun};
+        buff[0] = h->errorState;
+        buff[1] = h->tec;
+        buff[2] = h->rec;
+        for (int v = 0; v < 3; v++) {
+            buff[3 + v * 2] = (uint8_t)(vals16[v] & 0xFF);
+            buff[4 + v * 2] = (uint8_t)(vals16[v] >> 8);
+        }
+        for (int v = 0; v < 2; v++) {
+            buff[9 + v * 4] = (uint8_t)(vals32[v] & 0xFF);
+            buff[10 + v * 4] = (uint8_t)(vals32[v] >> 8);
+            buff[11 + v * 4] = (uint8_t)(vals32[v] >> 16);
+            buff[12 + v * 4] = (uint8_t)(vals32[v] >> 24);
+        }
+        buff[17] = (uint8_t)(h->passiveCount & 0xFF);
+        buff[18] = (uint8_t)(h->passiveCount >> 8);
+        buff[19] = (uint8_t)(h->busOffCount & 0xFF);
+        buff[20] = (uint8_t)(h->busOffCount >> 8);
+        SerialUSB.write(buff, 21);
+    }
+}
+
+/*
+ * Status byte for the Lawicel F command. Bit 0 RX FIFO full, 1 TX FIFO full, 2 error warning,
+ * 3 data overrun, 5 error passive, 7 bus error. Overrun is only reported once per new loss.
+ */
+uint8_t Buses::lawicelStatus(int bus)
+{
+    if (bus < 0 || bus >= count()) return 0;
+    BUS_HEALTH *h = &health[bus];
+    uint32_t overruns = stats[bus].rxOverflow + stats[bus].hwOverrun;
+    uint8_t status = 0;
+
+    if (available(bus) >= BUS_RX_RING_LEN - 1) status |= 0x01;
+    if (TxQueue::pending(bus) >= TxQueue::getDepth()) status |= 0x02;
+    if (h->errorState >= ERROR_WARNING) status |= 0x04;
+    if (overruns != h->reportedOverruns) status |= 0x08;
+    if (h->errorState >= ERROR_PASSIVE) status |= 0x20;
+    if (h->errorState == ERROR_BUS_OFF) status |= 0x80;
+    h->reportedOverruns = overruns;
+    return status;
+}
@@ -0,0 +1,151 @@
+/*
+ * Buses.h
+ *
+ * Table of every CAN controller on the board, indexed by bus number. RX, TX, settings,
+ * filters and counters all go through here so the rest of the firmware never has to
+ * know which controller sits behind a bus number.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BUSES_H_
+#define BUSES_H_
+
+#include <Arduino.h>
+#include <can_common.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct CAN_BUS {
+    uint8_t driver; //BUS_DRIVER
+    CAN_COMMON *dev;
+    uint32_t maxSpeed;
+    const char *name;
+    void (*rxHandler)(CAN_FRAME *frame); //receive interrupt callback for native controllers
+};
+
+struct BUS_STATS {
+    uint32_t rxFrames;
+    uint32_t txFrames;
+    uint32_t txRefused; //controller had no free mailbox or the bus was off
+    uint32_t rxOverflow; //frames dropped because the ring was full
+    uint32_t hwOverrun; //frames the controller itself lost before we could read them
+};
+
+//bus load and controller error state, updated once per BUS_LOAD_SLOT_MS by Buses::loop()
+struct BUS_HEALTH {
+    uint32_t bits; //bits counted so far in the current slot
+    uint32_t slotBits[BUS_LOAD_SLOTS];
+    uint8_t slot;
+    uint16_t loadNow; //tenths of a percent over the last slot
+    uint16_t loadAvg; //tenths of a percent over the whole window
+    uint16_t loadPeak; //highest loadNow since the counters were reset
+    uint8_t errorState; //BUS_ERROR_STATE
+    uint8_t tec;
+    uint8_t rec;
+    uint16_t passiveCount; //times the controller went error passive
+    uint16_t busOffCount; //times the controller went bus off
+    uint32_t reportedOverruns; //rxOverflow + hwOverrun when the Lawicel status was last read
+    boolean protocolError; //bit, stuff, form or CRC error seen since takeProtocolErrors()
+};
+
+//filled from the receive interrupts, emptied by loop(). One writer and one reader so no locking is needed
+struct BUS_RX_RING {
+    CAN_FRAME frames[BUS_RX_RING_LEN];
+    uint32_t stamps[BUS_RX_RING_LEN]; //DWT cycle count when each frame came in
+    uint16_t seqs[BUS_RX_RING_LEN]; //receive sequence number of each frame
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+class Buses
+{
+public:
+    enum BUS_DRIVER {
+        DRIVER_NONE = 0,
+        DRIVER_NATIVE = 1, //controller built into the processor
+        DRIVER_MCP2515 = 2 //SPI controller on the dedicated single wire channel
+    };
+
+    enum BUS_ERROR_STATE {
+        ERROR_ACTIVE = 0,
+        ERROR_WARNING = 1, //either counter has passed 96
+        ERROR_PASSIVE = 2,
+        ERROR_BUS_OFF = 3
+    };
+
+    static void setup();
+    static void loop();
+    static int count();
+    static const char *name(int bus);
+    static uint32_t maxSpeed(int bus);
+    static boolean isNative(int bus);
+    static boolean isEnabled(int bus);
+    static void setEnabled(int bus, boolean en);
+    static void setSpeed(int bus, uint32_t speed);
+    static void setListenOnly(int bus, boolean en);
+    static void setFilter(int bus, int filter, uint32_t id, uint32_t mask, boolean extended, boolean enabled);
+    static void setPromiscuous(int bus);
+    static void configure(int bus, uint32_t value);
+    static int available(int bus);
+    static boolean read(int bus, CAN_FRAME &frame, uint32_t *stamp = NULL, uint16_t *seq = NULL);
+    static boolean send(CAN_FRAME &frame, int bus, boolean ignoreHold = false);
+    static void hold(int bus, boolean en);
+    static boolean txIdle(int bus);
+    static BUS_STATS *getStats(int bus);
+    static void resetStats();
+    static void printStatus();
+    static BUS_HEALTH *getHealth(int bus);
+    static void sendHealth();
+    static uint8_t lawicelStatus(int bus);
+    static boolean takeProtocolErrors(int bus);
+    static uint16_t frameBits(CAN_FRAME &frame);
+    static void mcp2515Interrupt();
+    static void pushRX(int bus, CAN_FRAME &frame);
+    static void lockSPI();
+    static void unlockSPI();
+
+private:
+    static CAN_BUS table[NUM_BUSES];
+    static BUS_STATS stats[NUM_BUSES];
+    static BUS_RX_RING rings[NUM_BUSES];
+    static BUS_HEALTH health[NUM_BUSES];
+    static uint32_t lastSlotTime;
+    static uint16_t rxSeq[NUM_BUSES]; //next receive sequence number. Frames dropped for a full ring still use one up
+    static int8_t mcp2515Bus; //bus the MCP2515 serves, -1 if none
+    static boolean mcp2515Attached; //its INT pin handler is meant to be running
+    static uint8_t spiLockDepth;
+    static volatile boolean held[NUM_BUSES]; //sends refused while the single wire wake up sequence runs
+
+    static void start(int bus);
+    static void stop(int bus);
+    static boolean txFree(int bus);
+    static void applyFilters(int bus);
+    static void applyMCP2515Filters(int bus);
+    static void readMCP2515Buffer(uint8_t reg, uint8_t flag);
+    static void sampleErrors(int bus);
+    static void readProtocolErrors(int bus);
+    static void closeLoadSlot(int bus);
+};
+
+#endif /* BUSES_H_ */
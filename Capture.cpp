@@ -0,0 +1,461 @@
+/*
+ * Capture.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Capture.h"
+#include "Logger.h"
+#include "sys_io.h"
+#include "Buses.h"
+#include "ClockSync.h"
+
+CAPTURE_FRAME Capture::ring[CAPTURE_RING_LEN];
+uint32_t Capture::writeCount = 0;
+
+uint8_t Capture::state = CAP_IDLE;
+uint8_t Capture::armMode = 0;
+uint8_t Capture::trigType = TRIG_NONE;
+uint32_t Capture::trigID = 0;
+uint32_t Capture::trigMask = 0;
+uint8_t Capture::trigBus = 255;
+uint8_t Capture::dataValue[8];
+uint8_t Capture::dataMask[8];
+uint8_t Capture::trigInput = 0;
+uint8_t Capture::trigEdge = 0;
+uint16_t Capture::trigThreshold = 0;
+uint8_t Capture::trigDirection = 0;
+boolean Capture::lastDigital = false;
+uint16_t Capture::lastAnalog = 0;
+uint32_t Capture::preTime = CAPTURE_DEFAULT_PRE;
+uint32_t Capture::postTime = CAPTURE_DEFAULT_POST;
+uint8_t Capture::destination = DEST_USB;
+
+uint8_t Capture::trigSource = TRIG_NONE;
+uint32_t Capture::trigTime = 0;
+uint32_t Capture::startIdx = 0;
+uint32_t Capture::preHeld = 0;
+uint32_t Capture::endIdx = 0;
+uint32_t Capture::flushIdx = 0;
+uint32_t Capture::dropped = 0;
+uint32_t Capture::captures = 0;
+SdFile Capture::file;
+uint16_t Capture::fileNum = 0;
+
+/*
+ * Every received frame goes into the ring whether armed or not so there is always history to save.
+ * rxTime is the device time the frame came in at (ClockSync::fromCycles), 0 for now. Frames are
+ * stamped like the USB and file records so a capture lines up with the live log.
+ */
+void Capture::processFrame(CAN_FRAME &frame, int whichBus, uint64_t rxTime)
+{
+    CAPTURE_FRAME *slot = &ring[writeCount % CAPTURE_RING_LEN];
+    slot->time = rxTime ? ClockSync::frameTime(rxTime) : ClockSync::frameTime();
+    slot->id = frame.id & 0x7FFFFFFF;
+    if (frame.extended) slot->id |= 1ul << 31;
+    slot->lenBus = frame.length + (uint8_t)(whichBus << 4);
+    memcpy(slot->data, frame.data.bytes, 8);
+    writeCount++;
+
+    if (state == CAP_ARMED && trigType == TRIG_FRAME && matchFrame(frame, whichBus)) fire(TRIG_FRAME);
+}
+
+boolean Capture::matchFrame(CAN_FRAME &frame, int whichBus)
+{
+    if (trigBus != 255 && trigBus != whichBus) return false;
+    uint32_t id = frame.id & 0x7FFFFFFF;
+    if (frame.extended) id |= 1ul << 31;
+    if ((id & trigMask) != (trigID & trigMask)) return false;
+    for (int c = 0; c < 8; c++) {
+        if (!dataMask[c]) continue;
+        if (c >= frame.length) return false;
+        if ((frame.data.bytes[c] & dataMask[c]) != (dataValue[c] & dataMask[c])) return false;
+    }
+    return true;
+}
+
+//inputs are tracked all the time so arming never sees a stale previous value as an edge
+void Capture::checkInputs()
+{
+    if (trigType == TRIG_DIGITAL) {
+        boolean val = getDigital(trigInput);
+        boolean edge = false;
+        if (val != lastDigital) {
+            if (trigEdge == 2) edge = true;
+            else if (trigEdge == 0) edge = val;
+            else edge = !val;
+        }
+        lastDigital = val;
+        if (edge && state == CAP_ARMED) fire(TRIG_DIGITAL);
+    } else if (trigType == TRIG_ANALOG) {
+        uint16_t val = getAnalog(trigInput);
+        boolean crossed;
+        if (trigDirection == 0) crossed = (lastAnalog < trigThreshold && val >= trigThreshold);
+        else crossed = (lastAnalog > trigThreshold && val <= trigThreshold);
+        lastAnalog = val;
+        if (crossed && state == CAP_ARMED) fire(TRIG_ANALOG);
+    }
+}
+
+/*
+ * Freeze the trigger point, work out how far back the pre trigger window reaches and start saving
+ * straight away. The ring keeps being written while the post window runs, so waiting for it to
+ * close would let new traffic overwrite the pre trigger frames. Anything overwritten before it
+ * is saved is counted as dropped.
+ */
+void Capture::fire(uint8_t source)
+{
+    if (state != CAP_ARMED) return;
+
+    trigSource = source;
+    trigTime = ClockSync::frameTime(); //frame times are in this timebase, not micros()
+    uint32_t oldest = (writeCount > CAPTURE_RING_LEN) ? writeCount - CAPTURE_RING_LEN : 0;
+    uint32_t preMicros = preTime * 1000;
+    startIdx = writeCount;
+    while (startIdx > oldest && (trigTime - ring[(startIdx - 1) % CAPTURE_RING_LEN].time) <= preMicros) startIdx--;
+    preHeld = (startIdx < writeCount) ? (trigTime - ring[startIdx % CAPTURE_RING_LEN].time) / 1000 : 0;
+    dropped = 0;
+    state = CAP_POST;
+    if (!settings.useBinarySerialComm && !SysSettings.lawicelMode) {
+        Logger::console("Capture triggered");
+        //ran into the oldest frame with the window still open, so older ones were already gone
+        if (startIdx == oldest && oldest > 0 && preHeld < preTime)
+            Logger::console("Pre trigger window cut to %i ms, the ring can't hold more at this load", preHeld);
+    }
+    beginFlush();
+}
+
+void Capture::loop()
+{
+    checkInputs();
+
+    if (state == CAP_POST && (ClockSync::frameTime() - trigTime) >= postTime * 1000) {
+        endIdx = writeCount;
+        state = CAP_FLUSH;
+    }
+    if (state == CAP_POST || state == CAP_FLUSH) flushSome();
+}
+
+void Capture::beginFlush()
+{
+    flushIdx = startIdx;
+
+    if (destination == DEST_SD) {
+        char name[16];
+        boolean opened = false;
+        if (SysSettings.SDCardInserted) {
+            for (int tries = 0; tries < 1000 && !opened; tries++) {
+                sprintf(name, "CAP%04u.BIN", fileNum++);
+                Buses::lockSPI();
+                opened = file.open(name, O_CREAT | O_EXCL | O_WRITE);
+                Buses::unlockSPI();
+            }
+        }
+        if (!opened) {
+            Logger::error("Could not create capture file");
+            endIdx = startIdx;
+            endFlush();
+            return;
+        }
+    } else {
+        uint8_t buff[13];
+        uint32_t count = writeCount - startIdx;
+        buff[0] = trigSource;
+        for (int i = 0; i < 4; i++) buff[1 + i] = (uint8_t)(trigTime >> (i * 8));
+        for (int i = 0; i < 4; i++) buff[5 + i] = (uint8_t)(count >> (i * 8));
+        for (int i = 0; i < 4; i++) buff[9 + i] = (uint8_t)(preHeld >> (i * 8));
+        sendRecord(REC_BEGIN, buff, 13);
+    }
+}
+
+/*
+ * Save up to CAPTURE_FLUSH_FRAMES frames per pass so the live path never stalls for long.
+ * SD files use the BINARYFILE record layout so they can be replayed or loaded like any other log.
+ */
+void Capture::flushSome()
+{
+    uint8_t buff[CAPTURE_FLUSH_FRAMES * 17];
+    int pos = 0;
+    uint32_t limit = (state == CAP_POST) ? writeCount : endIdx; //the end isn't known until the post window closes
+
+    uint32_t oldest = (writeCount > CAPTURE_RING_LEN) ? writeCount - CAPTURE_RING_LEN : 0;
+    if (flushIdx < oldest) {
+        dropped += oldest - flushIdx;
+        flushIdx = oldest;
+    }
+
+    for (int f = 0; f < CAPTURE_FLUSH_FRAMES && flushIdx < limit; f++, flushIdx++) {
+        CAPTURE_FRAME *cf = &ring[flushIdx % CAPTURE_RING_LEN];
+        uint8_t len = cf->lenBus & 0xF;
+        uint8_t *rec = buff + pos;
+        for (int i = 0; i < 4; i++) rec[i] = (uint8_t)(cf->time >> (i * 8));
+        for (int i = 0; i < 4; i++) rec[4 + i] = (uint8_t)(cf->id >> (i * 8));
+        rec[8] = cf->lenBus;
+        memcpy(rec + 9, cf->data, len);
+        if (destination == DEST_SD) pos += 9 + len;
+        else sendRecord(REC_FRAME, rec, 9 + len);
+    }
+
+    boolean failed = false;
+    if (pos > 0) {
+        Buses::lockSPI();
+        failed = (file.write(buff, pos) != pos);
+        Buses::unlockSPI();
+    }
+    if (failed) {
+        Logger::error("Write to capture file failed");
+        endIdx = flushIdx;
+        state = CAP_FLUSH;
+    }
+
+    if (state == CAP_FLUSH && flushIdx >= endIdx) endFlush();
+}
+
+void Capture::endFlush()
+{
+    uint32_t saved = endIdx - startIdx - dropped;
+
+    if (destination == DEST_SD) {
+        if (file.isOpen()) {
+            Buses::lockSPI();
+            file.sync();
+            file.close();
+            Buses::unlockSPI();
+        }
+    } else {
+        uint8_t buff[8];
+        for (int i = 0; i < 4; i++) buff[i] = (uint8_t)(saved >> (i * 8));
+        for (int i = 0; i < 4; i++) buff[4 + i] = (uint8_t)(dropped >> (i * 8));
+        sendRecord(REC_END, buff, 8);
+    }
+    captures++;
+    if (!settings.useBinarySerialComm && !SysSettings.lawicelMode) Logger::console("Capture saved %i frames (%i lost)", saved, dropped);
+
+    if (armMode == 2) state = CAP_ARMED;
+    else {
+        state = CAP_IDLE;
+        armMode = 0;
+    }
+}
+
+/*
+ * 0xF1, PROTO_CAPTURE, record type, record data. Text mode gets a readable line per record instead.
+ * Times are in the same timebase as binary frame records (host time once ClockSync has a fit).
+ * REC_BEGIN - trigger source, trigger time uS (4 bytes), frames before the trigger (4 bytes),
+ *             ms of pre trigger history the ring held (4 bytes, less than asked for if the ring was too small)
+ * REC_FRAME - time uS (4 bytes), ID (4 bytes, bit 31 = extended), length + (bus << 4), data bytes
+ * REC_END - frames sent (4 bytes), frames lost to ring overwrite (4 bytes)
+ */
+void Capture::sendRecord(uint8_t type, uint8_t *data, int length)
+{
+    if (SysSettings.lawicelMode) return;
+
+    if (settings.useBinarySerialComm) {
+        uint8_t buff[3];
+        buff[0] = 0xF1;
+        buff[1] = PROTO_CAPTURE;
+        buff[2] = type;
+        bufferUSBBytes(buff, 3);
+        bufferUSBBytes(data, length);
+        return;
+    }
+
+    if (type == REC_FRAME) {
+        SerialUSB.print("CAP ");
+        SerialUSB.print(data[0] + ((uint32_t)data[1] << 8) + ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24));
+        SerialUSB.print(" - ");
+        SerialUSB.print(data[4] + ((uint32_t)data[5] << 8) + ((uint32_t)data[6] << 16) + ((uint32_t)(data[7] & 0x7F) << 24), HEX);
+        if (data[7] & 0x80) SerialUSB.print(" X ");
+        else SerialUSB.print(" S ");
+        SerialUSB.print(data[8] >> 4);
+        SerialUSB.print(" ");
+        SerialUSB.print(data[8] & 0xF);
+        for (int c = 0; c < (data[8] & 0xF); c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(data[9 + c], HEX);
+        }
+        SerialUSB.println();
+    } else if (type == REC_BEGIN) {
+        Logger::console("CAP BEGIN source %i", data[0]);
+    } else {
+        Logger::console("CAP END");
+    }
+}
+
+void Capture::arm(uint8_t mode)
+{
+    if (mode > 2) mode = 2;
+    armMode = mode;
+    if (mode == 0) {
+        if (state == CAP_ARMED) state = CAP_IDLE;
+        return; //a capture already in progress still finishes
+    }
+    if (state == CAP_IDLE) state = CAP_ARMED;
+}
+
+void Capture::setTrigger(uint8_t type)
+{
+    if (type > TRIG_ANALOG) type = TRIG_NONE;
+    trigType = type;
+    lastDigital = getDigital(trigInput);
+    lastAnalog = getAnalog(trigInput);
+}
+
+void Capture::setFrameTrigger(uint32_t id, uint32_t mask, uint8_t bus)
+{
+    trigID = id;
+    trigMask = mask;
+    trigBus = bus;
+}
+
+void Capture::setDataMatch(uint8_t index, uint8_t value, uint8_t mask)
+{
+    if (index > 7) return;
+    dataValue[index] = value;
+    dataMask[index] = mask;
+}
+
+void Capture::setDigitalTrigger(uint8_t input, uint8_t edge)
+{
+    if (input >= NUM_DIGITAL) return;
+    trigInput = input;
+    trigEdge = (edge > 2) ? 2 : edge;
+    lastDigital = getDigital(trigInput);
+}
+
+void Capture::setAnalogTrigger(uint8_t input, uint16_t threshold, uint8_t direction)
+{
+    if (input >= NUM_ANALOG) return;
+    trigInput = input;
+    trigThreshold = threshold;
+    trigDirection = direction ? 1 : 0;
+    lastAnalog = getAnalog(trigInput);
+}
+
+//ms between the oldest and newest frame in the ring, 0 while it hasn't filled yet
+uint32_t Capture::ringSpan()
+{
+    if (writeCount < CAPTURE_RING_LEN) return 0;
+    return (ring[(writeCount - 1) % CAPTURE_RING_LEN].time - ring[writeCount % CAPTURE_RING_LEN].time) / 1000;
+}
+
+//a window longer than the ring reaches back at the current load would only be cut short when it fires
+void Capture::setPreTime(uint32_t ms)
+{
+    uint32_t span = ringSpan();
+    if (writeCount >= CAPTURE_RING_LEN && ms > span) {
+        if (!settings.useBinarySerialComm) Logger::console("Pre trigger time limited to %i ms, all the ring holds at the current load", span);
+        ms = span;
+    }
+    preTime = ms;
+}
+
+void Capture::setPostTime(uint32_t ms)
+{
+    postTime = ms;
+}
+
+void Capture::setDestination(uint8_t dest)
+{
+    destination = dest ? DEST_SD : DEST_USB;
+}
+
+uint8_t Capture::getDestination()
+{
+    return destination;
+}
+
+//number of data bytes that follow each sub command byte
+int Capture::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_ARM:
+        return 1;
+    case CMD_SET_TRIGGER:
+        return 30;
+    case CMD_SET_WINDOW:
+        return 9;
+    }
+    return 0;
+}
+
+/*
+ * CMD_ARM - mode (0 = disarm, 1 = one shot, 2 = re-arm after each capture)
+ * CMD_SET_TRIGGER - type, bus (255 = any), ID (4 bytes, bit 31 = extended), ID mask (4 bytes),
+ *                   8 data bytes, 8 data mask bytes, input, edge/direction, analog threshold (2 bytes)
+ * CMD_SET_WINDOW - pre trigger ms (4 bytes), post trigger ms (4 bytes), destination (0 = USB, 1 = SD)
+ * CMD_FIRE - trigger now if armed
+ */
+void Capture::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_ARM:
+        arm(data[1]);
+        break;
+    case CMD_SET_TRIGGER:
+        setFrameTrigger(data[3] + ((uint32_t)data[4] << 8) + ((uint32_t)data[5] << 16) + ((uint32_t)data[6] << 24),
+                        data[7] + ((uint32_t)data[8] << 8) + ((uint32_t)data[9] << 16) + ((uint32_t)data[10] << 24), data[2]);
+        for (int c = 0; c < 8; c++) setDataMatch(c, data[11 + c], data[19 + c]);
+        if (data[1] == TRIG_DIGITAL) setDigitalTrigger(data[27], data[28]);
+        if (data[1] == TRIG_ANALOG) setAnalogTrigger(data[27], data[29] + ((uint16_t)data[30] << 8), data[28]);
+        setTrigger(data[1]);
+        break;
+    case CMD_SET_WINDOW:
+        setPreTime(data[1] + ((uint32_t)data[2] << 8) + ((uint32_t)data[3] << 16) + ((uint32_t)data[4] << 24));
+        setPostTime(data[5] + ((uint32_t)data[6] << 8) + ((uint32_t)data[7] << 16) + ((uint32_t)data[8] << 24));
+        setDestination(data[9]);
+        break;
+    case CMD_FIRE:
+        fire(TRIG_MARK);
+        break;
+    case CMD_GET_STATUS:
+        sendStatus();
+        break;
+    }
+}
+
+void Capture::printStatus()
+{
+    static const char *stateNames[] = {"idle", "armed", "post trigger", "saving"};
+    Logger::console("Capture %s (arm mode %i), trigger type %i, pre %i ms, post %i ms, to %s", stateNames[state], armMode,
+                    trigType, preTime, postTime, destination == DEST_SD ? "SD" : "USB");
+    Logger::console("%i frames buffered, %i captures taken", (writeCount > CAPTURE_RING_LEN) ? CAPTURE_RING_LEN : writeCount, captures);
+}
+
+//0xF1, PROTO_CAPTURE, CMD_GET_STATUS, state, arm mode, trigger type, frames buffered (2 bytes), captures taken (4 bytes)
+void Capture::sendStatus()
+{
+    uint8_t buff[12];
+    uint16_t buffered = (writeCount > CAPTURE_RING_LEN) ? CAPTURE_RING_LEN : writeCount;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_CAPTURE;
+    buff[2] = CMD_GET_STATUS;
+    buff[3] = state;
+    buff[4] = armMode;
+    buff[5] = trigType;
+    buff[6] = (uint8_t)(buffered & 0xFF);
+    buff[7] = (uint8_t)(buffered >> 8);
+    for (int i = 0; i < 4; i++) buff[8 + i] = (uint8_t)(captures >> (i * 8));
+    bufferUSBBytes(buff, 12);
+}
@@ -0,0 +1,142 @@
+/*
+ * Capture.h
+ *
+ * Keeps the most recent frames from every bus in a RAM ring and, when a trigger
+ * fires, saves the window around the event to the SD card or sends it over USB.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct CAPTURE_FRAME {
+    uint32_t time; //ClockSync::frameTime() of the receive interrupt, same timebase as the live log
+    uint32_t id; //bit 31 set for extended
+    uint8_t lenBus; //length + (bus << 4), same as the binary file format
+    uint8_t data[8];
+};
+
+class Capture
+{
+public:
+    enum CAPTURE_CMD {
+        CMD_ARM = 0,
+        CMD_SET_TRIGGER = 1,
+        CMD_SET_WINDOW = 2,
+        CMD_FIRE = 3,
+        CMD_GET_STATUS = 4
+    };
+
+    enum TRIGGER_TYPE {
+        TRIG_NONE = 0, //only MARK or a manual fire
+        TRIG_FRAME = 1,
+        TRIG_DIGITAL = 2,
+        TRIG_ANALOG = 3,
+        TRIG_MARK = 4 //only reported as the source, MARK can always fire an armed capture
+    };
+
+    enum CAPTURE_STATE {
+        CAP_IDLE = 0,
+        CAP_ARMED = 1,
+        CAP_POST = 2, //triggered, saving while the post trigger window is still collected
+        CAP_FLUSH = 3 //window closed, saving what is left of it
+    };
+
+    enum CAPTURE_DEST {
+        DEST_USB = 0,
+        DEST_SD = 1
+    };
+
+    enum CAPTURE_RECORD { //second byte after PROTO_CAPTURE in records sent to the host
+        REC_BEGIN = 0x10,
+        REC_FRAME = 0x11,
+        REC_END = 0x12
+    };
+
+    static void processFrame(CAN_FRAME &frame, int whichBus, uint64_t rxTime = 0);
+    static void loop();
+    static void arm(uint8_t mode); //0 = disarm, 1 = one shot, 2 = re-arm after every capture
+    static void fire(uint8_t source);
+    static void setTrigger(uint8_t type);
+    static void setFrameTrigger(uint32_t id, uint32_t mask, uint8_t bus);
+    static void setDataMatch(uint8_t index, uint8_t value, uint8_t mask);
+    static void setDigitalTrigger(uint8_t input, uint8_t edge);
+    static void setAnalogTrigger(uint8_t input, uint16_t threshold, uint8_t direction);
+    static void setPreTime(uint32_t ms);
+    static void setPostTime(uint32_t ms);
+    static void setDestination(uint8_t dest);
+    static uint8_t getDestination();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void printStatus();
+    static void sendStatus();
+
+private:
+    static CAPTURE_FRAME ring[CAPTURE_RING_LEN];
+    static uint32_t writeCount; //total frames ever written. Slot is writeCount % CAPTURE_RING_LEN
+
+    static uint8_t state;
+    static uint8_t armMode;
+    static uint8_t trigType;
+    static uint32_t trigID;
+    static uint32_t trigMask;
+    static uint8_t trigBus; //255 = any bus
+    static uint8_t dataValue[8];
+    static uint8_t dataMask[8];
+    static uint8_t trigInput;
+    static uint8_t trigEdge; //0 = rising, 1 = falling, 2 = either
+    static uint16_t trigThreshold;
+    static uint8_t trigDirection; //0 = rises above, 1 = falls below
+    static boolean lastDigital;
+    static uint16_t lastAnalog;
+    static uint32_t preTime; //ms
+    static uint32_t postTime;
+    static uint8_t destination;
+
+    static uint8_t trigSource;
+    static uint32_t trigTime;
+    static uint32_t startIdx;
+    static uint32_t preHeld; //ms of pre trigger history the ring actually had
+    static uint32_t endIdx;
+    static uint32_t flushIdx;
+    static uint32_t dropped;
+    static uint32_t captures;
+    static SdFile file;
+    static uint16_t fileNum;
+
+    static uint32_t ringSpan();
+    static boolean matchFrame(CAN_FRAME &frame, int whichBus);
+    static void checkInputs();
+    static void beginFlush();
+    static void flushSome();
+    static void endFlush();
+    static void sendRecord(uint8_t type, uint8_t *data, int length);
+};
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,340 @@
+/*
+ * ClockSync.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ClockSync.h"
+#include "Logger.h"
+
+CLOCK_SAMPLE ClockSync::samples[CLOCK_SYNC_SAMPLES];
+uint8_t ClockSync::numSamples;
+uint8_t ClockSync::nextSample;
+uint32_t ClockSync::lastMicros = 0;
+uint32_t ClockSync::microsHigh = 0;
+uint64_t ClockSync::pingReceived;
+uint8_t ClockSync::pendingId;
+uint64_t ClockSync::pingHostTime;
+uint64_t ClockSync::pingDevRx;
+uint64_t ClockSync::pingDevTx;
+boolean ClockSync::pending;
+boolean ClockSync::locked;
+boolean ClockSync::hostTime = false;
+boolean ClockSync::external = false;
+uint64_t ClockSync::refTime;
+int64_t ClockSync::refOffset;
+int64_t ClockSync::driftQ32;
+
+static uint64_t get64(uint8_t *data)
+{
+    uint64_t val = 0;
+    for (int i = 7; i >= 0; i--) val = (val << 8) | data[i];
+    return val;
+}
+
+static void put64(uint8_t *data, uint64_t val)
+{
+    for (int i = 0; i < 8; i++) {
+        data[i] = (uint8_t)(val & 0xFF);
+        val >>= 8;
+    }
+}
+
+void ClockSync::setup()
+{
+    now64();
+    reset();
+}
+
+//keeps the 64 bit clock going. micros() wraps every 71 minutes so this only has to run now and then
+void ClockSync::loop()
+{
+    now64();
+}
+
+uint64_t ClockSync::now64()
+{
+    noInterrupts(); //can be called from more than one place, keep the wrap check and the update together
+    uint32_t now = micros();
+    if (now < lastMicros) microsHigh++;
+    lastMicros = now;
+    uint64_t val = ((uint64_t)microsHigh << 32) | now;
+    interrupts();
+    return val;
+}
+
+//device time to host time with the current fit. Unchanged until the first fit
+uint64_t ClockSync::toHost(uint64_t deviceTime)
+{
+    if (!locked) return deviceTime;
+    int64_t since = (int64_t)(deviceTime - refTime);
+    int64_t offset = refOffset + ((since * driftQ32) >> 32);
+    return deviceTime - offset;
+}
+
+//device time a DWT cycle count stamp was taken at. The counter wraps every 51 seconds so the stamp has to be newer than that
+uint64_t ClockSync::fromCycles(uint32_t stamp)
+{
+    uint32_t age = (DWT->CYCCNT - stamp) / CYCLES_PER_US;
+    return now64() - age;
+}
+
+//time stamp for binary frame records, in host time if that was asked for and a fit exists
+uint32_t ClockSync::frameTime()
+{
+    return frameTime(now64());
+}
+
+uint32_t ClockSync::frameTime(uint64_t deviceTime)
+{
+    if (!(hostTime || external) || !locked) return (uint32_t)deviceTime;
+    return (uint32_t)toHost(deviceTime);
+}
+
+//same for the text log formats, which count in mS
+uint32_t ClockSync::frameMillis()
+{
+    return frameMillis(now64());
+}
+
+uint32_t ClockSync::frameMillis(uint64_t deviceTime)
+{
+    if (!(hostTime || external) || !locked) return (uint32_t)(deviceTime / 1000);
+    return (uint32_t)(toHost(deviceTime) / 1000);
+}
+
+void ClockSync::setHostTime(boolean en)
+{
+    hostTime = en;
+}
+
+boolean ClockSync::getHostTime()
+{
+    return hostTime;
+}
+
+void ClockSync::reset()
+{
+    numSamples = 0;
+    nextSample = 0;
+    pending = false;
+    locked = false;
+    driftQ32 = 0;
+}
+
+//while set, host ping reports are ignored and stamps always follow the external reference
+void ClockSync::setExternal(boolean en)
+{
+    external = en;
+    reset();
+}
+
+//a device time known to match a reference time exactly, e.g. a sync pulse edge
+void ClockSync::addReference(uint64_t deviceTime, uint64_t refTime)
+{
+    addSample(refTime, deviceTime, deviceTime, refTime);
+}
+
+//called the moment a clock sync command is recognised, as close to the ping arriving as the parser gets
+void ClockSync::markReceived()
+{
+    pingReceived = now64();
+}
+
+/*
+ * NTP style: t1 host send, t2 device receive, t3 device send, t4 host receive.
+ * offset = ((t2 - t1) + (t3 - t4)) / 2, delay = (t4 - t1) - (t3 - t2)
+ */
+void ClockSync::addSample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    CLOCK_SAMPLE *s = &samples[nextSample];
+    int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+
+    if (delay < 0) return; //host clock stepped or the report doesn't belong to this ping
+    s->deviceTime = t2;
+    s->offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+    s->delay = (uint32_t)delay;
+    nextSample = (nextSample + 1) % CLOCK_SYNC_SAMPLES;
+    if (numSamples < CLOCK_SYNC_SAMPLES) numSamples++;
+    fit();
+}
+
+/*
+ * Least squares line through the offsets of the exchanges whose round trip was within
+ * CLOCK_SYNC_DELAY_SLACK of the quickest. A slow round trip means the USB host sat on
+ * one direction, so its offset is skewed by up to half the extra time.
+ */
+void ClockSync::fit()
+{
+    uint32_t minDelay = 0xFFFFFFFF;
+    uint64_t newest = 0;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int n = 0;
+
+    for (int i = 0; i < numSamples; i++) {
+        if (samples[i].delay < minDelay) minDelay = samples[i].delay;
+        if (samples[i].deviceTime > newest) newest = samples[i].deviceTime;
+    }
+    //offsets are taken relative to the newest sample so the doubles keep their precision
+    int64_t base = 0;
+    for (int i = 0; i < numSamples; i++) {
+        if (samples[i].deviceTime == newest) base = samples[i].offset;
+    }
+    for (int i = 0; i < numSamples; i++) {
+        if (samples[i].delay > minDelay + CLOCK_SYNC_DELAY_SLACK) continue;
+        double x = -(double)(int64_t)(newest - samples[i].deviceTime);
+        double y = (double)(samples[i].offset - base);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+    }
+    if (n == 0) return;
+
+    double slope = 0;
+    double den = n * sxx - sx * sx;
+    if (n >= 2 && den > 0) slope = (n * sxy - sx * sy) / den;
+    double intercept = (sy - slope * sx) / n;
+
+    refTime = newest;
+    refOffset = base + (int64_t)intercept;
+    driftQ32 = (int64_t)(slope * 4294967296.0);
+    locked = true;
+}
+
+/*
+ * 0xF1, PROTO_CLOCK_SYNC, CMD_PING, ping id, host time when sent (8 bytes),
+ * device time the ping came in (8 bytes), device time the pong went out (8 bytes)
+ * Written straight to USB rather than through the frame buffer so the send time is honest.
+ */
+void ClockSync::sendPong(uint8_t id)
+{
+    uint8_t buff[28];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_CLOCK_SYNC;
+    buff[2] = CMD_PING;
+    buff[3] = id;
+    put64(buff + 4, pingHostTime);
+    put64(buff + 12, pingDevRx);
+    pingDevTx = now64();
+    put64(buff + 20, pingDevTx);
+    SerialUSB.write(buff, 28);
+    pendingId = id;
+    pending = true;
+}
+
+//number of data bytes that follow each sub command byte
+int ClockSync::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_PING:
+    case CMD_REPORT:
+        return 9;
+    case CMD_HOST_TIME:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_PING - ping id, host time in uS (8 bytes). Answered at once with a pong
+ * CMD_REPORT - ping id, host time the pong arrived (8 bytes). Completes one exchange
+ * CMD_HOST_TIME - 1 to stamp binary frame records in host time, 0 for device time
+ * CMD_GET - send the current fit
+ * CMD_RESET - forget every exchange
+ */
+void ClockSync::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_PING:
+        pingDevRx = pingReceived;
+        pingHostTime = get64(data + 2);
+        sendPong(data[1]);
+        break;
+    case CMD_REPORT:
+        if (pending && data[1] == pendingId && !external) addSample(pingHostTime, pingDevRx, pingDevTx, get64(data + 2));
+        pending = false;
+        break;
+    case CMD_HOST_TIME:
+        setHostTime(data[1]);
+        break;
+    case CMD_GET:
+        sendStatus();
+        break;
+    case CMD_RESET:
+        reset();
+        break;
+    }
+}
+
+/*
+ * 0xF1, PROTO_CLOCK_SYNC, CMD_GET, locked, host time stamping, exchanges held,
+ * offset in uS (8 bytes, device minus host), drift in parts per billion (4 bytes, signed),
+ * quickest round trip in uS (4 bytes), host time now (8 bytes)
+ */
+void ClockSync::sendStatus()
+{
+    uint8_t buff[30];
+    uint32_t minDelay = 0;
+    int32_t ppb = (int32_t)((driftQ32 * 1000000000ll) >> 32);
+
+    for (int i = 0; i < numSamples; i++) {
+        if (i == 0 || samples[i].delay < minDelay) minDelay = samples[i].delay;
+    }
+    uint64_t now = now64();
+    buff[0] = 0xF1;
+    buff[1] = PROTO_CLOCK_SYNC;
+    buff[2] = CMD_GET;
+    buff[3] = locked;
+    buff[4] = hostTime;
+    buff[5] = numSamples;
+    put64(buff + 6, now - toHost(now));
+    buff[14] = (uint8_t)(ppb & 0xFF);
+    buff[15] = (uint8_t)(ppb >> 8);
+    buff[16] = (uint8_t)(ppb >> 16);
+    buff[17] = (uint8_t)(ppb >> 24);
+    buff[18] = (uint8_t)(minDelay & 0xFF);
+    buff[19] = (uint8_t)(minDelay >> 8);
+    buff[20] = (uint8_t)(minDelay >> 16);
+    buff[21] = (uint8_t)(minDelay >> 24);
+    put64(buff + 22, toHost(now));
+    SerialUSB.write(buff, 30);
+}
+
+void ClockSync::printStatus()
+{
+    uint64_t now = now64();
+    int64_t offset = (int64_t)(now - toHost(now));
+    int32_t ppb = (int32_t)((driftQ32 * 1000000000ll) >> 32);
+
+    if (!locked) {
+        Logger::console("Clock not synced to the %s yet", external ? "sync pulse" : "host");
+        return;
+    }
+    Logger::console("Clock offset %is %iuS, drift %i ppb from %i %s. Frames stamped in %s time",
+                    (int32_t)(offset / 1000000), (int32_t)(offset % 1000000), ppb, numSamples, external ? "sync pulses" : "exchanges",
+                    external ? "sync master" : (hostTime ? "host" : "device"));
+}
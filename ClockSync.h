@@ -0,0 +1,102 @@
+/*
+ * ClockSync.h
+ *
+ * Lines the device clock up with the host's. The host sends a ping with its own time, the device
+ * answers with when it got the ping and when it sent the pong, and the host reports back when the
+ * pong arrived. The four times give offset and round trip for one exchange; a least squares fit
+ * over the recent exchanges with short round trips gives offset and drift. Frame records can then
+ * be stamped directly in host time.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CLOCKSYNC_H_
+#define CLOCKSYNC_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+//one complete ping exchange. All times in uS
+struct CLOCK_SAMPLE {
+    uint64_t deviceTime; //when the device got the ping
+    int64_t offset; //device clock minus host clock
+    uint32_t delay; //round trip less the time the device held the ping
+};
+
+class ClockSync
+{
+public:
+    enum CLOCK_CMD {
+        CMD_PING = 0,
+        CMD_REPORT = 1,
+        CMD_HOST_TIME = 2,
+        CMD_GET = 3,
+        CMD_RESET = 4
+    };
+
+    static void setup();
+    static void loop();
+    static uint64_t now64();
+    static uint64_t toHost(uint64_t deviceTime);
+    static uint64_t fromCycles(uint32_t stamp);
+    static uint32_t frameTime();
+    static uint32_t frameTime(uint64_t deviceTime);
+    static uint32_t frameMillis();
+    static uint32_t frameMillis(uint64_t deviceTime);
+    static void setHostTime(boolean en);
+    static boolean getHostTime();
+    static void reset();
+    static void setExternal(boolean en);
+    static void addReference(uint64_t deviceTime, uint64_t refTime);
+    static void markReceived();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void sendStatus();
+    static void printStatus();
+
+private:
+    static CLOCK_SAMPLE samples[CLOCK_SYNC_SAMPLES];
+    static uint8_t numSamples;
+    static uint8_t nextSample;
+    static uint32_t lastMicros;
+    static uint32_t microsHigh; //upper half of the 64 bit uS clock
+    static uint64_t pingReceived;
+    static uint8_t pendingId; //id of the ping the next report must match
+    static uint64_t pingHostTime;
+    static uint64_t pingDevRx;
+    static uint64_t pingDevTx;
+    static boolean pending;
+    static boolean locked; //fit has been made at least once
+    static boolean hostTime;
+    static boolean external; //reference comes from SyncPulse, not the host, and is always used for stamps
+    static uint64_t refTime; //device time the fit is anchored at
+    static int64_t refOffset; //fitted offset at refTime
+    static int64_t driftQ32; //offset change per uS of device time, scaled by 2^32
+
+    static void addSample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+    static void fit();
+    static void sendPong(uint8_t id);
+};
+
+#endif /* CLOCKSYNC_H_ */
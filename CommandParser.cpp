@@ -0,0 +1,575 @@
+/*
+ * CommandParser.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "CommandParser.h"
+#include <EEPROM.h>
+#include "sys_io.h"
+#include "Logger.h"
+#include "SerialConsole.h"
+#include "Buses.h"
+#include "BitTracker.h"
+#include "PeriodicTX.h"
+#include "TxQueue.h"
+#include "BulkTX.h"
+#include "Replay.h"
+#include "Capture.h"
+#include "IsoTp.h"
+#include "J1939.h"
+#include "Signals.h"
+#include "AutoBaud.h"
+#include "Gateway.h"
+#include "Latency.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "Generator.h"
+#include "LossReport.h"
+#include "ClockSync.h"
+#include "SyncPulse.h"
+
+extern SerialConsole console;
+
+uint8_t CommandParser::rxBuff[CMD_BUFF_SIZE];
+uint16_t CommandParser::rxLen = 0;
+uint32_t CommandParser::lastByteTime = 0;
+const CMD_ENTRY *CommandParser::streaming = NULL;
+uint8_t CommandParser::index[CMD_MAX_PROTO];
+CMD_STATS CommandParser::stats;
+
+//ID (4 bytes, bit 31 = extended), bus, length, data, checksum
+static void readFrame(uint8_t *data, CAN_FRAME &frame, int &bus)
+{
+    frame.id = data[0] + ((uint32_t)data[1] << 8) + ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24);
+    frame.extended = (frame.id & 1ul << 31) ? true : false;
+    frame.id &= 0x7FFFFFFF;
+    bus = data[4];
+    frame.length = data[5] & 0xF;
+    if (frame.length > 8) frame.length = 8;
+    frame.rtr = 0;
+    for (int c = 0; c < frame.length; c++) frame.data.bytes[c] = data[6 + c];
+}
+
+static int frameLength(uint8_t *data, int have)
+{
+    if (have < 6) return -1;
+    int length = data[5] & 0xF;
+    if (length > 8) length = 8;
+    return 6 + length + 1;
+}
+
+static void buildFrame(uint8_t *data)
+{
+    CAN_FRAME frame;
+    int bus;
+
+    readFrame(data, frame, bus);
+    if (settings.singleWire_Enabled == 1 && frame.id == 0x100 &&
+            ( ((bus == 1) && !SysSettings.dedicatedSWCAN) || (bus == 2) )) {
+        if (!queueSWCANWakeFrame(frame, bus)) TxQueue::refuse(frame, bus);
+    } else TxQueue::queueFrame(frame, bus);
+}
+
+static void echoFrame(uint8_t *data)
+{
+    CAN_FRAME frame;
+    int bus;
+
+    readFrame(data, frame, bus);
+    toggleRXLED();
+    sendFrameToUSB(frame, bus);
+}
+
+//ID (4 bytes, bit 31 = extended), bus, flags, length (0 - 64), data, checksum
+static void readFDFrame(uint8_t *data, CAN_FD_FRAME &frame, int &bus)
+{
+    frame.id = data[0] + ((uint32_t)data[1] << 8) + ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24);
+    frame.extended = (frame.id & 1ul << 31) ? true : false;
+    frame.id &= 0x7FFFFFFF;
+    bus = data[4];
+    frame.flags = data[5] & (FD_FLAG_BRS | FD_FLAG_ESI);
+    frame.length = (data[6] > 64) ? 64 : data[6];
+    memcpy(frame.data, data + 7, frame.length);
+    //pad up to the next valid FD size like the controller would
+    uint8_t padded = fdDLCToLength(fdLengthToDLC(frame.length));
+    while (frame.length < padded) frame.data[frame.length++] = 0;
+}
+
+static int fdFrameLength(uint8_t *data, int have)
+{
+    if (have < 7) return -1;
+    if (data[6] > 64) return -2; //the rest would be taken for commands if this were cut short
+    return 7 + data[6] + 1;
+}
+
+static void buildFDFrame(uint8_t *data)
+{
+    CAN_FD_FRAME frame;
+    int bus;
+
+    readFDFrame(data, frame, bus);
+    if (!queueFDFrame(frame, bus)) {
+        if (!settings.useBinarySerialComm) Logger::console("Bus %i can't send CAN FD frames", bus);
+    }
+}
+
+static void echoFDFrame(uint8_t *data)
+{
+    CAN_FD_FRAME frame;
+    int bus;
+
+    readFDFrame(data, frame, bus);
+    toggleRXLED();
+    sendFDFrameToUSB(frame, bus);
+    if (SysSettings.logToFile) sendFDFrameToFile(frame, bus);
+}
+
+static void timeSync(uint8_t *data)
+{
+    uint8_t buff[6];
+    uint32_t now = micros();
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_TIME_SYNC;
+    buff[2] = (uint8_t)(now & 0xFF);
+    buff[3] = (uint8_t)(now >> 8);
+    buff[4] = (uint8_t)(now >> 16);
+    buff[5] = (uint8_t)(now >> 24);
+    SerialUSB.write(buff, 6);
+}
+
+static void digInputs(uint8_t *data)
+{
+    uint8_t buff[4];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_DIG_INPUTS;
+    buff[2] = getDigital(0) + (getDigital(1) << 1) + (getDigital(2) << 2) + (getDigital(3) << 3);
+    buff[3] = checksumCalc(buff, 2);
+    SerialUSB.write(buff, 4);
+}
+
+static void anaInputs(uint8_t *data)
+{
+    uint8_t buff[11];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_ANA_INPUTS;
+    for (int i = 0; i < 4; i++) {
+        uint16_t val = getAnalog(i);
+        buff[2 + i * 2] = val & 0xFF;
+        buff[3 + i * 2] = uint8_t(val >> 8);
+    }
+    buff[10] = checksumCalc(buff, 9);
+    SerialUSB.write(buff, 11);
+}
+
+static void setDigOutputs(uint8_t *data)
+{
+    for (int c = 0; c < 8; c++) setOutput(c, (data[0] & (1 << c)) ? true : false);
+}
+
+//two setup words (see Buses::configure), one for CAN0 and one for CAN1
+static void setupCanbus(uint8_t *data)
+{
+    for (int bus = 0; bus < 2; bus++) {
+        uint8_t *d = data + bus * 4;
+        Buses::configure(bus, d[0] + ((uint32_t)d[1] << 8) + ((uint32_t)d[2] << 16) + ((uint32_t)d[3] << 24));
+    }
+    EEPROM.write(EEPROM_PAGE, settings);
+    setPromiscuousMode();
+}
+
+static void getCanbusParams(uint8_t *data)
+{
+    uint8_t buff[12];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_CANBUS_PARAMS;
+    for (int bus = 0; bus < 2; bus++) {
+        buff[2 + bus * 5] = settings.buses[bus].enabled + ((unsigned char)settings.buses[bus].listenOnly << 4);
+        buff[3 + bus * 5] = settings.buses[bus].speed;
+        buff[4 + bus * 5] = settings.buses[bus].speed >> 8;
+        buff[5 + bus * 5] = settings.buses[bus].speed >> 16;
+        buff[6 + bus * 5] = settings.buses[bus].speed >> 24;
+    }
+    buff[7] += (unsigned char)settings.singleWire_Enabled << 6;
+    SerialUSB.write(buff, 12);
+}
+
+static void getDeviceInfo(uint8_t *data)
+{
+    uint8_t buff[8];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_DEV_INFO;
+    buff[2] = CFG_BUILD_NUM & 0xFF;
+    buff[3] = (CFG_BUILD_NUM >> 8);
+    buff[4] = EEPROM_VER;
+    buff[5] = (unsigned char)settings.fileOutputType;
+    buff[6] = (unsigned char)settings.autoStartLogging;
+    buff[7] = settings.singleWire_Enabled;
+    SerialUSB.write(buff, 8);
+}
+
+static void setSingleWireMode(uint8_t *data)
+{
+    if (SysSettings.dedicatedSWCAN) Buses::setEnabled(2, data[0] == 0x10);
+    else if (data[0] == 0x10) {
+        settings.singleWire_Enabled = true;
+        setSWCANEnabled();
+    } else {
+        settings.singleWire_Enabled = false;
+        setSWCANSleep();
+    }
+    EEPROM.write(EEPROM_PAGE, settings);
+}
+
+static void keepAlive(uint8_t *data)
+{
+    uint8_t buff[4] = {0xF1, PROTO_KEEPALIVE, 0xDE, 0xAD};
+    SerialUSB.write(buff, 4);
+}
+
+static void setSysType(uint8_t *data)
+{
+    settings.sysType = data[0];
+    EEPROM.write(EEPROM_PAGE, settings);
+    loadSettings();
+}
+
+static void getNumBuses(uint8_t *data)
+{
+    uint8_t buff[3] = {0xF1, PROTO_GET_NUMBUSES, (uint8_t)Buses::count()};
+    SerialUSB.write(buff, 3);
+}
+
+//third, fourth and fifth bus. Zeros if the board doesn't have them
+static void getExtBuses(uint8_t *data)
+{
+    uint8_t buff[17];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_EXT_BUSES;
+    for (int bus = 2; bus < 5; bus++) {
+        int pos = 2 + (bus - 2) * 5;
+        uint32_t speed = 0;
+        buff[pos] = 0;
+        if (bus < Buses::count()) {
+            buff[pos] = settings.buses[bus].enabled + ((unsigned char)settings.buses[bus].listenOnly << 4);
+            speed = settings.buses[bus].speed;
+        }
+        buff[pos + 1] = speed;
+        buff[pos + 2] = speed >> 8;
+        buff[pos + 3] = speed >> 16;
+        buff[pos + 4] = speed >> 24;
+    }
+    SerialUSB.write(buff, 17);
+}
+
+//setup words for the third, fourth and fifth bus. Ignored for buses the board doesn't have
+static void setExtBuses(uint8_t *data)
+{
+    for (int i = 0; i < 3; i++) {
+        uint8_t *d = data + i * 4;
+        Buses::configure(2 + i, d[0] + ((uint32_t)d[1] << 8) + ((uint32_t)d[2] << 16) + ((uint32_t)d[3] << 24));
+    }
+    EEPROM.write(EEPROM_PAGE, settings);
+}
+
+static void busStatus(uint8_t *data)
+{
+    Buses::sendHealth();
+}
+
+//bit mask of the buses to search, 0 cancels
+static void autoBaud(uint8_t *data)
+{
+    AutoBaud::start(data[0]);
+}
+
+static void bitTrack(uint8_t *data)
+{
+    switch (data[0]) {
+    case BitTracker::CMD_DISABLE:
+        BitTracker::setEnabled(false);
+        break;
+    case BitTracker::CMD_ENABLE:
+        BitTracker::setEnabled(true);
+        break;
+    case BitTracker::CMD_RESET:
+        BitTracker::reset();
+        break;
+    case BitTracker::CMD_DUMP:
+        BitTracker::dumpBinary();
+        break;
+    }
+}
+
+//the ping is stamped as late as this, which is still the same pass as the bulk read that brought it in
+static void clockSync(uint8_t *data)
+{
+    ClockSync::markReceived();
+    ClockSync::handleCommand(data);
+}
+
+static void parserStats(uint8_t *data)
+{
+    CommandParser::sendStats();
+}
+
+static const CMD_ENTRY commandTable[] = {
+    {PROTO_BUILD_CAN_FRAME, CommandParser::CMD_LEN_FUNC, NULL, frameLength, buildFrame, NULL, NULL},
+    {PROTO_TIME_SYNC, 0, NULL, NULL, timeSync, NULL, NULL},
+    {PROTO_DIG_INPUTS, 0, NULL, NULL, digInputs, NULL, NULL},
+    {PROTO_ANA_INPUTS, 0, NULL, NULL, anaInputs, NULL, NULL},
+    {PROTO_SET_DIG_OUT, 1, NULL, NULL, setDigOutputs, NULL, NULL},
+    {PROTO_SETUP_CANBUS, 8, NULL, NULL, setupCanbus, NULL, NULL},
+    {PROTO_GET_CANBUS_PARAMS, 0, NULL, NULL, getCanbusParams, NULL, NULL},
+    {PROTO_GET_DEV_INFO, 0, NULL, NULL, getDeviceInfo, NULL, NULL},
+    {PROTO_SET_SW_MODE, 1, NULL, NULL, setSingleWireMode, NULL, NULL},
+    {PROTO_KEEPALIVE, 0, NULL, NULL, keepAlive, NULL, NULL},
+    {PROTO_SET_SYSTYPE, 1, NULL, NULL, setSysType, NULL, NULL},
+    {PROTO_ECHO_CAN_FRAME, CommandParser::CMD_LEN_FUNC, NULL, frameLength, echoFrame, NULL, NULL},
+    {PROTO_GET_NUMBUSES, 0, NULL, NULL, getNumBuses, NULL, NULL},
+    {PROTO_GET_EXT_BUSES, 0, NULL, NULL, getExtBuses, NULL, NULL},
+    {PROTO_SET_EXT_BUSES, 12, NULL, NULL, setExtBuses, NULL, NULL},
+    {PROTO_BITTRACK, 1, NULL, NULL, bitTrack, NULL, NULL},
+    {PROTO_PERIODIC_TX, CommandParser::CMD_LEN_SUB, PeriodicTX::commandLength, NULL, PeriodicTX::handleCommand, NULL, NULL},
+    {PROTO_TX_QUEUE, CommandParser::CMD_LEN_SUB, TxQueue::commandLength, NULL, TxQueue::handleCommand, NULL, NULL},
+    {PROTO_BULK_TX, CommandParser::CMD_LEN_STREAM, NULL, NULL, NULL, BulkTX::receive, BulkTX::begin},
+    {PROTO_REPLAY, CommandParser::CMD_LEN_SUB, Replay::commandLength, NULL, Replay::handleCommand, NULL, NULL},
+    {PROTO_CAPTURE, CommandParser::CMD_LEN_SUB, Capture::commandLength, NULL, Capture::handleCommand, NULL, NULL},
+    {PROTO_ISOTP, CommandParser::CMD_LEN_STREAM, NULL, NULL, NULL, IsoTp::receive, IsoTp::begin},
+    {PROTO_J1939, CommandParser::CMD_LEN_SUB, J1939::commandLength, NULL, J1939::handleCommand, NULL, NULL},
+    {PROTO_SIGNALS, CommandParser::CMD_LEN_SUB, Signals::commandLength, NULL, Signals::handleCommand, NULL, NULL},
+    {PROTO_BUILD_FD_FRAME, CommandParser::CMD_LEN_FUNC, NULL, fdFrameLength, buildFDFrame, NULL, NULL},
+    {PROTO_ECHO_FD_FRAME, CommandParser::CMD_LEN_FUNC, NULL, fdFrameLength, echoFDFrame, NULL, NULL},
+    {PROTO_BUS_STATUS, 0, NULL, NULL, busStatus, NULL, NULL},
+    {PROTO_AUTOBAUD, 1, NULL, NULL, autoBaud, NULL, NULL},
+    {PROTO_GATEWAY, CommandParser::CMD_LEN_SUB, Gateway::commandLength, NULL, Gateway::handleCommand, NULL, NULL},
+    {PROTO_LATENCY, CommandParser::CMD_LEN_SUB, Latency::commandLength, NULL, Latency::handleCommand, NULL, NULL},
+    {PROTO_PROFILE, CommandParser::CMD_LEN_SUB, Profiler::commandLength, NULL, Profiler::handleCommand, NULL, NULL},
+    {PROTO_BENCHMARK, CommandParser::CMD_LEN_SUB, Benchmark::commandLength, NULL, Benchmark::handleCommand, NULL, NULL},
+    {PROTO_GENERATOR, CommandParser::CMD_LEN_SUB, Generator::commandLength, NULL, Generator::handleCommand, NULL, NULL},
+    {PROTO_LOSS, CommandParser::CMD_LEN_SUB, LossReport::commandLength, NULL, LossReport::handleCommand, NULL, NULL},
+    {PROTO_CLOCK_SYNC, CommandParser::CMD_LEN_SUB, ClockSync::commandLength, NULL, clockSync, NULL, NULL},
+    {PROTO_SYNC_PULSE, CommandParser::CMD_LEN_SUB, SyncPulse::commandLength, NULL, SyncPulse::handleCommand, NULL, NULL},
+    {PROTO_PARSER_STATS, 0, NULL, NULL, parserStats, NULL, NULL}
+};
+
+#define NUM_COMMANDS (sizeof(commandTable) / sizeof(commandTable[0]))
+
+void CommandParser::setup()
+{
+    for (int i = 0; i < CMD_MAX_PROTO; i++) index[i] = 0;
+    for (unsigned int i = 0; i < NUM_COMMANDS; i++) {
+        if (commandTable[i].proto < CMD_MAX_PROTO) index[commandTable[i].proto] = i + 1;
+    }
+    memset(&stats, 0, sizeof(stats));
+}
+
+const CMD_ENTRY *CommandParser::find(uint8_t proto)
+{
+    if (proto >= CMD_MAX_PROTO || index[proto] == 0) return NULL;
+    return &commandTable[index[proto] - 1];
+}
+
+//bytes after the protocol byte, -1 if the start of the payload has to arrive before that is known, -2 if it is bad
+int CommandParser::payloadLength(const CMD_ENTRY *entry, uint8_t *data, int have)
+{
+    switch (entry->length) {
+    case CMD_LEN_SUB:
+        if (have < 1) return -1;
+        return 1 + entry->subLength(data[0]);
+    case CMD_LEN_FUNC:
+        return entry->lengthOf(data, have);
+    }
+    return entry->length;
+}
+
+/*
+ * 0xF2 packet. Nothing in it is trusted until the CRC matches, so a bad one only gives up
+ * the start byte. Stream commands must arrive complete in one packet here.
+ */
+int CommandParser::parseFramed(uint8_t *data, int have)
+{
+    if (have < 2) return 0;
+    int length = data[1];
+    int total = 2 + length + 2;
+    if (length == 0 || total > CMD_BUFF_SIZE) {
+        stats.badLength++;
+        return 1;
+    }
+    if (have < total) return 0;
+
+    uint16_t crc = data[2 + length] + ((uint16_t)data[3 + length] << 8);
+    if (BulkTX::crc16(data + 1, 1 + length) != crc) {
+        stats.badCRC++;
+        return 1;
+    }
+
+    const CMD_ENTRY *entry = find(data[2]);
+    uint8_t *payload = data + 3;
+    int payloadLen = length - 1;
+    if (!entry) {
+        stats.unknown++;
+        return total;
+    }
+    if (entry->length == CMD_LEN_STREAM) {
+        int used;
+        entry->begin();
+        if (!entry->stream(payload, payloadLen, used) || used != payloadLen) {
+            entry->begin();
+            stats.badLength++;
+        } else stats.framed++;
+        return total;
+    }
+    if (payloadLength(entry, payload, payloadLen) != payloadLen) {
+        stats.badLength++;
+        return total;
+    }
+    entry->handler(payload);
+    stats.framed++;
+    return total;
+}
+
+//returns the number of bytes used from the front of data, 0 if more have to arrive first
+int CommandParser::parse(uint8_t *data, int have)
+{
+    if (streaming) {
+        int used;
+        if (streaming->stream(data, have, used)) {
+            streaming = NULL;
+            stats.packets++;
+        }
+        return used;
+    }
+
+    switch (data[0]) {
+    case 0xF1: {
+        if (have < 2) return 0;
+        const CMD_ENTRY *entry = find(data[1]);
+        if (!entry) {
+            stats.unknown++;
+            return 1;
+        }
+        if (entry->length == CMD_LEN_STREAM) {
+            entry->begin();
+            streaming = entry;
+            return 2;
+        }
+        int need = payloadLength(entry, data + 2, have - 2);
+        if (need == -1) return 0;
+        if (need < 0 || 2 + need > CMD_BUFF_SIZE) { //out of range or could never all be buffered
+            stats.badLength++;
+            return 1;
+        }
+        if (2 + need > have) return 0;
+        entry->handler(data + 2);
+        stats.packets++;
+        return 2 + need;
+    }
+    case 0xF2:
+        return parseFramed(data, have);
+    case 0xE7:
+        settings.useBinarySerialComm = true;
+        SysSettings.lawicelMode = false;
+        setPromiscuousMode(); //go into promisc. mode with binary comm
+        return 1;
+    }
+    console.rcvCharacter(data[0]);
+    return 1;
+}
+
+/*
+ * Reads whatever USB has, decodes every complete packet, and keeps the remainder for next time.
+ * Goes round again while more keeps arriving, up to CMD_MAX_PER_LOOP bytes per call.
+ */
+void CommandParser::loop()
+{
+    int total = 0;
+
+    while (total < CMD_MAX_PER_LOOP) {
+        int avail = SerialUSB.available();
+        if (avail > CMD_BUFF_SIZE - rxLen) avail = CMD_BUFF_SIZE - rxLen;
+        if (avail > 0) {
+            rxLen += SerialUSB.readBytes(rxBuff + rxLen, avail);
+            lastByteTime = millis();
+            total += avail;
+        }
+
+        int pos = 0;
+        while (pos < rxLen) {
+            int used = parse(rxBuff + pos, rxLen - pos);
+            if (used == 0) break;
+            pos += used;
+        }
+
+        //a packet that was started but never finished is given up on one start byte at a time
+        if (pos < rxLen && pos == 0 && (millis() - lastByteTime) > CMD_TIMEOUT) {
+            stats.timeouts++;
+            pos = 1;
+        }
+        if (pos > 0) {
+            memmove(rxBuff, rxBuff + pos, rxLen - pos);
+            rxLen -= pos;
+        }
+        if (avail <= 0) break;
+    }
+
+    if (streaming && rxLen == 0 && (millis() - lastByteTime) > CMD_TIMEOUT) {
+        streaming->begin();
+        streaming = NULL;
+        stats.timeouts++;
+    }
+}
+
+CMD_STATS *CommandParser::getStats()
+{
+    return &stats;
+}
+
+//0xF1, PROTO_PARSER_STATS, then each CMD_STATS counter (4 bytes each)
+void CommandParser::sendStats()
+{
+    uint8_t buff[26];
+    uint32_t vals[6] = {stats.packets, stats.framed, stats.badCRC, stats.badLength, stats.unknown, stats.timeouts};
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_PARSER_STATS;
+    for (int v = 0; v < 6; v++) {
+        buff[2 + v * 4] = (uint8_t)(vals[v] & 0xFF);
+        buff[3 + v * 4] = (uint8_t)(vals[v] >> 8);
+        buff[4 + v * 4] = (uint8_t)(vals[v] >> 16);
+        buff[5 + v * 4] = (uint8_t)(vals[v] >> 24);
+    }
+    SerialUSB.write(buff, 26);
+}
+
+void CommandParser::printStats()
+{
+    Logger::console("Binary commands: %i run, %i framed run, %i bad CRC, %i bad length, %i unknown, %i timed out",
+                    stats.packets, stats.framed, stats.badCRC, stats.badLength, stats.unknown, stats.timeouts);
+}
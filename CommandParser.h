@@ -0,0 +1,97 @@
+/*
+ * CommandParser.h
+ *
+ * Binary command decoder. Everything waiting on USB is read into a buffer in one go and whole
+ * packets are cut out of it and dispatched through a table that says, for each protocol byte,
+ * how long the packet is and which function runs it. Two framings are understood:
+ *
+ * 0xF1, protocol, payload - the original framing. The table gives the payload size, so no
+ *     length travels with it and the trailing checksum byte some commands carry is not checked
+ *     (hosts have always sent 0 there).
+ * 0xF2, length, protocol, payload, CRC16 (2 bytes) - length counts the protocol byte and the
+ *     payload, the CRC is the same CCITT CRC16 bulk transmit uses and covers length, protocol
+ *     and payload. The packet is only run if the CRC matches and the length agrees with the table.
+ *
+ * Bytes that don't start a packet go to the serial console as before. A bad start byte,
+ * unknown protocol, bad CRC or a packet that stops arriving for CMD_TIMEOUT mS costs only the
+ * start byte and decoding carries on from the next one.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef COMMANDPARSER_H_
+#define COMMANDPARSER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct CMD_ENTRY {
+    uint8_t proto; //GVRET_PROTOCOL
+    int16_t length; //payload bytes after the protocol byte, or one of CommandParser::CMD_LENGTH
+    int (*subLength)(uint8_t cmd); //CMD_LEN_SUB: bytes that follow each sub command byte
+    int (*lengthOf)(uint8_t *data, int have); //CMD_LEN_FUNC: payload size, -1 until enough is in to tell, -2 if it can't be valid
+    void (*handler)(uint8_t *data);
+    boolean (*stream)(uint8_t *data, int length, int &used); //CMD_LEN_STREAM: fed until it returns true
+    void (*begin)(); //CMD_LEN_STREAM: reset before a new command
+};
+
+struct CMD_STATS {
+    uint32_t packets; //0xF1 packets run
+    uint32_t framed; //0xF2 packets run
+    uint32_t badCRC;
+    uint32_t badLength; //length didn't agree with the table, was out of range, or too big to ever fit
+    uint32_t unknown; //no table entry for the protocol byte
+    uint32_t timeouts; //packet stopped arriving part way
+};
+
+class CommandParser
+{
+public:
+    enum CMD_LENGTH {
+        CMD_LEN_SUB = -1, //sub command byte, then as many bytes as the module says
+        CMD_LEN_FUNC = -2, //worked out from the start of the payload
+        CMD_LEN_STREAM = -3 //variable and possibly bigger than the buffer, handed over as it comes
+    };
+
+    static void setup();
+    static void loop();
+    static CMD_STATS *getStats();
+    static void sendStats();
+    static void printStats();
+
+private:
+    static uint8_t rxBuff[CMD_BUFF_SIZE];
+    static uint16_t rxLen;
+    static uint32_t lastByteTime; //millis() when the buffer last grew
+    static const CMD_ENTRY *streaming; //stream command being fed, NULL if none
+    static uint8_t index[CMD_MAX_PROTO]; //table position + 1 for each protocol byte, 0 if none
+    static CMD_STATS stats;
+
+    static const CMD_ENTRY *find(uint8_t proto);
+    static int payloadLength(const CMD_ENTRY *entry, uint8_t *data, int have);
+    static int parse(uint8_t *data, int have);
+    static int parseFramed(uint8_t *data, int have);
+};
+
+#endif /* COMMANDPARSER_H_ */
@@ -39,6 +39,26 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <FlexCAN_T4.h>
 #include <MCP2515.h>
 #include "SerialConsole.h"
+#include "BitTracker.h"
+#include "PeriodicTX.h"
+#include "TxQueue.h"
+#include "BulkTX.h"
+#include "Replay.h"
+#include "Capture.h"
+#include "IsoTp.h"
+#include "J1939.h"
+#include "Signals.h"
+#include "Buses.h"
+#include "AutoBaud.h"
+#include "Gateway.h"
+#include "Latency.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "Generator.h"
+#include "LossReport.h"
+#include "ClockSync.h"
+#include "SyncPulse.h"
+#include "CommandParser.h"
 
 /*
 Notes on project:
@@ -51,6 +71,8 @@ byte i = 0;
 
 byte serialBuffer[SER_BUFF_SIZE];
 int serialBufferLength = 0; //not creating a ring buffer. The buffer should be large enough to never overflow
+Print *usbOut = &SerialUSB; //where frame output goes. Only the benchmark points it anywhere else
+int serialBufferFrames = 0; //binary frame records in serialBuffer, counted as lost if the write to the host comes up short
 uint32_t lastFlushMicros = 0;
 
 EEPROMSettings settings;
@@ -60,19 +82,26 @@ DigitalCANToggleSettings digToggleSettings;
 // file system on sdcard
 SdFat sd;
 
-//Only used by CANDue V2.2 boards
-MCP2515 SWCAN(CANDUE22_SW_CS, CANDUE22_SW_INT);
-
 SerialConsole console;
 
+//single wire wake up state machine. Frames that need the high voltage wake up wait here
+enum SWCAN_WAKE_STATE {
+    WAKE_IDLE,
+    WAKE_PRE, //transceiver switched to wake mode, timer running until it has settled
+    WAKE_SEND, //settled, loop() hands the frame to the controller
+    WAKE_TX, //handed over, loop() waits for the controller to finish sending it
+    WAKE_POST //sent, timer holding wake mode until it has cleared the transceiver
+};
+volatile uint8_t swcanWakeState = WAKE_IDLE; //SWCAN_WAKE_STATE. The timer interrupt moves it on from PRE and POST
+TXQ_ENTRY swcanWakeFrames[SWCAN_WAKE_QUEUE];
+uint8_t swcanWakeBuses[SWCAN_WAKE_QUEUE];
+uint8_t swcanWakeHead = 0;
+volatile uint8_t swcanWakeCount = 0;
+uint32_t swcanWakeTime; //millis() the current step started, for giving up on a controller that never sends
+
 bool digTogglePinState;
 uint8_t digTogglePinCounter;
 
-void SWCAN_Int()
-{
-    SWCAN.intHandler();
-}
-
 //initializes all the system EEPROM values. Chances are this should be broken out a bit but
 //there is only one checksum check for all of them so it's simple to do it all here.
 void loadSettings()
@@ -83,49 +112,35 @@ void loadSettings()
         Logger::console("Resetting to factory defaults");
         settings.version = EEPROM_VER;
         settings.appendFile = false;
-        settings.CAN0Speed = 500000;
-        settings.CAN0_Enabled = true;
-        settings.CAN1Speed = 500000;
-        settings.CAN1_Enabled = true;
-        settings.SWCANSpeed = 33333;
+        for (int bus = 0; bus < NUM_BUSES; bus++) {
+            settings.buses[bus].speed = 500000;
+            settings.buses[bus].enabled = true;
+            settings.buses[bus].listenOnly = false;
+            for (int i = 0; i < NUM_BUS_FILTERS; i++) {
+                settings.buses[bus].filters[i].enabled = true;
+                settings.buses[bus].filters[i].extended = (i < 3); //3 extended mailboxes, the rest standard
+                settings.buses[bus].filters[i].id = 0;
+                settings.buses[bus].filters[i].mask = 0;
+            }
+        }
+        settings.buses[2].speed = 33333; //single wire
+        settings.buses[2].enabled = false;
         settings.singleWire_Enabled = false;
         sprintf((char *)settings.fileNameBase, "CANBUS");
         sprintf((char *)settings.fileNameExt, "TXT");
         settings.fileNum = 1;
-        for (int i = 0; i < 3; i++) {
-            settings.CAN0Filters[i].enabled = true;
-            settings.CAN0Filters[i].extended = true;
-            settings.CAN0Filters[i].id = 0;
-            settings.CAN0Filters[i].mask = 0;
-            settings.CAN1Filters[i].enabled = true;
-            settings.CAN1Filters[i].extended = true;
-            settings.CAN1Filters[i].id = 0;
-            settings.CAN1Filters[i].mask = 0;
-        }
-        for (int j = 3; j < 8; j++) {
-            settings.CAN0Filters[j].enabled = true;
-            settings.CAN0Filters[j].extended = false;
-            settings.CAN0Filters[j].id = 0;
-            settings.CAN0Filters[j].mask = 0;
-            settings.CAN1Filters[j].enabled = true;
-            settings.CAN1Filters[j].extended = false;
-            settings.CAN1Filters[j].id = 0;
-            settings.CAN1Filters[j].mask = 0;
-        }
         settings.fileOutputType = CRTD;
         settings.useBinarySerialComm = false;
         settings.autoStartLogging = false;
         settings.logLevel = 1; //info
         settings.sysType = 0; //CANDUE as default
         settings.valid = 0; //not used right now
-        settings.CAN0ListenOnly = false;
-        settings.CAN1ListenOnly = false;
         EEPROM.write(EEPROM_PAGE, settings);
     } else {
         Logger::console("Using stored values from EEPROM");
     }
 
-    EEPROM.read(EEPROM_PAGE + 1, digToggleSettings);
+    EEPROM.read(EEPROM_TOGGLE_PAGE, digToggleSettings);
     if (digToggleSettings.mode == 255) {
         Logger::console("Resetting digital toggling system to defaults");
         digToggleSettings.enabled = false;
@@ -134,7 +149,7 @@ void loadSettings()
         digToggleSettings.pin = 1;
         digToggleSettings.rxTxID = 0x700;
         for (int c=0 ; c<8 ; c++) digToggleSettings.payload[c] = 0;
-        EEPROM.write(EEPROM_PAGE + 1, digToggleSettings);
+        EEPROM.write(EEPROM_TOGGLE_PAGE, digToggleSettings);
     } else {
         Logger::console("Using stored values for digital toggling system");
     }
@@ -147,8 +162,9 @@ void loadSettings()
     case 1:  //GEVCU
         Logger::console("Running on GEVCU hardware");
         SysSettings.eepromWPPin = GEVCU_EEPROM_WP_PIN;
-        SysSettings.CAN0EnablePin = GEVCU_CAN0_EN_PIN;
-        SysSettings.CAN1EnablePin = GEVCU_CAN1_EN_PIN;
+        SysSettings.busEnablePin[0] = GEVCU_CAN0_EN_PIN;
+        SysSettings.busEnablePin[1] = GEVCU_CAN1_EN_PIN;
+        SysSettings.busEnablePin[2] = 255;
         SysSettings.SWCANMode0Pin = GEVCU_SWCAN_MODE0;
         SysSettings.SWCANMode1Pin = GEVCU_SWCAN_MODE1;
         SysSettings.useSD = false;
@@ -164,8 +180,9 @@ void loadSettings()
     case 2: //CANDUE13
         Logger::console("Running on CANDue v1.3 - v2.1 hardware");
         SysSettings.eepromWPPin = CANDUE_EEPROM_WP_PIN;
-        SysSettings.CAN0EnablePin = CANDUE_CAN0_EN_PIN;
-        SysSettings.CAN1EnablePin = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[0] = CANDUE_CAN0_EN_PIN;
+        SysSettings.busEnablePin[1] = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[2] = 255;
         SysSettings.SWCANMode0Pin = CANDUE_SWCAN_MODE0;
         SysSettings.SWCANMode1Pin = CANDUE_SWCAN_MODE1;
         SysSettings.useSD = true;
@@ -184,8 +201,9 @@ void loadSettings()
     case 3: //CANDue 2.2 boards
         Logger::console("Running on CANDue v2.2 hardware");
         SysSettings.eepromWPPin = CANDUE_EEPROM_WP_PIN;
-        SysSettings.CAN0EnablePin = CANDUE_CAN0_EN_PIN;
-        SysSettings.CAN1EnablePin = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[0] = CANDUE_CAN0_EN_PIN;
+        SysSettings.busEnablePin[1] = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[2] = 255;
         SysSettings.SWCANMode0Pin = CANDUE_SWCAN_MODE0;
         SysSettings.SWCANMode1Pin = CANDUE_SWCAN_MODE1;
         SysSettings.useSD = true;
@@ -204,8 +222,9 @@ void loadSettings()
     default: //CANDUE
         Logger::console("Running on CANDue hardware");
         SysSettings.eepromWPPin = CANDUE_EEPROM_WP_PIN;
-        SysSettings.CAN0EnablePin = CANDUE_CAN0_EN_PIN;
-        SysSettings.CAN1EnablePin = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[0] = CANDUE_CAN0_EN_PIN;
+        SysSettings.busEnablePin[1] = CANDUE_CAN1_EN_PIN;
+        SysSettings.busEnablePin[2] = 255;
         SysSettings.SWCANMode0Pin = CANDUE_SWCAN_MODE0;
         SysSettings.SWCANMode1Pin = CANDUE_SWCAN_MODE1;
         SysSettings.useSD = true;
@@ -230,12 +249,9 @@ void loadSettings()
     if (SysSettings.SWCANMode0Pin != 255) pinMode(SysSettings.SWCANMode0Pin, OUTPUT);
     if (SysSettings.SWCANMode1Pin != 255) pinMode(SysSettings.SWCANMode1Pin, OUTPUT);
 
-    if (SysSettings.CAN0EnablePin != 255) pinMode(SysSettings.CAN0EnablePin, OUTPUT);
-    if (SysSettings.CAN1EnablePin != 255) pinMode(SysSettings.CAN1EnablePin, OUTPUT);
-
     if (!SysSettings.dedicatedSWCAN)
     {
-        if (settings.singleWire_Enabled && settings.CAN1_Enabled) setSWCANEnabled();
+        if (settings.singleWire_Enabled && settings.buses[1].enabled) setSWCANEnabled();
         else setSWCANSleep(); //start out setting single wire to sleep.
     }
     else
@@ -250,7 +266,7 @@ void setSWCANSleep()
     if (SysSettings.SWCANMode0Pin != 255) digitalWrite(SysSettings.SWCANMode0Pin, LOW);
     if (SysSettings.SWCANMode1Pin != 255) digitalWrite(SysSettings.SWCANMode1Pin, LOW);
     if (SysSettings.dedicatedSWCAN) return;
-    if (settings.CAN1_Enabled && SysSettings.CAN1EnablePin != 255) digitalWrite(SysSettings.CAN1EnablePin, HIGH);
+    if (settings.buses[1].enabled && SysSettings.busEnablePin[1] != 255) digitalWrite(SysSettings.busEnablePin[1], HIGH);
 }
 
 void setSWCANEnabled()
@@ -258,7 +274,7 @@ void setSWCANEnabled()
     if (SysSettings.SWCANMode0Pin != 255) digitalWrite(SysSettings.SWCANMode0Pin, HIGH);
     if (SysSettings.SWCANMode1Pin != 255) digitalWrite(SysSettings.SWCANMode1Pin, HIGH);
     if (SysSettings.dedicatedSWCAN) return;
-    if (settings.CAN1_Enabled && SysSettings.CAN1EnablePin != 255) digitalWrite(SysSettings.CAN1EnablePin, LOW);
+    if (settings.buses[1].enabled && SysSettings.busEnablePin[1] != 255) digitalWrite(SysSettings.busEnablePin[1], LOW);
 }
 
 void setSWCANWakeup()
@@ -267,6 +283,111 @@ void setSWCANWakeup()
     if (SysSettings.SWCANMode1Pin != 255) digitalWrite(SysSettings.SWCANMode1Pin, HIGH);
 }
 
+//every bus that shares the single wire transceiver is held off for the whole wake sequence, interrupt senders included
+void holdSWCANBuses(boolean en)
+{
+    Buses::hold(2, en);
+    if (!SysSettings.dedicatedSWCAN) Buses::hold(1, en);
+}
+
+//one shot settle period on the wake timer
+void startSWCANWakeTimer()
+{
+    TC_SetRC(SWCAN_WAKE_TIMER, SWCAN_WAKE_TIMER_CH, SWCAN_WAKE_SETTLE * (VARIANT_MCK / 2000000));
+    TC_Start(SWCAN_WAKE_TIMER, SWCAN_WAKE_TIMER_CH);
+}
+
+void SWCAN_WAKE_TIMER_HANDLER()
+{
+    TC_GetStatus(SWCAN_WAKE_TIMER, SWCAN_WAKE_TIMER_CH); //reading the status register clears the interrupt
+    TC_Stop(SWCAN_WAKE_TIMER, SWCAN_WAKE_TIMER_CH);
+    if (swcanWakeState == WAKE_PRE) swcanWakeState = WAKE_SEND;
+    else if (swcanWakeState == WAKE_POST) {
+        if (swcanWakeCount > 0) { //still in wake mode so the next one can go straight out
+            swcanWakeState = WAKE_SEND;
+            return;
+        }
+        setSWCANEnabled();
+        holdSWCANBuses(false);
+        swcanWakeState = WAKE_IDLE;
+    }
+}
+
+void setupSWCANWake()
+{
+    pmc_set_writeprotect(false);
+    pmc_enable_periph_clk(SWCAN_WAKE_TIMER_ID);
+    TC_Configure(SWCAN_WAKE_TIMER, SWCAN_WAKE_TIMER_CH, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1);
+    SWCAN_WAKE_TIMER->TC_CHANNEL[SWCAN_WAKE_TIMER_CH].TC_IER = TC_IER_CPCS;
+    SWCAN_WAKE_TIMER->TC_CHANNEL[SWCAN_WAKE_TIMER_CH].TC_IDR = ~TC_IER_CPCS;
+    NVIC_SetPriority(SWCAN_WAKE_TIMER_IRQ, 14);
+    NVIC_EnableIRQ(SWCAN_WAKE_TIMER_IRQ);
+}
+
+//false if the wake queue is full, the caller reports that like a full transmit queue
+boolean queueSWCANWakeFrame(CAN_message_t &frame, int whichBus)
+{
+    if (swcanWakeCount >= SWCAN_WAKE_QUEUE) return false;
+    int idx = (swcanWakeHead + swcanWakeCount) % SWCAN_WAKE_QUEUE;
+    swcanWakeFrames[idx].frame = frame;
+    swcanWakeFrames[idx].seq = TxQueue::takeSeq();
+    swcanWakeFrames[idx].queuedAt = millis();
+    swcanWakeBuses[idx] = whichBus;
+    swcanWakeCount++; //the timer interrupt may now see it and stay in wake mode for it
+    if (swcanWakeState == WAKE_IDLE) {
+        holdSWCANBuses(true);
+        setSWCANWakeup();
+        swcanWakeState = WAKE_PRE;
+        startSWCANWakeTimer();
+    }
+    return true;
+}
+
+//true while the given bus is in (or about to go into) high voltage wake mode. Normal traffic holds off until then.
+boolean swcanWakeBusy(int whichBus)
+{
+    if (swcanWakeState == WAKE_IDLE && swcanWakeCount == 0) return false;
+    if (whichBus == 2) return true;
+    return (whichBus == 1 && !SysSettings.dedicatedSWCAN);
+}
+
+/*
+Wake up sequence: wake mode, settle, send, wait for the frame to leave, settle, normal mode.
+The settle periods and the mode changes run from the wake timer. The send and the check for
+the end of transmission need the MCP2515's SPI bus, so they are done from here.
+Back to back wake frames are sent without leaving wake mode in between.
+*/
+void swcanWakeLoop()
+{
+    uint32_t now = millis();
+    TXQ_ENTRY *entry = &swcanWakeFrames[swcanWakeHead];
+    int bus = swcanWakeBuses[swcanWakeHead];
+
+    switch (swcanWakeState) {
+    case WAKE_SEND:
+        if (Buses::send(entry->frame, bus, true)) {
+            swcanWakeTime = now;
+            swcanWakeState = WAKE_TX;
+        } else if (now - entry->queuedAt > TXQ_TIMEOUT) { //give up if the controller never takes it
+            TxQueue::sendAck(bus, entry, TxQueue::TX_TIMEOUT);
+            swcanWakeHead = (swcanWakeHead + 1) % SWCAN_WAKE_QUEUE;
+            swcanWakeCount--;
+            swcanWakeState = WAKE_POST;
+            startSWCANWakeTimer();
+        }
+        break;
+    case WAKE_TX:
+        if (Buses::txIdle(bus)) TxQueue::sendAck(bus, entry, TxQueue::TX_COMPLETE);
+        else if (now - swcanWakeTime > TXQ_TIMEOUT) TxQueue::sendAck(bus, entry, TxQueue::TX_TIMEOUT);
+        else return;
+        swcanWakeHead = (swcanWakeHead + 1) % SWCAN_WAKE_QUEUE;
+        swcanWakeCount--;
+        swcanWakeState = WAKE_POST;
+        startSWCANWakeTimer();
+        break;
+    }
+}
+
 void setup()
 {
     pinMode(CANDUE22_SW_CS, OUTPUT);
@@ -327,88 +448,31 @@ void setup()
         }
     }
 
-    if (settings.CAN0_Enabled) {
-        if (settings.CAN0ListenOnly) {
-            Can0.enable_autobaud_listen_mode();
-        } else {
-            Can0.disable_autobaud_listen_mode();
-        }
-        Can0.enable();
-        Can0.begin(settings.CAN0Speed, SysSettings.CAN0EnablePin);
-    } else Can0.disable();
-
-    if (settings.CAN1_Enabled) {
-        if (settings.CAN1ListenOnly) {
-            Can1.enable_autobaud_listen_mode();
-        } else {
-            Can1.disable_autobaud_listen_mode();
-        }
-        Can1.enable();
-        Can1.begin(settings.CAN1Speed, SysSettings.CAN1EnablePin);
-        if (!SysSettings.dedicatedSWCAN) 
-        {
-            if (settings.singleWire_Enabled) {
-                setSWCANEnabled();
-            } else {
-                setSWCANSleep();
-            }
-        }
-    } else Can1.disable();
-    
     if (SysSettings.dedicatedSWCAN) setSWCANSleep();
+    Buses::setup();
 
-    if (settings.singleWire_Enabled && SysSettings.dedicatedSWCAN)
-    {
-        SPI.begin();
-        if(SWCAN.Init(settings.SWCANSpeed,16))
-        {
-            SerialUSB.println("MCP2515 Init OK ...");
-            attachInterrupt(CANDUE22_SW_INT, SWCAN_Int, FALLING);
-            setSWCANEnabled();
-        } else {
-            SerialUSB.println("MCP2515 Init Failed ...");
-        }
-    } 
-
-    for (int i = 0; i < 7; i++) {
-        if (settings.CAN0Filters[i].enabled) {
-            Can0.setRXFilter(i, settings.CAN0Filters[i].id,
-                             settings.CAN0Filters[i].mask, settings.CAN0Filters[i].extended);
-        }
-        if (settings.CAN1Filters[i].enabled) {
-            Can1.setRXFilter(i, settings.CAN1Filters[i].id,
-                             settings.CAN1Filters[i].mask, settings.CAN1Filters[i].extended);
-        }
-    }
-
-    if (settings.singleWire_Enabled && SysSettings.dedicatedSWCAN)
-        SWCAN.InitFilters(true); //let everything through
-    
     SysSettings.lawicelMode = false;
     SysSettings.lawicelAutoPoll = false;
     SysSettings.lawicelTimestamping = false;
     SysSettings.lawicelPollCounter = 0;
 
+    PeriodicTX::setup();
+    setupSWCANWake();
+    Gateway::setup();
+    Latency::setup();
+    Generator::setup();
+    LossReport::setup();
+    ClockSync::setup();
+    SyncPulse::setup();
+    CommandParser::setup();
+
     SerialUSB.print("Done with init\n");
     digitalWrite(BLINK_LED, HIGH);
 }
 
 void setPromiscuousMode()
 {
-    //By default there are 7 mailboxes for each device that are RX boxes
-    //This sets each mailbox to have an open filter that will accept extended
-    //or standard frames
-    int filter;
-    //extended
-    for (filter = 0; filter < 3; filter++) {
-        Can0.setRXFilter(filter, 0, 0, true);
-        Can1.setRXFilter(filter, 0, 0, true);
-    }
-    //standard
-    for (filter = 3; filter < 7; filter++) {
-        Can0.setRXFilter(filter, 0, 0, false);
-        Can1.setRXFilter(filter, 0, 0, false);
-    }
+    for (int bus = 0; bus < Buses::count(); bus++) Buses::setPromiscuous(bus);
 }
 
 //Get the value of XOR'ing all the bytes together. This creates a reasonable checksum that can be used
@@ -422,42 +486,78 @@ uint8_t checksumCalc(uint8_t *buffer, int length)
     return valu;
 }
 
+//Send whatever is waiting in the USB output buffer
+void flushUSBBuffer()
+{
+    if (serialBufferLength == 0) return;
+    if ((int)usbOut->write(serialBuffer, serialBufferLength) < serialBufferLength) LossReport::usbLost(serialBufferFrames);
+    serialBufferLength = 0;
+    serialBufferFrames = 0;
+    lastFlushMicros = micros();
+    Latency::flushedUSB();
+}
+
+//room left in the USB output buffer
+int usbBufferFree()
+{
+    return SER_BUFF_SIZE - serialBufferLength;
+}
+
+//Add raw bytes to the USB output buffer so they stay in order with the binary frame traffic
+void bufferUSBBytes(uint8_t *data, int length)
+{
+    if (serialBufferLength + length > SER_BUFF_SIZE) flushUSBBuffer();
+    memcpy(serialBuffer + serialBufferLength, data, length);
+    serialBufferLength += length;
+}
+
 void toggleRXLED()
 {
     SysSettings.rxToggle = !SysSettings.rxToggle;
     setLED(SysSettings.LED_CANRX, SysSettings.rxToggle);
 }
 
-void sendFrameToUSB(CAN_message_t &frame, int whichBus)
+/*
+ * Returns the number of bytes it produced. seq is the receive sequence number, -1 for frames that weren't received.
+ * rxTime is the device time (ClockSync::fromCycles) the frame came in at, 0 to stamp it with the time now.
+ */
+int sendFrameToUSB(CAN_message_t &frame, int whichBus, int seq, uint64_t rxTime)
 {
     uint8_t buff[22];
     uint8_t temp;
-    uint32_t now = micros();
+    if (!rxTime) rxTime = ClockSync::now64();
+    uint32_t now = ClockSync::frameTime(rxTime);
+    int start = serialBufferLength;
+    int len = 0;
 
     if (SysSettings.lawicelMode) {
         if (frame.extended) {
-            SerialUSB.print("T");
+            len += usbOut->print("T");
             sprintf((char *)buff, "%08x", frame.id);
-            SerialUSB.print((char *)buff);
+            len += usbOut->print((char *)buff);
         } else {
-            SerialUSB.print("t");
+            len += usbOut->print("t");
             sprintf((char *)buff, "%03x", frame.id);
-            SerialUSB.print((char *)buff);
+            len += usbOut->print((char *)buff);
         }
-        SerialUSB.print(frame.length);
+        len += usbOut->print(frame.length);
         for (int i = 0; i < frame.length; i++) {
             sprintf((char *)buff, "%02x", frame.data.byte[i]);
-            SerialUSB.print((char *)buff);
+            len += usbOut->print((char *)buff);
         }
         if (SysSettings.lawicelTimestamping) {
-            uint16_t timestamp = (uint16_t)millis();
+            uint16_t timestamp = (uint16_t)(rxTime / 1000);
             sprintf((char *)buff, "%04x", timestamp);
-            SerialUSB.print((char *)buff);
+            len += usbOut->print((char *)buff);
         }
-        SerialUSB.write(13);
+        len += usbOut->write(13);
     } else {
         if (settings.useBinarySerialComm) {
             if (frame.extended) frame.id |= 1 << 31;
+            if (usbBufferFree() < 13 + frame.length) {
+                flushUSBBuffer();
+                start = 0;
+            }
             serialBuffer[serialBufferLength++] = 0xF1;
             serialBuffer[serialBufferLength++] = 0; //0 = canbus frame sending
             serialBuffer[serialBufferLength++] = (uint8_t)(now & 0xFF);
@@ -474,34 +574,41 @@ void sendFrameToUSB(CAN_message_t &frame, int whichBus)
             }
             //temp = checksumCalc(buff, 11 + frame.length);
             temp = 0;
+            if (seq >= 0 && LossReport::isEnabled()) temp = (uint8_t)seq; //low byte of the sequence number in place of the checksum
             serialBuffer[serialBufferLength++] = temp;
+            serialBufferFrames++;
             //SerialUSB.write(buff, 12 + frame.length);
+            len = serialBufferLength - start;
         } else {
-            SerialUSB.print(micros());
-            SerialUSB.print(" - ");
-            SerialUSB.print(frame.id, HEX);
-            if (frame.extended) SerialUSB.print(" X ");
-            else SerialUSB.print(" S ");
-            SerialUSB.print(whichBus);
-            SerialUSB.print(" ");
-            SerialUSB.print(frame.length);
+            len += usbOut->print(now);
+            len += usbOut->print(" - ");
+            len += usbOut->print(frame.id, HEX);
+            if (frame.extended) len += usbOut->print(" X ");
+            else len += usbOut->print(" S ");
+            len += usbOut->print(whichBus);
+            len += usbOut->print(" ");
+            len += usbOut->print(frame.length);
             for (int c = 0; c < frame.length; c++) {
-                SerialUSB.print(" ");
-                SerialUSB.print(frame.data.bytes[c], HEX);
+                len += usbOut->print(" ");
+                len += usbOut->print(frame.data.bytes[c], HEX);
             }
-            SerialUSB.println();
+            len += usbOut->println();
         }
     }
+    return len;
 }
 
-void sendFrameToFile(CAN_message_t &frame, int whichBus)
+//returns the number of bytes it produced. rxTime as for sendFrameToUSB
+int sendFrameToFile(CAN_message_t &frame, int whichBus, uint64_t rxTime)
 {
     uint8_t buff[40];
     uint8_t temp;
     uint32_t timestamp;
+    int len = 0;
+    if (!rxTime) rxTime = ClockSync::now64();
     if (settings.fileOutputType == BINARYFILE) {
         if (frame.extended) frame.id |= 1 << 31;
-        timestamp = micros();
+        timestamp = ClockSync::frameTime(rxTime);
         buff[0] = (uint8_t)(timestamp & 0xFF);
         buff[1] = (uint8_t)(timestamp >> 8);
         buff[2] = (uint8_t)(timestamp >> 16);
@@ -515,31 +622,35 @@ void sendFrameToFile(CAN_message_t &frame, int whichBus)
             buff[9 + c] = frame.data.bytes[c];
         }
         Logger::fileRaw(buff, 9 + frame.length);
+        len = 9 + frame.length;
     } else if (settings.fileOutputType == GVRET) {
-        sprintf((char *)buff, "%i,%x,%i,%i,%i", millis(), frame.id, frame.extended, whichBus, frame.length);
+        len += sprintf((char *)buff, "%i,%x,%i,%i,%i", ClockSync::frameMillis(rxTime), frame.id, frame.extended, whichBus, frame.length);
         Logger::fileRaw(buff, strlen((char *)buff));
 
         for (int c = 0; c < frame.length; c++) {
-            sprintf((char *) buff, ",%x", frame.data.bytes[c]);
+            len += sprintf((char *) buff, ",%x", frame.data.bytes[c]);
             Logger::fileRaw(buff, strlen((char *)buff));
         }
         buff[0] = '\r';
         buff[1] = '\n';
         Logger::fileRaw(buff, 2);
+        len += 2;
     } else if (settings.fileOutputType == CRTD) {
         int idBits = 11;
         if (frame.extended) idBits = 29;
-        sprintf((char *)buff, "%f R%i %x", millis() / 1000.0f, idBits, frame.id);
+        len += sprintf((char *)buff, "%f R%i %x", ClockSync::frameMillis(rxTime) / 1000.0f, idBits, frame.id);
         Logger::fileRaw(buff, strlen((char *)buff));
 
         for (int c = 0; c < frame.length; c++) {
-            sprintf((char *) buff, " %x", frame.data.bytes[c]);
+            len += sprintf((char *) buff, " %x", frame.data.bytes[c]);
             Logger::fileRaw(buff, strlen((char *)buff));
         }
         buff[0] = '\r';
         buff[1] = '\n';
         Logger::fileRaw(buff, 2);
+        len += 2;
     }
+    return len;
 }
 
 void processDigToggleFrame(CAN_message_t &frame)
@@ -573,39 +684,167 @@ void sendDigToggleMsg()
     else frame.extended = false;
     frame.length = digToggleSettings.length;
     for (int c = 0; c < frame.length; c++) frame.data.byte[c] = digToggleSettings.payload[c];
-    if (digToggleSettings.mode & 2) Can0.sendFrame(frame);
-    if (digToggleSettings.mode & 4) Can1.sendFrame(frame);
+    if (digToggleSettings.mode & 2) TxQueue::queueFrame(frame, 0);
+    if (digToggleSettings.mode & 4) TxQueue::queueFrame(frame, 1);
+}
+
+//CAN FD payload sizes by DLC code. Lengths between two sizes round up to the next one
+static const uint8_t fdLengths[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+uint8_t fdLengthToDLC(uint8_t length)
+{
+    uint8_t dlc = 0;
+    while (dlc < 15 && fdLengths[dlc] < length) dlc++;
+    return dlc;
+}
+
+uint8_t fdDLCToLength(uint8_t dlc)
+{
+    return fdLengths[dlc & 0xF];
+}
+
+/*
+ * Queue an FD frame for transmission. The controllers on this hardware only do classic CAN so a frame
+ * that is classic compatible (8 bytes or less, no bit rate switch) goes out as one and anything else is refused.
+ */
+bool queueFDFrame(CAN_FD_FRAME &frame, int whichBus)
+{
+    if (frame.length > 8 || (frame.flags & FD_FLAG_BRS)) return false;
+
+    CAN_message_t classic;
+    classic.id = frame.id;
+    classic.extended = frame.extended;
+    classic.rtr = 0;
+    classic.length = frame.length;
+    memcpy(classic.data.bytes, frame.data, frame.length);
+    return TxQueue::queueFrame(classic, whichBus);
+}
+
+/*
+ * Same as sendFrameToUSB but for FD frames. The binary record uses a full byte for the length:
+ * 0xF1, PROTO_BUILD_FD_FRAME, time uS (4 bytes), ID (4 bytes, bit 31 = extended), bus, flags, length, data, checksum
+ * LAWICEL has no way to express FD frames so nothing is sent in that mode.
+ * Neither on-board controller can receive FD so for now only PROTO_ECHO_FD_FRAME ends up here.
+ */
+void sendFDFrameToUSB(CAN_FD_FRAME &frame, int whichBus, uint64_t rxTime)
+{
+    uint8_t buff[13];
+    if (!rxTime) rxTime = ClockSync::now64();
+    uint32_t now = ClockSync::frameTime(rxTime);
+    uint32_t id = frame.id;
+
+    if (SysSettings.lawicelMode) return;
+
+    if (settings.useBinarySerialComm) {
+        if (frame.extended) id |= 1ul << 31;
+        buff[0] = 0xF1;
+        buff[1] = PROTO_BUILD_FD_FRAME;
+        buff[2] = (uint8_t)(now & 0xFF);
+        buff[3] = (uint8_t)(now >> 8);
+        buff[4] = (uint8_t)(now >> 16);
+        buff[5] = (uint8_t)(now >> 24);
+        buff[6] = (uint8_t)(id & 0xFF);
+        buff[7] = (uint8_t)(id >> 8);
+        buff[8] = (uint8_t)(id >> 16);
+        buff[9] = (uint8_t)(id >> 24);
+        buff[10] = whichBus;
+        buff[11] = frame.flags;
+        buff[12] = frame.length;
+        bufferUSBBytes(buff, 13);
+        bufferUSBBytes(frame.data, frame.length);
+        buff[0] = 0; //checksum, unused just like the classic frame record
+        bufferUSBBytes(buff, 1);
+    } else {
+        SerialUSB.print(now);
+        SerialUSB.print(" - ");
+        SerialUSB.print(frame.id, HEX);
+        if (frame.extended) SerialUSB.print(" X ");
+        else SerialUSB.print(" S ");
+        SerialUSB.print(whichBus);
+        SerialUSB.print(" FD");
+        if (frame.flags & FD_FLAG_BRS) SerialUSB.print(" BRS");
+        if (frame.flags & FD_FLAG_ESI) SerialUSB.print(" ESI");
+        SerialUSB.print(" ");
+        SerialUSB.print(frame.length);
+        for (int c = 0; c < frame.length; c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(frame.data[c], HEX);
+        }
+        SerialUSB.println();
+    }
+}
+
+/*
+ * Same as sendFrameToFile but for FD frames. BINARYFILE records can't fit the length in the low nibble
+ * so a nibble of 0xF (never valid for classic frames) means a flags byte and a full length byte follow.
+ * GVRET text lines just carry more data bytes. CRTD has no FD notation so the frame is written as R11 / R29.
+ */
+void sendFDFrameToFile(CAN_FD_FRAME &frame, int whichBus, uint64_t rxTime)
+{
+    uint8_t buff[11 + 64]; //header plus the largest FD payload so a binary record goes in whole
+    uint32_t timestamp;
+    uint32_t id = frame.id;
+    if (!rxTime) rxTime = ClockSync::now64();
+
+    if (settings.fileOutputType == BINARYFILE) {
+        if (frame.extended) id |= 1ul << 31;
+        timestamp = ClockSync::frameTime(rxTime);
+        buff[0] = (uint8_t)(timestamp & 0xFF);
+        buff[1] = (uint8_t)(timestamp >> 8);
+        buff[2] = (uint8_t)(timestamp >> 16);
+        buff[3] = (uint8_t)(timestamp >> 24);
+        buff[4] = (uint8_t)(id & 0xFF);
+        buff[5] = (uint8_t)(id >> 8);
+        buff[6] = (uint8_t)(id >> 16);
+        buff[7] = (uint8_t)(id >> 24);
+        buff[8] = 0xF + (uint8_t)(whichBus << 4);
+        buff[9] = frame.flags;
+        buff[10] = frame.length;
+        memcpy(buff + 11, frame.data, frame.length);
+        Logger::fileRaw(buff, 11 + frame.length);
+    } else if (settings.fileOutputType == GVRET) {
+        sprintf((char *)buff, "%i,%x,%i,%i,%i", ClockSync::frameMillis(rxTime), frame.id, frame.extended, whichBus, frame.length);
+        Logger::fileRaw(buff, strlen((char *)buff));
+
+        for (int c = 0; c < frame.length; c++) {
+            sprintf((char *) buff, ",%x", frame.data[c]);
+            Logger::fileRaw(buff, strlen((char *)buff));
+        }
+        buff[0] = '\r';
+        buff[1] = '\n';
+        Logger::fileRaw(buff, 2);
+    } else if (settings.fileOutputType == CRTD) {
+        int idBits = 11;
+        if (frame.extended) idBits = 29;
+        sprintf((char *)buff, "%f R%i %x", ClockSync::frameMillis(rxTime) / 1000.0f, idBits, frame.id);
+        Logger::fileRaw(buff, strlen((char *)buff));
+
+        for (int c = 0; c < frame.length; c++) {
+            sprintf((char *) buff, " %x", frame.data[c]);
+            Logger::fileRaw(buff, strlen((char *)buff));
+        }
+        buff[0] = '\r';
+        buff[1] = '\n';
+        Logger::fileRaw(buff, 2);
+    }
 }
 
 /*
 Loop executes as often as possible all the while interrupts fire in the background.
-The serial comm protocol is as follows:
-All commands start with 0xF1 this helps to synchronize if there were comm issues
-Then the next byte specifies which command this is.
-Then the command data bytes which are specific to the command
-Lastly, there is a checksum byte just to be sure there are no missed or duped bytes
-Any bytes between checksum and 0xF1 are thrown away
-
-Yes, this should probably have been done more neatly but this way is likely to be the
-fastest and safest with limited function calls
+Binary commands from the host are decoded by CommandParser, see CommandParser.h for the framing.
 */
 void loop()
 {
     static int loops = 0;
     CAN_message_t incoming;
-    static CAN_message_t build_out_frame;
-    static int out_bus;
-    int in_byte;
-    static byte buff[20];
-    static int step = 0;
-    static STATE state = IDLE;
-    static uint32_t build_int;
-    uint8_t temp8;
-    uint16_t temp16;
+    uint32_t rxStamp; //cycle count from the receive interrupt
+    uint16_t rxSeq;
+    uint64_t rxTime; //device uS the frame came in at
     static bool markToggle = false;
     bool isConnected = false;
-    int serialCnt;
-    uint32_t now = micros();
+    bool hideRaw; //frame was turned into a PGN or signal record instead
+    ProfileProbe loopProbe(Profiler::PROBE_LOOP);
+    ProfileProbe stageProbe(Profiler::PROBE_CAN_RX);
 
     /*if (SerialUSB)*/ isConnected = true;
 
@@ -626,34 +865,55 @@ void loop()
 
     //if (!SysSettings.lawicelMode || SysSettings.lawicelAutoPoll || SysSettings.lawicelPollCounter > 0)
     //{
-    while (Can0.available()) {
-        Can0.read(incoming);
-        if (digitalRead(ENABLE_PASS_0TO1_PIN)) Can1.sendFrame(incoming); // if pin is NOT shorted to GND
-        toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 0);
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 0);
-        if (digToggleSettings.enabled && (digToggleSettings.mode & 1) && (digToggleSettings.mode & 2)) processDigToggleFrame(incoming);
-    }
-
-    while (Can1.available()) {
-        Can1.read(incoming);
-        if (digitalRead(ENABLE_PASS_1TO0_PIN)) Can0.sendFrame(incoming); // if pin is NOT shorted to GND
-        toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 1);
-        if (digToggleSettings.enabled && (digToggleSettings.mode & 1) && (digToggleSettings.mode & 4)) processDigToggleFrame(incoming);
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 1);
-    }
-
-    if (SysSettings.dedicatedSWCAN && settings.singleWire_Enabled && SWCAN.GetRXFrame(incoming))
-    {
-        toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 2);
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 2);
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        LossReport::check(bus);
+        while (Buses::read(bus, incoming, &rxStamp, &rxSeq)) {
+            Latency::record(Latency::STAGE_DEQUEUE, rxStamp);
+            rxTime = ClockSync::fromCycles(rxStamp);
+            Gateway::processFrame(incoming, bus, rxStamp);
+            Generator::processFrame(incoming, bus);
+            toggleRXLED();
+            hideRaw = J1939::processFrame(incoming, bus);
+            if (Signals::processFrame(incoming, bus)) hideRaw = true;
+            if (isConnected && !hideRaw) {
+                sendFrameToUSB(incoming, bus, rxSeq, rxTime);
+                Latency::record(Latency::STAGE_USB_QUEUE, rxStamp);
+                Latency::pendingUSB(rxStamp);
+            }
+            if (SysSettings.logToFile) {
+                sendFrameToFile(incoming, bus, rxTime);
+                Latency::record(Latency::STAGE_SD_BUFFER, rxStamp);
+                Latency::pendingSD(rxStamp);
+            }
+            if (digToggleSettings.enabled && (digToggleSettings.mode & 1) && (digToggleSettings.mode & (2 << bus))) processDigToggleFrame(incoming);
+            BitTracker::processFrame(incoming, bus);
+            Capture::processFrame(incoming, bus, rxTime);
+            IsoTp::processFrame(incoming, bus);
+        }
     }
 
     if (SysSettings.lawicelPollCounter > 0) SysSettings.lawicelPollCounter--;
     //}
 
+    stageProbe.next(Profiler::PROBE_MODULES);
+    Buses::loop();
+    AutoBaud::loop();
+    Gateway::loop();
+    Latency::loop();
+    Generator::loop();
+    ClockSync::loop();
+    SyncPulse::loop();
+    BitTracker::loop();
+    swcanWakeLoop();
+    BulkTX::loop();
+    Replay::loop();
+    Capture::loop();
+    IsoTp::loop();
+    J1939::loop();
+    Signals::loop();
+    TxQueue::loop();
+
+    stageProbe.next(Profiler::PROBE_DIG_TOGGLE);
     if (digToggleSettings.enabled && !(digToggleSettings.mode & 1)) {
         if (digTogglePinState) { //pin currently high. Look for it going low
             if (!digitalRead(digToggleSettings.pin)) digTogglePinCounter++; //went low, increment debouncing counter
@@ -674,487 +934,13 @@ void loop()
         }
     }
 
-    if (micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) {
-        if (serialBufferLength > 0) {
-            SerialUSB.write(serialBuffer, serialBufferLength);
-            serialBufferLength = 0;
-            lastFlushMicros = micros();
-        }
-    }
+    stageProbe.next(Profiler::PROBE_USB_FLUSH);
+    if (micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) flushUSBBuffer();
 
-    serialCnt = 0;
-    while (isConnected && (SerialUSB.available() > 0) && serialCnt < 128) {
-        serialCnt++;
-        in_byte = SerialUSB.read();
-        switch (state) {
-        case IDLE:
-            if (in_byte == 0xF1) state = GET_COMMAND;
-            else if (in_byte == 0xE7) {
-                settings.useBinarySerialComm = true;
-                SysSettings.lawicelMode = false;
-                setPromiscuousMode(); //go into promisc. mode with binary comm
-            } else {
-                console.rcvCharacter((uint8_t)in_byte);
-            }
-            break;
-        case GET_COMMAND:
-            switch (in_byte) {
-            case PROTO_BUILD_CAN_FRAME:
-                state = BUILD_CAN_FRAME;
-                buff[0] = 0xF1;
-                step = 0;
-                break;
-            case PROTO_TIME_SYNC:
-                state = TIME_SYNC;
-                step = 0;
-                buff[0] = 0xF1;
-                buff[1] = 1; //time sync
-                buff[2] = (uint8_t)(now & 0xFF);
-                buff[3] = (uint8_t)(now >> 8);
-                buff[4] = (uint8_t)(now >> 16);
-                buff[5] = (uint8_t)(now >> 24);
-                SerialUSB.write(buff, 6);
-                break;
-            case PROTO_DIG_INPUTS:
-                //immediately return the data for digital inputs
-                temp8 = getDigital(0) + (getDigital(1) << 1) + (getDigital(2) << 2) + (getDigital(3) << 3);
-                buff[0] = 0xF1;
-                buff[1] = 2; //digital inputs
-                buff[2] = temp8;
-                temp8 = checksumCalc(buff, 2);
-                buff[3] = temp8;
-                SerialUSB.write(buff, 4);
-                state = IDLE;
-                break;
-            case PROTO_ANA_INPUTS:
-                //immediately return data on analog inputs
-                temp16 = getAnalog(0);
-                buff[0] = 0xF1;
-                buff[1] = 3;
-                buff[2] = temp16 & 0xFF;
-                buff[3] = uint8_t(temp16 >> 8);
-                temp16 = getAnalog(1);
-                buff[4] = temp16 & 0xFF;
-                buff[5] = uint8_t(temp16 >> 8);
-                temp16 = getAnalog(2);
-                buff[6] = temp16 & 0xFF;
-                buff[7] = uint8_t(temp16 >> 8);
-                temp16 = getAnalog(3);
-                buff[8] = temp16 & 0xFF;
-                buff[9] = uint8_t(temp16 >> 8);
-                temp8 = checksumCalc(buff, 9);
-                buff[10] = temp8;
-                SerialUSB.write(buff, 11);
-                state = IDLE;
-                break;
-            case PROTO_SET_DIG_OUT:
-                state = SET_DIG_OUTPUTS;
-                buff[0] = 0xF1;
-                break;
-            case PROTO_SETUP_CANBUS:
-                state = SETUP_CANBUS;
-                step = 0;
-                buff[0] = 0xF1;
-                break;
-            case PROTO_GET_CANBUS_PARAMS:
-                //immediately return data on canbus params
-                buff[0] = 0xF1;
-                buff[1] = 6;
-                buff[2] = settings.CAN0_Enabled + ((unsigned char)settings.CAN0ListenOnly << 4);
-                buff[3] = settings.CAN0Speed;
-                buff[4] = settings.CAN0Speed >> 8;
-                buff[5] = settings.CAN0Speed >> 16;
-                buff[6] = settings.CAN0Speed >> 24;
-                buff[7] = settings.CAN1_Enabled + ((unsigned char)settings.CAN1ListenOnly << 4) + (unsigned char)settings.singleWire_Enabled << 6;
-                buff[8] = settings.CAN1Speed;
-                buff[9] = settings.CAN1Speed >> 8;
-                buff[10] = settings.CAN1Speed >> 16;
-                buff[11] = settings.CAN1Speed >> 24;
-                SerialUSB.write(buff, 12);
-                state = IDLE;
-                break;
-            case PROTO_GET_DEV_INFO:
-                //immediately return device information
-                buff[0] = 0xF1;
-                buff[1] = 7;
-                buff[2] = CFG_BUILD_NUM & 0xFF;
-                buff[3] = (CFG_BUILD_NUM >> 8);
-                buff[4] = EEPROM_VER;
-                buff[5] = (unsigned char)settings.fileOutputType;
-                buff[6] = (unsigned char)settings.autoStartLogging;
-                buff[7] = settings.singleWire_Enabled;
-                SerialUSB.write(buff, 8);
-                state = IDLE;
-                break;
-            case PROTO_SET_SW_MODE:
-                buff[0] = 0xF1;
-                state = SET_SINGLEWIRE_MODE;
-                step = 0;
-                break;
-            case PROTO_KEEPALIVE:
-                buff[0] = 0xF1;
-                buff[1] = 0x09;
-                buff[2] = 0xDE;
-                buff[3] = 0xAD;
-                SerialUSB.write(buff, 4);
-                state = IDLE;
-                break;
-            case PROTO_SET_SYSTYPE:
-                buff[0] = 0xF1;
-                state = SET_SYSTYPE;
-                step = 0;
-                break;
-            case PROTO_ECHO_CAN_FRAME:
-                state = ECHO_CAN_FRAME;
-                buff[0] = 0xF1;
-                step = 0;
-                break;
-            case PROTO_GET_NUMBUSES:
-                buff[0] = 0xF1;
-                buff[1] = 12;
-                buff[2] = 3; //CAN0, CAN1, SWCAN
-                SerialUSB.write(buff, 3);
-                state = IDLE;
-                break;
-             case PROTO_GET_EXT_BUSES:
-                buff[0] = 0xF1;
-                buff[1] = 13;
-                buff[2] = settings.singleWire_Enabled + ((unsigned char)settings.SWCANListenOnly << 4);
-                buff[3] = settings.SWCANSpeed;
-                buff[4] = settings.SWCANSpeed >> 8;
-                buff[5] = settings.SWCANSpeed >> 16;
-                buff[6] = settings.SWCANSpeed >> 24;
-                buff[7] = 0; //fourth bus enabled
-                buff[8] = 0; //fourth bus speed (4 bytes)
-                buff[9] = 0;
-                buff[10] = 0;
-                buff[11] = 0;
-                buff[12] = 0; //fifth bus enabled
-                buff[13] = 0; //fifth bus speed (4 bytes)
-                buff[14] = 0;
-                buff[15] = 0;
-                buff[16] = 0;
-                SerialUSB.write(buff, 17);
-                state = IDLE;             
-                break;
-             case PROTO_SET_EXT_BUSES:
-                state = SETUP_EXT_BUSES;
-                step = 0;
-                buff[0] = 0xF1;      
-                break;                
-            }
-            break;
-        case BUILD_CAN_FRAME:
-            buff[1 + step] = in_byte;
-            switch (step) {
-            case 0:
-                build_out_frame.id = in_byte;
-                break;
-            case 1:
-                build_out_frame.id |= in_byte << 8;
-                break;
-            case 2:
-                build_out_frame.id |= in_byte << 16;
-                break;
-            case 3:
-                build_out_frame.id |= in_byte << 24;
-                if (build_out_frame.id & 1 << 31) {
-                    build_out_frame.id &= 0x7FFFFFFF;
-                    build_out_frame.extended = true;
-                } else build_out_frame.extended = false;
-                break;
-            case 4:
-                out_bus = in_byte & 3;
-                break;
-            case 5:
-                build_out_frame.length = in_byte & 0xF;
-                if (build_out_frame.length > 8) build_out_frame.length = 8;
-                break;
-            default:
-                if (step < build_out_frame.length + 6) {
-                    build_out_frame.data.bytes[step - 6] = in_byte;
-                } else {
-                    state = IDLE;
-                    //this would be the checksum byte. Compute and compare.
-                    temp8 = checksumCalc(buff, step);
-                    //if (temp8 == in_byte)
-                    //{
-                    if (settings.singleWire_Enabled == 1) {
-                        if (build_out_frame.id == 0x100) {
-                            if ( ((out_bus == 1) && !SysSettings.dedicatedSWCAN) || (out_bus == 2) ) {
-                                setSWCANWakeup();
-                                delay(1);
-                            }
-                        }
-                    }
-                    build_out_frame.rtr = 0;
-                    if (out_bus == 0) Can0.sendFrame(build_out_frame);
-                    if (out_bus == 1) Can1.sendFrame(build_out_frame);
-                    if (out_bus == 2) SWCAN.sendFrame(build_out_frame);
-
-                    if (settings.singleWire_Enabled == 1) {
-                        if (build_out_frame.id == 0x100) {
-                            if ( ((out_bus == 1) && !SysSettings.dedicatedSWCAN) || (out_bus == 2) ) {
-                                delay(1);
-                                setSWCANEnabled();
-                            }
-                        }
-                    }
-                    //}
-                }
-                break;
-            }
-            step++;
-            break;
-        case TIME_SYNC:
-            state = IDLE;
-            break;
-        case SET_DIG_OUTPUTS: //todo: validate the XOR byte
-            buff[1] = in_byte;
-            //temp8 = checksumCalc(buff, 2);
-            for (int c = 0; c < 8; c++) {
-                if (in_byte & (1 << c)) setOutput(c, true);
-                else setOutput(c, false);
-            }
-            state = IDLE;
-            break;
-        case SETUP_CANBUS: //todo: validate checksum
-            switch (step) {
-            case 0:
-                build_int = in_byte;
-                break;
-            case 1:
-                build_int |= in_byte << 8;
-                break;
-            case 2:
-                build_int |= in_byte << 16;
-                break;
-            case 3:
-                build_int |= in_byte << 24;
-                if (build_int > 0) {
-                    if (build_int & 0x80000000) { //signals that enabled and listen only status are also being passed
-                        if (build_int & 0x40000000) {
-                            settings.CAN0_Enabled = true;
-                            Can0.enable();
-                        } else {
-                            settings.CAN0_Enabled = false;
-                            Can0.disable();
-                        }
-                        if (build_int & 0x20000000) {
-                            settings.CAN0ListenOnly = true;
-                            Can0.enable_autobaud_listen_mode();
-                        } else {
-                            settings.CAN0ListenOnly = false;
-                            Can0.disable_autobaud_listen_mode();
-                        }
-                    } else {
-                        Can0.enable(); //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.CAN0_Enabled = true;
-                    }
-                    build_int = build_int & 0xFFFFF;
-                    if (build_int > 1000000) build_int = 1000000;
-                    Can0.begin(build_int, SysSettings.CAN0EnablePin);
-                    //Can0.set_baudrate(build_int);
-                    settings.CAN0Speed = build_int;
-                } else { //disable first canbus
-                    Can0.disable();
-                    settings.CAN0_Enabled = false;
-                }
-                break;
-            case 4:
-                build_int = in_byte;
-                break;
-            case 5:
-                build_int |= in_byte << 8;
-                break;
-            case 6:
-                build_int |= in_byte << 16;
-                break;
-            case 7:
-                build_int |= in_byte << 24;
-                if (build_int > 0) {
-                    if (build_int & 0x80000000) { //signals that enabled and listen only status are also being passed
-                        if (build_int & 0x40000000) {
-                            settings.CAN1_Enabled = true;
-                            Can1.enable();
-                        } else {
-                            settings.CAN1_Enabled = false;
-                            Can1.disable();
-                        }
-                        if (build_int & 0x20000000) {
-                            settings.CAN1ListenOnly = true;
-                            Can1.enable_autobaud_listen_mode();
-                        } else {
-                            settings.CAN1ListenOnly = false;
-                            Can1.disable_autobaud_listen_mode();
-                        }
-                    } else {
-                        Can1.enable(); //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.CAN1_Enabled = true;
-                    }
-                    build_int = build_int & 0xFFFFF;
-                    if (build_int > 1000000) build_int = 1000000;
-                    Can1.begin(build_int, SysSettings.CAN1EnablePin);
-                    if (settings.singleWire_Enabled && !SysSettings.dedicatedSWCAN) setSWCANEnabled();
-                    else setSWCANSleep();
-                    //Can1.set_baudrate(build_int);
-
-                    settings.CAN1Speed = build_int;
-                } else { //disable second canbus
-                    if (!SysSettings.dedicatedSWCAN) setSWCANSleep();
-                    Can1.disable();
-                    settings.CAN1_Enabled = false;
-                }
-                state = IDLE;
-                //now, write out the new canbus settings to EEPROM
-                EEPROM.write(EEPROM_PAGE, settings);
-                setPromiscuousMode();
-                break;
-            }
-            step++;
-            break;
-        case SET_SINGLEWIRE_MODE:
-            if (in_byte == 0x10) {
-                settings.singleWire_Enabled = true;
-                setSWCANEnabled();
-            } else {
-                settings.singleWire_Enabled = false;
-                setSWCANSleep();
-            }
-            EEPROM.write(EEPROM_PAGE, settings);
-            state = IDLE;
-            break;
-        case SET_SYSTYPE:
-            settings.sysType = in_byte;
-            EEPROM.write(EEPROM_PAGE, settings);
-            loadSettings();
-            state = IDLE;
-            break;
-        case ECHO_CAN_FRAME:
-            buff[1 + step] = in_byte;
-            switch (step) {
-            case 0:
-                build_out_frame.id = in_byte;
-                break;
-            case 1:
-                build_out_frame.id |= in_byte << 8;
-                break;
-            case 2:
-                build_out_frame.id |= in_byte << 16;
-                break;
-            case 3:
-                build_out_frame.id |= in_byte << 24;
-                if (build_out_frame.id & 1 << 31) {
-                    build_out_frame.id &= 0x7FFFFFFF;
-                    build_out_frame.extended = true;
-                } else build_out_frame.extended = false;
-                break;
-            case 4:
-                out_bus = in_byte & 1;
-                break;
-            case 5:
-                build_out_frame.length = in_byte & 0xF;
-                if (build_out_frame.length > 8) build_out_frame.length = 8;
-                break;
-            default:
-                if (step < build_out_frame.length + 6) {
-                    build_out_frame.data.bytes[step - 6] = in_byte;
-                } else {
-                    state = IDLE;
-                    //this would be the checksum byte. Compute and compare.
-                    temp8 = checksumCalc(buff, step);
-                    //if (temp8 == in_byte)
-                    //{
-                    toggleRXLED();
-                    if (isConnected) sendFrameToUSB(build_out_frame, 0);
-                    //}
-                }
-                break;
-            }
-            step++;
-            break;
-        case SETUP_EXT_BUSES: //setup enable/listenonly/speed for SWCAN, Enable/Speed for LIN1, LIN2
-            switch (step) {
-            case 0:
-                build_int = in_byte;
-                break;
-            case 1:
-                build_int |= in_byte << 8;
-                break;
-            case 2:
-                build_int |= in_byte << 16;
-                break;
-            case 3:
-                build_int |= in_byte << 24;
-                if (build_int > 0) {
-                    if (build_int & 0x80000000) { //signals that enabled and listen only status are also being passed
-                        if (build_int & 0x40000000) {
-                            settings.singleWire_Enabled = true;
-                            setSWCANEnabled();
-                        } else {
-                            settings.singleWire_Enabled = false;
-                            setSWCANSleep();
-                        }
-                        if (build_int & 0x20000000) {
-                            settings.SWCANListenOnly = true;
-                            //SWCAN.enable_autobaud_listen_mode();
-                        } else {
-                            settings.SWCANListenOnly = false;
-                            //SWCAN.disable_autobaud_listen_mode();
-                        }
-                    } else {
-                        setSWCANEnabled();
-                        settings.singleWire_Enabled = true;
-                    }
-                    build_int = build_int & 0xFFFFF;
-                    if (build_int > 100000) build_int = 100000;
-                    settings.SWCANSpeed = build_int;
-                    SPI.begin();
-                    if(SWCAN.Init(settings.SWCANSpeed,16))
-                    {
-                        SerialUSB.println("MCP2515 Init OK ...");
-                        attachInterrupt(CANDUE22_SW_INT, SWCAN_Int, FALLING);
-                        setSWCANEnabled();
-                    } else {
-                        SerialUSB.println("MCP2515 Init Failed ...");
-                    }
-                } else { //disable first canbus
-                    void setSWCANSleep();
-                    settings.singleWire_Enabled = false;
-                }
-                break;
-            case 4:
-                build_int = in_byte;
-                break;
-            case 5:
-                build_int |= in_byte << 8;
-                break;
-            case 6:
-                build_int |= in_byte << 16;
-                break;
-            case 7:
-                build_int |= in_byte << 24;
-                break;
-            case 8:
-                build_int = in_byte;
-                break;
-            case 9:
-                build_int |= in_byte << 8;
-                break;
-            case 10:
-                build_int |= in_byte << 16;
-                break;
-            case 11:
-                build_int |= in_byte << 24;
-                state = IDLE;
-                //now, write out the new canbus settings to EEPROM
-                EEPROM.write(EEPROM_PAGE, settings);                
-                break;
-            }        
-            step++;
-            break; 
-        }
-    }
+    stageProbe.next(Profiler::PROBE_COMMANDS);
+    CommandParser::loop();
+
+    stageProbe.next(Profiler::PROBE_LOGGER);
     Logger::loop();
     //this should still be here. It checks for a flag set during an interrupt
     //sys_io_adc_poll();
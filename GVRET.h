@@ -41,23 +41,6 @@ void setup();
 } // extern "C"
 #endif
 
-enum STATE {
-    IDLE,
-    GET_COMMAND,
-    BUILD_CAN_FRAME,
-    TIME_SYNC,
-    GET_DIG_INPUTS,
-    GET_ANALOG_INPUTS,
-    SET_DIG_OUTPUTS,
-    SETUP_CANBUS,
-    GET_CANBUS_PARAMS,
-    GET_DEVICE_INFO,
-    SET_SINGLEWIRE_MODE,
-    SET_SYSTYPE,
-    ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
-};
-
 enum GVRET_PROTOCOL
 {
     PROTO_BUILD_CAN_FRAME = 0,
@@ -74,15 +57,55 @@ enum GVRET_PROTOCOL
     PROTO_ECHO_CAN_FRAME = 11,
     PROTO_GET_NUMBUSES = 12,
     PROTO_GET_EXT_BUSES = 13,
-    PROTO_SET_EXT_BUSES = 14
+    PROTO_SET_EXT_BUSES = 14,
+    PROTO_BITTRACK = 15,
+    PROTO_PERIODIC_TX = 16,
+    PROTO_TX_QUEUE = 17,
+    PROTO_TX_ACK = 18, //only ever sent from GVRET to the host
+    PROTO_BULK_TX = 19,
+    PROTO_REPLAY = 20,
+    PROTO_CAPTURE = 21,
+    PROTO_ISOTP = 22,
+    PROTO_J1939 = 23,
+    PROTO_SIGNALS = 24,
+    PROTO_BUILD_FD_FRAME = 25, //also the record type for FD frames sent to the host. Only echoes make them, the controllers here are classic only
+    PROTO_ECHO_FD_FRAME = 26,
+    PROTO_BUS_STATUS = 27,
+    PROTO_AUTOBAUD = 28, //also the record type for the result
+    PROTO_GATEWAY = 29,
+    PROTO_LATENCY = 30,
+    PROTO_PROFILE = 31,
+    PROTO_BENCHMARK = 32,
+    PROTO_GENERATOR = 33,
+    PROTO_LOSS = 34, //also the record type for loss reports
+    PROTO_CLOCK_SYNC = 35,
+    PROTO_SYNC_PULSE = 36,
+    PROTO_PARSER_STATS = 37
 };
 
 void loadSettings();
+void setPromiscuousMode();
+uint8_t checksumCalc(uint8_t *buffer, int length);
+void toggleRXLED();
 void setSWCANSleep();
 void setSWCANEnabled();
 void setSWCANWakeup();
+boolean queueSWCANWakeFrame(CAN_FRAME &frame, int whichBus);
+boolean swcanWakeBusy(int whichBus);
+void swcanWakeLoop();
 void processDigToggleFrame(CAN_FRAME &frame);
 void sendDigToggleMsg();
+uint8_t fdLengthToDLC(uint8_t length);
+uint8_t fdDLCToLength(uint8_t dlc);
+bool queueFDFrame(CAN_FD_FRAME &frame, int whichBus);
+void sendFDFrameToUSB(CAN_FD_FRAME &frame, int whichBus, uint64_t rxTime = 0);
+void sendFDFrameToFile(CAN_FD_FRAME &frame, int whichBus, uint64_t rxTime = 0);
+extern Print *usbOut;
+void bufferUSBBytes(uint8_t *data, int length);
+void flushUSBBuffer();
+int usbBufferFree();
+int sendFrameToUSB(CAN_FRAME &frame, int whichBus, int seq = -1, uint64_t rxTime = 0);
+int sendFrameToFile(CAN_FRAME &frame, int whichBus, uint64_t rxTime = 0);
 
 #endif /* GVRET_H_ */
 
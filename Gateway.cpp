@@ -0,0 +1,405 @@
+/*
+ * Gateway.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Gateway.h"
+#include "Buses.h"
+#include "Logger.h"
+#include "Latency.h"
+
+GW_RULE Gateway::rules[GW_MAX_RULES];
+int8_t Gateway::lookup[GW_HASH_SIZE];
+GW_STATS Gateway::stats[NUM_BUSES];
+volatile boolean Gateway::fastPath = false;
+volatile boolean Gateway::passEnabled[NUM_BUSES];
+uint8_t Gateway::pinCounter[NUM_BUSES];
+
+//frames from bus 0 and 1 go to the other one while their pass pin is high (not shorted to GND)
+static const uint8_t passPins[2] = {ENABLE_PASS_0TO1_PIN, ENABLE_PASS_1TO0_PIN};
+
+void Gateway::setup()
+{
+    clear();
+    resetStats();
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        passEnabled[bus] = (bus < 2) ? digitalRead(passPins[bus]) : false;
+        pinCounter[bus] = 0;
+    }
+}
+
+//samples the pass pins once a millisecond so nothing has to read them per frame
+void Gateway::loop()
+{
+    static uint32_t lastSample;
+    uint32_t now = millis();
+
+    if (now == lastSample) return;
+    lastSample = now;
+
+    for (int bus = 0; bus < 2; bus++) {
+        boolean level = digitalRead(passPins[bus]) ? true : false;
+        if (level == passEnabled[bus]) pinCounter[bus] = 0;
+        else if (++pinCounter[bus] >= GW_PIN_DEBOUNCE) {
+            passEnabled[bus] = level;
+            pinCounter[bus] = 0;
+        }
+    }
+}
+
+void Gateway::setFastPath(boolean en)
+{
+    fastPath = en;
+}
+
+boolean Gateway::getFastPath()
+{
+    return fastPath;
+}
+
+//multiplicative hash, the middle bits spread both nearby IDs and the bus number
+static inline uint32_t slotOf(uint32_t key)
+{
+    return ((key * 2654435761u) >> 16) & (GW_HASH_SIZE - 1);
+}
+
+uint32_t Gateway::keyOf(int bus, uint32_t id, boolean extended)
+{
+    return (id & 0x1FFFFFFF) | (extended ? 0x20000000 : 0) | ((uint32_t)bus << 30);
+}
+
+/*
+ * The lookup table is rebuilt whenever a rule changes so the per frame cost is one hash and,
+ * almost always, one probe. Rules are inserted in index order so the lowest one wins a tie.
+ */
+void Gateway::compile()
+{
+    for (int i = 0; i < GW_HASH_SIZE; i++) lookup[i] = -1;
+
+    for (int r = 0; r < GW_MAX_RULES; r++) {
+        if (!(rules[r].flags & RULE_ENABLED)) continue;
+        if (findRule(rules[r].srcBus, rules[r].id, rules[r].flags & RULE_EXTENDED) >= 0) continue;
+        uint32_t key = keyOf(rules[r].srcBus, rules[r].id, rules[r].flags & RULE_EXTENDED);
+        uint32_t slot = slotOf(key);
+        while (lookup[slot] >= 0) slot = (slot + 1) & (GW_HASH_SIZE - 1);
+        lookup[slot] = r;
+    }
+}
+
+int Gateway::findRule(int bus, uint32_t id, boolean extended)
+{
+    uint32_t key = keyOf(bus, id, extended);
+    uint32_t slot = slotOf(key);
+
+    for (int probe = 0; probe < GW_HASH_SIZE; probe++) {
+        int8_t r = lookup[slot];
+        if (r < 0) return -1;
+        if (keyOf(rules[r].srcBus, rules[r].id, rules[r].flags & RULE_EXTENDED) == key) return r;
+        slot = (slot + 1) & (GW_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+//a rule with its own destination ignores the pass pins, the default other bus follows them
+int Gateway::destinationOf(int bus, int r)
+{
+    if (r >= 0 && rules[r].dstBus != 0xFF) return rules[r].dstBus;
+    if (!passEnabled[bus]) return -1;
+    return (bus == 0) ? 1 : 0;
+}
+
+/*
+ * Receive interrupt side. Only frames going to a native controller are handled here, putting
+ * one in the MCP2515 would mean SPI traffic in the middle of whatever loop() was doing with it.
+ */
+void Gateway::processFrameISR(CAN_FRAME &frame, int bus, uint32_t stamp)
+{
+    if (!fastPath) return;
+
+    int r = findRule(bus, frame.id, frame.extended);
+    int dst = destinationOf(bus, r);
+    if (dst < 0 || !Buses::isNative(dst)) return;
+    forward(frame, bus, stamp, r, dst);
+}
+
+//called from loop() for every received frame. stamp is the cycle count from the receive interrupt
+void Gateway::processFrame(CAN_FRAME &frame, int bus, uint32_t stamp)
+{
+    int r = findRule(bus, frame.id, frame.extended);
+    int dst = destinationOf(bus, r);
+    if (dst < 0) return;
+    if (fastPath && Buses::isNative(dst)) return; //already went out from the receive interrupt
+    forward(frame, bus, stamp, r, dst);
+}
+
+/*
+ * Apply rule r (-1 for none) and send. Both paths can count into the same bus when rules mix
+ * native and MCP2515 destinations, the counters are diagnostics so no locking is done for that.
+ */
+void Gateway::forward(CAN_FRAME &frame, int bus, uint32_t stamp, int r, int dst)
+{
+    GW_STATS *st = &stats[bus];
+    CAN_FRAME out = frame;
+
+    if (r >= 0) {
+        GW_RULE *rule = &rules[r];
+        rule->hits++;
+        if (rule->flags & RULE_BLOCK) {
+            st->blocked++;
+            return;
+        }
+        if (rule->flags & RULE_RATE_LIMIT) {
+            uint32_t now = millis();
+            if (rule->lastForward != 0 && (now - rule->lastForward) < rule->minInterval) {
+                st->limited++;
+                return;
+            }
+            rule->lastForward = now ? now : 1;
+        }
+        if (rule->flags & RULE_REMAP) {
+            out.id = rule->newId & 0x1FFFFFFF;
+            out.extended = (rule->newId & (1ul << 31)) ? true : false;
+        }
+        if (rule->flags & RULE_PATCH) {
+            for (int i = 0; i < 8; i++) out.data.bytes[i] = (out.data.bytes[i] & rule->andMask[i]) | rule->orMask[i];
+        }
+    }
+
+    if (!Buses::send(out, dst)) {
+        st->refused++;
+        return;
+    }
+    uint32_t latency = DWT->CYCCNT - stamp;
+    uint32_t us = latency / CYCLES_PER_US;
+    int bin = us ? 32 - __builtin_clz(us) : 0;
+    if (bin >= GW_HIST_BINS) bin = GW_HIST_BINS - 1;
+    st->histogram[bin]++;
+    st->forwarded++;
+    Latency::record(Latency::STAGE_GATEWAY_TX, stamp);
+    st->latencyTotal += latency;
+    if (latency < st->latencyMin) st->latencyMin = latency;
+    if (latency > st->latencyMax) st->latencyMax = latency;
+}
+
+//number of data bytes that follow each sub command byte
+int Gateway::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_SET_RULE:
+        return 29;
+    case CMD_CLEAR_RULE:
+    case CMD_SET_FAST_PATH:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_SET_RULE - index, flags, source bus, ID (4 bytes), new ID (4 bytes, bit 31 = extended),
+ *                destination bus (0xFF = other bus), minimum interval in ms (2 bytes),
+ *                8 AND mask bytes, 8 OR mask bytes
+ * CMD_CLEAR_RULE - index
+ * CMD_SET_FAST_PATH - 1 to forward from the receive interrupts, 0 to forward from loop()
+ */
+void Gateway::handleCommand(uint8_t *data)
+{
+    GW_RULE rule;
+
+    switch (data[0]) {
+    case CMD_SET_RULE:
+        rule.flags = data[2];
+        rule.srcBus = data[3];
+        rule.id = data[4] + ((uint32_t)data[5] << 8) + ((uint32_t)data[6] << 16) + ((uint32_t)data[7] << 24);
+        rule.newId = data[8] + ((uint32_t)data[9] << 8) + ((uint32_t)data[10] << 16) + ((uint32_t)data[11] << 24);
+        rule.dstBus = data[12];
+        rule.minInterval = data[13] + ((uint16_t)data[14] << 8);
+        for (int i = 0; i < 8; i++) {
+            rule.andMask[i] = data[15 + i];
+            rule.orMask[i] = data[23 + i];
+        }
+        setRule(data[1], rule);
+        break;
+    case CMD_CLEAR_RULE:
+        clearRule(data[1]);
+        break;
+    case CMD_CLEAR:
+        clear();
+        break;
+    case CMD_GET_STATS:
+        sendStats();
+        break;
+    case CMD_RESET_STATS:
+        resetStats();
+        break;
+    case CMD_SET_FAST_PATH:
+        setFastPath(data[1]);
+        break;
+    case CMD_GET_HISTOGRAM:
+        sendHistogram();
+        break;
+    }
+}
+
+boolean Gateway::setRule(uint8_t idx, GW_RULE &rule)
+{
+    if (idx >= GW_MAX_RULES || rule.srcBus >= NUM_BUSES) return false;
+    if (rule.dstBus != 0xFF && rule.dstBus >= NUM_BUSES) return false;
+    noInterrupts(); //the fast path looks rules up from the receive interrupts
+    rules[idx] = rule;
+    rules[idx].id &= 0x1FFFFFFF;
+    rules[idx].lastForward = 0;
+    rules[idx].hits = 0;
+    compile();
+    interrupts();
+    return true;
+}
+
+void Gateway::clearRule(uint8_t idx)
+{
+    if (idx >= GW_MAX_RULES) return;
+    noInterrupts();
+    rules[idx].flags = 0;
+    compile();
+    interrupts();
+}
+
+void Gateway::clear()
+{
+    noInterrupts();
+    for (int r = 0; r < GW_MAX_RULES; r++) rules[r].flags = 0;
+    compile();
+    interrupts();
+}
+
+void Gateway::resetStats()
+{
+    noInterrupts();
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        stats[bus].forwarded = 0;
+        stats[bus].blocked = 0;
+        stats[bus].limited = 0;
+        stats[bus].refused = 0;
+        stats[bus].latencyMin = 0xFFFFFFFF;
+        stats[bus].latencyMax = 0;
+        stats[bus].latencyTotal = 0;
+        for (int i = 0; i < GW_HIST_BINS; i++) stats[bus].histogram[i] = 0;
+    }
+    for (int r = 0; r < GW_MAX_RULES; r++) rules[r].hits = 0;
+    interrupts();
+}
+
+/*
+ * 0xF1, PROTO_GATEWAY, CMD_GET_STATS, CYCLES_PER_US, number of buses
+ * then per source bus: forwarded, blocked, rate limited, refused (4 bytes each),
+ * min / max / average latency in cycles (4 bytes each)
+ */
+void Gateway::sendStats()
+{
+    uint8_t buff[28];
+    uint32_t vals[7];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GATEWAY;
+    buff[2] = CMD_GET_STATS;
+    buff[3] = CYCLES_PER_US;
+    buff[4] = NUM_BUSES;
+    SerialUSB.write(buff, 5);
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        GW_STATS *st = &stats[bus];
+        vals[0] = st->forwarded;
+        vals[1] = st->blocked;
+        vals[2] = st->limited;
+        vals[3] = st->refused;
+        vals[4] = st->forwarded ? st->latencyMin : 0;
+        vals[5] = st->latencyMax;
+        vals[6] = st->forwarded ? (uint32_t)(st->latencyTotal / st->forwarded) : 0;
+        for (int v = 0; v < 7; v++) {
+            buff[v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[1 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[2 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        SerialUSB.write(buff, 28);
+    }
+}
+
+/*
+ * 0xF1, PROTO_GATEWAY, CMD_GET_HISTOGRAM, fast path on, GW_HIST_BINS, number of buses
+ * then per source bus GW_HIST_BINS counts of 4 bytes. See GW_STATS for the bucket bounds
+ */
+void Gateway::sendHistogram()
+{
+    uint8_t buff[GW_HIST_BINS * 4];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GATEWAY;
+    buff[2] = CMD_GET_HISTOGRAM;
+    buff[3] = fastPath ? 1 : 0;
+    buff[4] = GW_HIST_BINS;
+    buff[5] = NUM_BUSES;
+    SerialUSB.write(buff, 6);
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        for (int i = 0; i < GW_HIST_BINS; i++) {
+            uint32_t val = stats[bus].histogram[i];
+            buff[i * 4] = (uint8_t)(val & 0xFF);
+            buff[1 + i * 4] = (uint8_t)(val >> 8);
+            buff[2 + i * 4] = (uint8_t)(val >> 16);
+            buff[3 + i * 4] = (uint8_t)(val >> 24);
+        }
+        SerialUSB.write(buff, GW_HIST_BINS * 4);
+    }
+}
+
+void Gateway::printStats()
+{
+    char buff[20 + GW_HIST_BINS * 20]; //a bin is at most " 1024:4294967295"
+    int len;
+
+    Logger::console("Fast path forwarding %s. Pass 0->1 %s, 1->0 %s", fastPath ? "on" : "off",
+                    passEnabled[0] ? "on" : "off", passEnabled[1] ? "on" : "off");
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        GW_STATS *st = &stats[bus];
+        uint32_t avg = st->forwarded ? (uint32_t)(st->latencyTotal / st->forwarded) : 0;
+        uint32_t min = st->forwarded ? st->latencyMin : 0;
+        //tenths of a microsecond, a bit at 1Mbit is 1uS
+        min = min * 10 / CYCLES_PER_US;
+        avg = avg * 10 / CYCLES_PER_US;
+        uint32_t max = st->latencyMax * 10 / CYCLES_PER_US;
+        Logger::console("From %s: forwarded %i, blocked %i, rate limited %i, refused %i. Latency min %i.%iuS max %i.%iuS avg %i.%iuS",
+                        Buses::name(bus), st->forwarded, st->blocked, st->limited, st->refused,
+                        min / 10, min % 10, max / 10, max % 10, avg / 10, avg % 10);
+        if (st->forwarded == 0) continue;
+        len = snprintf(buff, sizeof(buff), "    <1uS:%lu", (unsigned long)st->histogram[0]);
+        for (int i = 1; i < GW_HIST_BINS && len < (int)sizeof(buff); i++)
+            len += snprintf(buff + len, sizeof(buff) - len, " %i:%lu", 1 << (i - 1), (unsigned long)st->histogram[i]);
+        Logger::console(buff);
+    }
+    for (int r = 0; r < GW_MAX_RULES; r++) {
+        if (!(rules[r].flags & RULE_ENABLED)) continue;
+        Logger::console("Rule %i: %s ID 0x%x flags 0x%x, %i hits", r, Buses::name(rules[r].srcBus), rules[r].id, rules[r].flags, rules[r].hits);
+    }
+}
@@ -0,0 +1,119 @@
+/*
+ * Gateway.h
+ *
+ * Forwarding of frames between buses. With no rules a frame simply goes to the other bus
+ * whenever the pass pin for its direction allows it. In fast path mode frames headed for a
+ * native controller are sent from the receive interrupt itself so loop() can't delay them. Rules, looked up by bus and ID through a
+ * small hash table, can block an ID, send it out under another ID or bus, patch its payload
+ * or limit how often it is passed on. A rule naming its destination bus applies whatever the
+ * pass pins say, the pins only gate the default passthrough to the other bus.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef GATEWAY_H_
+#define GATEWAY_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct GW_RULE {
+    uint8_t flags; //Gateway::GW_RULE_FLAGS
+    uint8_t srcBus;
+    uint32_t id; //ID to match on srcBus
+    uint32_t newId; //bit 31 = send as extended. Used with RULE_REMAP
+    uint8_t dstBus; //0xFF = the usual other bus
+    uint16_t minInterval; //ms between forwards with RULE_RATE_LIMIT
+    uint8_t andMask[8]; //with RULE_PATCH each byte becomes (byte & andMask) | orMask
+    uint8_t orMask[8];
+    uint32_t lastForward; //millis()
+    uint32_t hits;
+};
+
+struct GW_STATS {
+    uint32_t forwarded;
+    uint32_t blocked;
+    uint32_t limited; //held back by a rate limit
+    uint32_t refused; //destination controller would not take the frame
+    //cycles from the receive interrupt to the frame being handed to the destination controller
+    uint32_t latencyMin;
+    uint32_t latencyMax;
+    uint64_t latencyTotal; //32 bits would wrap after a few million forwards
+    uint32_t histogram[GW_HIST_BINS]; //bucket n > 0 holds latencies of 2^(n-1) up to 2^n uS
+};
+
+class Gateway
+{
+public:
+    enum GW_CMD {
+        CMD_SET_RULE = 0,
+        CMD_CLEAR_RULE = 1,
+        CMD_CLEAR = 2,
+        CMD_GET_STATS = 3,
+        CMD_RESET_STATS = 4,
+        CMD_SET_FAST_PATH = 5,
+        CMD_GET_HISTOGRAM = 6
+    };
+
+    enum GW_RULE_FLAGS {
+        RULE_BLOCK = 1,
+        RULE_REMAP = 2,
+        RULE_PATCH = 4,
+        RULE_RATE_LIMIT = 8,
+        RULE_EXTENDED = 0x40, //rule matches an extended ID
+        RULE_ENABLED = 0x80
+    };
+
+    static void setup();
+    static void loop();
+    static void processFrame(CAN_FRAME &frame, int bus, uint32_t stamp);
+    static void processFrameISR(CAN_FRAME &frame, int bus, uint32_t stamp);
+    static void setFastPath(boolean en);
+    static boolean getFastPath();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static boolean setRule(uint8_t idx, GW_RULE &rule);
+    static void clearRule(uint8_t idx);
+    static void clear();
+    static void resetStats();
+    static void sendStats();
+    static void sendHistogram();
+    static void printStats();
+
+private:
+    static GW_RULE rules[GW_MAX_RULES];
+    static int8_t lookup[GW_HASH_SIZE]; //rule index or -1
+    static GW_STATS stats[NUM_BUSES];
+    static volatile boolean fastPath;
+    static volatile boolean passEnabled[NUM_BUSES]; //debounced pass pin levels, read by the interrupts. SWCAN has no pin
+    static uint8_t pinCounter[NUM_BUSES];
+
+    static void compile();
+    static uint32_t keyOf(int bus, uint32_t id, boolean extended);
+    static int findRule(int bus, uint32_t id, boolean extended);
+    static int destinationOf(int bus, int rule); //-1 if the frame isn't passed on
+    static void forward(CAN_FRAME &frame, int bus, uint32_t stamp, int r, int dst);
+};
+
+#endif /* GATEWAY_H_ */
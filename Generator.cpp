@@ -0,0 +1,390 @@
+/*
+ * Generator.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Generator.h"
+#include "Buses.h"
+#include "Logger.h"
+
+GEN_BUS Generator::gens[NUM_BUSES];
+GEN_CHECK Generator::checks[NUM_BUSES];
+GEN_LEARNED Generator::learned[GEN_MAX_LEARNED];
+uint8_t Generator::numLearned = 0;
+int8_t Generator::learnBus = -1;
+uint32_t Generator::learnStart;
+uint32_t Generator::learnEnd;
+uint32_t Generator::rng = 0x2545F491;
+
+void Generator::setup()
+{
+    GEN_PROFILE profile;
+
+    profile.load = 500;
+    profile.extPercent = 50;
+    profile.idMin = 0x100;
+    profile.idMax = 0x7FF;
+    profile.dlcMin = 3;
+    profile.dlcMax = 8;
+    profile.burstFrames = 0;
+    profile.burstPeriod = 0;
+    profile.flags = FLAG_TAG;
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        gens[bus].running = false;
+        gens[bus].profile = profile;
+    }
+    resetStats();
+}
+
+//xorshift32, plenty for traffic and far cheaper than random()
+uint32_t Generator::random32()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+void Generator::makeRandomFrame(GEN_PROFILE &profile, CAN_FRAME &frame)
+{
+    frame.extended = (random32() % 100) < profile.extPercent;
+    frame.id = profile.idMin + random32() % (profile.idMax - profile.idMin + 1);
+    frame.id &= frame.extended ? 0x1FFFFFFF : 0x7FF;
+    frame.rtr = 0;
+    frame.length = profile.dlcMin + random32() % (profile.dlcMax - profile.dlcMin + 1);
+    frame.data.value = ((uint64_t)random32() << 32) | random32();
+}
+
+/*
+ * Tagged frames start with 0xA0 + source bus and a 16 bit sequence number. Frames shorter
+ * than three bytes are stretched to three so every tagged frame can be checked.
+ */
+boolean Generator::sendFrame(int bus, CAN_FRAME &frame)
+{
+    GEN_BUS *g = &gens[bus];
+
+    if (g->profile.flags & FLAG_TAG) {
+        if (frame.length < 3) frame.length = 3;
+        frame.data.bytes[0] = GEN_TAG_MARK + bus;
+        frame.data.bytes[1] = (uint8_t)(g->seq & 0xFF);
+        frame.data.bytes[2] = (uint8_t)(g->seq >> 8);
+    }
+    if (!Buses::send(frame, bus)) {
+        g->refused++;
+        return false;
+    }
+    g->seq++;
+    g->sent++;
+    return true;
+}
+
+void Generator::setProfile(int bus, GEN_PROFILE &profile)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return;
+    if (profile.load > 1000) profile.load = 1000;
+    if (profile.extPercent > 100) profile.extPercent = 100;
+    if (profile.dlcMax > 8) profile.dlcMax = 8;
+    if (profile.dlcMin > profile.dlcMax) profile.dlcMin = profile.dlcMax;
+    if (profile.idMin > profile.idMax) profile.idMin = profile.idMax;
+    gens[bus].profile = profile;
+}
+
+GEN_PROFILE *Generator::getProfile(int bus)
+{
+    return &gens[bus].profile;
+}
+
+void Generator::start(int bus)
+{
+    if (bus < 0 || bus >= Buses::count()) return;
+    GEN_BUS *g = &gens[bus];
+
+    g->credit = 0;
+    g->lastTopUp = micros();
+    g->lastBurst = millis();
+    g->burstLeft = 0;
+    g->running = true;
+    if ((g->profile.flags & FLAG_LEARNED) && learnBus < 0) {
+        for (int i = 0; i < numLearned; i++) learned[i].nextDue = millis() + (random32() % learned[i].period);
+    }
+}
+
+void Generator::stop(int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return;
+    gens[bus].running = false;
+}
+
+//record which IDs a bus carries, how long they are and how often they come, for ms milliseconds
+void Generator::learn(int bus, uint16_t ms)
+{
+    if (bus < 0 || bus >= Buses::count() || ms == 0) return;
+    numLearned = 0;
+    learnStart = millis();
+    learnEnd = learnStart + ms;
+    learnBus = bus;
+}
+
+void Generator::finishLearning()
+{
+    uint32_t window = learnEnd - learnStart;
+
+    learnBus = -1;
+    for (int i = 0; i < numLearned; i++) {
+        learned[i].period = window / learned[i].count;
+        if (learned[i].period == 0) learned[i].period = 1;
+    }
+    if (!settings.useBinarySerialComm && !SysSettings.lawicelMode)
+        Logger::console("Generator learned %i IDs in %ims", numLearned, window);
+}
+
+//receive side: learning and sequence checks. Called for every received frame
+void Generator::processFrame(CAN_FRAME &frame, int bus)
+{
+    if (learnBus == bus) {
+        int i;
+        for (i = 0; i < numLearned; i++) {
+            if (learned[i].id == frame.id && learned[i].extended == frame.extended) break;
+        }
+        if (i == numLearned && numLearned < GEN_MAX_LEARNED) {
+            learned[i].id = frame.id;
+            learned[i].extended = frame.extended;
+            learned[i].count = 0;
+            numLearned++;
+        }
+        if (i < numLearned) {
+            learned[i].length = frame.length;
+            learned[i].count++;
+        }
+    }
+
+    if (frame.length < 3 || (frame.data.bytes[0] & 0xF0) != GEN_TAG_MARK) return;
+    uint8_t src = frame.data.bytes[0] & 0x0F;
+    if (src >= NUM_BUSES) return;
+
+    GEN_CHECK *c = &checks[src];
+    uint16_t seq = frame.data.bytes[1] + ((uint16_t)frame.data.bytes[2] << 8);
+    uint16_t ahead = seq - c->expected;
+
+    c->received++;
+    if (!c->synced) {
+        c->synced = true;
+        c->expected = seq + 1;
+    } else if (ahead < 0x8000) { //on time, or some went missing in between
+        c->lost += ahead;
+        c->expected = seq + 1;
+    } else {
+        c->reordered++;
+    }
+}
+
+/*
+ * The load target is a token bucket in bits: credit grows with time at the target share of the
+ * bus speed and every frame spends its real on wire length, stuff bits included. Credit is
+ * capped at GEN_MAX_CREDIT_US worth so a stall in loop() doesn't turn into a long burst.
+ */
+void Generator::runBus(int bus)
+{
+    GEN_BUS *g = &gens[bus];
+    GEN_PROFILE *p = &g->profile;
+    CAN_FRAME frame;
+    uint32_t now = micros();
+    uint32_t bitsPerMs = settings.buses[bus].speed / 1000 * p->load / 1000;
+    uint32_t maxCredit = bitsPerMs * GEN_MAX_CREDIT_US / 1000;
+    uint32_t elapsed = now - g->lastTopUp;
+
+    if (elapsed >= 100) { //top up in 100uS steps so the division doesn't lose everything
+        g->credit += bitsPerMs * elapsed / 1000;
+        if (g->credit > maxCredit) g->credit = maxCredit;
+        g->lastTopUp = now;
+    }
+
+    if (p->burstFrames && p->burstPeriod && (millis() - g->lastBurst) >= p->burstPeriod) {
+        g->lastBurst = millis();
+        g->burstLeft = p->burstFrames;
+    }
+    while (g->burstLeft > 0) {
+        makeRandomFrame(*p, frame);
+        if (!sendFrame(bus, frame)) break;
+        g->burstLeft--;
+    }
+
+    if (p->flags & FLAG_LEARNED) {
+        runLearned(bus);
+        return;
+    }
+    for (int i = 0; i < GEN_MAX_PER_LOOP; i++) {
+        makeRandomFrame(*p, frame);
+        uint16_t bits = Buses::frameBits(frame);
+        if (g->credit < bits) break;
+        if (!sendFrame(bus, frame)) break;
+        g->credit -= bits;
+    }
+}
+
+//learned profile: every ID at its own period, scaled by the load setting (1000 = as learned)
+void Generator::runLearned(int bus)
+{
+    GEN_BUS *g = &gens[bus];
+    CAN_FRAME frame;
+    uint32_t now = millis();
+
+    if (g->profile.load == 0 || learnBus >= 0) return; //table isn't usable until learning finishes
+    for (int i = 0; i < numLearned; i++) {
+        GEN_LEARNED *l = &learned[i];
+        if ((int32_t)(now - l->nextDue) < 0) continue;
+        frame.id = l->id;
+        frame.extended = l->extended;
+        frame.rtr = 0;
+        frame.length = l->length;
+        frame.data.value = ((uint64_t)random32() << 32) | random32();
+        if (!sendFrame(bus, frame)) return; //controller full, try again next pass
+        l->nextDue += l->period * 1000 / g->profile.load;
+        if ((int32_t)(now - l->nextDue) > 0) l->nextDue = now; //fell behind, don't burst to catch up
+    }
+}
+
+void Generator::loop()
+{
+    if (learnBus >= 0 && (int32_t)(millis() - learnEnd) >= 0) finishLearning();
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        if (gens[bus].running && Buses::isEnabled(bus)) runBus(bus);
+    }
+}
+
+//number of data bytes that follow each sub command byte
+int Generator::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_SET_PROFILE:
+        return 19;
+    case CMD_START:
+    case CMD_STOP:
+        return 1;
+    case CMD_LEARN:
+        return 3;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_SET_PROFILE - bus, load in tenths of a percent (2 bytes), percent 29 bit IDs,
+ *                   lowest ID (4 bytes), highest ID (4 bytes), shortest length, longest length,
+ *                   burst frames (2 bytes), burst period in mS (2 bytes), flags
+ * CMD_START, CMD_STOP - bit mask of buses
+ * CMD_LEARN - bus, mS to learn for (2 bytes)
+ */
+void Generator::handleCommand(uint8_t *data)
+{
+    GEN_PROFILE profile;
+
+    switch (data[0]) {
+    case CMD_SET_PROFILE:
+        profile.load = data[2] + ((uint16_t)data[3] << 8);
+        profile.extPercent = data[4];
+        profile.idMin = data[5] + ((uint32_t)data[6] << 8) + ((uint32_t)data[7] << 16) + ((uint32_t)data[8] << 24);
+        profile.idMax = data[9] + ((uint32_t)data[10] << 8) + ((uint32_t)data[11] << 16) + ((uint32_t)data[12] << 24);
+        profile.dlcMin = data[13];
+        profile.dlcMax = data[14];
+        profile.burstFrames = data[15] + ((uint16_t)data[16] << 8);
+        profile.burstPeriod = data[17] + ((uint16_t)data[18] << 8);
+        profile.flags = data[19];
+        setProfile(data[1], profile);
+        break;
+    case CMD_START:
+        for (int bus = 0; bus < NUM_BUSES; bus++) if (data[1] & (1 << bus)) start(bus);
+        break;
+    case CMD_STOP:
+        for (int bus = 0; bus < NUM_BUSES; bus++) if (data[1] & (1 << bus)) stop(bus);
+        break;
+    case CMD_LEARN:
+        learn(data[1], data[2] + ((uint16_t)data[3] << 8));
+        break;
+    case CMD_GET_STATS:
+        sendStats();
+        break;
+    case CMD_RESET_STATS:
+        resetStats();
+        break;
+    }
+}
+
+void Generator::resetStats()
+{
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        gens[bus].sent = 0;
+        gens[bus].refused = 0;
+        gens[bus].seq = 0;
+        checks[bus].synced = false;
+        checks[bus].received = 0;
+        checks[bus].lost = 0;
+        checks[bus].reordered = 0;
+    }
+}
+
+/*
+ * 0xF1, PROTO_GENERATOR, CMD_GET_STATS, number of buses
+ * then per bus: running, sent, refused, and for the frames tagged by that bus:
+ * received, lost, reordered (4 bytes each)
+ */
+void Generator::sendStats()
+{
+    uint8_t buff[21];
+    uint32_t vals[5];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GENERATOR;
+    buff[2] = CMD_GET_STATS;
+    buff[3] = NUM_BUSES;
+    SerialUSB.write(buff, 4);
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        vals[0] = gens[bus].sent;
+        vals[1] = gens[bus].refused;
+        vals[2] = checks[bus].received;
+        vals[3] = checks[bus].lost;
+        vals[4] = checks[bus].reordered;
+        buff[0] = gens[bus].running;
+        for (int v = 0; v < 5; v++) {
+            buff[1 + v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[2 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[4 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        SerialUSB.write(buff, 21);
+    }
+}
+
+void Generator::printStats()
+{
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        GEN_BUS *g = &gens[bus];
+        GEN_CHECK *c = &checks[bus];
+        Logger::console("%s generator %s at %i.%i%% load: sent %i, refused %i. Its tagged frames seen: %i, lost %i, reordered %i",
+                        Buses::name(bus), g->running ? "running" : "stopped", g->profile.load / 10, g->profile.load % 10,
+                        g->sent, g->refused, c->received, c->lost, c->reordered);
+    }
+    if (numLearned) Logger::console("%i learned IDs", numLearned);
+}
@@ -0,0 +1,130 @@
+/*
+ * Generator.h
+ *
+ * Synthetic traffic for stress testing. Each bus can be loaded to a target percentage with
+ * random IDs and lengths from a configured range, with optional bursts on top, or with a
+ * profile learned from a real bus. Tagged frames carry a sequence number that the receive
+ * side checks, so loss and reordering anywhere between two buses show up exactly.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef GENERATOR_H_
+#define GENERATOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct GEN_PROFILE {
+    uint16_t load; //tenths of a percent of the bus speed
+    uint8_t extPercent; //share of 29 bit IDs
+    uint32_t idMin;
+    uint32_t idMax;
+    uint8_t dlcMin;
+    uint8_t dlcMax;
+    uint16_t burstFrames; //frames sent back to back every burstPeriod ms, on top of the load. 0 = no bursts
+    uint16_t burstPeriod;
+    uint8_t flags; //Generator::GEN_FLAGS
+};
+
+struct GEN_BUS {
+    boolean running;
+    GEN_PROFILE profile;
+    uint32_t credit; //bits we may still send, topped up from the target load as time passes
+    uint32_t lastTopUp; //micros()
+    uint32_t lastBurst; //millis()
+    uint16_t burstLeft;
+    uint16_t seq;
+    uint32_t sent;
+    uint32_t refused; //controller was full, frame retried later
+};
+
+//what the receive side saw of the frames tagged by one source bus
+struct GEN_CHECK {
+    boolean synced;
+    uint16_t expected;
+    uint32_t received;
+    uint32_t lost;
+    uint32_t reordered; //arrived after a later one, or twice
+};
+
+struct GEN_LEARNED {
+    uint32_t id;
+    boolean extended;
+    uint8_t length;
+    uint16_t count; //seen while learning
+    uint32_t period; //mS between frames, worked out when learning ends
+    uint32_t nextDue;
+};
+
+class Generator
+{
+public:
+    enum GEN_CMD {
+        CMD_SET_PROFILE = 0,
+        CMD_START = 1,
+        CMD_STOP = 2,
+        CMD_LEARN = 3,
+        CMD_GET_STATS = 4,
+        CMD_RESET_STATS = 5
+    };
+
+    enum GEN_FLAGS {
+        FLAG_TAG = 1, //sequence tag in the first three data bytes
+        FLAG_LEARNED = 2 //play the learned ID table instead of random IDs
+    };
+
+    static void setup();
+    static void loop();
+    static void processFrame(CAN_FRAME &frame, int bus);
+    static void setProfile(int bus, GEN_PROFILE &profile);
+    static GEN_PROFILE *getProfile(int bus);
+    static void start(int bus);
+    static void stop(int bus);
+    static void learn(int bus, uint16_t ms);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void resetStats();
+    static void sendStats();
+    static void printStats();
+
+private:
+    static GEN_BUS gens[NUM_BUSES];
+    static GEN_CHECK checks[NUM_BUSES];
+    static GEN_LEARNED learned[GEN_MAX_LEARNED];
+    static uint8_t numLearned;
+    static int8_t learnBus; //-1 when not learning
+    static uint32_t learnStart;
+    static uint32_t learnEnd;
+    static uint32_t rng;
+
+    static uint32_t random32();
+    static void makeRandomFrame(GEN_PROFILE &profile, CAN_FRAME &frame);
+    static boolean sendFrame(int bus, CAN_FRAME &frame);
+    static void runBus(int bus);
+    static void runLearned(int bus);
+    static void finishLearning();
+};
+
+#endif /* GENERATOR_H_ */
@@ -0,0 +1,474 @@
+/*
+ * IsoTp.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "IsoTp.h"
+#include "Logger.h"
+#include "TxQueue.h"
+#include "Buses.h"
+
+//protocol control information, upper nibble of the first data byte
+#define PCI_SINGLE		0x00
+#define PCI_FIRST		0x10
+#define PCI_CONSEC		0x20
+#define PCI_FLOW		0x30
+
+#define FC_CTS			0
+#define FC_WAIT			1
+#define FC_OVERFLOW		2
+
+ISOTP_CHANNEL IsoTp::channels[ISOTP_MAX_CHANNELS];
+
+uint8_t IsoTp::txBuff[ISOTP_MAX_PDU];
+uint8_t IsoTp::txState = TX_IDLE;
+uint8_t IsoTp::txChan = 0;
+uint16_t IsoTp::txLen = 0;
+uint16_t IsoTp::txPos = 0;
+uint8_t IsoTp::txSN = 0;
+uint8_t IsoTp::txBlockLeft = 0;
+uint32_t IsoTp::txSTmin = 0;
+uint32_t IsoTp::txLastFrame = 0;
+uint32_t IsoTp::txTime = 0;
+
+uint8_t IsoTp::cmd = 0;
+uint8_t IsoTp::cmdBuff[16];
+uint16_t IsoTp::cmdPos = 0;
+uint16_t IsoTp::dataLen = 0;
+uint16_t IsoTp::dataPos = 0;
+boolean IsoTp::discard = false;
+
+boolean IsoTp::setChannel(uint8_t chan, boolean enable, uint8_t bus, uint32_t rxID, uint32_t txID)
+{
+    if (chan >= ISOTP_MAX_CHANNELS || bus >= NUM_BUSES) return false;
+    ISOTP_CHANNEL *ch = &channels[chan];
+    ch->enabled = false; //drop anything in progress while the IDs change
+    ch->rxActive = false;
+    if (txState != TX_IDLE && txChan == chan) txDone(TX_BAD);
+    ch->bus = bus;
+    ch->rxID = rxID;
+    ch->txID = txID;
+    ch->enabled = enable;
+    return true;
+}
+
+void IsoTp::setFlowControl(uint8_t chan, uint8_t blockSize, uint8_t stMin)
+{
+    if (chan >= ISOTP_MAX_CHANNELS) return;
+    channels[chan].blockSize = blockSize;
+    channels[chan].stMin = stMin;
+}
+
+void IsoTp::setPadding(uint8_t chan, boolean enable, uint8_t padByte)
+{
+    if (chan >= ISOTP_MAX_CHANNELS) return;
+    channels[chan].padding = enable;
+    channels[chan].padByte = padByte;
+}
+
+//STmin is 0 - 127 ms, or 100 - 900 uS for 0xF1 - 0xF9. Reserved values mean the maximum
+uint32_t IsoTp::decodeSTmin(uint8_t stMin)
+{
+    if (stMin <= 0x7F) return stMin * 1000ul;
+    if (stMin >= 0xF1 && stMin <= 0xF9) return (stMin - 0xF0) * 100ul;
+    return 127000ul;
+}
+
+boolean IsoTp::matches(ISOTP_CHANNEL *ch, CAN_FRAME &frame, int whichBus)
+{
+    if (!ch->enabled || ch->bus != whichBus || frame.length < 1) return false;
+    uint32_t id = frame.id & 0x7FFFFFFF;
+    if (frame.extended) id |= 1ul << 31;
+    return (id == ch->rxID);
+}
+
+//Flow control can't sit behind other traffic in the queue so try the controller first
+boolean IsoTp::sendRaw(ISOTP_CHANNEL *ch, uint8_t *data, uint8_t length)
+{
+    CAN_FRAME frame;
+    frame.id = ch->txID & 0x7FFFFFFF;
+    frame.extended = (ch->txID & (1ul << 31)) ? true : false;
+    frame.rtr = 0;
+    frame.length = ch->padding ? 8 : length;
+    for (int c = 0; c < 8; c++) frame.data.bytes[c] = (c < length) ? data[c] : ch->padByte;
+    return Buses::send(frame, ch->bus);
+}
+
+void IsoTp::sendFlowControl(ISOTP_CHANNEL *ch, uint8_t status)
+{
+    uint8_t fc[3];
+    fc[0] = PCI_FLOW | status;
+    fc[1] = ch->blockSize;
+    fc[2] = ch->stMin;
+    if (!sendRaw(ch, fc, 3)) {
+        CAN_FRAME frame;
+        frame.id = ch->txID & 0x7FFFFFFF;
+        frame.extended = (ch->txID & (1ul << 31)) ? true : false;
+        frame.length = ch->padding ? 8 : 3;
+        for (int c = 0; c < 8; c++) frame.data.bytes[c] = (c < 3) ? fc[c] : ch->padByte;
+        TxQueue::queueFrame(frame, ch->bus);
+    }
+}
+
+void IsoTp::processFrame(CAN_FRAME &frame, int whichBus)
+{
+    for (int chan = 0; chan < ISOTP_MAX_CHANNELS; chan++) {
+        ISOTP_CHANNEL *ch = &channels[chan];
+        if (!matches(ch, frame, whichBus)) continue;
+
+        uint8_t *d = frame.data.bytes;
+        switch (d[0] & 0xF0) {
+        case PCI_SINGLE: {
+            uint8_t len = d[0] & 0x0F;
+            if (len == 0 || len > frame.length - 1) {
+                ch->errors++;
+                break;
+            }
+            ch->rxActive = false; //a new PDU aborts one in progress
+            ch->rxPDUs++;
+            emitPDU(chan, d + 1, len);
+            break;
+        }
+        case PCI_FIRST: {
+            uint16_t len = ((d[0] & 0x0F) << 8) | d[1];
+            if (frame.length < 8 || len < 8) {
+                ch->errors++;
+                break;
+            }
+            if (len > ISOTP_MAX_PDU) {
+                ch->errors++;
+                ch->rxActive = false;
+                sendFlowControl(ch, FC_OVERFLOW);
+                break;
+            }
+            memcpy(ch->rxBuff, d + 2, 6);
+            ch->rxLen = len;
+            ch->rxPos = 6;
+            ch->rxSN = 1;
+            ch->rxBlockLeft = ch->blockSize;
+            ch->rxTime = millis();
+            ch->rxActive = true;
+            sendFlowControl(ch, FC_CTS);
+            break;
+        }
+        case PCI_CONSEC: {
+            if (!ch->rxActive) break;
+            if ((d[0] & 0x0F) != ch->rxSN) {
+                ch->errors++;
+                ch->rxActive = false;
+                break;
+            }
+            int take = ch->rxLen - ch->rxPos;
+            if (take > 7) take = 7;
+            if (take > frame.length - 1) take = frame.length - 1;
+            memcpy(ch->rxBuff + ch->rxPos, d + 1, take);
+            ch->rxPos += take;
+            ch->rxSN = (ch->rxSN + 1) & 0x0F;
+            ch->rxTime = millis();
+            if (ch->rxPos >= ch->rxLen) {
+                ch->rxActive = false;
+                ch->rxPDUs++;
+                emitPDU(chan, ch->rxBuff, ch->rxLen);
+            } else if (ch->blockSize && --ch->rxBlockLeft == 0) {
+                ch->rxBlockLeft = ch->blockSize;
+                sendFlowControl(ch, FC_CTS);
+            }
+            break;
+        }
+        case PCI_FLOW:
+            if (txState != TX_IDLE && txChan == chan) handleFlowControl(frame);
+            break;
+        }
+    }
+}
+
+void IsoTp::handleFlowControl(CAN_FRAME &frame)
+{
+    if (txState != TX_WAIT_FC) return; //unexpected, ignore it
+    switch (frame.data.bytes[0] & 0x0F) {
+    case FC_CTS:
+        txBlockLeft = frame.data.bytes[1];
+        txSTmin = decodeSTmin(frame.data.bytes[2]);
+        txLastFrame = micros() - txSTmin; //first consecutive frame can go right away
+        txState = TX_SENDING;
+        break;
+    case FC_WAIT:
+        txTime = millis();
+        break;
+    case FC_OVERFLOW:
+        txDone(TX_OVERFLOW);
+        break;
+    }
+}
+
+/*
+ * Start sending a PDU. Single frames go immediately, longer ones send the first frame and
+ * then wait for the receiver's flow control in loop().
+ */
+uint8_t IsoTp::sendPDU(uint8_t chan, uint8_t *data, uint16_t length)
+{
+    if (chan >= ISOTP_MAX_CHANNELS || !channels[chan].enabled || length == 0 || length > ISOTP_MAX_PDU) return TX_BAD;
+    if (txState != TX_IDLE) return TX_BUSY;
+
+    ISOTP_CHANNEL *ch = &channels[chan];
+    uint8_t buff[8];
+    txChan = chan;
+
+    if (length <= 7) {
+        buff[0] = PCI_SINGLE | length;
+        memcpy(buff + 1, data, length);
+        if (!sendRaw(ch, buff, length + 1)) {
+            CAN_FRAME frame;
+            frame.id = ch->txID & 0x7FFFFFFF;
+            frame.extended = (ch->txID & (1ul << 31)) ? true : false;
+            frame.length = ch->padding ? 8 : length + 1;
+            for (int c = 0; c < 8; c++) frame.data.bytes[c] = (c <= length) ? buff[c] : ch->padByte;
+            TxQueue::queueFrame(frame, ch->bus);
+        }
+        ch->txPDUs++;
+        return TX_OK;
+    }
+
+    if (data != txBuff) memcpy(txBuff, data, length);
+    txLen = length;
+    buff[0] = PCI_FIRST | (length >> 8);
+    buff[1] = length & 0xFF;
+    memcpy(buff + 2, txBuff, 6);
+    if (!sendRaw(ch, buff, 8)) return TX_BUSY;
+    txPos = 6;
+    txSN = 1;
+    txTime = millis();
+    txState = TX_WAIT_FC;
+    return TX_OK;
+}
+
+void IsoTp::sendNextConsecutive()
+{
+    uint8_t buff[8];
+    int take = txLen - txPos;
+    if (take > 7) take = 7;
+    buff[0] = PCI_CONSEC | txSN;
+    memcpy(buff + 1, txBuff + txPos, take);
+    if (!sendRaw(&channels[txChan], buff, take + 1)) return; //mailboxes full, try again next pass
+
+    txLastFrame = micros();
+    txPos += take;
+    txSN = (txSN + 1) & 0x0F;
+    if (txPos >= txLen) {
+        channels[txChan].txPDUs++;
+        txDone(TX_OK);
+    } else if (txBlockLeft && --txBlockLeft == 0) {
+        txTime = millis();
+        txState = TX_WAIT_FC;
+    }
+}
+
+void IsoTp::loop()
+{
+    uint32_t now = millis();
+
+    for (int chan = 0; chan < ISOTP_MAX_CHANNELS; chan++) {
+        ISOTP_CHANNEL *ch = &channels[chan];
+        if (ch->rxActive && now - ch->rxTime > ISOTP_TIMEOUT) {
+            ch->rxActive = false;
+            ch->errors++;
+        }
+    }
+
+    if (txState == TX_WAIT_FC && now - txTime > ISOTP_TIMEOUT) {
+        channels[txChan].errors++;
+        txDone(TX_TIMEOUT);
+    } else if (txState == TX_SENDING && (micros() - txLastFrame) >= txSTmin) {
+        sendNextConsecutive();
+    }
+}
+
+/*
+ * 0xF1, PROTO_ISOTP, REC_PDU, channel, bus, length (2 bytes), PDU bytes
+ */
+void IsoTp::emitPDU(uint8_t chan, uint8_t *data, uint16_t length)
+{
+    if (SysSettings.lawicelMode) return;
+
+    if (settings.useBinarySerialComm) {
+        uint8_t buff[7];
+        buff[0] = 0xF1;
+        buff[1] = PROTO_ISOTP;
+        buff[2] = REC_PDU;
+        buff[3] = chan;
+        buff[4] = channels[chan].bus;
+        buff[5] = (uint8_t)(length & 0xFF);
+        buff[6] = (uint8_t)(length >> 8);
+        bufferUSBBytes(buff, 7);
+        bufferUSBBytes(data, length);
+    } else {
+        SerialUSB.print("ISOTP ");
+        SerialUSB.print(chan);
+        SerialUSB.print(" ");
+        SerialUSB.print(length);
+        for (int c = 0; c < length; c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(data[c], HEX);
+        }
+        SerialUSB.println();
+    }
+}
+
+//0xF1, PROTO_ISOTP, REC_TX_DONE, channel, status (ISOTP_TX_STATUS)
+void IsoTp::txDone(uint8_t status)
+{
+    txState = TX_IDLE;
+    if (SysSettings.lawicelMode) return;
+
+    if (settings.useBinarySerialComm) {
+        uint8_t buff[5];
+        buff[0] = 0xF1;
+        buff[1] = PROTO_ISOTP;
+        buff[2] = REC_TX_DONE;
+        buff[3] = txChan;
+        buff[4] = status;
+        bufferUSBBytes(buff, 5);
+    } else if (status != TX_OK) Logger::console("ISO-TP send on channel %i failed (%i)", txChan, status);
+}
+
+//called when PROTO_ISOTP has been seen, or to drop a command that was cut short
+void IsoTp::begin()
+{
+    cmdPos = 0;
+}
+
+/*
+ * Command layout after 0xF1, PROTO_ISOTP:
+ * CMD_SET_CHANNEL - channel, flags (bit 0 = enable, bit 1 = pad frames), bus, RX ID (4 bytes),
+ *                   TX ID (4 bytes, bit 31 = extended on both), block size, STmin, pad byte
+ * CMD_SEND - channel, length (2 bytes), PDU bytes. Answered with REC_TX_DONE
+ * CMD_GET_STATS - no data
+ * CMD_SEND is variable length so the PDU is copied straight into the transmit buffer from
+ * whatever the command parser has buffered instead of going through a fixed size buffer.
+ * used says how many bytes were taken. Returns true when the command is complete.
+ */
+boolean IsoTp::receive(uint8_t *data, int length, int &used)
+{
+    used = 0;
+    while (used < length) {
+        if (cmdPos == 0) {
+            cmd = data[used++];
+            cmdPos = 1;
+            dataLen = dataPos = 0;
+            if (cmd != CMD_SET_CHANNEL && cmd != CMD_SEND) {
+                cmdPos = 0;
+                if (cmd == CMD_GET_STATS) sendStats();
+                return true; //nothing more to read
+            }
+            continue;
+        }
+
+        if (cmd == CMD_SET_CHANNEL) {
+            cmdBuff[cmdPos++ - 1] = data[used++];
+            if (cmdPos <= 14) continue;
+            uint8_t *d = cmdBuff;
+            setChannel(d[0], d[1] & 1, d[2], d[3] + ((uint32_t)d[4] << 8) + ((uint32_t)d[5] << 16) + ((uint32_t)d[6] << 24),
+                       d[7] + ((uint32_t)d[8] << 8) + ((uint32_t)d[9] << 16) + ((uint32_t)d[10] << 24));
+            setFlowControl(d[0], d[11], d[12]);
+            setPadding(d[0], d[1] & 2, d[13]);
+            cmdPos = 0;
+            return true;
+        }
+
+        //CMD_SEND
+        if (cmdPos < 4) {
+            cmdBuff[cmdPos++ - 1] = data[used++];
+            if (cmdPos < 4) continue;
+            dataLen = cmdBuff[1] + ((uint16_t)cmdBuff[2] << 8);
+            //the PDU is read straight into the transmit buffer so it can't be taken while one is going out
+            discard = (txState != TX_IDLE || dataLen == 0 || dataLen > ISOTP_MAX_PDU);
+            if (dataLen > 0) continue;
+        } else {
+            int take = dataLen - dataPos;
+            if (take > length - used) take = length - used;
+            if (!discard) memcpy(txBuff + dataPos, data + used, take);
+            dataPos += take;
+            used += take;
+            if (dataPos < dataLen) return false;
+        }
+        finishSend();
+        return true;
+    }
+    return false;
+}
+
+//whole CMD_SEND is in, start the PDU or say why not
+void IsoTp::finishSend()
+{
+    cmdPos = 0;
+    uint8_t chan = cmdBuff[0];
+    if (discard) {
+        if (txState != TX_IDLE) {
+            //report busy without disturbing the PDU in flight
+            uint8_t buff[5] = {0xF1, PROTO_ISOTP, REC_TX_DONE, chan, TX_BUSY};
+            bufferUSBBytes(buff, 5);
+        } else {
+            txChan = chan;
+            txDone(TX_BAD);
+        }
+        return;
+    }
+    uint8_t status = sendPDU(chan, txBuff, dataLen);
+    if (status != TX_OK || txState == TX_IDLE) {
+        txChan = chan;
+        txDone(status);
+    }
+}
+
+void IsoTp::printStats()
+{
+    for (int chan = 0; chan < ISOTP_MAX_CHANNELS; chan++) {
+        ISOTP_CHANNEL *ch = &channels[chan];
+        Logger::console("ISO-TP %i: %s bus %i RX 0x%x TX 0x%x BS %i STmin %i - %i PDUs in, %i out, %i errors", chan,
+                        ch->enabled ? "on" : "off", ch->bus, ch->rxID, ch->txID, ch->blockSize, ch->stMin, ch->rxPDUs,
+                        ch->txPDUs, ch->errors);
+    }
+}
+
+//0xF1, PROTO_ISOTP, CMD_GET_STATS, number of channels, then per channel: enabled, PDUs in, PDUs out, errors (4 bytes each)
+void IsoTp::sendStats()
+{
+    uint8_t buff[13];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_ISOTP;
+    buff[2] = CMD_GET_STATS;
+    buff[3] = ISOTP_MAX_CHANNELS;
+    bufferUSBBytes(buff, 4);
+
+    for (int chan = 0; chan < ISOTP_MAX_CHANNELS; chan++) {
+        ISOTP_CHANNEL *ch = &channels[chan];
+        uint32_t vals[3] = {ch->rxPDUs, ch->txPDUs, ch->errors};
+        buff[0] = ch->enabled;
+        for (int v = 0; v < 3; v++) {
+            for (int i = 0; i < 4; i++) buff[1 + v * 4 + i] = (uint8_t)(vals[v] >> (i * 8));
+        }
+        bufferUSBBytes(buff, 13);
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ * IsoTp.h
+ *
+ * ISO 15765-2 transport layer for a handful of configured ID pairs. Incoming
+ * multi-frame PDUs are reassembled here (with flow control answered locally) and
+ * outgoing PDUs from the host are segmented and paced against the receiver's flow control.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef ISOTP_H_
+#define ISOTP_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct ISOTP_CHANNEL {
+    boolean enabled;
+    uint8_t bus;
+    uint32_t rxID; //ID the other node sends on. Bit 31 set for extended
+    uint32_t txID; //ID we send on (flow control and our own PDUs)
+    uint8_t blockSize; //flow control we hand out when receiving
+    uint8_t stMin;
+    boolean padding;
+    uint8_t padByte;
+
+    uint8_t rxBuff[ISOTP_MAX_PDU];
+    boolean rxActive;
+    uint16_t rxLen;
+    uint16_t rxPos;
+    uint8_t rxSN;
+    uint8_t rxBlockLeft;
+    uint32_t rxTime; //millis() of the last frame of the PDU in progress
+
+    uint32_t rxPDUs;
+    uint32_t txPDUs;
+    uint32_t errors;
+};
+
+class IsoTp
+{
+public:
+    enum ISOTP_CMD {
+        CMD_SET_CHANNEL = 0,
+        CMD_SEND = 1,
+        CMD_GET_STATS = 2
+    };
+
+    enum ISOTP_RECORD { //sent to the host after 0xF1, PROTO_ISOTP
+        REC_PDU = 0x10,
+        REC_TX_DONE = 0x11
+    };
+
+    enum ISOTP_TX_STATUS {
+        TX_OK = 0,
+        TX_TIMEOUT = 1, //no flow control from the receiver
+        TX_OVERFLOW = 2, //receiver said the PDU is too big for it
+        TX_BUSY = 3, //another PDU is still being sent
+        TX_BAD = 4 //bad channel or length
+    };
+
+    static void processFrame(CAN_FRAME &frame, int whichBus);
+    static void loop();
+    static boolean setChannel(uint8_t chan, boolean enable, uint8_t bus, uint32_t rxID, uint32_t txID);
+    static void setFlowControl(uint8_t chan, uint8_t blockSize, uint8_t stMin);
+    static void setPadding(uint8_t chan, boolean enable, uint8_t padByte);
+    static uint8_t sendPDU(uint8_t chan, uint8_t *data, uint16_t length);
+    static void begin();
+    static boolean receive(uint8_t *data, int length, int &used);
+    static void printStats();
+    static void sendStats();
+
+private:
+    enum TX_STATE {
+        TX_IDLE,
+        TX_WAIT_FC,
+        TX_SENDING
+    };
+
+    static ISOTP_CHANNEL channels[ISOTP_MAX_CHANNELS];
+
+    //only one outgoing PDU at a time across all channels
+    static uint8_t txBuff[ISOTP_MAX_PDU];
+    static uint8_t txState;
+    static uint8_t txChan;
+    static uint16_t txLen;
+    static uint16_t txPos;
+    static uint8_t txSN;
+    static uint8_t txBlockLeft; //0 = no limit until the end of the PDU
+    static uint32_t txSTmin; //uS
+    static uint32_t txLastFrame; //micros() of the last consecutive frame
+    static uint32_t txTime; //millis() we started waiting for flow control
+
+    //binary command parser state
+    static uint8_t cmd;
+    static uint8_t cmdBuff[16];
+    static uint16_t cmdPos;
+    static uint16_t dataLen;
+    static uint16_t dataPos;
+    static boolean discard;
+
+    static void finishSend();
+    static boolean matches(ISOTP_CHANNEL *ch, CAN_FRAME &frame, int whichBus);
+    static boolean sendRaw(ISOTP_CHANNEL *ch, uint8_t *data, uint8_t length);
+    static void sendFlowControl(ISOTP_CHANNEL *ch, uint8_t status);
+    static void handleFlowControl(CAN_FRAME &frame);
+    static void sendNextConsecutive();
+    static void emitPDU(uint8_t chan, uint8_t *data, uint16_t length);
+    static void txDone(uint8_t status);
+    static uint32_t decodeSTmin(uint8_t stMin);
+};
+
+#endif /* ISOTP_H_ */
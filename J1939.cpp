@@ -0,0 +1,379 @@
+/*
+ * J1939.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "J1939.h"
+#include "Logger.h"
+
+#define PGN_TP_CM		0xEC00
+#define PGN_TP_DT		0xEB00
+
+//TP.CM control bytes
+#define TP_CM_RTS		16
+#define TP_CM_CTS		17
+#define TP_CM_EOMA		19
+#define TP_CM_BAM		32
+#define TP_CM_ABORT		255
+
+uint8_t J1939::mode = MODE_OFF;
+uint8_t J1939::busMask = 0xFF;
+J1939_SESSION J1939::sessions[J1939_MAX_SESSIONS];
+J1939_PGN_STATS J1939::stats[J1939_MAX_PGNS];
+uint32_t J1939::completed = 0;
+uint32_t J1939::aborted = 0;
+uint32_t J1939::untracked = 0;
+
+/*
+ * Called for every received frame before it is streamed. Returns true if the raw frame
+ * should be left out of the USB stream because it has been (or will be) sent as a PGN record.
+ */
+boolean J1939::processFrame(CAN_FRAME &frame, int whichBus)
+{
+    if (mode == MODE_OFF || !frame.extended || !(busMask & (1 << whichBus))) return false;
+
+    uint32_t id = frame.id & 0x1FFFFFFF;
+    uint8_t priority = (id >> 26) & 7;
+    uint8_t pf = (id >> 16) & 0xFF;
+    uint8_t sa = id & 0xFF;
+    uint8_t da = 0xFF;
+    uint32_t pgn;
+
+    if (pf < 240) { //PDU1, the PS field is a destination address
+        pgn = (id >> 8) & 0x3FF00;
+        da = (id >> 8) & 0xFF;
+    } else pgn = (id >> 8) & 0x3FFFF; //PDU2, the PS field is a group extension
+
+    if (pgn == PGN_TP_CM) {
+        if (frame.length == 8) handleTPCM(whichBus, sa, da, priority, frame.data.bytes);
+        return (mode == MODE_PGN);
+    }
+    if (pgn == PGN_TP_DT) {
+        if (frame.length == 8) handleTPDT(whichBus, sa, da, frame.data.bytes);
+        return (mode == MODE_PGN);
+    }
+
+    countPGN(whichBus, pgn);
+    if (mode == MODE_PGN) {
+        emitPGN(whichBus, pgn, priority, sa, da, frame.data.bytes, frame.length);
+        return true;
+    }
+    return false;
+}
+
+J1939_SESSION *J1939::findSession(uint8_t bus, uint8_t sa, uint8_t da)
+{
+    for (int i = 0; i < J1939_MAX_SESSIONS; i++) {
+        J1939_SESSION *s = &sessions[i];
+        if (s->active && s->bus == bus && s->sa == sa && s->da == da) return s;
+    }
+    return NULL;
+}
+
+void J1939::handleTPCM(uint8_t bus, uint8_t sa, uint8_t da, uint8_t priority, uint8_t *d)
+{
+    J1939_SESSION *s;
+
+    switch (d[0]) {
+    case TP_CM_RTS:
+    case TP_CM_BAM: {
+        if (d[0] == TP_CM_BAM) da = 0xFF;
+        uint16_t size = d[1] + ((uint16_t)d[2] << 8);
+        uint8_t packets = d[3];
+        if (size < 9 || size > J1939_MAX_LEN || packets < (size + 6) / 7) {
+            aborted++;
+            return;
+        }
+
+        //a new announcement from the same sender replaces the old transfer. Otherwise take a free
+        //slot or, failing that, the one that has been quiet longest
+        s = findSession(bus, sa, da);
+        if (s) aborted++;
+        else {
+            for (int i = 0; i < J1939_MAX_SESSIONS; i++) {
+                if (!sessions[i].active) {
+                    s = &sessions[i];
+                    break;
+                }
+                if (!s || (int32_t)(sessions[i].lastTime - s->lastTime) < 0) s = &sessions[i];
+            }
+            if (s->active) aborted++;
+        }
+
+        s->active = true;
+        s->bam = (d[0] == TP_CM_BAM);
+        s->bus = bus;
+        s->sa = sa;
+        s->da = da;
+        s->priority = priority;
+        s->pgn = d[5] + ((uint32_t)d[6] << 8) + ((uint32_t)d[7] << 16);
+        s->size = size;
+        s->packets = packets;
+        s->nextSeq = 1;
+        s->lastTime = millis();
+        break;
+    }
+    case TP_CM_ABORT: //can come from either end of the connection
+        s = findSession(bus, sa, da);
+        if (!s) s = findSession(bus, da, sa);
+        if (s) {
+            s->active = false;
+            aborted++;
+        }
+        break;
+    }
+}
+
+/*
+ * Data packets. With RTS/CTS the sender may repeat packets the receiver asked for again,
+ * so anything at or below the next expected sequence number is accepted and only a gap aborts.
+ */
+void J1939::handleTPDT(uint8_t bus, uint8_t sa, uint8_t da, uint8_t *d)
+{
+    J1939_SESSION *s = findSession(bus, sa, da);
+    if (!s) return;
+
+    uint8_t seq = d[0];
+    if (seq == 0 || seq > s->packets || seq > s->nextSeq) {
+        s->active = false;
+        aborted++;
+        return;
+    }
+
+    uint16_t offset = (seq - 1) * 7;
+    int take = s->size - offset;
+    if (take > 7) take = 7;
+    if (take > 0) memcpy(s->data + offset, d + 1, take);
+    if (seq == s->nextSeq) s->nextSeq++;
+    s->lastTime = millis();
+
+    if (s->nextSeq > s->packets) {
+        s->active = false;
+        completed++;
+        countPGN(bus, s->pgn);
+        emitPGN(bus, s->pgn, s->priority, sa, s->da, s->data, s->size);
+    }
+}
+
+void J1939::loop()
+{
+    if (mode == MODE_OFF) return;
+
+    uint32_t now = millis();
+    for (int i = 0; i < J1939_MAX_SESSIONS; i++) {
+        if (sessions[i].active && now - sessions[i].lastTime > J1939_TIMEOUT) {
+            sessions[i].active = false;
+            aborted++;
+        }
+    }
+}
+
+void J1939::countPGN(uint8_t bus, uint32_t pgn)
+{
+    uint32_t hash = (pgn ^ (pgn >> 8) ^ ((uint32_t)bus << 5)) % J1939_MAX_PGNS;
+    uint32_t now = millis();
+
+    for (int probe = 0; probe < J1939_MAX_PGNS; probe++) {
+        J1939_PGN_STATS *entry = &stats[hash];
+        if (!entry->used) {
+            entry->used = true;
+            entry->bus = bus;
+            entry->pgn = pgn;
+            entry->count = 1;
+            entry->lastTime = now;
+            entry->minInterval = 0xFFFFFFFF;
+            entry->maxInterval = 0;
+            entry->totalInterval = 0;
+            return;
+        }
+        if (entry->pgn == pgn && entry->bus == bus) {
+            uint32_t interval = now - entry->lastTime;
+            entry->lastTime = now;
+            entry->count++;
+            entry->totalInterval += interval;
+            if (interval < entry->minInterval) entry->minInterval = interval;
+            if (interval > entry->maxInterval) entry->maxInterval = interval;
+            return;
+        }
+        if (++hash == J1939_MAX_PGNS) hash = 0;
+    }
+    untracked++;
+}
+
+/*
+ * 0xF1, PROTO_J1939, REC_PGN, bus, time uS (4 bytes), PGN (3 bytes), priority, source address,
+ * destination address (0xFF for broadcast / PDU2), length (2 bytes), data bytes
+ */
+void J1939::emitPGN(uint8_t bus, uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da, uint8_t *data, uint16_t length)
+{
+    if (SysSettings.lawicelMode) return;
+
+    if (settings.useBinarySerialComm) {
+        uint8_t buff[16];
+        uint32_t now = micros();
+        buff[0] = 0xF1;
+        buff[1] = PROTO_J1939;
+        buff[2] = REC_PGN;
+        buff[3] = bus;
+        for (int i = 0; i < 4; i++) buff[4 + i] = (uint8_t)(now >> (i * 8));
+        buff[8] = (uint8_t)(pgn & 0xFF);
+        buff[9] = (uint8_t)(pgn >> 8);
+        buff[10] = (uint8_t)(pgn >> 16);
+        buff[11] = priority;
+        buff[12] = sa;
+        buff[13] = da;
+        buff[14] = (uint8_t)(length & 0xFF);
+        buff[15] = (uint8_t)(length >> 8);
+        bufferUSBBytes(buff, 16);
+        bufferUSBBytes(data, length);
+    } else {
+        SerialUSB.print(micros());
+        SerialUSB.print(" - PGN ");
+        SerialUSB.print(pgn, HEX);
+        SerialUSB.print(" SA ");
+        SerialUSB.print(sa, HEX);
+        SerialUSB.print(" DA ");
+        SerialUSB.print(da, HEX);
+        SerialUSB.print(" ");
+        SerialUSB.print(bus);
+        SerialUSB.print(" ");
+        SerialUSB.print(length);
+        for (int c = 0; c < length; c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(data[c], HEX);
+        }
+        SerialUSB.println();
+    }
+}
+
+void J1939::setMode(uint8_t newMode, uint8_t newBusMask)
+{
+    if (newMode > MODE_PGN) newMode = MODE_OFF;
+    mode = newMode;
+    busMask = newBusMask;
+    if (mode == MODE_OFF) {
+        for (int i = 0; i < J1939_MAX_SESSIONS; i++) sessions[i].active = false;
+    }
+}
+
+uint8_t J1939::getMode()
+{
+    return mode;
+}
+
+uint8_t J1939::getBusMask()
+{
+    return busMask;
+}
+
+void J1939::resetStats()
+{
+    for (int i = 0; i < J1939_MAX_PGNS; i++) stats[i].used = false;
+    completed = 0;
+    aborted = 0;
+    untracked = 0;
+}
+
+//number of data bytes that follow each sub command byte
+int J1939::commandLength(uint8_t cmd)
+{
+    if (cmd == CMD_SET_MODE) return 2;
+    return 0;
+}
+
+/*
+ * CMD_SET_MODE - mode (J1939_MODE), bus mask (bit 0 = bus 0 ...)
+ */
+void J1939::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_SET_MODE:
+        setMode(data[1], data[2]);
+        break;
+    case CMD_GET_STATS:
+        sendStats();
+        break;
+    case CMD_RESET_STATS:
+        resetStats();
+        break;
+    }
+}
+
+void J1939::printStats()
+{
+    Logger::console("J1939 mode %i, bus mask 0x%x, %i transfers completed, %i aborted, %i PGNs untracked", mode, busMask,
+                    completed, aborted, untracked);
+    for (int i = 0; i < J1939_MAX_PGNS; i++) {
+        J1939_PGN_STATS *entry = &stats[i];
+        if (!entry->used) continue;
+        if (entry->count < 2) {
+            Logger::console("Bus %i PGN 0x%x: 1 message", entry->bus, entry->pgn);
+            continue;
+        }
+        Logger::console("Bus %i PGN 0x%x: %i messages, interval avg %i min %i max %i ms", entry->bus, entry->pgn, entry->count,
+                        entry->totalInterval / (entry->count - 1), entry->minInterval, entry->maxInterval);
+    }
+}
+
+/*
+ * 0xF1, PROTO_J1939, CMD_GET_STATS, transfers completed (4 bytes), transfers aborted (4 bytes), number of PGNs (2 bytes)
+ * then per PGN: bus, PGN (3 bytes), count, average, min, max interval in ms (4 bytes each, intervals 0 until two messages seen)
+ */
+void J1939::sendStats()
+{
+    uint8_t buff[20];
+    uint16_t count = 0;
+
+    for (int i = 0; i < J1939_MAX_PGNS; i++) {
+        if (stats[i].used) count++;
+    }
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_J1939;
+    buff[2] = CMD_GET_STATS;
+    for (int i = 0; i < 4; i++) buff[3 + i] = (uint8_t)(completed >> (i * 8));
+    for (int i = 0; i < 4; i++) buff[7 + i] = (uint8_t)(aborted >> (i * 8));
+    buff[11] = (uint8_t)(count & 0xFF);
+    buff[12] = (uint8_t)(count >> 8);
+    bufferUSBBytes(buff, 13);
+
+    for (int i = 0; i < J1939_MAX_PGNS; i++) {
+        J1939_PGN_STATS *entry = &stats[i];
+        if (!entry->used) continue;
+        uint32_t vals[4] = {entry->count, 0, 0, 0};
+        if (entry->count > 1) {
+            vals[1] = entry->totalInterval / (entry->count - 1);
+            vals[2] = entry->minInterval;
+            vals[3] = entry->maxInterval;
+        }
+        buff[0] = entry->bus;
+        buff[1] = (uint8_t)(entry->pgn & 0xFF);
+        buff[2] = (uint8_t)(entry->pgn >> 8);
+        buff[3] = (uint8_t)(entry->pgn >> 16);
+        for (int v = 0; v < 4; v++) {
+            for (int b = 0; b < 4; b++) buff[4 + v * 4 + b] = (uint8_t)(vals[v] >> (b * 8));
+        }
+        bufferUSBBytes(buff, 20);
+    }
+}
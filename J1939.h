@@ -0,0 +1,110 @@
+/*
+ * J1939.h
+ *
+ * Optional SAE J1939 layer. Decodes PGN / source / destination from 29 bit IDs,
+ * reassembles TP.BAM and TP.CM/TP.DT (RTS/CTS) transfers by listening in, and keeps
+ * per PGN message rate statistics. Whole PGNs can be streamed to the host in place of raw frames.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef J1939_H_
+#define J1939_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct J1939_SESSION {
+    boolean active;
+    boolean bam; //broadcast, no CTS handshake
+    uint8_t bus;
+    uint8_t sa;
+    uint8_t da;
+    uint8_t priority;
+    uint32_t pgn;
+    uint16_t size;
+    uint8_t packets;
+    uint8_t nextSeq;
+    uint32_t lastTime; //millis() of the last TP frame
+    uint8_t data[J1939_MAX_LEN];
+};
+
+struct J1939_PGN_STATS {
+    boolean used;
+    uint8_t bus;
+    uint32_t pgn;
+    uint32_t count;
+    uint32_t lastTime; //millis()
+    uint32_t minInterval;
+    uint32_t maxInterval;
+    uint32_t totalInterval; //sum of intervals, for the average
+};
+
+class J1939
+{
+public:
+    enum J1939_MODE {
+        MODE_OFF = 0,
+        MODE_REASSEMBLE = 1, //raw frames still streamed, reassembled transfers added as PGN records
+        MODE_PGN = 2 //every J1939 message goes out as a PGN record, raw 29 bit frames are not streamed
+    };
+
+    enum J1939_CMD {
+        CMD_SET_MODE = 0,
+        CMD_GET_STATS = 1,
+        CMD_RESET_STATS = 2
+    };
+
+    enum J1939_RECORD { //sent to the host after 0xF1, PROTO_J1939
+        REC_PGN = 0x10
+    };
+
+    static boolean processFrame(CAN_FRAME &frame, int whichBus);
+    static void loop();
+    static void setMode(uint8_t newMode, uint8_t newBusMask);
+    static uint8_t getMode();
+    static uint8_t getBusMask();
+    static void resetStats();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void printStats();
+    static void sendStats();
+
+private:
+    static uint8_t mode;
+    static uint8_t busMask;
+    static J1939_SESSION sessions[J1939_MAX_SESSIONS];
+    static J1939_PGN_STATS stats[J1939_MAX_PGNS];
+    static uint32_t completed;
+    static uint32_t aborted;
+    static uint32_t untracked; //PGNs that didn't fit in the stats table
+
+    static J1939_SESSION *findSession(uint8_t bus, uint8_t sa, uint8_t da);
+    static void handleTPCM(uint8_t bus, uint8_t sa, uint8_t da, uint8_t priority, uint8_t *d);
+    static void handleTPDT(uint8_t bus, uint8_t sa, uint8_t da, uint8_t *d);
+    static void countPGN(uint8_t bus, uint32_t pgn);
+    static void emitPGN(uint8_t bus, uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da, uint8_t *data, uint16_t length);
+};
+
+#endif /* J1939_H_ */
@@ -0,0 +1,247 @@
+/*
+ * Latency.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Latency.h"
+#include "Buses.h"
+#include "Logger.h"
+
+LAT_STAGE Latency::stages[NUM_STAGES];
+volatile boolean Latency::enabled = false;
+uint32_t Latency::usbOldest;
+uint32_t Latency::sdOldest;
+uint8_t Latency::injectBus;
+uint16_t Latency::injectLeft;
+uint16_t Latency::injectInterval;
+uint32_t Latency::lastInject;
+
+static const char *stageNames[Latency::NUM_STAGES] = {"dequeue", "USB queue", "USB flush", "SD buffer", "SD write", "gateway TX"};
+
+void Latency::setup()
+{
+    injectLeft = 0;
+    reset();
+}
+
+void Latency::setEnabled(boolean en)
+{
+    usbOldest = 0;
+    sdOldest = 0;
+    enabled = en;
+}
+
+boolean Latency::isEnabled()
+{
+    return enabled;
+}
+
+//also called from the receive interrupt by the gateway fast path. These are diagnostics so a rare lost count there is accepted
+void Latency::record(uint8_t stage, uint32_t stamp)
+{
+    if (!enabled) return;
+
+    LAT_STAGE *st = &stages[stage];
+    uint32_t cycles = DWT->CYCCNT - stamp;
+    uint32_t us = cycles / CYCLES_PER_US;
+    int bin = us ? 32 - __builtin_clz(us) : 0;
+
+    if (bin >= LAT_HIST_BINS) bin = LAT_HIST_BINS - 1;
+    st->histogram[bin]++;
+    st->count++;
+    st->total += cycles;
+    if (cycles < st->min) st->min = cycles;
+    if (cycles > st->max) st->max = cycles;
+}
+
+/*
+ * The USB and SD buffers go out a batch at a time. Only the oldest frame of a batch is
+ * timed at the flush since it is the one that waited longest.
+ */
+void Latency::pendingUSB(uint32_t stamp)
+{
+    if (enabled && usbOldest == 0) usbOldest = stamp ? stamp : 1;
+}
+
+void Latency::flushedUSB()
+{
+    if (usbOldest == 0) return;
+    record(STAGE_USB_FLUSH, usbOldest);
+    usbOldest = 0;
+}
+
+void Latency::pendingSD(uint32_t stamp)
+{
+    if (enabled && sdOldest == 0) sdOldest = stamp ? stamp : 1;
+}
+
+void Latency::flushedSD()
+{
+    if (sdOldest == 0) return;
+    record(STAGE_SD_WRITE, sdOldest);
+    sdOldest = 0;
+}
+
+/*
+ * Feed synthetic frames into a bus's receive ring as if they had come off the wire, so every
+ * stage can be timed at a known rate without anything attached. They carry ID LAT_INJECT_ID
+ * and a running count in the first two bytes.
+ */
+void Latency::inject(uint8_t bus, uint16_t count, uint16_t interval)
+{
+    if (bus >= Buses::count()) return;
+    injectBus = bus;
+    injectInterval = interval;
+    lastInject = micros() - interval;
+    injectLeft = count;
+}
+
+void Latency::loop()
+{
+    CAN_FRAME frame;
+    int burst = 0;
+
+    //a slow pass through loop() may owe a few frames, but don't flood the ring trying to catch up
+    while (injectLeft > 0 && (micros() - lastInject) >= injectInterval && burst++ < 4) {
+        lastInject += injectInterval;
+        frame.id = LAT_INJECT_ID;
+        frame.extended = false;
+        frame.rtr = 0;
+        frame.length = 8;
+        frame.data.value = 0;
+        frame.data.bytes[0] = (uint8_t)(injectLeft & 0xFF);
+        frame.data.bytes[1] = (uint8_t)(injectLeft >> 8);
+        //the ring expects a single writer, normally the receive interrupt. With the fast path on pushRX()
+        //sends from here too, Buses::send() restores PRIMASK so interrupts stay off until the slot is written
+        noInterrupts();
+        Buses::pushRX(injectBus, frame);
+        interrupts();
+        injectLeft--;
+    }
+}
+
+//number of data bytes that follow each sub command byte
+int Latency::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_ENABLE:
+        return 1;
+    case CMD_INJECT:
+        return 5;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_ENABLE - 1 to start timing, 0 to stop
+ * CMD_INJECT - bus, frame count (2 bytes), interval in uS (2 bytes)
+ */
+void Latency::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_ENABLE:
+        setEnabled(data[1]);
+        break;
+    case CMD_RESET:
+        reset();
+        break;
+    case CMD_GET:
+        sendStats();
+        break;
+    case CMD_INJECT:
+        inject(data[1], data[2] + ((uint16_t)data[3] << 8), data[4] + ((uint16_t)data[5] << 8));
+        break;
+    }
+}
+
+void Latency::reset()
+{
+    noInterrupts();
+    for (int s = 0; s < NUM_STAGES; s++) {
+        stages[s].count = 0;
+        stages[s].min = 0xFFFFFFFF;
+        stages[s].max = 0;
+        stages[s].total = 0;
+        for (int i = 0; i < LAT_HIST_BINS; i++) stages[s].histogram[i] = 0;
+    }
+    interrupts();
+}
+
+/*
+ * 0xF1, PROTO_LATENCY, CMD_GET, CYCLES_PER_US, NUM_STAGES, LAT_HIST_BINS
+ * then per stage: count, min, max, average in cycles (4 bytes each), total in cycles (8 bytes)
+ * and LAT_HIST_BINS counts of 4 bytes
+ */
+void Latency::sendStats()
+{
+    uint8_t buff[(6 + LAT_HIST_BINS) * 4];
+    uint32_t vals[6 + LAT_HIST_BINS];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_LATENCY;
+    buff[2] = CMD_GET;
+    buff[3] = CYCLES_PER_US;
+    buff[4] = NUM_STAGES;
+    buff[5] = LAT_HIST_BINS;
+    SerialUSB.write(buff, 6);
+
+    for (int s = 0; s < NUM_STAGES; s++) {
+        LAT_STAGE *st = &stages[s];
+        vals[0] = st->count;
+        vals[1] = st->count ? st->min : 0;
+        vals[2] = st->max;
+        vals[3] = st->count ? (uint32_t)(st->total / st->count) : 0;
+        vals[4] = (uint32_t)(st->total & 0xFFFFFFFF);
+        vals[5] = (uint32_t)(st->total >> 32);
+        for (int i = 0; i < LAT_HIST_BINS; i++) vals[6 + i] = st->histogram[i];
+        for (int v = 0; v < 6 + LAT_HIST_BINS; v++) {
+            buff[v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[1 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[2 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        SerialUSB.write(buff, (6 + LAT_HIST_BINS) * 4);
+    }
+}
+
+void Latency::printStats()
+{
+    char buff[20 + LAT_HIST_BINS * 20]; //a bin is at most " 524288:4294967295"
+    int len;
+
+    Logger::console("Latency timing %s", enabled ? "on" : "off");
+    for (int s = 0; s < NUM_STAGES; s++) {
+        LAT_STAGE *st = &stages[s];
+        if (st->count == 0) continue;
+        uint32_t avg = (uint32_t)(st->total / st->count);
+        Logger::console("%s: %i frames, min %iuS max %iuS avg %iuS, jitter %iuS", stageNames[s], st->count,
+                        st->min / CYCLES_PER_US, st->max / CYCLES_PER_US, avg / CYCLES_PER_US, (st->max - st->min) / CYCLES_PER_US);
+        len = snprintf(buff, sizeof(buff), "    <1uS:%lu", (unsigned long)st->histogram[0]);
+        for (int i = 1; i < LAT_HIST_BINS && len < (int)sizeof(buff); i++) {
+            if (st->histogram[i]) len += snprintf(buff + len, sizeof(buff) - len, " %lu:%lu", 1ul << (i - 1), (unsigned long)st->histogram[i]);
+        }
+        Logger::console(buff);
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * Latency.h
+ *
+ * Per stage timing of the path a received frame takes through the firmware. Every stage is
+ * measured from the cycle count stamped in the receive interrupt, so each histogram shows the
+ * total age of a frame by the time it got that far. Off unless turned on, it costs one
+ * test per stage then.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct LAT_STAGE {
+    uint32_t count;
+    uint32_t min; //cycles
+    uint32_t max;
+    uint64_t total; //cycles. 32 bits would wrap after 51 seconds, a few hundred SD writes
+    uint32_t histogram[LAT_HIST_BINS]; //bucket n > 0 holds 2^(n-1) up to 2^n uS, bucket 0 anything under 1uS
+};
+
+class Latency
+{
+public:
+    enum LAT_CMD {
+        CMD_ENABLE = 0,
+        CMD_RESET = 1,
+        CMD_GET = 2,
+        CMD_INJECT = 3
+    };
+
+    enum LAT_STAGES {
+        STAGE_DEQUEUE = 0, //loop() took the frame out of the receive ring
+        STAGE_USB_QUEUE = 1, //frame is in the USB output buffer
+        STAGE_USB_FLUSH = 2, //buffer holding the frame was handed to SerialUSB
+        STAGE_SD_BUFFER = 3, //frame is in the SD card buffer
+        STAGE_SD_WRITE = 4, //buffer holding the frame was written and synced to the card
+        STAGE_GATEWAY_TX = 5, //gateway handed the frame to the other controller
+        NUM_STAGES = 6
+    };
+
+    static void setup();
+    static void loop();
+    static void setEnabled(boolean en);
+    static boolean isEnabled();
+    static void record(uint8_t stage, uint32_t stamp);
+    static void pendingUSB(uint32_t stamp);
+    static void flushedUSB();
+    static void pendingSD(uint32_t stamp);
+    static void flushedSD();
+    static void inject(uint8_t bus, uint16_t count, uint16_t interval);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void reset();
+    static void sendStats();
+    static void printStats();
+
+private:
+    static LAT_STAGE stages[NUM_STAGES];
+    static volatile boolean enabled;
+    //stamp of the oldest frame waiting in the USB and SD buffers, 0 when nothing is waiting
+    static uint32_t usbOldest;
+    static uint32_t sdOldest;
+    static uint8_t injectBus;
+    static uint16_t injectLeft;
+    static uint16_t injectInterval; //uS
+    static uint32_t lastInject;
+};
+
+#endif /* LATENCY_H_ */
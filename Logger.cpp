@@ -27,6 +27,8 @@
 #include "Logger.h"
 #include "config.h"
 #include "sys_io.h"
+#include "Latency.h"
+#include "Buses.h"
 // #include <due_wire.h>
 #include <Wire.h>
 // #include <Wire_EEPROM.h>
@@ -38,6 +40,7 @@ Logger::LogLevel Logger::logLevel = Logger::Info;
 uint32_t Logger::lastLogTime = 0;
 uint16_t Logger::fileBuffWritePtr = 0;
 SdFile Logger::fileRef; //file we're logging to
+Print *Logger::fileSink = NULL;
 uint8_t Logger::filebuffer[BUF_SIZE]; //size of buffer for file output
 uint32_t Logger::lastWriteTime = 0;
 
@@ -132,13 +135,17 @@ void Logger::flushFileBuff()
 {
     Logger::debug("Write to SD Card %i bytes", fileBuffWritePtr);
     lastWriteTime = millis();
-    if (fileRef.write(filebuffer, fileBuffWritePtr) != fileBuffWritePtr) {
+    Buses::lockSPI();
+    boolean written = (fileRef.write(filebuffer, fileBuffWritePtr) == fileBuffWritePtr);
+    if (written) fileRef.sync(); //needed in order to update the file if you aren't closing it ever
+    Buses::unlockSPI();
+    if (!written) {
         Logger::error("Write to SDCard failed!");
         SysSettings.useSD = false; //borked so stop trying.
         fileBuffWritePtr = 0;
         return;
     }
-    fileRef.sync(); //needed in order to update the file if you aren't closing it ever
+    Latency::flushedSD();
     SysSettings.logToggle = !SysSettings.logToggle;
     setLED(SysSettings.LED_LOGGING, SysSettings.logToggle);
     fileBuffWritePtr = 0;
@@ -153,14 +160,18 @@ boolean Logger::setupFile()
             filename = String(settings.fileNameBase);
             filename.concat(".");
             filename.concat(settings.fileNameExt);
+            Buses::lockSPI();
             fileRef.open(filename.c_str(), O_APPEND | O_WRITE);
+            Buses::unlockSPI();
         } else {
             filename = String(settings.fileNameBase);
             filename.concat(settings.fileNum++);
             filename.concat(".");
             filename.concat(settings.fileNameExt);
             EEPROM.write(EEPROM_PAGE, settings); //save settings to save updated filenum
+            Buses::lockSPI();
             fileRef.open(filename.c_str(), O_CREAT | O_TRUNC | O_WRITE);
+            Buses::unlockSPI();
         }
         if (!fileRef.isOpen()) {
             Logger::error("open failed");
@@ -282,15 +293,36 @@ void Logger::file(const char *message, ...)
 
 void Logger::fileRaw(uint8_t* buff, int sz)
 {
+    if (fileSink) {
+        fileSink->write(buff, sz);
+        return;
+    }
     if (!SysSettings.SDCardInserted) return; // not possible to log without card
 
     if (!setupFile()) return;
 
-    for (int i; i < sz; i++) {
-        buffPutChar(*buff++);
+    //keep a record in one write where it fits, anything bigger than the buffer goes in pieces
+    if (fileBuffWritePtr + sz > BUF_SIZE) flushFileBuff();
+    while (sz > 0) {
+        int n = BUF_SIZE - fileBuffWritePtr;
+        if (n > sz) n = sz;
+        memcpy(filebuffer + fileBuffWritePtr, buff, n);
+        fileBuffWritePtr += n;
+        buff += n;
+        sz -= n;
+        if (fileBuffWritePtr == BUF_SIZE) flushFileBuff();
     }
 }
 
+/*
+ * Send fileRaw output somewhere other than the card, NULL to go back to the card.
+ * Nothing is opened or written on the card while a sink is set.
+ */
+void Logger::setFileSink(Print *sink)
+{
+    fileSink = sink;
+}
+
 /*
  * Set the log level. Any output below the specified log level will be omitted.
  */
@@ -45,6 +45,7 @@ public:
     static void console(const char *, ...);
     static void file(const char *, ...);
     static void fileRaw(uint8_t*, int);
+    static void setFileSink(Print *sink);
     static void setLoglevel(LogLevel);
     static LogLevel getLogLevel();
     static uint32_t getLastLogTime();
@@ -58,6 +59,7 @@ private:
     static uint8_t filebuffer[BUF_SIZE]; //size of buffer for file output
     static uint16_t fileBuffWritePtr;
     static uint32_t lastWriteTime;
+    static Print *fileSink; //takes fileRaw output in place of the card when set
 
     static void log(LogLevel, const char *format, va_list);
     static void logMessage(const char *format, va_list args);
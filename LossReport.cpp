@@ -0,0 +1,148 @@
+/*
+ * LossReport.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "LossReport.h"
+#include "Buses.h"
+#include "Logger.h"
+
+boolean LossReport::enabled = false;
+uint32_t LossReport::reported[NUM_BUSES][NUM_STAGES];
+uint32_t LossReport::usbLostFrames = 0;
+uint32_t LossReport::usbReported = 0;
+uint32_t LossReport::totals[NUM_STAGES];
+
+void LossReport::setup()
+{
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        for (int s = 0; s < NUM_STAGES; s++) reported[bus][s] = 0;
+    }
+    for (int s = 0; s < NUM_STAGES; s++) totals[s] = 0;
+}
+
+//losses from before the host asked for reports go into the totals but not into the stream
+void LossReport::setEnabled(boolean en)
+{
+    enabled = false;
+    for (int bus = 0; bus < Buses::count(); bus++) check(bus);
+    enabled = en;
+}
+
+boolean LossReport::isEnabled()
+{
+    return enabled;
+}
+
+//called from flushUSBBuffer() with the number of frame records in a write that came up short
+void LossReport::usbLost(uint32_t frames)
+{
+    usbLostFrames += frames;
+}
+
+/*
+ * 0xF1, PROTO_LOSS, stage, bus (0xFF if it can't be told), frames lost (4 bytes)
+ * Goes into the USB buffer so it lands in order with the frame records around it
+ */
+void LossReport::sendMarker(uint8_t stage, uint8_t bus, uint32_t count)
+{
+    uint8_t buff[8];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_LOSS;
+    buff[2] = stage;
+    buff[3] = bus;
+    buff[4] = (uint8_t)(count & 0xFF);
+    buff[5] = (uint8_t)(count >> 8);
+    buff[6] = (uint8_t)(count >> 16);
+    buff[7] = (uint8_t)(count >> 24);
+    bufferUSBBytes(buff, 8);
+}
+
+//the bus counters can be cleared under us, in which case there's nothing new to report
+void LossReport::catchUp(uint8_t stage, uint8_t bus, uint32_t now, uint32_t &seen)
+{
+    if (now > seen) {
+        totals[stage] += now - seen;
+        if (enabled && settings.useBinarySerialComm) sendMarker(stage, bus, now - seen);
+    }
+    seen = now;
+}
+
+//called by loop() before it empties a bus ring so the loss record comes before the frames after the gap
+void LossReport::check(int bus)
+{
+    BUS_STATS *stats = Buses::getStats(bus);
+
+    catchUp(STAGE_CONTROLLER, bus, stats->hwOverrun, reported[bus][STAGE_CONTROLLER]);
+    catchUp(STAGE_RX_RING, bus, stats->rxOverflow, reported[bus][STAGE_RX_RING]);
+    if (bus == 0) catchUp(STAGE_USB, 0xFF, usbLostFrames, usbReported);
+}
+
+int LossReport::commandLength(uint8_t cmd)
+{
+    if (cmd == CMD_ENABLE) return 1;
+    return 0;
+}
+
+/*
+ * data[0] is the sub command
+ * CMD_ENABLE - 1 to turn on sequence bytes and loss records, 0 to turn them off
+ * CMD_GET - reply 0xF1, PROTO_LOSS, CMD_GET | 0x80, enabled, then frames lost at each stage
+ *           since power up (4 bytes each)
+ */
+void LossReport::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_ENABLE:
+        setEnabled(data[1]);
+        break;
+    case CMD_GET:
+        sendTotals();
+        break;
+    }
+}
+
+void LossReport::sendTotals()
+{
+    uint8_t buff[4 + NUM_STAGES * 4];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_LOSS;
+    buff[2] = CMD_GET | 0x80; //loss records start with a stage number, this keeps the reply apart from them
+    buff[3] = enabled;
+    for (int s = 0; s < NUM_STAGES; s++) {
+        buff[4 + s * 4] = (uint8_t)(totals[s] & 0xFF);
+        buff[5 + s * 4] = (uint8_t)(totals[s] >> 8);
+        buff[6 + s * 4] = (uint8_t)(totals[s] >> 16);
+        buff[7 + s * 4] = (uint8_t)(totals[s] >> 24);
+    }
+    bufferUSBBytes(buff, sizeof(buff));
+}
+
+void LossReport::printStats()
+{
+    Logger::console("Loss reports %s. Frames lost in the controller: %i, receive ring: %i, USB: %i",
+                    enabled ? "on" : "off", totals[STAGE_CONTROLLER], totals[STAGE_RX_RING], totals[STAGE_USB]);
+}
@@ -0,0 +1,75 @@
+/*
+ * LossReport.h
+ *
+ * Makes the binary capture stream say how complete it is. While on, every binary frame record
+ * carries the low byte of its bus's receive sequence number in the otherwise unused checksum
+ * byte, and a loss record goes out in line with the frames whenever frames were dropped
+ * somewhere between the controller and the host.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef LOSSREPORT_H_
+#define LOSSREPORT_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+class LossReport
+{
+public:
+    enum LOSS_STAGE {
+        STAGE_CONTROLLER = 0, //controller overran before its interrupt was serviced
+        STAGE_RX_RING = 1, //receive ring full, loop() fell behind
+        STAGE_USB = 2, //USB write came up short, the host wasn't taking data
+        NUM_STAGES = 3
+    };
+
+    enum LOSS_CMD {
+        CMD_ENABLE = 0,
+        CMD_GET = 1
+    };
+
+    static void setup();
+    static void setEnabled(boolean en);
+    static boolean isEnabled();
+    static void check(int bus);
+    static void usbLost(uint32_t frames);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void sendTotals();
+    static void printStats();
+
+private:
+    static boolean enabled;
+    static uint32_t reported[NUM_BUSES][NUM_STAGES]; //counter values already covered by loss records
+    static uint32_t usbLostFrames;
+    static uint32_t usbReported;
+    static uint32_t totals[NUM_STAGES];
+
+    static void sendMarker(uint8_t stage, uint8_t bus, uint32_t count);
+    static void catchUp(uint8_t stage, uint8_t bus, uint32_t now, uint32_t &seen);
+};
+
+#endif /* LOSSREPORT_H_ */
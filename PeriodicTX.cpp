@@ -0,0 +1,297 @@
+/*
+ * PeriodicTX.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "PeriodicTX.h"
+#include "Buses.h"
+
+PERIODIC_ENTRY PeriodicTX::entries[PERIODIC_MAX_ENTRIES];
+
+//The timer runs from MCK/2 so there are 42 timer ticks per microsecond
+#define PERIODIC_TICKS_PER_US	(VARIANT_MCK / 2000000)
+
+void PERIODIC_TIMER_HANDLER()
+{
+    TC_GetStatus(PERIODIC_TIMER, PERIODIC_TIMER_CH); //reading the status register clears the interrupt
+    PeriodicTX::timerTick();
+}
+
+void PeriodicTX::setup()
+{
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) entries[i].active = false;
+
+    pmc_set_writeprotect(false);
+    pmc_enable_periph_clk(PERIODIC_TIMER_ID);
+    TC_Configure(PERIODIC_TIMER, PERIODIC_TIMER_CH, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1);
+    PERIODIC_TIMER->TC_CHANNEL[PERIODIC_TIMER_CH].TC_IER = TC_IER_CPCS;
+    PERIODIC_TIMER->TC_CHANNEL[PERIODIC_TIMER_CH].TC_IDR = ~TC_IER_CPCS;
+    //CAN interrupts must be able to preempt us or the RX mailboxes could overflow while we send
+    NVIC_SetPriority(PERIODIC_TIMER_IRQ, 14);
+    NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+}
+
+//number of data bytes that follow each sub command byte
+int PeriodicTX::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_SET_ENTRY:
+        return 25;
+    case CMD_REMOVE_ENTRY:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * data[0] is the sub command, the rest is the payload as sized by commandLength()
+ * CMD_SET_ENTRY - slot, bus, ID (4 bytes, bit 31 = extended), length, 8 data bytes,
+ *                 period in uS (4 bytes), phase in uS (4 bytes), counter config, checksum config.
+ *                 Period and phase are at most PERIODIC_MAX_PERIOD
+ * CMD_REMOVE_ENTRY - slot
+ */
+void PeriodicTX::handleCommand(uint8_t *data)
+{
+    CAN_FRAME frame;
+    uint32_t id, period, phase;
+
+    switch (data[0]) {
+    case CMD_SET_ENTRY:
+        id = data[3] + ((uint32_t)data[4] << 8) + ((uint32_t)data[5] << 16) + ((uint32_t)data[6] << 24);
+        frame.extended = (id & (1ul << 31)) ? true : false;
+        frame.id = id & 0x7FFFFFFF;
+        frame.length = data[7];
+        if (frame.length > 8) frame.length = 8;
+        frame.rtr = 0;
+        for (int c = 0; c < 8; c++) frame.data.bytes[c] = data[8 + c];
+        period = data[16] + ((uint32_t)data[17] << 8) + ((uint32_t)data[18] << 16) + ((uint32_t)data[19] << 24);
+        phase = data[20] + ((uint32_t)data[21] << 8) + ((uint32_t)data[22] << 16) + ((uint32_t)data[23] << 24);
+        setEntry(data[1], data[2], frame, period, phase, data[24], data[25]);
+        break;
+    case CMD_REMOVE_ENTRY:
+        removeEntry(data[1]);
+        break;
+    case CMD_CLEAR:
+        clear();
+        break;
+    case CMD_GET_STATS:
+        sendStats();
+        break;
+    case CMD_RESET_STATS:
+        resetStats();
+        break;
+    }
+}
+
+boolean PeriodicTX::setEntry(uint8_t slot, uint8_t bus, CAN_FRAME &frame, uint32_t period, uint32_t phase,
+                             uint8_t counterCfg, uint8_t checksumCfg)
+{
+    if (slot >= PERIODIC_MAX_ENTRIES) return false;
+    if (period < PERIODIC_MIN_PERIOD || period > PERIODIC_MAX_PERIOD) return false;
+    if (phase > PERIODIC_MAX_PERIOD) return false;
+    if (!Buses::isNative(bus)) return false; //frames go out from the timer interrupt, which can't take the SPI lock
+
+    NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+    PERIODIC_ENTRY *entry = &entries[slot];
+    entry->bus = bus;
+    entry->frame = frame;
+    entry->period = period;
+    entry->counterCfg = counterCfg;
+    entry->checksumCfg = checksumCfg;
+    entry->sentCount = 0;
+    entry->failCount = 0;
+    entry->lateTotal = 0;
+    entry->lateMin = 0xFFFF;
+    entry->lateMax = 0;
+    uint32_t now = micros();
+    entry->nextDue = now + phase;
+    entry->active = true;
+    schedule(now);
+    NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+    return true;
+}
+
+void PeriodicTX::removeEntry(uint8_t slot)
+{
+    if (slot >= PERIODIC_MAX_ENTRIES) return;
+    NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+    entries[slot].active = false;
+    schedule(micros());
+    NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+}
+
+void PeriodicTX::clear()
+{
+    NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) entries[i].active = false;
+    schedule(micros());
+    NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+}
+
+void PeriodicTX::resetStats()
+{
+    NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        entries[i].sentCount = 0;
+        entries[i].failCount = 0;
+        entries[i].lateTotal = 0;
+        entries[i].lateMin = 0xFFFF;
+        entries[i].lateMax = 0;
+    }
+    NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+}
+
+/*
+ * 0xF1, PROTO_PERIODIC_TX, CMD_GET_STATS, number of active entries
+ * then per entry: slot, sent count (4 bytes), failed count (4 bytes),
+ * min / max / average lateness in uS (2 bytes each)
+ */
+void PeriodicTX::sendStats()
+{
+    uint8_t buff[20];
+    uint8_t count = 0;
+
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) if (entries[i].active) count++;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_PERIODIC_TX;
+    buff[2] = CMD_GET_STATS;
+    buff[3] = count;
+    SerialUSB.write(buff, 4);
+
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        if (!entries[i].active) continue;
+
+        NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+        PERIODIC_ENTRY entry = entries[i];
+        NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+
+        uint16_t avg = entry.sentCount ? entry.lateTotal / entry.sentCount : 0;
+        if (entry.sentCount == 0) entry.lateMin = 0;
+        buff[0] = i;
+        buff[1] = (uint8_t)(entry.sentCount & 0xFF);
+        buff[2] = (uint8_t)(entry.sentCount >> 8);
+        buff[3] = (uint8_t)(entry.sentCount >> 16);
+        buff[4] = (uint8_t)(entry.sentCount >> 24);
+        buff[5] = (uint8_t)(entry.failCount & 0xFF);
+        buff[6] = (uint8_t)(entry.failCount >> 8);
+        buff[7] = (uint8_t)(entry.failCount >> 16);
+        buff[8] = (uint8_t)(entry.failCount >> 24);
+        buff[9] = (uint8_t)(entry.lateMin & 0xFF);
+        buff[10] = (uint8_t)(entry.lateMin >> 8);
+        buff[11] = (uint8_t)(entry.lateMax & 0xFF);
+        buff[12] = (uint8_t)(entry.lateMax >> 8);
+        buff[13] = (uint8_t)(avg & 0xFF);
+        buff[14] = (uint8_t)(avg >> 8);
+        SerialUSB.write(buff, 15);
+    }
+}
+
+void PeriodicTX::updateAutoBytes(PERIODIC_ENTRY *entry)
+{
+    uint8_t *bytes = entry->frame.data.bytes;
+    int idx;
+
+    if (entry->counterCfg != 0xFF) {
+        idx = entry->counterCfg & 7;
+        switch ((entry->counterCfg >> 4) & 3) {
+        case 0:
+            bytes[idx]++;
+            break;
+        case 1:
+            bytes[idx] = (bytes[idx] & 0xF0) | ((bytes[idx] + 1) & 0x0F);
+            break;
+        case 2:
+            bytes[idx] = (bytes[idx] & 0x0F) | ((bytes[idx] + 0x10) & 0xF0);
+            break;
+        }
+    }
+
+    if (entry->checksumCfg != 0xFF) {
+        idx = entry->checksumCfg & 7;
+        uint8_t sum = 0;
+        for (int c = 0; c < entry->frame.length; c++) {
+            if (c == idx) continue;
+            if ((entry->checksumCfg >> 4) & 3) sum += bytes[c];
+            else sum ^= bytes[c];
+        }
+        bytes[idx] = sum;
+    }
+}
+
+/*
+ * Program the timer for whichever entry is due next. The timer resets on RC compare so
+ * the new RC value counts from right now. A deadline further off than PERIODIC_MAX_WAIT
+ * gets an early tick that sends nothing and programs the timer again.
+ */
+void PeriodicTX::schedule(uint32_t now)
+{
+    boolean found = false;
+    int32_t soonest = 0x7FFFFFFF;
+
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        if (!entries[i].active) continue;
+        int32_t delta = (int32_t)(entries[i].nextDue - now);
+        if (delta < soonest) soonest = delta;
+        found = true;
+    }
+
+    if (!found) {
+        TC_Stop(PERIODIC_TIMER, PERIODIC_TIMER_CH);
+        return;
+    }
+
+    if (soonest < 2) soonest = 2; //never ask for a compare we've already passed
+    if (soonest > PERIODIC_MAX_WAIT) soonest = PERIODIC_MAX_WAIT; //RC is 32 bits of 42 ticks per uS
+    TC_SetRC(PERIODIC_TIMER, PERIODIC_TIMER_CH, soonest * PERIODIC_TICKS_PER_US);
+    TC_Start(PERIODIC_TIMER, PERIODIC_TIMER_CH);
+}
+
+void PeriodicTX::timerTick()
+{
+    uint32_t now = micros();
+
+    for (int i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        PERIODIC_ENTRY *entry = &entries[i];
+        if (!entry->active) continue;
+        int32_t late = (int32_t)(now - entry->nextDue);
+        if (late < 0) continue;
+
+        updateAutoBytes(entry);
+        //may have interrupted loop() sending on the same controller, Buses::send() keeps the mailbox hand over atomic
+        if (Buses::send(entry->frame, entry->bus)) {
+            entry->sentCount++;
+            if (late > 0xFFFF) late = 0xFFFF;
+            entry->lateTotal += late;
+            if (late < entry->lateMin) entry->lateMin = late;
+            if (late > entry->lateMax) entry->lateMax = late;
+        } else entry->failCount++;
+
+        entry->nextDue += entry->period;
+        //if we've fallen more than a whole period behind then skip ahead instead of bursting to catch up
+        if ((int32_t)(now - entry->nextDue) >= 0) entry->nextDue = now + entry->period;
+    }
+
+    schedule(micros());
+}
@@ -0,0 +1,87 @@
+/*
+ * PeriodicTX.h
+ *
+ * On device table of cyclic frames. A hardware timer is always programmed for the next
+ * deadline in the table so frames go out on time no matter what loop() is doing.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PERIODICTX_H_
+#define PERIODICTX_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct PERIODIC_ENTRY {
+    boolean active;
+    uint8_t bus;
+    CAN_FRAME frame;
+    uint32_t period; //microseconds
+    uint32_t nextDue; //micros() value this entry should next go out at
+    /* Auto updated bytes. 0xFF = not used. Otherwise:
+     * Bits 0-2 - payload byte to update
+     * Bits 4-5 - counter: 0 = whole byte, 1 = low nibble, 2 = high nibble
+     *            checksum: 0 = XOR of the other payload bytes, 1 = 8 bit sum of the other payload bytes
+     */
+    uint8_t counterCfg;
+    uint8_t checksumCfg;
+    //timing statistics. Lateness is measured from the scheduled time to the moment the frame was handed to the controller
+    uint32_t sentCount;
+    uint32_t failCount;
+    uint32_t lateTotal;
+    uint16_t lateMin;
+    uint16_t lateMax;
+};
+
+class PeriodicTX
+{
+public:
+    enum PERIODIC_CMD {
+        CMD_SET_ENTRY = 0,
+        CMD_REMOVE_ENTRY = 1,
+        CMD_CLEAR = 2,
+        CMD_GET_STATS = 3,
+        CMD_RESET_STATS = 4
+    };
+
+    static void setup();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static boolean setEntry(uint8_t slot, uint8_t bus, CAN_FRAME &frame, uint32_t period, uint32_t phase,
+                            uint8_t counterCfg, uint8_t checksumCfg);
+    static void removeEntry(uint8_t slot);
+    static void clear();
+    static void resetStats();
+    static void sendStats();
+    static void timerTick(); //only to be called from the timer interrupt
+
+private:
+    static PERIODIC_ENTRY entries[PERIODIC_MAX_ENTRIES];
+
+    static void updateAutoBytes(PERIODIC_ENTRY *entry);
+    static void schedule(uint32_t now);
+};
+
+#endif /* PERIODICTX_H_ */
@@ -0,0 +1,125 @@
+/*
+ * Profiler.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Profiler.h"
+#include "Logger.h"
+
+PROFILE_ENTRY Profiler::entries[NUM_PROBES];
+
+static const char *probeNames[Profiler::NUM_PROBES] = {"loop", "CAN RX", "modules", "dig toggle", "USB flush", "commands", "logger"};
+
+void Profiler::record(uint8_t probe, uint32_t cycles)
+{
+    PROFILE_ENTRY *e = &entries[probe];
+    uint32_t us = cycles / CYCLES_PER_US;
+    int bin = us ? 32 - __builtin_clz(us) : 0;
+
+    if (bin >= PROF_HIST_BINS) bin = PROF_HIST_BINS - 1;
+    e->histogram[bin]++;
+    e->count++;
+    e->total += cycles;
+    if (cycles > e->max) e->max = cycles;
+}
+
+void Profiler::reset()
+{
+    memset(entries, 0, sizeof(entries));
+}
+
+//number of data bytes that follow each sub command byte
+int Profiler::commandLength(uint8_t cmd)
+{
+    return 0;
+}
+
+void Profiler::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_GET:
+        sendStats();
+        break;
+    case CMD_RESET:
+        reset();
+        break;
+    }
+}
+
+/*
+ * 0xF1, PROTO_PROFILE, CMD_GET, CYCLES_PER_US, NUM_PROBES, PROF_HIST_BINS
+ * then per probe: count, max and average in cycles, total in cycles (8 bytes)
+ * and PROF_HIST_BINS counts of 4 bytes
+ */
+void Profiler::sendStats()
+{
+    uint8_t buff[(5 + PROF_HIST_BINS) * 4];
+    uint32_t vals[5 + PROF_HIST_BINS];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_PROFILE;
+    buff[2] = CMD_GET;
+    buff[3] = CYCLES_PER_US;
+    buff[4] = NUM_PROBES;
+    buff[5] = PROF_HIST_BINS;
+    SerialUSB.write(buff, 6);
+
+    for (int p = 0; p < NUM_PROBES; p++) {
+        PROFILE_ENTRY e = entries[p];
+        vals[0] = e.count;
+        vals[1] = e.max;
+        vals[2] = e.count ? (uint32_t)(e.total / e.count) : 0;
+        vals[3] = (uint32_t)(e.total & 0xFFFFFFFF);
+        vals[4] = (uint32_t)(e.total >> 32);
+        for (int i = 0; i < PROF_HIST_BINS; i++) vals[5 + i] = e.histogram[i];
+        for (int v = 0; v < 5 + PROF_HIST_BINS; v++) {
+            buff[v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[1 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[2 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        SerialUSB.write(buff, (5 + PROF_HIST_BINS) * 4);
+    }
+}
+
+void Profiler::printStats()
+{
+    char buff[20 + PROF_HIST_BINS * 20]; //a bin is at most " 16384:4294967295"
+    int len;
+    uint64_t loopTotal = entries[PROBE_LOOP].total;
+
+    for (int p = 0; p < NUM_PROBES; p++) {
+        PROFILE_ENTRY e = entries[p];
+        if (e.count == 0) continue;
+        uint32_t avg = (uint32_t)(e.total / e.count);
+        uint32_t share = loopTotal ? (uint32_t)(e.total * 1000 / loopTotal) : 0; //tenths of a percent of loop()
+        Logger::console("%s: %i runs, avg %iuS max %iuS, %i.%i%% of loop time", probeNames[p], e.count,
+                        avg / CYCLES_PER_US, e.max / CYCLES_PER_US, share / 10, share % 10);
+        len = snprintf(buff, sizeof(buff), "    <1uS:%lu", (unsigned long)e.histogram[0]);
+        for (int i = 1; i < PROF_HIST_BINS && len < (int)sizeof(buff); i++) {
+            if (e.histogram[i]) len += snprintf(buff + len, sizeof(buff) - len, " %lu:%lu", 1ul << (i - 1), (unsigned long)e.histogram[i]);
+        }
+        Logger::console(buff);
+    }
+}
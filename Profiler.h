@@ -0,0 +1,116 @@
+/*
+ * Profiler.h
+ *
+ * Where the time in loop() goes. A ProfileProbe takes the cycle count when it is made and
+ * adds the elapsed cycles to its entry in the probe table when it ends or goes out of scope.
+ * Recording is a handful of instructions so the probes are always on.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+#ifdef DWT
+#define PROFILE_NOW()	(DWT->CYCCNT)
+#else
+#define PROFILE_NOW()	(micros() * CYCLES_PER_US) //no cycle counter, fall back to the microsecond clock
+#endif
+
+struct PROFILE_ENTRY {
+    uint32_t count;
+    uint64_t total; //cycles. 32 bits would wrap in under a minute for the whole loop
+    uint32_t max;
+    uint32_t histogram[PROF_HIST_BINS]; //bucket n > 0 holds 2^(n-1) up to 2^n uS, bucket 0 anything under 1uS
+};
+
+class Profiler
+{
+public:
+    enum PROF_CMD {
+        CMD_GET = 0,
+        CMD_RESET = 1
+    };
+
+    enum PROF_PROBES {
+        PROBE_LOOP = 0, //one whole pass of loop()
+        PROBE_CAN_RX = 1, //draining the receive rings and handing frames out
+        PROBE_MODULES = 2, //the loop() of every module
+        PROBE_DIG_TOGGLE = 3, //digital toggle input debouncing
+        PROBE_USB_FLUSH = 4,
+        PROBE_COMMANDS = 5, //reading and parsing up to 128 bytes from the host
+        PROBE_LOGGER = 6, //Logger::loop(), mostly SD card writes
+        NUM_PROBES = 7
+    };
+
+    static void record(uint8_t probe, uint32_t cycles);
+    static void reset();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void sendStats();
+    static void printStats();
+
+private:
+    static PROFILE_ENTRY entries[NUM_PROBES];
+};
+
+class ProfileProbe
+{
+public:
+    ProfileProbe(uint8_t probe)
+    {
+        this->probe = probe;
+        start = PROFILE_NOW();
+    }
+
+    ~ProfileProbe()
+    {
+        end();
+    }
+
+    void end()
+    {
+        if (probe == 0xFF) return;
+        Profiler::record(probe, PROFILE_NOW() - start);
+        probe = 0xFF;
+    }
+
+    //end this stage and start timing the next one
+    void next(uint8_t newProbe)
+    {
+        uint32_t now = PROFILE_NOW();
+        if (probe != 0xFF) Profiler::record(probe, now - start);
+        probe = newProbe;
+        start = now;
+    }
+
+private:
+    uint8_t probe;
+    uint32_t start;
+};
+
+#endif /* PROFILER_H_ */
@@ -0,0 +1,513 @@
+/*
+ * Replay.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Replay.h"
+#include "Logger.h"
+#include "Buses.h"
+
+SdFile Replay::file;
+FILEOUTPUTTYPE Replay::fileType = BINARYFILE;
+boolean Replay::active = false;
+boolean Replay::eof = false;
+boolean Replay::looping = false;
+boolean Replay::passHadFrame = false;
+uint16_t Replay::speed = 100;
+
+uint8_t Replay::readBuff[REPLAY_READ_BUFF];
+uint16_t Replay::readPos = 0;
+uint16_t Replay::readLen = 0;
+char Replay::lineBuff[REPLAY_LINE_LEN];
+uint8_t Replay::linePos = 0;
+
+REPLAY_FRAME Replay::queue[REPLAY_QUEUE_LEN];
+uint8_t Replay::queueHead = 0;
+uint8_t Replay::queueCount = 0;
+
+uint64_t Replay::fileTime = 0;
+uint32_t Replay::lastRawTime = 0;
+boolean Replay::haveRawTime = false;
+uint32_t Replay::startMicros = 0;
+
+REPLAY_REMAP Replay::remaps[REPLAY_MAX_REMAP];
+uint8_t Replay::numRemaps = 0;
+uint8_t Replay::busMap[NUM_BUSES]; //output bus + 1, 0 = play on the bus it was recorded on
+
+uint32_t Replay::framesSent = 0;
+uint32_t Replay::framesDropped = 0;
+uint32_t Replay::lateMax = 0;
+uint32_t Replay::histogram[REPLAY_HIST_BUCKETS];
+
+//upper bound (uS) of each lateness bucket. The last bucket catches everything else
+static const uint32_t histLimits[REPLAY_HIST_BUCKETS - 1] = {10, 50, 100, 500, 1000, 5000, 10000};
+
+boolean Replay::start(const char *filename, FILEOUTPUTTYPE type)
+{
+    if (active) stop();
+    if (!SysSettings.SDCardInserted) {
+        Logger::error("No SD card, can't replay");
+        return false;
+    }
+    if (type == NONE) type = settings.fileOutputType;
+    if (type == NONE) type = BINARYFILE;
+
+    Buses::lockSPI();
+    boolean opened = file.open(filename, O_READ);
+    Buses::unlockSPI();
+    if (!opened) {
+        Logger::error("Could not open %s for replay", filename);
+        return false;
+    }
+
+    fileType = type;
+    readPos = readLen = 0;
+    linePos = 0;
+    queueHead = queueCount = 0;
+    fileTime = 0;
+    haveRawTime = false;
+    framesSent = 0;
+    framesDropped = 0;
+    lateMax = 0;
+    for (int i = 0; i < REPLAY_HIST_BUCKETS; i++) histogram[i] = 0;
+    eof = false;
+    passHadFrame = false;
+    active = true;
+    refill(); //prime the queue before taking the start time so the first frame isn't late from card latency
+    startMicros = micros();
+    return true;
+}
+
+void Replay::stop()
+{
+    if (file.isOpen()) {
+        Buses::lockSPI();
+        file.close();
+        Buses::unlockSPI();
+    }
+    active = false;
+}
+
+boolean Replay::isActive()
+{
+    return active;
+}
+
+void Replay::setSpeed(uint16_t percent)
+{
+    if (percent == 0) percent = 100;
+    if (percent > 10000) percent = 10000;
+    speed = percent;
+}
+
+uint16_t Replay::getSpeed()
+{
+    return speed;
+}
+
+void Replay::setLooping(boolean en)
+{
+    looping = en;
+}
+
+boolean Replay::getLooping()
+{
+    return looping;
+}
+
+boolean Replay::addRemap(uint32_t fromID, uint32_t toID)
+{
+    for (int i = 0; i < numRemaps; i++) {
+        if (remaps[i].fromID == fromID) {
+            remaps[i].toID = toID;
+            return true;
+        }
+    }
+    if (numRemaps >= REPLAY_MAX_REMAP) return false;
+    remaps[numRemaps].fromID = fromID;
+    remaps[numRemaps].toID = toID;
+    numRemaps++;
+    return true;
+}
+
+void Replay::clearRemaps()
+{
+    numRemaps = 0;
+}
+
+void Replay::setBusMap(uint8_t fileBus, uint8_t outBus)
+{
+    if (fileBus >= NUM_BUSES || outBus >= NUM_BUSES) return;
+    busMap[fileBus] = outBus + 1;
+}
+
+//compact the read ahead buffer and top it up from the card. Returns false at end of file
+boolean Replay::fillBuffer()
+{
+    if (readPos > 0) {
+        memmove(readBuff, readBuff + readPos, readLen - readPos);
+        readLen -= readPos;
+        readPos = 0;
+    }
+    if (readLen >= REPLAY_READ_BUFF) return true;
+    Buses::lockSPI();
+    int got = file.read(readBuff + readLen, REPLAY_READ_BUFF - readLen);
+    Buses::unlockSPI();
+    if (got <= 0) return false;
+    readLen += got;
+    return true;
+}
+
+//turn a raw file timestamp (uS, wrapping at 32 bits) into monotonic time since the replay started
+void Replay::advanceTime(uint32_t raw)
+{
+    if (haveRawTime) fileTime += (uint32_t)(raw - lastRawTime);
+    lastRawTime = raw;
+    haveRawTime = true;
+}
+
+void Replay::applyMaps(REPLAY_FRAME *rf)
+{
+    if (rf->bus < NUM_BUSES && busMap[rf->bus]) rf->bus = busMap[rf->bus] - 1;
+
+    uint32_t id = rf->frame.id;
+    if (rf->frame.extended) id |= 1ul << 31;
+    for (int i = 0; i < numRemaps; i++) {
+        if (remaps[i].fromID == id) {
+            rf->frame.extended = (remaps[i].toID & (1ul << 31)) ? true : false;
+            rf->frame.id = remaps[i].toID & 0x7FFFFFFF;
+            break;
+        }
+    }
+}
+
+/*
+ * BINARYFILE records are exactly what sendFrameToFile() writes:
+ * timestamp (4 bytes uS), ID (4 bytes, bit 31 = extended), length + (bus << 4), data bytes
+ */
+boolean Replay::parseBinary(REPLAY_FRAME *out)
+{
+    while (true) {
+        if (readLen - readPos >= 9) {
+            uint8_t *rec = readBuff + readPos;
+            uint8_t len = rec[8] & 0xF;
+            if (len == 0xF) {
+                //CAN FD record: flags and a full length byte follow. Only frames a classic controller can send are replayed
+                if (readLen - readPos < 11) {
+                    if (!fillBuffer() || readLen - readPos < 11) return false;
+                    continue;
+                }
+                uint8_t fdLen = rec[10] > 64 ? 64 : rec[10];
+                if (readLen - readPos < 11u + fdLen) {
+                    if (!fillBuffer() || readLen - readPos < 11u + fdLen) return false;
+                    continue;
+                }
+                if (fdLen > 8 || (rec[9] & FD_FLAG_BRS)) {
+                    readPos += 11 + fdLen;
+                    continue;
+                }
+                memmove(rec + 2, rec, 9); //line the record up with the classic layout
+                rec += 2;
+                readPos += 2;
+                len = fdLen;
+            }
+            if (len > 8) len = 8;
+            if (readLen - readPos >= 9 + len) {
+                uint32_t raw = rec[0] + ((uint32_t)rec[1] << 8) + ((uint32_t)rec[2] << 16) + ((uint32_t)rec[3] << 24);
+                uint32_t id = rec[4] + ((uint32_t)rec[5] << 8) + ((uint32_t)rec[6] << 16) + ((uint32_t)rec[7] << 24);
+                out->frame.extended = (id & (1ul << 31)) ? true : false;
+                out->frame.id = id & 0x7FFFFFFF;
+                out->frame.length = len;
+                out->frame.rtr = 0;
+                out->bus = rec[8] >> 4;
+                for (int c = 0; c < len; c++) out->frame.data.bytes[c] = rec[9 + c];
+                readPos += 9 + len;
+                advanceTime(raw);
+                return true;
+            }
+        }
+        if (!fillBuffer() || readLen - readPos < 9) return false;
+    }
+}
+
+//GVRET lines: millis,ID,extended,bus,length,data bytes... all numbers but millis in hex. Mark lines are skipped
+boolean Replay::parseGVRETLine(REPLAY_FRAME *out)
+{
+    char *ptr = lineBuff;
+    char *end;
+
+    uint32_t ms = strtoul(ptr, &end, 10);
+    if (end == ptr || *end != ',') return false;
+    ptr = end + 1;
+    out->frame.id = strtoul(ptr, &end, 16);
+    if (*end != ',') return false;
+    ptr = end + 1;
+    out->frame.extended = strtoul(ptr, &end, 10) ? true : false;
+    if (*end != ',') return false;
+    ptr = end + 1;
+    out->bus = strtoul(ptr, &end, 10);
+    if (*end != ',') return false;
+    ptr = end + 1;
+    out->frame.length = strtoul(ptr, &end, 10);
+    if (out->frame.length > 8) return false;
+    for (int c = 0; c < out->frame.length; c++) {
+        if (*end != ',') return false;
+        ptr = end + 1;
+        out->frame.data.bytes[c] = strtoul(ptr, &end, 16);
+    }
+    out->frame.id &= 0x7FFFFFFF;
+    out->frame.rtr = 0;
+    advanceTime(ms * 1000);
+    return true;
+}
+
+//CRTD lines: seconds R11|R29 ID data bytes... CRTD has no bus number so everything is bus 0. CEV (mark) lines are skipped
+boolean Replay::parseCRTDLine(REPLAY_FRAME *out)
+{
+    char *ptr = lineBuff;
+    char *end;
+
+    double secs = strtod(ptr, &end);
+    if (end == ptr || *end != ' ') return false;
+    ptr = end + 1;
+    if (*ptr != 'R' && *ptr != 'T') return false;
+    ptr++;
+    int idBits = strtol(ptr, &end, 10);
+    if (idBits != 11 && idBits != 29) return false;
+    ptr = end;
+    out->frame.extended = (idBits == 29);
+    out->frame.id = strtoul(ptr, &end, 16);
+    if (end == ptr) return false;
+    out->frame.length = 0;
+    while (out->frame.length < 8) {
+        ptr = end;
+        uint32_t val = strtoul(ptr, &end, 16);
+        if (end == ptr) break;
+        out->frame.data.bytes[out->frame.length++] = val;
+    }
+    out->frame.rtr = 0;
+    out->bus = 0;
+    advanceTime((uint32_t)(uint64_t)(secs * 1000000.0));
+    return true;
+}
+
+boolean Replay::parseText(REPLAY_FRAME *out)
+{
+    while (true) {
+        while (readPos < readLen) {
+            char c = readBuff[readPos++];
+            if (c == '\r' || c == '\n') {
+                if (linePos == 0) continue;
+                lineBuff[linePos] = 0;
+                linePos = 0;
+                if (fileType == GVRET ? parseGVRETLine(out) : parseCRTDLine(out)) return true;
+            } else if (linePos < REPLAY_LINE_LEN - 1) lineBuff[linePos++] = c;
+        }
+        if (!fillBuffer()) {
+            //last line may not have a line ending
+            if (linePos == 0) return false;
+            lineBuff[linePos] = 0;
+            linePos = 0;
+            return (fileType == GVRET ? parseGVRETLine(out) : parseCRTDLine(out));
+        }
+    }
+}
+
+boolean Replay::parseNext(REPLAY_FRAME *out)
+{
+    if (fileType == BINARYFILE) return parseBinary(out);
+    return parseText(out);
+}
+
+void Replay::recordLateness(uint32_t late)
+{
+    int bucket = 0;
+    while (bucket < REPLAY_HIST_BUCKETS - 1 && late >= histLimits[bucket]) bucket++;
+    histogram[bucket]++;
+    if (late > lateMax) lateMax = late;
+}
+
+/*
+ * Keep the queue topped up. This is where all the card reading happens. Frames for a bus that
+ * is missing or disabled could never go out and would hold up everything behind them, so they
+ * are counted and dropped here. At most a queue's worth of frames is parsed per call.
+ */
+void Replay::refill()
+{
+    int parsed = 0;
+
+    while (queueCount < REPLAY_QUEUE_LEN && !eof && parsed < REPLAY_QUEUE_LEN) {
+        REPLAY_FRAME *slot = &queue[(queueHead + queueCount) % REPLAY_QUEUE_LEN];
+        if (parseNext(slot)) {
+            parsed++;
+            applyMaps(slot);
+            if (!Buses::isEnabled(slot->bus)) {
+                framesDropped++;
+                continue;
+            }
+            slot->time = fileTime;
+            queueCount++;
+            passHadFrame = true;
+        } else if (looping && passHadFrame) {
+            Buses::lockSPI();
+            file.seekSet(0);
+            Buses::unlockSPI();
+            readPos = readLen = 0;
+            linePos = 0;
+            haveRawTime = false;
+            passHadFrame = false;
+            fileTime += REPLAY_LOOP_GAP;
+        } else {
+            //a whole pass with nothing in it would otherwise rewind forever
+            if (looping) Logger::error("No frames for an enabled bus in replay file, can't loop it");
+            eof = true;
+        }
+    }
+}
+
+void Replay::dropHead()
+{
+    queueHead = (queueHead + 1) % REPLAY_QUEUE_LEN;
+    queueCount--;
+}
+
+/*
+ * Send everything whose time has come. A busy controller gets retried next time around, but
+ * only for REPLAY_TIMEOUT, and a bus that was turned off mid replay drops its frames.
+ */
+void Replay::sendDue()
+{
+    uint32_t now = micros();
+    while (queueCount > 0) {
+        REPLAY_FRAME *rf = &queue[queueHead];
+        uint32_t target = startMicros + (uint32_t)(rf->time * 100 / speed);
+        int32_t late = (int32_t)(now - target);
+        if (late < 0) break;
+        if (!Buses::send(rf->frame, rf->bus)) {
+            if (Buses::isEnabled(rf->bus) && late < REPLAY_TIMEOUT) break;
+            framesDropped++;
+            dropHead();
+            continue;
+        }
+        recordLateness(late);
+        framesSent++;
+        dropHead();
+        now = micros();
+    }
+}
+
+void Replay::loop()
+{
+    if (!active) return;
+
+    refill();
+    sendDue();
+
+    if (eof && queueCount == 0) {
+        stop();
+        if (!settings.useBinarySerialComm) Logger::console("Replay finished, %i frames sent, %i dropped", framesSent, framesDropped);
+    }
+}
+
+//number of data bytes that follow each sub command byte
+int Replay::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_START:
+        return 4 + REPLAY_NAME_LEN;
+    case CMD_ADD_REMAP:
+        return 8;
+    case CMD_SET_BUS_MAP:
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * CMD_START - file type (0 = same as FILETYPE), speed percent (2 bytes), flags (bit 0 = loop), file name (null padded)
+ * CMD_ADD_REMAP - from ID, to ID (4 bytes each, bit 31 = extended)
+ * CMD_SET_BUS_MAP - bus in file, bus to send on
+ */
+void Replay::handleCommand(uint8_t *data)
+{
+    char name[REPLAY_NAME_LEN + 1];
+
+    switch (data[0]) {
+    case CMD_START:
+        setSpeed(data[2] + ((uint16_t)data[3] << 8));
+        setLooping(data[4] & 1);
+        memcpy(name, data + 5, REPLAY_NAME_LEN);
+        name[REPLAY_NAME_LEN] = 0;
+        start(name, (FILEOUTPUTTYPE)data[1]);
+        sendStatus();
+        break;
+    case CMD_STOP:
+        stop();
+        break;
+    case CMD_GET_STATUS:
+        sendStatus();
+        break;
+    case CMD_ADD_REMAP:
+        addRemap(data[1] + ((uint32_t)data[2] << 8) + ((uint32_t)data[3] << 16) + ((uint32_t)data[4] << 24),
+                 data[5] + ((uint32_t)data[6] << 8) + ((uint32_t)data[7] << 16) + ((uint32_t)data[8] << 24));
+        break;
+    case CMD_CLEAR_REMAPS:
+        clearRemaps();
+        break;
+    case CMD_SET_BUS_MAP:
+        setBusMap(data[1], data[2]);
+        break;
+    }
+}
+
+void Replay::printStatus()
+{
+    Logger::console("Replay %s, speed %i%%, loop %i, %i frames sent, %i dropped, worst lateness %i uS", active ? "running" : "stopped",
+                    speed, looping, framesSent, framesDropped, lateMax);
+    Logger::console("Lateness <10uS: %i <50uS: %i <100uS: %i <500uS: %i <1mS: %i <5mS: %i <10mS: %i more: %i",
+                    histogram[0], histogram[1], histogram[2], histogram[3], histogram[4], histogram[5], histogram[6], histogram[7]);
+}
+
+/*
+ * 0xF1, PROTO_REPLAY, CMD_GET_STATUS, active, frames sent (4 bytes), worst lateness uS (4 bytes),
+ * then REPLAY_HIST_BUCKETS lateness counts (4 bytes each) for <10, <50, <100, <500, <1000, <5000, <10000, more uS,
+ * then frames dropped (4 bytes)
+ */
+void Replay::sendStatus()
+{
+    uint8_t buff[16 + REPLAY_HIST_BUCKETS * 4];
+    int pos = 0;
+
+    buff[pos++] = 0xF1;
+    buff[pos++] = PROTO_REPLAY;
+    buff[pos++] = CMD_GET_STATUS;
+    buff[pos++] = active;
+    for (int i = 0; i < 4; i++) buff[pos++] = (uint8_t)(framesSent >> (i * 8));
+    for (int i = 0; i < 4; i++) buff[pos++] = (uint8_t)(lateMax >> (i * 8));
+    for (int b = 0; b < REPLAY_HIST_BUCKETS; b++) {
+        for (int i = 0; i < 4; i++) buff[pos++] = (uint8_t)(histogram[b] >> (i * 8));
+    }
+    for (int i = 0; i < 4; i++) buff[pos++] = (uint8_t)(framesDropped >> (i * 8));
+    SerialUSB.write(buff, pos);
+}
@@ -0,0 +1,126 @@
+/*
+ * Replay.h
+ *
+ * Plays a capture file from the SD card back onto the buses with the original
+ * relative timing (optionally scaled), ID remapping and looping.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct REPLAY_FRAME {
+    CAN_FRAME frame;
+    uint8_t bus;
+    uint64_t time; //uS from the start of the replay in file time (before speed scaling)
+};
+
+struct REPLAY_REMAP {
+    uint32_t fromID; //bit 31 set for extended
+    uint32_t toID;
+};
+
+class Replay
+{
+public:
+    enum REPLAY_CMD {
+        CMD_START = 0,
+        CMD_STOP = 1,
+        CMD_GET_STATUS = 2,
+        CMD_ADD_REMAP = 3,
+        CMD_CLEAR_REMAPS = 4,
+        CMD_SET_BUS_MAP = 5
+    };
+
+    static boolean start(const char *filename, FILEOUTPUTTYPE type);
+    static void stop();
+    static boolean isActive();
+    static void loop();
+    static void setSpeed(uint16_t percent);
+    static uint16_t getSpeed();
+    static void setLooping(boolean en);
+    static boolean getLooping();
+    static boolean addRemap(uint32_t fromID, uint32_t toID);
+    static void clearRemaps();
+    static void setBusMap(uint8_t fileBus, uint8_t outBus);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void printStatus();
+    static void sendStatus();
+
+private:
+    static SdFile file;
+    static FILEOUTPUTTYPE fileType;
+    static boolean active;
+    static boolean eof;
+    static boolean looping;
+    static boolean passHadFrame; //a frame has come out of the file since the start or the last rewind
+    static uint16_t speed; //percent of real time. 200 = twice as fast
+
+    //read ahead buffer straight from the card
+    static uint8_t readBuff[REPLAY_READ_BUFF];
+    static uint16_t readPos;
+    static uint16_t readLen;
+    static char lineBuff[REPLAY_LINE_LEN];
+    static uint8_t linePos;
+
+    //parsed frames waiting for their send time
+    static REPLAY_FRAME queue[REPLAY_QUEUE_LEN];
+    static uint8_t queueHead;
+    static uint8_t queueCount;
+
+    static uint64_t fileTime;
+    static uint32_t lastRawTime;
+    static boolean haveRawTime;
+    static uint32_t startMicros;
+
+    static REPLAY_REMAP remaps[REPLAY_MAX_REMAP];
+    static uint8_t numRemaps;
+    static uint8_t busMap[NUM_BUSES];
+
+    static uint32_t framesSent;
+    static uint32_t framesDropped; //bus disabled or missing, or the controller stayed busy past REPLAY_TIMEOUT
+    static uint32_t lateMax;
+    static uint32_t histogram[REPLAY_HIST_BUCKETS];
+
+    static boolean fillBuffer();
+    static void refill();
+    static void sendDue();
+    static boolean parseNext(REPLAY_FRAME *out);
+    static boolean parseBinary(REPLAY_FRAME *out);
+    static boolean parseText(REPLAY_FRAME *out);
+    static boolean parseGVRETLine(REPLAY_FRAME *out);
+    static boolean parseCRTDLine(REPLAY_FRAME *out);
+    static void advanceTime(uint32_t raw);
+    static void applyMaps(REPLAY_FRAME *rf);
+    static void dropHead();
+    static void recordLateness(uint32_t late);
+};
+
+#endif /* REPLAY_H_ */
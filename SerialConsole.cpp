@@ -35,6 +35,24 @@
 #include <MCP2515.h>
 #include "config.h"
 #include "sys_io.h"
+#include "BitTracker.h"
+#include "TxQueue.h"
+#include "Replay.h"
+#include "Capture.h"
+#include "IsoTp.h"
+#include "J1939.h"
+#include "Signals.h"
+#include "Buses.h"
+#include "AutoBaud.h"
+#include "Gateway.h"
+#include "Latency.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "Generator.h"
+#include "LossReport.h"
+#include "ClockSync.h"
+#include "SyncPulse.h"
+#include "CommandParser.h"
 
 extern MCP2515 SWCAN;
 
@@ -67,6 +85,21 @@ void SerialConsole::printMenu()
     SerialUSB.println("R = reset to factory defaults");
     SerialUSB.println("s = Start logging to file");
     SerialUSB.println("S = Stop logging to file");
+    SerialUSB.println("b = Show bit change tracker report");
+    SerialUSB.println("B = Reset bit change tracker");
+    SerialUSB.println("q = Show transmit queue counters");
+    SerialUSB.println("n = Show bus setup, frame counters, load and error state");
+    SerialUSB.println("g = Show gateway forwarding counters, latency and rules");
+    SerialUSB.println("l = Show per stage frame latency histograms");
+    SerialUSB.println("o = Show where loop() spends its time");
+    SerialUSB.println("e = Show traffic generator counters and lost or reordered tagged frames");
+    SerialUSB.println("y = Show clock offset and drift against the host or sync master");
+    SerialUSB.println("u = Show binary command counters and errors");
+    SerialUSB.println("p = Show replay status and lateness histogram");
+    SerialUSB.println("c = Show triggered capture status");
+    SerialUSB.println("i = Show ISO-TP channels");
+    SerialUSB.println("j = Show J1939 PGN statistics");
+    SerialUSB.println("v = Show decoded signal values");
     SerialUSB.println();
     SerialUSB.println("Config Commands (enter command=newvalue). Current values shown in parenthesis:");
     SerialUSB.println();
@@ -75,35 +108,42 @@ void SerialConsole::printMenu()
     Logger::console("SYSTYPE=%i - set board type (0=CANDue, 1=GEVCU, 2 = CANDUE1.3-2.1, 3 = CANDUE2.2)", settings.sysType);
     SerialUSB.println();
 
-    Logger::console("CAN0EN=%i - Enable/Disable CAN0 (0 = Disable, 1 = Enable)", settings.CAN0_Enabled);
-    Logger::console("CAN0SPEED=%i - Set speed of CAN0 in baud (125000, 250000, etc)", settings.CAN0Speed);
-    Logger::console("CAN0LISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", settings.CAN0ListenOnly);
-    for (int i = 0; i < 8; i++) {
-        sprintf(buff, "CAN0FILTER%i=0x%%x,0x%%x,%%i,%%i (ID, Mask, Extended, Enabled)", i);
-        Logger::console(buff, settings.CAN0Filters[i].id, settings.CAN0Filters[i].mask,
-                        settings.CAN0Filters[i].extended, settings.CAN0Filters[i].enabled);
-    }
-    SerialUSB.println();
-
-    Logger::console("CAN1EN=%i - Enable/Disable CAN1 (0 = Disable, 1 = Enable)", settings.CAN1_Enabled);
-    Logger::console("CAN1SPEED=%i - Set speed of CAN1 in baud (125000, 250000, etc)", settings.CAN1Speed);
-    Logger::console("CAN1LISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", settings.CAN1ListenOnly);
-    for (int i = 0; i < 8; i++) {
-        sprintf(buff, "CAN1FILTER%i=0x%%x,0x%%x,%%i,%%i (ID, Mask, Extended, Enabled)", i);
-        Logger::console(buff, settings.CAN1Filters[i].id, settings.CAN1Filters[i].mask,
-                        settings.CAN1Filters[i].extended, settings.CAN1Filters[i].enabled);
+    for (int bus = 0; bus < Buses::count(); bus++) {
+        BUS_SETTINGS *bs = &settings.buses[bus];
+        Logger::console("CAN%iEN=%i - Enable/Disable %s (0 = Disable, 1 = Enable)", bus, bs->enabled, Buses::name(bus));
+        Logger::console("CAN%iSPEED=%i - Set speed of %s in baud (125000, 250000, etc)", bus, bs->speed, Buses::name(bus));
+        Logger::console("CAN%iLISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", bus, bs->listenOnly);
+        Logger::console("CAN%iAUTOBAUD=1 - Find the speed of %s by listening to it (0 = Cancel)", bus, Buses::name(bus));
+        for (int i = 0; i < NUM_BUS_FILTERS; i++) {
+            sprintf(buff, "CAN%iFILTER%i=0x%%x,0x%%x,%%i,%%i (ID, Mask, Extended, Enabled)", bus, i);
+            Logger::console(buff, bs->filters[i].id, bs->filters[i].mask, bs->filters[i].extended, bs->filters[i].enabled);
+        }
+        SerialUSB.println();
     }
-    Logger::console("CAN0SEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: C0SEND=0x200,4,1,2,3,4");
-    Logger::console("CAN1SEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: C1SEND=0x200,8,00,00,00,10,0xAA,0xBB,0xA0,00");
+    Logger::console("CAN0SEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: CAN0SEND=0x200,4,1,2,3,4 (CAN1SEND etc for the other buses)");
     Logger::console("MARK=<Description of what you are doing> - Set a mark in the log file about what you are about to do.");
     if (!SysSettings.dedicatedSWCAN)
         Logger::console("SINGLEWIRE=%i - Use single wire mode (0 = Normal Mode 1 = Single Wire Mode", settings.singleWire_Enabled);
     else
         Logger::console("SINGLEWIRE=%i - Enable/Disable Single Wire CAN interface (0 = Disable 1 = Enable", settings.singleWire_Enabled);
-        Logger::console("SWSPEED=%i - Set speed of SW CAN Interface (33333 or 100000 likely)", settings.SWCANSpeed);
-        Logger::console("SWSEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: C0SEND=0x200,4,1,2,3,4");
+        Logger::console("SWSPEED=%i - Set speed of SW CAN Interface (33333 or 100000 likely)", settings.buses[2].speed);
+        Logger::console("SWSEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: SWSEND=0x200,4,1,2,3,4");
     SerialUSB.println();
 
+    Logger::console("GWFASTPATH=%i - Forward passthrough frames from the receive interrupt (0 = Dis, 1 = En)", Gateway::getFastPath());
+    Logger::console("LATENCY=%i - Time each stage frames go through (0 = Dis, 1 = En and clear)", Latency::isEnabled());
+    Logger::console("LATINJECT=BUS,COUNT,INTERVAL - Feed synthetic frames in as if received. Ex: LATINJECT=0,1000,500");
+    Logger::console("PROFRESET=1 - Clear the loop() profile shown by o");
+    Logger::console("BENCH=COUNT - Time COUNT frames through every USB and file output format (0 = %i)", BENCH_DEFAULT_FRAMES);
+    Logger::console("RXSEQ=%i - Sequence numbers and loss records in the binary stream (0 = Dis, 1 = En)", LossReport::isEnabled());
+    Logger::console("HOSTTIME=%i - Stamp binary frame records in synced host time (0 = Device time, 1 = Host time)", ClockSync::getHostTime());
+    Logger::console("SYNC=MODE,PIN - Sync pulse between units (0 = Off, 1 = Master on output PIN, 2 = Slave on input PIN). Ex: SYNC=1,7");
+    Logger::console("GENLOAD=BUS,LOAD - Generate random traffic at LOAD tenths of a percent of the bus. Ex: GENLOAD=0,500");
+    Logger::console("GENIDS=BUS,MIN,MAX,EXTPCT - ID range and share of 29 bit IDs the generator uses. Ex: GENIDS=0,0x100,0x7FF,0");
+    Logger::console("GENLEARN=BUS,MS - Learn the IDs, lengths and rates seen on a bus for MS milliseconds");
+    Logger::console("GENPLAY=BUS,SCALE - Play the learned traffic, SCALE in tenths of a percent (1000 = as learned)");
+    Logger::console("GENSTOP=BUS - Stop the traffic generator on a bus");
+    Logger::console("TXQDEPTH=%i - Number of frames each bus may have waiting to transmit (1 - %i)", TxQueue::getDepth(), TXQ_MAX_DEPTH);
     Logger::console("BINSERIAL=%i - Enable/Disable Binary Sending of CANBus Frames to Serial (0=Dis, 1=En)", settings.useBinarySerialComm);
     Logger::console("FILETYPE=%i - Set type of file output (0=None, 1 = Binary, 2 = GVRET, 3 = CRTD)", settings.fileOutputType);
     SerialUSB.println();
@@ -115,6 +155,42 @@ void SerialConsole::printMenu()
     Logger::console("FILEAUTO=%i - Automatically start logging at startup (0=No, 1 = Yes)", settings.autoStartLogging);
     SerialUSB.println();
 
+    Logger::console("REPLAY=<filename> - Play a capture file back onto the buses (file format taken from FILETYPE)");
+    Logger::console("REPLAYSTOP=1 - Stop a replay in progress");
+    Logger::console("REPLAYSPEED=%i - Replay speed in percent of real time (1 - 10000)", Replay::getSpeed());
+    Logger::console("REPLAYLOOP=%i - Start the file over when it ends (0 = No, 1 = Yes)", Replay::getLooping());
+    Logger::console("REPLAYMAP=FROM,TO - Send frames with ID FROM as ID TO (bit 31 = extended). REPLAYMAP=0 clears all");
+    Logger::console("REPLAYBUS=FROM,TO - Send frames recorded on bus FROM out on bus TO");
+    SerialUSB.println();
+
+    Logger::console("CAPARM=MODE - Arm triggered capture (0 = Disarm, 1 = One shot, 2 = Re-arm after each capture)");
+    Logger::console("CAPTRIG=TYPE - Trigger source (0 = MARK only, 1 = Frame match, 2 = Digital input edge, 3 = Analog threshold)");
+    Logger::console("CAPFRAME=ID,MASK,BUS - Frame trigger (bit 31 of ID = extended, BUS 255 = any)");
+    Logger::console("CAPDATA=INDEX,VALUE,MASK - Frame trigger data byte match (MASK 0 = don't care)");
+    Logger::console("CAPDIG=INPUT,EDGE - Digital trigger (EDGE 0 = Rising, 1 = Falling, 2 = Either)");
+    Logger::console("CAPANA=INPUT,THRESHOLD,DIR - Analog trigger (DIR 0 = Rises above, 1 = Falls below)");
+    Logger::console("CAPPRE=MS - History to keep from before the trigger. CAPPOST=MS - Time to keep capturing after it");
+    Logger::console("CAPDEST=%i - Where captures go (0 = USB, 1 = SD card file CAPnnnn.BIN)", Capture::getDestination());
+    Logger::console("MARK also fires an armed capture");
+    SerialUSB.println();
+
+    Logger::console("ISOTPCH=CH,BUS,RXID,TXID - Set up ISO-TP channel CH (0 - %i). RXID 0 turns it off. Bit 31 of an ID = extended", ISOTP_MAX_CHANNELS - 1);
+    Logger::console("ISOTPFC=CH,BS,STMIN - Block size and STmin we ask for when receiving on channel CH");
+    Logger::console("ISOTPPAD=CH,EN,BYTE - Pad frames sent on channel CH to 8 bytes with BYTE (0 = Dis, 1 = En)");
+    Logger::console("ISOTPSEND=CH,<BYTES SEPARATED BY COMMAS> - Send a PDU on channel CH. Ex: ISOTPSEND=0,0x22,0xF1,0x90");
+    SerialUSB.println();
+
+    Logger::console("J1939=%i - J1939 decoding (0 = Off, 1 = Reassemble transport transfers, 2 = Stream whole PGNs instead of frames)", J1939::getMode());
+    Logger::console("J1939BUSES=0x%x - Bit mask of buses J1939 decoding applies to", J1939::getBusMask());
+    SerialUSB.println();
+
+    Logger::console("SIGMODE=%i - Signal decoding (0 = Off, 1 = Send values when they change, 2 = Send all values every SIGRATE ms)", Signals::getMode());
+    Logger::console("SIGRATE=%i - ms between signal snapshots in mode 2", Signals::getRate());
+    Logger::console("SIGRAW=%i - Keep streaming raw frames while decoding signals (0 = No, 1 = Yes)", Signals::getKeepRaw());
+    Logger::console("SIGADD=ID,BUS,START,LEN,FLAGS,SCALE,OFFSET - Add a signal (BUS 255 = any, FLAGS bit 0 = big endian, bit 1 = signed)");
+    Logger::console("SIGCLEAR=1 - Remove all signals");
+    SerialUSB.println();
+
     Logger::console("DIGTOGEN=%i - Enable digital toggling system (0 = Dis, 1 = En)", digToggleSettings.enabled);
     Logger::console("DIGTOGMODE=%i - Set digital toggle mode (0 = Read pin, send CAN, 1 = Receive CAN, set pin)", digToggleSettings.mode & 1);
     Logger::console("DIGTOGLEVEL=%i - Set default level of digital pin (0 = LOW, 1 = HIGH)", digToggleSettings.mode >> 7);
@@ -126,6 +202,10 @@ void SerialConsole::printMenu()
     Logger::console("DIGTOGPAYLOAD=%X,%X,%X,%X,%X,%X,%X,%X - Payload to send or validate against (comma separated list)", digToggleSettings.payload[0],
                     digToggleSettings.payload[1], digToggleSettings.payload[2], digToggleSettings.payload[3], digToggleSettings.payload[4],
                     digToggleSettings.payload[5], digToggleSettings.payload[6], digToggleSettings.payload[7]);
+    SerialUSB.println();
+
+    Logger::console("BITTRACK=%i - Track which payload bits change per ID (0 = Dis, 1 = En)", BitTracker::isEnabled());
+    Logger::console("BITTRACKPIN=%i - Digital input (0-3) that resets the bit tracker when activated (255 = None)", BitTracker::getResetPin());
 }
 
 /*	There is a help menu (press H or h or ?)
@@ -178,54 +258,54 @@ void SerialConsole::handleLawicelCmd()
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = parseHexString(cmdBuffer + 5 + (2 * data), 2);
         }
-        Can0.sendFrame(outFrame);
+        TxQueue::queueFrame(outFrame, 0);
         if (SysSettings.lawicelAutoPoll) SerialUSB.print("z");
         break;
     case 'T': //transmit extended frame
         outFrame.id = parseHexString(cmdBuffer + 1, 8);
         outFrame.length = cmdBuffer[9] - '0';
-        outFrame.extended = false;
+        outFrame.extended = true;
         if (outFrame.length < 0) outFrame.length = 0;
         if (outFrame.length > 8) outFrame.length = 8;
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = parseHexString(cmdBuffer + 10 + (2 * data), 2);
         }
-        Can0.sendFrame(outFrame);
+        TxQueue::queueFrame(outFrame, 0);
         if (SysSettings.lawicelAutoPoll) SerialUSB.print("Z");
         break;
     case 'S': //setup canbus baud via predefined speeds
         val = parseHexCharacter(cmdBuffer[1]);
         switch (val) {
         case 0:
-            settings.CAN0Speed = 10000;
+            settings.buses[0].speed = 10000;
             break;
         case 1:
-            settings.CAN0Speed = 20000;
+            settings.buses[0].speed = 20000;
             break;
         case 2:
-            settings.CAN0Speed = 50000;
+            settings.buses[0].speed = 50000;
             break;
         case 3:
-            settings.CAN0Speed = 100000;
+            settings.buses[0].speed = 100000;
             break;
         case 4:
-            settings.CAN0Speed = 125000;
+            settings.buses[0].speed = 125000;
             break;
         case 5:
-            settings.CAN0Speed = 250000;
+            settings.buses[0].speed = 250000;
             break;
         case 6:
-            settings.CAN0Speed = 500000;
+            settings.buses[0].speed = 500000;
             break;
         case 7:
-            settings.CAN0Speed = 800000;
+            settings.buses[0].speed = 800000;
             break;
         case 8:
-            settings.CAN0Speed = 1000000;
+            settings.buses[0].speed = 1000000;
             break;
         }
     case 's': //setup canbus baud via register writes (we can't really do that...)
-        //settings.CAN0Speed = 250000;
+        //settings.buses[0].speed = 250000;
         break;
     case 'r': //send a standard RTR frame (don't really... that's so deprecated its not even funny)
         break;
@@ -288,104 +368,16 @@ void SerialConsole::handleConfigCmd()
 
     cmdString.toUpperCase();
 
-    if (cmdString == String("CAN0EN")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting CAN0 Enabled to %i", newValue);
-        settings.CAN0_Enabled = newValue;
-        if (newValue == 1) Can0.begin(settings.CAN0Speed, SysSettings.CAN0EnablePin);
-        else Can0.disable();
-        writeEEPROM = true;
-    } else if (cmdString == String("CAN1EN")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting CAN1 Enabled to %i", newValue);
-        if (newValue == 1) Can1.begin(settings.CAN1Speed, SysSettings.CAN1EnablePin);
-        else Can1.disable();
-        settings.CAN1_Enabled = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("CAN0SPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting CAN0 Baud Rate to %i", newValue);
-            settings.CAN0Speed = newValue;
-            Can0.begin(settings.CAN0Speed, SysSettings.CAN0EnablePin);
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
-    } else if (cmdString == String("CAN1SPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting CAN1 Baud Rate to %i", newValue);
-            settings.CAN1Speed = newValue;
-            Can1.begin(settings.CAN1Speed, SysSettings.CAN1EnablePin);
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
+    const char *cmd = cmdString.c_str();
+    if (strncmp(cmd, "CAN", 3) == 0 && cmd[3] >= '0' && cmd[3] <= '9') {
+        if (handleBusCmd(cmd[3] - '0', cmd + 4, newValue, newString)) writeEEPROM = true;
     } else if (cmdString == String("SWSPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting SWCAN Baud Rate to %i", newValue);
-            settings.SWCANSpeed = newValue;
-            //Can1.begin(settings.CAN1Speed, SysSettings.CAN1EnablePin);
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
-    } else if (cmdString == String("CAN0LISTENONLY")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting CAN0 Listen Only to %i", newValue);
-            settings.CAN0ListenOnly = newValue;
-            if (settings.CAN0ListenOnly) {
-                Can0.enable_autobaud_listen_mode();
-            } else {
-                Can0.disable_autobaud_listen_mode();
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("CAN1LISTENONLY")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting CAN1 Listen Only to %i", newValue);
-            settings.CAN1ListenOnly = newValue;
-            if (settings.CAN1ListenOnly) {
-                Can1.enable_autobaud_listen_mode();
-            } else {
-                Can1.disable_autobaud_listen_mode();
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("CAN0FILTER0")) { //someone should kick me in the face for this laziness... FIX THIS!
-        handleFilterSet(0, 0, newString);
-    } else if (cmdString == String("CAN0FILTER1")) {
-        if (handleFilterSet(0, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER2")) {
-        if (handleFilterSet(0, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER3")) {
-        if (handleFilterSet(0, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER4")) {
-        if (handleFilterSet(0, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER5")) {
-        if (handleFilterSet(0, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER6")) {
-        if (handleFilterSet(0, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER7")) {
-        if (handleFilterSet(0, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER0")) {
-        if (handleFilterSet(1, 0, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER1")) {
-        if (handleFilterSet(1, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER2")) {
-        if (handleFilterSet(1, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER3")) {
-        if (handleFilterSet(1, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER4")) {
-        if (handleFilterSet(1, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER5")) {
-        if (handleFilterSet(1, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER6")) {
-        if (handleFilterSet(1, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER7")) {
-        if (handleFilterSet(1, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0SEND")) {
-        handleCANSend(&Can0, newString);
-    } else if (cmdString == String("CAN1SEND")) {
-        handleCANSend(&Can1, newString);
+        if (!SysSettings.dedicatedSWCAN) Logger::console("No dedicated single wire bus on this board. Set the speed of CAN1 instead");
+        else if (handleBusCmd(2, "SPEED", newValue, newString)) writeEEPROM = true;
     } else if (cmdString == String("SWSEND")) {
-        handleCANSend(&SWCAN, newString);        
+        handleCANSend(SysSettings.dedicatedSWCAN ? 2 : 1, newString);
     } else if (cmdString == String("MARK")) { //just ascii based for now
+        Capture::fire(Capture::TRIG_MARK);
         if (settings.fileOutputType == GVRET) Logger::file("Mark: %s", newString);
         if (settings.fileOutputType == CRTD) {
             uint8_t buff[40];
@@ -402,8 +394,294 @@ void SerialConsole::handleConfigCmd()
         if (newValue < 0) newValue = 0;
         if (newValue > 1) newValue = 1;
         Logger::console("Setting Single Wire Mode to %i", newValue);
-        settings.singleWire_Enabled = newValue;
+        if (SysSettings.dedicatedSWCAN) Buses::setEnabled(2, newValue);
+        else settings.singleWire_Enabled = newValue;
         writeEEPROM = true;
+    } else if (cmdString == String("GWFASTPATH")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Gateway Fast Path to %i", newValue);
+        Gateway::setFastPath(newValue);
+    } else if (cmdString == String("LATENCY")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Latency Timing to %i", newValue);
+        if (newValue) Latency::reset();
+        Latency::setEnabled(newValue);
+    } else if (cmdString == String("LATINJECT")) {
+        char *busTok = strtok(newString, ",");
+        char *countTok = strtok(NULL, ",");
+        char *intervalTok = strtok(NULL, ",");
+        if (intervalTok) {
+            int bus = strtol(busTok, NULL, 0);
+            int count = strtol(countTok, NULL, 0);
+            int interval = strtol(intervalTok, NULL, 0);
+            Logger::console("Injecting %i frames into bus %i every %iuS", count, bus, interval);
+            Latency::inject(bus, count, interval);
+        } else Logger::console("Need bus, count and interval");
+    } else if (cmdString == String("PROFRESET")) {
+        Logger::console("Clearing loop profile");
+        Profiler::reset();
+    } else if (cmdString == String("BENCH")) {
+        if (newValue < 0 || newValue > 65535) Logger::console("Invalid frame count. Enter 0 - 65535, 0 for the default");
+        else Benchmark::run(newValue);
+    } else if (cmdString == String("RXSEQ")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting sequence numbers and loss records to %s", newValue ? "on" : "off");
+        LossReport::setEnabled(newValue);
+    } else if (cmdString == String("HOSTTIME")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Stamping frames in %s time", newValue ? "host" : "device");
+        ClockSync::setHostTime(newValue);
+    } else if (cmdString == String("SYNC")) {
+        char *modeTok = strtok(newString, ",");
+        char *pinTok = strtok(NULL, ",");
+        int mode = strtol(modeTok, NULL, 0);
+        int pin = pinTok ? strtol(pinTok, NULL, 0) : 0;
+        if ((mode == SyncPulse::MODE_MASTER && pin >= 0 && pin < NUM_OUTPUT) || (mode == SyncPulse::MODE_SLAVE && pin >= 0 && pin < NUM_DIGITAL) || mode == SyncPulse::MODE_OFF) {
+            SyncPulse::setMode(mode, pin);
+            SyncPulse::printStatus();
+        } else Logger::console("Invalid mode or pin. Outputs are 0 - %i, inputs 0 - %i", NUM_OUTPUT - 1, NUM_DIGITAL - 1);
+    } else if (cmdString == String("GENLOAD") || cmdString == String("GENPLAY")) {
+        char *busTok = strtok(newString, ",");
+        char *loadTok = strtok(NULL, ",");
+        if (loadTok) {
+            int bus = strtol(busTok, NULL, 0);
+            int load = strtol(loadTok, NULL, 0);
+            if (bus >= 0 && bus < Buses::count() && load > 0 && load <= 1000) {
+                GEN_PROFILE *profile = Generator::getProfile(bus);
+                profile->load = load;
+                if (cmdString == String("GENPLAY")) profile->flags |= Generator::FLAG_LEARNED;
+                else profile->flags &= ~Generator::FLAG_LEARNED;
+                Logger::console("Generating traffic on %s at %i.%i%%", Buses::name(bus), load / 10, load % 10);
+                Generator::start(bus);
+            } else Logger::console("Invalid bus or load. Load is 1 - 1000 tenths of a percent");
+        } else Logger::console("Need bus and load");
+    } else if (cmdString == String("GENIDS")) {
+        char *busTok = strtok(newString, ",");
+        char *minTok = strtok(NULL, ",");
+        char *maxTok = strtok(NULL, ",");
+        char *extTok = strtok(NULL, ",");
+        if (extTok) {
+            int bus = strtol(busTok, NULL, 0);
+            if (bus >= 0 && bus < NUM_BUSES) {
+                GEN_PROFILE profile = *Generator::getProfile(bus);
+                profile.idMin = strtoul(minTok, NULL, 0);
+                profile.idMax = strtoul(maxTok, NULL, 0);
+                profile.extPercent = strtol(extTok, NULL, 0);
+                Generator::setProfile(bus, profile);
+            } else Logger::console("Invalid bus");
+        } else Logger::console("Need bus, lowest ID, highest ID and percent extended");
+    } else if (cmdString == String("GENLEARN")) {
+        char *busTok = strtok(newString, ",");
+        char *msTok = strtok(NULL, ",");
+        if (msTok) {
+            int bus = strtol(busTok, NULL, 0);
+            int ms = strtol(msTok, NULL, 0);
+            if (ms > 0 && ms <= 65535) {
+                Logger::console("Learning traffic on bus %i for %ims", bus, ms);
+                Generator::learn(bus, ms);
+            } else Logger::console("Invalid time. Enter 1 - 65535 mS");
+        } else Logger::console("Need bus and time");
+    } else if (cmdString == String("GENSTOP")) {
+        Logger::console("Stopping traffic generator on bus %i", newValue);
+        Generator::stop(newValue);
+    } else if (cmdString == String("TXQDEPTH")) {
+        if (newValue >= 1 && newValue <= TXQ_MAX_DEPTH) {
+            Logger::console("Setting Transmit Queue Depth to %i", newValue);
+            TxQueue::setDepth(newValue);
+        } else Logger::console("Invalid depth. Must be between 1 and %i", TXQ_MAX_DEPTH);
+    } else if (cmdString == String("CAPARM")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 2) newValue = 2;
+        Logger::console("Setting Capture Arm Mode to %i", newValue);
+        Capture::arm(newValue);
+    } else if (cmdString == String("CAPTRIG")) {
+        if (newValue >= 0 && newValue <= 3) {
+            Logger::console("Setting Capture Trigger Type to %i", newValue);
+            Capture::setTrigger(newValue);
+        } else Logger::console("Invalid trigger type. Must be between 0 and 3");
+    } else if (cmdString == String("CAPFRAME")) {
+        char *idTok = strtok(newString, ",");
+        char *maskTok = strtok(NULL, ",");
+        char *busTok = strtok(NULL, ",");
+        if (busTok) {
+            uint32_t id = strtoul(idTok, NULL, 0);
+            uint32_t mask = strtoul(maskTok, NULL, 0);
+            int bus = strtol(busTok, NULL, 0);
+            Logger::console("Setting Capture Frame Trigger to ID 0x%x Mask 0x%x Bus %i", id, mask, bus);
+            Capture::setFrameTrigger(id, mask, bus);
+        } else Logger::console("Need ID, mask and bus");
+    } else if (cmdString == String("CAPDATA")) {
+        char *idxTok = strtok(newString, ",");
+        char *valTok = strtok(NULL, ",");
+        char *maskTok = strtok(NULL, ",");
+        int idx = maskTok ? strtol(idxTok, NULL, 0) : -1;
+        if (idx >= 0 && idx <= 7) {
+            int val = strtol(valTok, NULL, 0);
+            int mask = strtol(maskTok, NULL, 0);
+            Logger::console("Setting Capture Data Byte %i to 0x%x Mask 0x%x", idx, val, mask);
+            Capture::setDataMatch(idx, val, mask);
+        } else Logger::console("Need index (0 - 7), value and mask");
+    } else if (cmdString == String("CAPDIG")) {
+        char *inTok = strtok(newString, ",");
+        char *edgeTok = strtok(NULL, ",");
+        int input = edgeTok ? strtol(inTok, NULL, 0) : -1;
+        if (input >= 0 && input < NUM_DIGITAL) {
+            int edge = strtol(edgeTok, NULL, 0);
+            Logger::console("Setting Capture Digital Trigger to input %i edge %i", input, edge);
+            Capture::setDigitalTrigger(input, edge);
+        } else Logger::console("Need input (0 - %i) and edge", NUM_DIGITAL - 1);
+    } else if (cmdString == String("CAPANA")) {
+        char *inTok = strtok(newString, ",");
+        char *thresTok = strtok(NULL, ",");
+        char *dirTok = strtok(NULL, ",");
+        int input = dirTok ? strtol(inTok, NULL, 0) : -1;
+        if (input >= 0 && input < NUM_ANALOG) {
+            int threshold = strtol(thresTok, NULL, 0);
+            int dir = strtol(dirTok, NULL, 0);
+            Logger::console("Setting Capture Analog Trigger to input %i threshold %i direction %i", input, threshold, dir);
+            Capture::setAnalogTrigger(input, threshold, dir);
+        } else Logger::console("Need input (0 - %i), threshold and direction", NUM_ANALOG - 1);
+    } else if (cmdString == String("CAPPRE")) {
+        if (newValue >= 0) {
+            Logger::console("Setting Capture Pre Trigger Time to %i ms", newValue);
+            Capture::setPreTime(newValue);
+        }
+    } else if (cmdString == String("CAPPOST")) {
+        if (newValue >= 0) {
+            Logger::console("Setting Capture Post Trigger Time to %i ms", newValue);
+            Capture::setPostTime(newValue);
+        }
+    } else if (cmdString == String("CAPDEST")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Capture Destination to %i", newValue);
+        Capture::setDestination(newValue);
+    } else if (cmdString == String("ISOTPCH")) {
+        char *chTok = strtok(newString, ",");
+        char *busTok = strtok(NULL, ",");
+        char *rxTok = strtok(NULL, ",");
+        char *txTok = strtok(NULL, ",");
+        if (txTok) {
+            int chan = strtol(chTok, NULL, 0);
+            int bus = strtol(busTok, NULL, 0);
+            uint32_t rxID = strtoul(rxTok, NULL, 0);
+            uint32_t txID = strtoul(txTok, NULL, 0);
+            if (IsoTp::setChannel(chan, rxID != 0, bus, rxID, txID))
+                Logger::console("Setting ISO-TP channel %i to bus %i RX 0x%x TX 0x%x", chan, bus, rxID, txID);
+            else Logger::console("Invalid channel or bus");
+        } else Logger::console("Need channel, bus, RX ID and TX ID");
+    } else if (cmdString == String("ISOTPFC")) {
+        char *chTok = strtok(newString, ",");
+        char *bsTok = strtok(NULL, ",");
+        char *stTok = strtok(NULL, ",");
+        if (stTok) {
+            int chan = strtol(chTok, NULL, 0);
+            int bs = strtol(bsTok, NULL, 0);
+            int st = strtol(stTok, NULL, 0);
+            Logger::console("Setting ISO-TP channel %i flow control to BS %i STmin 0x%x", chan, bs, st);
+            IsoTp::setFlowControl(chan, bs, st);
+        } else Logger::console("Need channel, block size and STmin");
+    } else if (cmdString == String("ISOTPPAD")) {
+        char *chTok = strtok(newString, ",");
+        char *enTok = strtok(NULL, ",");
+        char *byteTok = strtok(NULL, ",");
+        if (byteTok) {
+            int chan = strtol(chTok, NULL, 0);
+            int en = strtol(enTok, NULL, 0);
+            int padByte = strtol(byteTok, NULL, 0);
+            Logger::console("Setting ISO-TP channel %i padding to %i with 0x%x", chan, en, padByte);
+            IsoTp::setPadding(chan, en, padByte);
+        } else Logger::console("Need channel, enable and pad byte");
+    } else if (cmdString == String("ISOTPSEND")) {
+        uint8_t pdu[64];
+        int len = 0;
+        char *chTok = strtok(newString, ",");
+        char *byteTok = strtok(NULL, ",");
+        while (byteTok && len < 64) {
+            pdu[len++] = strtol(byteTok, NULL, 0);
+            byteTok = strtok(NULL, ",");
+        }
+        if (chTok && len > 0) {
+            int status = IsoTp::sendPDU(strtol(chTok, NULL, 0), pdu, len);
+            if (status != IsoTp::TX_OK) Logger::console("Could not send PDU (%i)", status);
+        } else Logger::console("Need channel and at least one byte");
+    } else if (cmdString == String("J1939")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 2) newValue = 2;
+        Logger::console("Setting J1939 Mode to %i", newValue);
+        J1939::setMode(newValue, J1939::getBusMask());
+    } else if (cmdString == String("J1939BUSES")) {
+        Logger::console("Setting J1939 Bus Mask to 0x%x", newValue);
+        J1939::setMode(J1939::getMode(), newValue);
+    } else if (cmdString == String("SIGMODE")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 2) newValue = 2;
+        Logger::console("Setting Signal Decoding Mode to %i", newValue);
+        Signals::setMode(newValue, Signals::getRate(), Signals::getKeepRaw());
+    } else if (cmdString == String("SIGRATE")) {
+        if (newValue >= 1 && newValue <= 65535) {
+            Logger::console("Setting Signal Rate to %i ms", newValue);
+            Signals::setMode(Signals::getMode(), newValue, Signals::getKeepRaw());
+        } else Logger::console("Invalid rate. Must be between 1 and 65535");
+    } else if (cmdString == String("SIGRAW")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Keep Raw Frames to %i", newValue);
+        Signals::setMode(Signals::getMode(), Signals::getRate(), newValue);
+    } else if (cmdString == String("SIGADD")) {
+        char *tok[7];
+        tok[0] = strtok(newString, ",");
+        for (int t = 1; t < 7; t++) tok[t] = strtok(NULL, ",");
+        if (tok[6]) {
+            uint8_t result = Signals::addSignal(strtoul(tok[0], NULL, 0), strtol(tok[1], NULL, 0), strtol(tok[2], NULL, 0),
+                                                strtol(tok[3], NULL, 0), strtol(tok[4], NULL, 0), strtod(tok[5], NULL), strtod(tok[6], NULL));
+            if (result == Signals::ADD_OK) Logger::console("Signal added");
+            else if (result == Signals::ADD_FULL) Logger::console("Signal table is full");
+            else Logger::console("Invalid start bit or length");
+        } else Logger::console("Need ID, bus, start bit, length, flags, scale and offset");
+    } else if (cmdString == String("SIGCLEAR")) {
+        Signals::clear();
+        Logger::console("Signal table cleared");
+    } else if (cmdString == String("REPLAY")) {
+        if (Replay::start(newString, settings.fileOutputType)) Logger::console("Replaying %s", newString);
+    } else if (cmdString == String("REPLAYSTOP")) {
+        Replay::stop();
+        Logger::console("Replay stopped");
+    } else if (cmdString == String("REPLAYSPEED")) {
+        if (newValue >= 1 && newValue <= 10000) {
+            Logger::console("Setting Replay Speed to %i%%", newValue);
+            Replay::setSpeed(newValue);
+        } else Logger::console("Invalid speed. Must be between 1 and 10000");
+    } else if (cmdString == String("REPLAYLOOP")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Replay Looping to %i", newValue);
+        Replay::setLooping(newValue);
+    } else if (cmdString == String("REPLAYMAP")) {
+        char *fromTok = strtok(newString, ",");
+        char *toTok = strtok(NULL, ",");
+        if (!toTok) {
+            Replay::clearRemaps();
+            Logger::console("Replay ID remaps cleared");
+        } else {
+            uint32_t fromID = strtoul(fromTok, NULL, 0);
+            uint32_t toID = strtoul(toTok, NULL, 0);
+            if (Replay::addRemap(fromID, toID)) Logger::console("Replay will send ID 0x%x as 0x%x", fromID, toID);
+            else Logger::console("No room for more remaps (max %i)", REPLAY_MAX_REMAP);
+        }
+    } else if (cmdString == String("REPLAYBUS")) {
+        char *fromTok = strtok(newString, ",");
+        char *toTok = strtok(NULL, ",");
+        int fromBus = toTok ? strtol(fromTok, NULL, 0) : -1;
+        int toBus = toTok ? strtol(toTok, NULL, 0) : -1;
+        if (fromBus >= 0 && fromBus < NUM_BUSES && toBus >= 0 && toBus < NUM_BUSES) {
+            Logger::console("Replay will send bus %i frames on bus %i", fromBus, toBus);
+            Replay::setBusMap(fromBus, toBus);
+        } else Logger::console("Invalid buses. Both must be between 0 and %i", NUM_BUSES - 1);
     } else if (cmdString == String("BINSERIAL")) {
         if (newValue < 0) newValue = 0;
         if (newValue > 1) newValue = 1;
@@ -513,6 +791,16 @@ void SerialConsole::handleConfigCmd()
             writeDigEE = true;
             Logger::console("Set new payload bytes");
         } else Logger::console("Error processing payload");
+    } else if (cmdString == String("BITTRACK")) {
+        if (newValue >= 0 && newValue <= 1) {
+            Logger::console("Setting Bit Tracker Enable to %i", newValue);
+            BitTracker::setEnabled(newValue);
+        } else Logger::console("Invalid enable value. Must be either 0 or 1");
+    } else if (cmdString == String("BITTRACKPIN")) {
+        if ((newValue >= 0 && newValue < NUM_DIGITAL) || newValue == 255) {
+            Logger::console("Setting Bit Tracker Reset Input to %i", newValue);
+            BitTracker::setResetPin(newValue);
+        } else Logger::console("Invalid input. Must be between 0 and 3 or 255 for none");
     } else if (cmdString == String("LOGLEVEL")) {
         switch (newValue) {
         case 0:
@@ -549,7 +837,7 @@ void SerialConsole::handleConfigCmd()
         EEPROM.write(EEPROM_PAGE, settings);
     }
     if (writeDigEE) {
-        EEPROM.write(EEPROM_PAGE + 1, digToggleSettings);
+        EEPROM.write(EEPROM_TOGGLE_PAGE, digToggleSettings);
     }
 }
 
@@ -559,6 +847,7 @@ LAWICEL single letter commands are now mixed in with the other commands here.
 void SerialConsole::handleShortCmd()
 {
     uint8_t val;
+    char buff[8];
 
     switch (cmdBuffer[0]) {
     case 'h':
@@ -585,32 +874,79 @@ void SerialConsole::handleShortCmd()
     case 'S': //stop logging canbus to file
         SysSettings.logToFile = false;
         break;
+    case 'b': //show which bits have changed since the last bit tracker reset
+        BitTracker::dumpConsole();
+        break;
+    case 'q': //show transmit queue counters
+        TxQueue::printStats();
+        break;
+    case 'g':
+        Gateway::printStats();
+        break;
+    case 'l':
+        Latency::printStats();
+        break;
+    case 'o':
+        Profiler::printStats();
+        break;
+    case 'e':
+        Generator::printStats();
+        break;
+    case 'y':
+        ClockSync::printStatus();
+        SyncPulse::printStatus();
+        break;
+    case 'u':
+        CommandParser::printStats();
+        break;
+    case 'n': //show setup, counters, load and error state of every bus
+        Buses::printStatus();
+        LossReport::printStats();
+        break;
+    case 'c': //show triggered capture state
+        Capture::printStatus();
+        break;
+    case 'i': //show ISO-TP channel setup and counters
+        IsoTp::printStats();
+        break;
+    case 'j': //show J1939 per PGN counters and intervals
+        J1939::printStats();
+        break;
+    case 'v': //show the latest decoded signal values
+        Signals::printValues();
+        break;
+    case 'p': //show replay progress and lateness
+        Replay::printStatus();
+        break;
+    case 'B': //start a new bit tracking window
+        BitTracker::reset();
+        Logger::console("Bit tracker reset");
+        break;
     case 'O': //LAWICEL open canbus port (first one only because LAWICEL has no concept of dual canbus
-        //Can0.begin(settings.CAN0Speed, SysSettings.CAN1EnablePin);
-        //Can0.enable();
+        //Buses::setEnabled(0, true);
         SerialUSB.write(13); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
     case 'C': //LAWICEL close canbus port (First one)
-        Can0.disable();
+        Buses::setEnabled(0, false);
         SerialUSB.write(13); //send CR to mean "ok"
         break;
     case 'L': //LAWICEL open canbus port in listen only mode
-        Can0.begin(settings.CAN0Speed, SysSettings.CAN1EnablePin); //this is NOT really listen only mode but it isn't supported yet so for now...
-        Can0.enable();
+        Buses::setEnabled(0, true); //this is NOT really listen only mode but it isn't supported yet so for now...
         SerialUSB.write(13); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
     case 'P': //LAWICEL - poll for one waiting frame. Or, just CR if no frames
-        if (Can0.available()) SysSettings.lawicelPollCounter = 1;
+        if (Buses::available(0)) SysSettings.lawicelPollCounter = 1;
         else SerialUSB.write(13); //no waiting frames
         break;
     case 'A': //LAWICEL - poll for all waiting frames - CR if no frames
-        SysSettings.lawicelPollCounter = Can0.available();
+        SysSettings.lawicelPollCounter = Buses::available(0);
         if (SysSettings.lawicelPollCounter == 0) SerialUSB.write(13);
         break;
     case 'F': //LAWICEL - read status bits
-        SerialUSB.print("F00"); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
+        sprintf(buff, "F%02X", Buses::lawicelStatus(0)); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
+        SerialUSB.print(buff);
         SerialUSB.write(13);
         break;
     case 'V': //LAWICEL - get version number
@@ -624,11 +960,11 @@ void SerialConsole::handleShortCmd()
     }
 }
 
-//CAN0FILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
+//CANnFILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
 bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
 {
-    if (filter < 0 || filter > 7) return false;
-    if (bus < 0 || bus > 1) return false;
+    if (filter >= NUM_BUS_FILTERS) return false;
+    if (bus >= Buses::count()) return false;
 
     //there should be four tokens
     char *idTok = strtok(values, ",");
@@ -647,25 +983,56 @@ bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
     int enVal = strtol(enTok, NULL, 0);
 
     Logger::console("Setting CAN%iFILTER%i to ID 0x%x Mask 0x%x Extended %i Enabled %i", bus, filter, idVal, maskVal, extVal, enVal);
+    Buses::setFilter(bus, filter, idVal, maskVal, extVal, enVal);
 
-    if (bus == 0) {
-        settings.CAN0Filters[filter].id = idVal;
-        settings.CAN0Filters[filter].mask = maskVal;
-        settings.CAN0Filters[filter].extended = extVal;
-        settings.CAN0Filters[filter].enabled = enVal;
-        Can0.setRXFilter(filter, idVal, maskVal, extVal);
-    } else if (bus == 1) {
-        settings.CAN1Filters[filter].id = idVal;
-        settings.CAN1Filters[filter].mask = maskVal;
-        settings.CAN1Filters[filter].extended = extVal;
-        settings.CAN1Filters[filter].enabled = enVal;
-        Can1.setRXFilter(filter, idVal, maskVal, extVal);
+    return true;
+}
+
+//CANnEN, CANnSPEED, CANnLISTENONLY, CANnFILTERx, CANnSEND. Returns true if the settings need saving
+bool SerialConsole::handleBusCmd(uint8_t bus, const char *cmd, int newValue, char *newString)
+{
+    if (bus >= Buses::count()) {
+        Logger::console("Invalid bus. This board has buses 0 - %i", Buses::count() - 1);
+        return false;
     }
 
-    return true;
+    if (strcmp(cmd, "EN") == 0) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting CAN%i Enabled to %i", bus, newValue);
+        Buses::setEnabled(bus, newValue);
+        return true;
+    } else if (strcmp(cmd, "SPEED") == 0) {
+        if (newValue > 0 && newValue <= 1000000) {
+            Logger::console("Setting CAN%i Baud Rate to %i", bus, newValue);
+            Buses::setSpeed(bus, newValue);
+            return true;
+        }
+        Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
+    } else if (strcmp(cmd, "LISTENONLY") == 0) {
+        if (newValue >= 0 && newValue <= 1) {
+            Logger::console("Setting CAN%i Listen Only to %i", bus, newValue);
+            Buses::setListenOnly(bus, newValue);
+            return true;
+        }
+        Logger::console("Invalid setting! Enter a value 0 - 1");
+    } else if (strcmp(cmd, "AUTOBAUD") == 0) {
+        if (newValue == 0) AutoBaud::cancel(bus);
+        else {
+            Logger::console("Searching for the speed of CAN%i", bus);
+            AutoBaud::start(1 << bus);
+        }
+    } else if (strncmp(cmd, "FILTER", 6) == 0 && cmd[6] >= '0' && cmd[6] <= '9' && cmd[7] == 0) {
+        return handleFilterSet(bus, cmd[6] - '0', newString);
+    } else if (strcmp(cmd, "SEND") == 0) {
+        handleCANSend(bus, newString);
+    } else {
+        Logger::console("Unknown command");
+    }
+    return false;
 }
 
-bool SerialConsole::handleCANSend(CAN_COMMON *port, char *inputString)
+bool SerialConsole::handleCANSend(uint8_t bus, char *inputString)
 {
     char *idTok = strtok(inputString, ",");
     char *lenTok = strtok(NULL, ",");
@@ -690,10 +1057,11 @@ bool SerialConsole::handleCANSend(CAN_COMMON *port, char *inputString)
     else frame.extended = false;
     frame.length = lenVal;
     frame.rtr = 0;
-    port->sendFrame(frame);
+    if (!TxQueue::queueFrame(frame, bus)) {
+        Logger::console("Transmit queue for bus %i is full, frame dropped", bus);
+        return false;
+    }
     Logger::console("Sending frame with id: 0x%x len: %i", frame.id, frame.length);
-    SysSettings.txToggle = !SysSettings.txToggle;
-    setLED(SysSettings.LED_CANTX, SysSettings.txToggle);
     return true;
 }
 
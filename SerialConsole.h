@@ -54,7 +54,8 @@ private:
     void handleConfigCmd();
     void handleLawicelCmd();
     bool handleFilterSet(uint8_t bus, uint8_t filter, char *values);
-    bool handleCANSend(CAN_COMMON *port, char *inputString); 
+    bool handleBusCmd(uint8_t bus, const char *cmd, int newValue, char *newString);
+    bool handleCANSend(uint8_t bus, char *inputString);
     unsigned int parseHexCharacter(char chr);
     unsigned int parseHexString(char *str, int length);
 };
@@ -0,0 +1,303 @@
+/*
+ * Signals.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Signals.h"
+#include "Logger.h"
+
+SIGNAL_DEF Signals::sigs[SIGNALS_MAX];
+uint16_t Signals::numSigs = 0;
+SIGNAL_MSG Signals::msgs[SIGNALS_MAX_MSGS];
+uint16_t Signals::numBusMsgs = 0;
+uint16_t Signals::numAnyMsgs = 0;
+uint8_t Signals::mode = MODE_OFF;
+uint16_t Signals::rate = 100;
+boolean Signals::keepRaw = false;
+uint32_t Signals::lastSnapshot = 0;
+
+uint8_t Signals::outBuff[8 + SIGNALS_PER_RECORD * 6];
+uint8_t Signals::outCount = 0;
+
+SIGNAL_MSG *Signals::findMsg(uint32_t id, uint8_t bus, boolean create)
+{
+    uint32_t hash = (id ^ (id >> 7) ^ ((uint32_t)bus << 5)) % SIGNALS_MAX_MSGS;
+
+    for (int probe = 0; probe < SIGNALS_MAX_MSGS; probe++) {
+        SIGNAL_MSG *msg = &msgs[hash];
+        if (!msg->used) {
+            if (!create) return NULL;
+            msg->used = true;
+            msg->id = id;
+            msg->bus = bus;
+            msg->first = -1;
+            if (bus == 255) numAnyMsgs++;
+            else numBusMsgs++;
+            return msg;
+        }
+        if (msg->id == id && msg->bus == bus) return msg;
+        if (++hash == SIGNALS_MAX_MSGS) hash = 0;
+    }
+    return NULL;
+}
+
+void Signals::clear()
+{
+    for (int i = 0; i < SIGNALS_MAX_MSGS; i++) msgs[i].used = false;
+    numBusMsgs = 0;
+    numAnyMsgs = 0;
+    numSigs = 0;
+    outCount = 0;
+}
+
+/*
+ * Add one signal and work out its extraction plan.
+ * Little endian (Intel) signals: start bit is the LSB, value = (payload >> start) & mask.
+ * Big endian (Motorola) signals: DBC start bit is the MSB in the sawtooth numbering. With the payload
+ * byte swapped so byte 0 is the most significant, the LSB sits at bit 63 - (msb position + length - 1).
+ * flags: bit 0 = big endian, bit 1 = signed
+ */
+uint8_t Signals::addSignal(uint32_t id, uint8_t bus, uint8_t startBit, uint8_t length, uint8_t flags, float scale, float offset)
+{
+    if (length == 0 || length > 64 || startBit > 63) return ADD_BAD;
+
+    int shift;
+    if (flags & 1) {
+        int msbPos = (startBit / 8) * 8 + (7 - (startBit % 8)); //sequential position counting from the first bit on the wire
+        shift = 64 - msbPos - length;
+    } else shift = startBit;
+    if (shift < 0 || shift + length > 64) return ADD_BAD;
+
+    if (numSigs >= SIGNALS_MAX) return ADD_FULL;
+    SIGNAL_MSG *msg = findMsg(id, bus, true);
+    if (!msg) return ADD_FULL;
+
+    SIGNAL_DEF *sig = &sigs[numSigs];
+    sig->shift = shift;
+    sig->length = length;
+    sig->bigEndian = flags & 1;
+    sig->isSigned = (flags & 2) ? true : false;
+    sig->mask = (length == 64) ? 0xFFFFFFFFFFFFFFFFull : ((1ull << length) - 1);
+    sig->scale = scale;
+    sig->offset = offset;
+    sig->seen = false;
+    sig->lastRaw = 0;
+
+    //keep the list in table order so the index the host knows a signal by never changes
+    sig->next = -1;
+    if (msg->first < 0) msg->first = numSigs;
+    else {
+        int16_t last = msg->first;
+        while (sigs[last].next >= 0) last = sigs[last].next;
+        sigs[last].next = numSigs;
+    }
+    numSigs++;
+    return ADD_OK;
+}
+
+float Signals::physical(SIGNAL_DEF *sig)
+{
+    uint64_t raw = sig->lastRaw;
+    if (sig->isSigned && sig->length < 64 && ((raw >> (sig->length - 1)) & 1)) raw |= ~sig->mask;
+    if (sig->isSigned) return (float)(int64_t)raw * sig->scale + sig->offset;
+    return (float)raw * sig->scale + sig->offset;
+}
+
+void Signals::decode(SIGNAL_MSG *msg, uint64_t le, uint64_t be)
+{
+    for (int16_t idx = msg->first; idx >= 0; idx = sigs[idx].next) {
+        SIGNAL_DEF *sig = &sigs[idx];
+        uint64_t raw = ((sig->bigEndian ? be : le) >> sig->shift) & sig->mask;
+        if (sig->seen && raw == sig->lastRaw) continue;
+        sig->lastRaw = raw;
+        sig->seen = true;
+        if (mode == MODE_CHANGE) queueValue(idx);
+    }
+}
+
+/*
+ * Called for every received frame before it is streamed. Returns true if the raw frame should be
+ * left out of the USB stream because only decoded values are wanted.
+ * Signals set up for this bus and signals set up for any bus are both decoded.
+ */
+boolean Signals::processFrame(CAN_FRAME &frame, int whichBus)
+{
+    if (mode == MODE_OFF) return false;
+
+    uint32_t id = frame.id & 0x7FFFFFFF;
+    if (frame.extended) id |= 1ul << 31;
+    SIGNAL_MSG *busMsg = numBusMsgs ? findMsg(id, whichBus, false) : NULL;
+    SIGNAL_MSG *anyMsg = numAnyMsgs ? findMsg(id, 255, false) : NULL;
+    if (!busMsg && !anyMsg) return !keepRaw;
+
+    uint64_t le = frame.data.value;
+    if (frame.length < 8) le &= (1ull << (frame.length * 8)) - 1;
+    uint64_t be = __builtin_bswap64(le);
+
+    if (busMsg) decode(busMsg, le, be);
+    if (anyMsg) decode(anyMsg, le, be);
+    if (mode == MODE_CHANGE) flushValues();
+    return !keepRaw;
+}
+
+void Signals::loop()
+{
+    if (mode != MODE_RATE) return;
+    if (millis() - lastSnapshot < rate) return;
+    lastSnapshot = millis();
+
+    for (uint16_t idx = 0; idx < numSigs; idx++) {
+        if (sigs[idx].seen) queueValue(idx);
+    }
+    flushValues();
+}
+
+/*
+ * 0xF1, PROTO_SIGNALS, REC_VALUES, time uS (4 bytes), count, then count times:
+ * signal index (2 bytes, order the signals were added), physical value (4 byte IEEE float)
+ */
+void Signals::queueValue(uint16_t index)
+{
+    if (outCount >= SIGNALS_PER_RECORD) flushValues();
+
+    float val = physical(&sigs[index]);
+
+    if (SysSettings.lawicelMode) return;
+    if (!settings.useBinarySerialComm) {
+        SerialUSB.print("SIG ");
+        SerialUSB.print(index);
+        SerialUSB.print(" ");
+        SerialUSB.print(val, 4);
+        SerialUSB.println();
+        return;
+    }
+
+    uint8_t *entry = outBuff + 8 + outCount * 6;
+    entry[0] = (uint8_t)(index & 0xFF);
+    entry[1] = (uint8_t)(index >> 8);
+    memcpy(entry + 2, &val, 4);
+    outCount++;
+}
+
+void Signals::flushValues()
+{
+    if (outCount == 0) return;
+    uint32_t now = micros();
+    outBuff[0] = 0xF1;
+    outBuff[1] = PROTO_SIGNALS;
+    outBuff[2] = REC_VALUES;
+    for (int i = 0; i < 4; i++) outBuff[3 + i] = (uint8_t)(now >> (i * 8));
+    outBuff[7] = outCount;
+    bufferUSBBytes(outBuff, 8 + outCount * 6);
+    outCount = 0;
+}
+
+void Signals::setMode(uint8_t newMode, uint16_t newRate, boolean newKeepRaw)
+{
+    if (newMode > MODE_RATE) newMode = MODE_OFF;
+    if (newRate < 1) newRate = 1;
+    mode = newMode;
+    rate = newRate;
+    keepRaw = newKeepRaw;
+}
+
+uint8_t Signals::getMode()
+{
+    return mode;
+}
+
+uint16_t Signals::getRate()
+{
+    return rate;
+}
+
+boolean Signals::getKeepRaw()
+{
+    return keepRaw;
+}
+
+//number of data bytes that follow each sub command byte
+int Signals::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_ADD_SIGNAL:
+        return 16;
+    case CMD_SET_MODE:
+        return 4;
+    }
+    return 0;
+}
+
+/*
+ * CMD_CLEAR - remove every signal
+ * CMD_ADD_SIGNAL - ID (4 bytes, bit 31 = extended), bus (255 = any), start bit, length, flags (bit 0 = big endian,
+ *                  bit 1 = signed), scale (4 byte float), offset (4 byte float). Answered with a status record
+ * CMD_SET_MODE - mode (SIGNAL_MODE), rate ms (2 bytes), keep raw frames (0 / 1)
+ */
+void Signals::handleCommand(uint8_t *data)
+{
+    float scale, offset;
+
+    switch (data[0]) {
+    case CMD_CLEAR:
+        clear();
+        break;
+    case CMD_ADD_SIGNAL:
+        memcpy(&scale, data + 9, 4);
+        memcpy(&offset, data + 13, 4);
+        sendStatus(addSignal(data[1] + ((uint32_t)data[2] << 8) + ((uint32_t)data[3] << 16) + ((uint32_t)data[4] << 24),
+                             data[5], data[6], data[7], data[8], scale, offset));
+        break;
+    case CMD_SET_MODE:
+        setMode(data[1], data[2] + ((uint16_t)data[3] << 8), data[4]);
+        break;
+    case CMD_GET_STATUS:
+        sendStatus(ADD_OK);
+        break;
+    }
+}
+
+void Signals::printValues()
+{
+    Logger::console("Signal decoding mode %i, rate %i ms, raw frames %s, %i signals loaded", mode, rate,
+                    keepRaw ? "kept" : "dropped", numSigs);
+    for (uint16_t idx = 0; idx < numSigs; idx++) {
+        if (sigs[idx].seen) Logger::console("%i: %f", idx, physical(&sigs[idx]));
+        else Logger::console("%i: not seen yet", idx);
+    }
+}
+
+//0xF1, PROTO_SIGNALS, CMD_GET_STATUS, result of the last add (ADD_RESULT), signals loaded (2 bytes), mode
+void Signals::sendStatus(uint8_t result)
+{
+    uint8_t buff[7];
+    buff[0] = 0xF1;
+    buff[1] = PROTO_SIGNALS;
+    buff[2] = CMD_GET_STATUS;
+    buff[3] = result;
+    buff[4] = (uint8_t)(numSigs & 0xFF);
+    buff[5] = (uint8_t)(numSigs >> 8);
+    buff[6] = mode;
+    bufferUSBBytes(buff, 7);
+}
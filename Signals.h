@@ -0,0 +1,119 @@
+/*
+ * Signals.h
+ *
+ * Decodes physical signal values on the device from a signal table compiled from a DBC
+ * by a host tool. Each signal gets a precomputed shift / mask plan at load time so decoding
+ * a frame is a table lookup, a shift and a mask per signal.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SIGNALS_H_
+#define SIGNALS_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct SIGNAL_DEF {
+    uint8_t shift; //right shift of the 64 bit payload (byte swapped first for big endian signals)
+    uint8_t length;
+    boolean bigEndian;
+    boolean isSigned;
+    uint64_t mask;
+    float scale;
+    float offset;
+    int16_t next; //next signal in the same message, -1 at the end
+    boolean seen;
+    uint64_t lastRaw;
+};
+
+struct SIGNAL_MSG {
+    boolean used;
+    uint32_t id; //bit 31 set for extended
+    uint8_t bus; //255 = any bus
+    int16_t first; //first signal of this message
+};
+
+class Signals
+{
+public:
+    enum SIGNAL_MODE {
+        MODE_OFF = 0,
+        MODE_CHANGE = 1, //send a signal when its raw value changes
+        MODE_RATE = 2 //send every signal seen so far at a fixed interval
+    };
+
+    enum SIGNAL_CMD {
+        CMD_CLEAR = 0,
+        CMD_ADD_SIGNAL = 1,
+        CMD_SET_MODE = 2,
+        CMD_GET_STATUS = 3
+    };
+
+    enum SIGNAL_RECORD { //sent to the host after 0xF1, PROTO_SIGNALS
+        REC_VALUES = 0x10
+    };
+
+    enum ADD_RESULT {
+        ADD_OK = 0,
+        ADD_FULL = 1,
+        ADD_BAD = 2
+    };
+
+    static boolean processFrame(CAN_FRAME &frame, int whichBus);
+    static void loop();
+    static void clear();
+    static uint8_t addSignal(uint32_t id, uint8_t bus, uint8_t startBit, uint8_t length, uint8_t flags, float scale, float offset);
+    static void setMode(uint8_t newMode, uint16_t newRate, boolean newKeepRaw);
+    static uint8_t getMode();
+    static uint16_t getRate();
+    static boolean getKeepRaw();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void printValues();
+    static void sendStatus(uint8_t result);
+
+private:
+    static SIGNAL_DEF sigs[SIGNALS_MAX];
+    static uint16_t numSigs;
+    static SIGNAL_MSG msgs[SIGNALS_MAX_MSGS];
+    static uint16_t numBusMsgs; //messages tied to one bus
+    static uint16_t numAnyMsgs; //messages on bus 255. Either table is only searched when it has any
+    static uint8_t mode;
+    static uint16_t rate; //ms between snapshots in MODE_RATE
+    static boolean keepRaw; //still stream raw frames while decoding
+    static uint32_t lastSnapshot;
+
+    //values waiting to be sent in the current record
+    static uint8_t outBuff[8 + SIGNALS_PER_RECORD * 6];
+    static uint8_t outCount;
+
+    static SIGNAL_MSG *findMsg(uint32_t id, uint8_t bus, boolean create);
+    static void decode(SIGNAL_MSG *msg, uint64_t le, uint64_t be);
+    static float physical(SIGNAL_DEF *sig);
+    static void queueValue(uint16_t index);
+    static void flushValues();
+};
+
+#endif /* SIGNALS_H_ */
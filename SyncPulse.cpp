@@ -0,0 +1,267 @@
+/*
+ * SyncPulse.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SyncPulse.h"
+#include "ClockSync.h"
+#include "Logger.h"
+#include "sys_io.h"
+
+uint8_t SyncPulse::mode = MODE_OFF;
+uint8_t SyncPulse::pin;
+uint64_t SyncPulse::lastPulse;
+uint32_t SyncPulse::pulses;
+uint32_t SyncPulse::skipped;
+uint32_t SyncPulse::errors;
+boolean SyncPulse::locked;
+boolean SyncPulse::inFrame;
+uint8_t SyncPulse::bitPos;
+uint32_t SyncPulse::frameNumber;
+uint64_t SyncPulse::lastEdge;
+volatile uint32_t SyncPulse::edgeRise;
+volatile uint32_t SyncPulse::edgeTimes[SYNC_EDGE_QUEUE];
+volatile uint16_t SyncPulse::edgeWidths[SYNC_EDGE_QUEUE];
+volatile uint8_t SyncPulse::edgeHead;
+uint8_t SyncPulse::edgeTail;
+
+static void syncPinInt()
+{
+    SyncPulse::edgeInterrupt();
+}
+
+void SyncPulse::setup()
+{
+    setMode(MODE_OFF, 0);
+}
+
+void SyncPulse::setMode(uint8_t newMode, uint8_t newPin)
+{
+    if (mode == MODE_SLAVE) detachInterrupt(getDigitalPin(pin));
+    if (mode == MODE_MASTER) setOutput(pin, false);
+
+    mode = MODE_OFF;
+    pin = newPin;
+    pulses = 0;
+    skipped = 0;
+    errors = 0;
+    locked = false;
+    inFrame = false;
+    edgeHead = 0;
+    edgeTail = 0;
+    lastPulse = 0;
+
+    if (newMode == MODE_SLAVE && newPin < NUM_DIGITAL) {
+        ClockSync::setExternal(true);
+        mode = MODE_SLAVE;
+        attachInterrupt(getDigitalPin(pin), syncPinInt, CHANGE);
+        return;
+    }
+    ClockSync::setExternal(false);
+    if (newMode == MODE_MASTER && newPin < NUM_OUTPUT) {
+        lastPulse = ClockSync::now64() / SYNC_PULSE_PERIOD;
+        mode = MODE_MASTER;
+    }
+}
+
+//marker pulse starts a frame, after it each pulse is a 0 or 1 bit of the frame number, LSB first
+uint16_t SyncPulse::pulseWidth(uint64_t pulse)
+{
+    uint8_t pos = pulse % SYNC_FRAME_PULSES;
+    if (pos == 0) return SYNC_WIDTH_MARKER;
+    if (((pulse / SYNC_FRAME_PULSES) >> (pos - 1)) & 1) return SYNC_WIDTH_ONE;
+    return SYNC_WIDTH_ZERO;
+}
+
+/*
+ * The edge is placed by spinning with interrupts off once the next grid point is less than
+ * SYNC_SPIN_US away, so loop() jitter doesn't show up in it. If loop() only gets here after
+ * the grid point has passed, that pulse is skipped rather than sent late; slaves count grid
+ * points, not pulses, so a gap does no harm.
+ */
+void SyncPulse::runMaster()
+{
+    uint64_t now = ClockSync::now64();
+    uint64_t pulse = now / SYNC_PULSE_PERIOD;
+
+    if (pulse > lastPulse) { //grid point already gone by
+        skipped += pulse - lastPulse;
+        lastPulse = pulse;
+    }
+    uint64_t edge = (lastPulse + 1) * SYNC_PULSE_PERIOD;
+    if (edge - now > SYNC_SPIN_US) return;
+
+    uint32_t target = (uint32_t)edge;
+    uint16_t width = pulseWidth(lastPulse + 1);
+    noInterrupts();
+    while ((int32_t)(micros() - target) < 0) ;
+    setOutput(pin, true);
+    interrupts();
+    while ((int32_t)(micros() - target) < width) ;
+    setOutput(pin, false);
+    lastPulse++;
+    pulses++;
+}
+
+//both edges of the input. getDigital() already undoes the active low wiring, so true is the start of a pulse
+void SyncPulse::edgeInterrupt()
+{
+    uint32_t now = micros();
+
+    if (getDigital(pin)) {
+        edgeRise = now;
+        return;
+    }
+    if (!edgeRise) return;
+    uint8_t next = (edgeHead + 1) % SYNC_EDGE_QUEUE;
+    if (next != edgeTail) {
+        edgeTimes[edgeHead] = edgeRise;
+        edgeWidths[edgeHead] = (uint16_t)((now - edgeRise) > 0xFFFF ? 0xFFFF : (now - edgeRise));
+        edgeHead = next;
+    }
+    edgeRise = 0;
+}
+
+void SyncPulse::takePulse(uint64_t edge, uint16_t width)
+{
+    boolean marker = width >= (SYNC_WIDTH_ONE + SYNC_WIDTH_MARKER) / 2;
+    uint8_t bit = width >= (SYNC_WIDTH_ZERO + SYNC_WIDTH_ONE) / 2;
+
+    if (width < SYNC_WIDTH_ZERO / 2) return; //glitch
+    pulses++;
+
+    if (locked) {
+        //whole periods since the last pulse used, so pulses the master skipped don't matter
+        uint64_t pulse = lastPulse + ((edge - lastEdge) + SYNC_PULSE_PERIOD / 2) / SYNC_PULSE_PERIOD;
+        if (marker != (pulseWidth(pulse) == SYNC_WIDTH_MARKER) || (!marker && bit != (pulseWidth(pulse) == SYNC_WIDTH_ONE))) {
+            errors++;
+            locked = false;
+            inFrame = false;
+            ClockSync::reset();
+            Logger::debug("Sync pulse %i didn't match, relocking", (uint32_t)pulse);
+        } else {
+            lastPulse = pulse;
+            lastEdge = edge;
+            if ((pulse % SYNC_SAMPLE_EVERY) == 0) ClockSync::addReference(edge, pulse * SYNC_PULSE_PERIOD);
+            return;
+        }
+    }
+
+    //not locked: read a whole frame to learn the pulse number
+    if (inFrame && (edge - lastEdge) > SYNC_PULSE_PERIOD * 3 / 2) inFrame = false; //missed one, start over
+    lastEdge = edge;
+    if (marker) {
+        inFrame = true;
+        bitPos = 0;
+        frameNumber = 0;
+        return;
+    }
+    if (!inFrame) return;
+    frameNumber |= (uint32_t)bit << bitPos;
+    if (++bitPos < SYNC_FRAME_PULSES - 1) return;
+
+    lastPulse = (uint64_t)frameNumber * SYNC_FRAME_PULSES + SYNC_FRAME_PULSES - 1;
+    locked = true;
+    inFrame = false;
+    ClockSync::addReference(edge, lastPulse * SYNC_PULSE_PERIOD);
+    Logger::debug("Locked to sync pulse %i", (uint32_t)lastPulse);
+}
+
+void SyncPulse::runSlave()
+{
+    while (edgeTail != edgeHead) {
+        uint64_t now = ClockSync::now64();
+        uint32_t rise = edgeTimes[edgeTail];
+        uint16_t width = edgeWidths[edgeTail];
+        edgeTail = (edgeTail + 1) % SYNC_EDGE_QUEUE;
+        takePulse(now - (uint32_t)((uint32_t)now - rise), width);
+    }
+}
+
+void SyncPulse::loop()
+{
+    if (mode == MODE_MASTER) runMaster();
+    else if (mode == MODE_SLAVE) runSlave();
+}
+
+int SyncPulse::commandLength(uint8_t cmd)
+{
+    if (cmd == CMD_SET) return 2;
+    return 0;
+}
+
+/*
+ * data[0] is the sub command
+ * CMD_SET - mode (SYNC_MODE), output number for a master or input number for a slave
+ * CMD_GET - send the status
+ */
+void SyncPulse::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_SET:
+        setMode(data[1], data[2]);
+        break;
+    case CMD_GET:
+        sendStatus();
+        break;
+    }
+}
+
+/*
+ * 0xF1, PROTO_SYNC_PULSE, CMD_GET, mode, pin, locked, pulses, skipped, errors (4 bytes each),
+ * last pulse number (4 bytes)
+ */
+void SyncPulse::sendStatus()
+{
+    uint8_t buff[22];
+    uint32_t vals[4] = {pulses, skipped, errors, (uint32_t)lastPulse};
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_SYNC_PULSE;
+    buff[2] = CMD_GET;
+    buff[3] = mode;
+    buff[4] = pin;
+    buff[5] = locked;
+    for (int v = 0; v < 4; v++) {
+        buff[6 + v * 4] = (uint8_t)(vals[v] & 0xFF);
+        buff[7 + v * 4] = (uint8_t)(vals[v] >> 8);
+        buff[8 + v * 4] = (uint8_t)(vals[v] >> 16);
+        buff[9 + v * 4] = (uint8_t)(vals[v] >> 24);
+    }
+    SerialUSB.write(buff, 22);
+}
+
+void SyncPulse::printStatus()
+{
+    switch (mode) {
+    case MODE_MASTER:
+        Logger::console("Sync master on output %i: %i pulses sent, %i skipped", pin, pulses, skipped);
+        break;
+    case MODE_SLAVE:
+        Logger::console("Sync slave on input %i: %s, %i pulses seen, %i mismatches", pin, locked ? "locked" : "not locked", pulses, errors);
+        break;
+    default:
+        Logger::console("Sync pulse off");
+    }
+}
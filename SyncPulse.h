@@ -0,0 +1,88 @@
+/*
+ * SyncPulse.h
+ *
+ * Shared timeline for several units without a host. The master drives a digital output high
+ * on a fixed grid of its own clock, every SYNC_PULSE_PERIOD uS. Pulse widths spell out the
+ * pulse number: a long marker pulse every SYNC_FRAME_PULSES pulses, then one bit of the frame
+ * number per pulse. Slaves time the leading edge on a digital input from the pin interrupt,
+ * decode the pulse number, and feed (own time, master time) pairs to ClockSync. Their frame
+ * stamps then follow the master's clock.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SYNCPULSE_H_
+#define SYNCPULSE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+class SyncPulse
+{
+public:
+    enum SYNC_MODE {
+        MODE_OFF = 0,
+        MODE_MASTER = 1, //drives the pulse on a digital output
+        MODE_SLAVE = 2 //follows the pulse on a digital input
+    };
+
+    enum SYNC_CMD {
+        CMD_SET = 0,
+        CMD_GET = 1
+    };
+
+    static void setup();
+    static void loop();
+    static void setMode(uint8_t mode, uint8_t pin);
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void sendStatus();
+    static void printStatus();
+    static void edgeInterrupt();
+
+private:
+    static uint8_t mode;
+    static uint8_t pin; //output number for a master, input number for a slave
+    static uint64_t lastPulse; //pulse number last sent or matched
+    static uint32_t pulses;
+    static uint32_t skipped; //master: loop() came round too late to hit the edge
+    static uint32_t errors; //slave: pulse width didn't fit the pulse number we expected
+    static boolean locked;
+    static boolean inFrame;
+    static uint8_t bitPos;
+    static uint32_t frameNumber;
+    static uint64_t lastEdge; //slave time of the last pulse used
+    static volatile uint32_t edgeRise; //micros() of the leading edge being timed
+    static volatile uint32_t edgeTimes[SYNC_EDGE_QUEUE];
+    static volatile uint16_t edgeWidths[SYNC_EDGE_QUEUE];
+    static volatile uint8_t edgeHead;
+    static uint8_t edgeTail;
+
+    static uint16_t pulseWidth(uint64_t pulse);
+    static void runMaster();
+    static void runSlave();
+    static void takePulse(uint64_t edge, uint16_t width);
+};
+
+#endif /* SYNCPULSE_H_ */
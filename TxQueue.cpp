@@ -0,0 +1,272 @@
+/*
+ * TxQueue.cpp
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "TxQueue.h"
+#include "Logger.h"
+#include "sys_io.h"
+#include "Buses.h"
+
+TXQ_BUS TxQueue::queues[NUM_BUSES];
+uint8_t TxQueue::depth = TXQ_MAX_DEPTH;
+boolean TxQueue::acksEnabled = false;
+uint16_t TxQueue::nextSeq = 0;
+
+/*
+ * Build a key that sorts the same way the bus arbitrates. The 11 bit base ID goes first,
+ * then the SRR/IDE bits (a standard frame beats an extended one with the same base ID),
+ * then the 18 bit extension.
+ */
+uint32_t TxQueue::priorityOf(CAN_FRAME &frame)
+{
+    if (frame.extended) return (((frame.id >> 18) & 0x7FF) << 19) | (1ul << 18) | (frame.id & 0x3FFFF);
+    return (frame.id & 0x7FF) << 19;
+}
+
+/*
+ * Accept a frame for transmission. Never blocks. If the queue for the bus is full the frame is
+ * refused, counted and (if enabled) a failure ack goes back to the host.
+ */
+boolean TxQueue::queueFrame(CAN_FRAME &frame, uint8_t bus)
+{
+    if (bus >= NUM_BUSES) return false;
+
+    TXQ_BUS *q = &queues[bus];
+    uint32_t prio = priorityOf(frame);
+
+    if (q->count >= depth) {
+        refuse(frame, bus);
+        return false;
+    }
+    uint16_t seq = nextSeq++;
+
+    //find the insert point. Frames of equal priority stay in FIFO order so the new one goes
+    //in front of (below) any existing frames with the same key
+    int pos = 0;
+    while (pos < q->count && q->entries[pos].priority > prio) pos++;
+    for (int i = q->count; i > pos; i--) q->entries[i] = q->entries[i - 1];
+
+    q->entries[pos].frame = frame;
+    q->entries[pos].frame.rtr = 0;
+    q->entries[pos].priority = prio;
+    q->entries[pos].queuedAt = millis();
+    q->entries[pos].seq = seq;
+    q->count++;
+    q->queued++;
+    if (q->count > q->highWater) q->highWater = q->count;
+    return true;
+}
+
+//sequence number for a frame sent outside the queues, so the host's count of offered frames stays right
+uint16_t TxQueue::takeSeq()
+{
+    return nextSeq++;
+}
+
+//count a frame that had nowhere to wait and tell the host
+void TxQueue::refuse(CAN_FRAME &frame, uint8_t bus)
+{
+    TXQ_ENTRY rejected;
+    rejected.frame = frame;
+    rejected.seq = nextSeq++;
+    if (bus < NUM_BUSES) queues[bus].overflows++;
+    sendAck(bus, &rejected, TX_QUEUE_FULL);
+}
+
+/*
+ * Move as many frames as the controllers will take. When a controller refuses a frame
+ * we stop trying that bus for this pass; the frame stays at the head and is retried next time.
+ */
+void TxQueue::loop()
+{
+    uint32_t now = millis();
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        TXQ_BUS *q = &queues[bus];
+        if (swcanWakeBusy(bus)) continue; //let the high voltage wake up finish first
+        while (q->count > 0) {
+            TXQ_ENTRY *head = &q->entries[q->count - 1];
+            if (Buses::send(head->frame, bus)) {
+                q->sent++;
+                sendAck(bus, head, TX_COMPLETE);
+                q->count--;
+                SysSettings.txToggle = !SysSettings.txToggle;
+                setLED(SysSettings.LED_CANTX, SysSettings.txToggle);
+            } else {
+                q->retries++;
+                if (now - head->queuedAt > TXQ_TIMEOUT) {
+                    q->timeouts++;
+                    sendAck(bus, head, TX_TIMEOUT);
+                    q->count--;
+                    continue;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * 0xF1, PROTO_TX_ACK, bus, status (TXQ_STATUS), sequence (2 bytes), ID (4 bytes, bit 31 = extended)
+ * TX_COMPLETE means the frame was handed to a controller mailbox that was empty at the time. An interrupt
+ * sending on the same bus can take that mailbox first, then it waits in the driver and the ack only means
+ * the driver accepted it.
+ * The sequence number counts every frame offered to the queues since acks were last enabled.
+ */
+void TxQueue::sendAck(uint8_t bus, TXQ_ENTRY *entry, uint8_t status)
+{
+    if (!acksEnabled || !settings.useBinarySerialComm) return;
+
+    uint8_t buff[10];
+    uint32_t id = entry->frame.id;
+    if (entry->frame.extended) id |= 1ul << 31;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_TX_ACK;
+    buff[2] = bus;
+    buff[3] = status;
+    buff[4] = (uint8_t)(entry->seq & 0xFF);
+    buff[5] = (uint8_t)(entry->seq >> 8);
+    buff[6] = (uint8_t)(id & 0xFF);
+    buff[7] = (uint8_t)(id >> 8);
+    buff[8] = (uint8_t)(id >> 16);
+    buff[9] = (uint8_t)(id >> 24);
+    bufferUSBBytes(buff, 10);
+}
+
+//number of data bytes that follow each sub command byte
+int TxQueue::commandLength(uint8_t cmd)
+{
+    switch (cmd) {
+    case CMD_SET_DEPTH:
+    case CMD_SET_ACKS:
+        return 1;
+    }
+    return 0;
+}
+
+void TxQueue::handleCommand(uint8_t *data)
+{
+    switch (data[0]) {
+    case CMD_SET_DEPTH:
+        setDepth(data[1]);
+        break;
+    case CMD_SET_ACKS:
+        setAcks(data[1]);
+        break;
+    case CMD_GET_STATS:
+        sendStats();
+        break;
+    case CMD_RESET_STATS:
+        resetStats();
+        break;
+    }
+}
+
+void TxQueue::setDepth(uint8_t newDepth)
+{
+    if (newDepth < 1) newDepth = 1;
+    if (newDepth > TXQ_MAX_DEPTH) newDepth = TXQ_MAX_DEPTH;
+    depth = newDepth; //frames already queued past the new depth still get sent
+}
+
+uint8_t TxQueue::getDepth()
+{
+    return depth;
+}
+
+void TxQueue::setAcks(boolean en)
+{
+    acksEnabled = en;
+    nextSeq = 0;
+}
+
+boolean TxQueue::getAcks()
+{
+    return acksEnabled;
+}
+
+int TxQueue::pending(uint8_t bus) //frames waiting to go out
+{
+    if (bus >= NUM_BUSES) return 0;
+    return queues[bus].count;
+}
+
+void TxQueue::resetStats()
+{
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        queues[bus].highWater = queues[bus].count;
+        queues[bus].queued = 0;
+        queues[bus].sent = 0;
+        queues[bus].retries = 0;
+        queues[bus].overflows = 0;
+        queues[bus].timeouts = 0;
+    }
+}
+
+/*
+ * 0xF1, PROTO_TX_QUEUE, CMD_GET_STATS, depth, number of buses
+ * then per bus: frames waiting, high water mark, queued, sent, retries, overflows, timeouts (4 bytes each)
+ */
+void TxQueue::sendStats()
+{
+    uint8_t buff[24];
+    uint32_t vals[5];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_TX_QUEUE;
+    buff[2] = CMD_GET_STATS;
+    buff[3] = depth;
+    buff[4] = NUM_BUSES;
+    SerialUSB.write(buff, 5);
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        TXQ_BUS *q = &queues[bus];
+        buff[0] = q->count;
+        buff[1] = q->highWater;
+        vals[0] = q->queued;
+        vals[1] = q->sent;
+        vals[2] = q->retries;
+        vals[3] = q->overflows;
+        vals[4] = q->timeouts;
+        for (int v = 0; v < 5; v++) {
+            buff[2 + v * 4] = (uint8_t)(vals[v] & 0xFF);
+            buff[3 + v * 4] = (uint8_t)(vals[v] >> 8);
+            buff[4 + v * 4] = (uint8_t)(vals[v] >> 16);
+            buff[5 + v * 4] = (uint8_t)(vals[v] >> 24);
+        }
+        SerialUSB.write(buff, 22);
+    }
+}
+
+void TxQueue::printStats()
+{
+    Logger::console("TX queue depth %i, acks %i", depth, acksEnabled);
+    for (int bus = 0; bus < NUM_BUSES; bus++) {
+        TXQ_BUS *q = &queues[bus];
+        Logger::console("Bus %i: waiting %i (max %i) queued %i sent %i retries %i overflows %i timeouts %i", bus, q->count,
+                        q->highWater, q->queued, q->sent, q->retries, q->overflows, q->timeouts);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * TxQueue.h
+ *
+ * Per bus transmit queues. Frames wait here in CAN priority order (the order the
+ * bus itself would arbitrate them) until a transmit mailbox is free.
+ *
+Copyright (c) 2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef TXQUEUE_H_
+#define TXQUEUE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "GVRET.h"
+
+struct TXQ_ENTRY {
+    CAN_FRAME frame;
+    uint32_t priority; //arbitration key, lower wins. See TxQueue::priorityOf()
+    uint32_t queuedAt; //millis() when the frame was accepted
+    uint16_t seq;
+};
+
+struct TXQ_BUS {
+    //kept sorted with the highest priority frame at the END so that dequeueing is just count--
+    TXQ_ENTRY entries[TXQ_MAX_DEPTH];
+    uint8_t count;
+    uint8_t highWater;
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t retries; //times the controller had no free mailbox for us
+    uint32_t overflows; //frames refused because the queue was full
+    uint32_t timeouts; //frames given up on after TXQ_TIMEOUT
+};
+
+class TxQueue
+{
+public:
+    enum TXQ_CMD {
+        CMD_SET_DEPTH = 0,
+        CMD_SET_ACKS = 1,
+        CMD_GET_STATS = 2,
+        CMD_RESET_STATS = 3
+    };
+
+    enum TXQ_STATUS {
+        TX_COMPLETE = 0,
+        TX_QUEUE_FULL = 1,
+        TX_TIMEOUT = 2
+    };
+
+    static boolean queueFrame(CAN_FRAME &frame, uint8_t bus);
+    static void loop();
+    static int commandLength(uint8_t cmd);
+    static void handleCommand(uint8_t *data);
+    static void setDepth(uint8_t newDepth);
+    static uint8_t getDepth();
+    static void setAcks(boolean en);
+    static boolean getAcks();
+    static int pending(uint8_t bus);
+    static void resetStats();
+    static void sendStats();
+    static void printStats();
+    static uint16_t takeSeq();
+    static void refuse(CAN_FRAME &frame, uint8_t bus);
+    static void sendAck(uint8_t bus, TXQ_ENTRY *entry, uint8_t status);
+
+private:
+    static TXQ_BUS queues[NUM_BUSES];
+    static uint8_t depth;
+    static boolean acksEnabled;
+    static uint16_t nextSeq;
+
+    static uint32_t priorityOf(CAN_FRAME &frame);
+};
+
+#endif /* TXQUEUE_H_ */
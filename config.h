@@ -43,6 +43,19 @@ struct FILTER {  //should be 10 bytes
     boolean enabled;
 };
 
+//CAN FD frame as it moves through the binary protocol and the log files.
+//Classic frames keep using CAN_FRAME; these only exist where a payload can be longer than 8 bytes
+struct CAN_FD_FRAME {
+    uint32_t id;
+    boolean extended;
+    uint8_t flags; //FD_FLAG_BRS, FD_FLAG_ESI
+    uint8_t length; //always one of the FD sizes: 0 - 8, 12, 16, 20, 24, 32, 48, 64
+    uint8_t data[64];
+};
+
+#define FD_FLAG_BRS		1 //bit rate switch for the data phase
+#define FD_FLAG_ESI		2 //error state indicator of the sender
+
 enum FILEOUTPUTTYPE {
     NONE = 0,
     BINARYFILE = 1,
@@ -50,17 +63,68 @@ enum FILEOUTPUTTYPE {
     CRTD = 3
 };
 
-struct EEPROMSettings { //Must stay under 256 - currently somewhere around 222
+//CAN buses. Bus numbers index the bus table in Buses.cpp and every per bus array in the firmware
+#define NUM_BUSES		3 //CAN0, CAN1, SWCAN. Boards with more controllers raise this and add them to the table
+#define NUM_BUS_FILTERS	8 //one per mailbox
+#define BUS_RX_RING_LEN	64 //frames held per bus between the receive interrupts and loop()
+#define BUS_LOAD_SLOT_MS	100 //bus load is summed over slots this long. Error counters are sampled at the same rate
+#define BUS_LOAD_SLOTS	10 //slots in the sliding load window, so the average covers one second
+#define AUTOBAUD_WINDOW		100 //ms a candidate rate gets to see traffic before the next one is tried
+#define AUTOBAUD_MIN_FRAMES	2 //error free frames needed to lock onto a rate
+#define AUTOBAUD_TIMEOUT	5000 //ms before a search with no result gives up and restores the old rate
+#define CYCLES_PER_US		(VARIANT_MCK / 1000000) //DWT cycle counter ticks per microsecond. Frames are stamped with it on receive
+
+//Gateway between buses
+#define GW_MAX_RULES	32
+#define GW_HASH_SIZE	64 //rule lookup slots, a power of two at least twice GW_MAX_RULES so probes stay short
+#define GW_HIST_BINS	12 //latency histogram buckets: under 1uS, then 1, 2, 4 ... 1024uS and up
+#define GW_PIN_DEBOUNCE	4 //ms a pass pin has to hold a new level before forwarding follows it
+
+//Latency timing
+#define LAT_HIST_BINS	21 //under 1uS, then 1, 2, 4 ... 512K uS and up. SD writes can take most of a second
+#define LAT_INJECT_ID	0x7FE //ID of the synthetic frames fed in by the latency inject command
+#define PROF_HIST_BINS	16 //loop() profiling buckets: under 1uS, then 1, 2, 4 ... 16K uS and up
+#define BENCH_DEFAULT_FRAMES	1000 //frames per output mode when the benchmark isn't given a count
+#define BENCH_SCRATCH_SIZE	512 //scratch buffer the benchmark output is written into
+
+//Traffic generator
+#define GEN_MAX_LEARNED		32 //IDs a learned profile can hold
+#define GEN_MAX_PER_LOOP	8 //frames one bus may send per pass through loop(), the controller only has a few mailboxes anyway
+#define GEN_MAX_CREDIT_US	2000 //longest stretch of unused load that can be made up for
+#define GEN_TAG_MARK		0xA0 //first data byte of a tagged frame is this plus the source bus
+
+//Host clock sync
+#define CLOCK_SYNC_SAMPLES	16 //ping exchanges the offset and drift fit is made over
+#define CLOCK_SYNC_DELAY_SLACK	200 //uS an exchange's round trip may exceed the quickest one by and still be used
+
+//Hardware sync pulse between units
+#define SYNC_PULSE_PERIOD	100000ull //uS between pulses on the master's clock
+#define SYNC_FRAME_PULSES	32 //marker pulse plus one bit per pulse of the frame number
+#define SYNC_WIDTH_ZERO		150 //uS pulse widths
+#define SYNC_WIDTH_ONE		300
+#define SYNC_WIDTH_MARKER	600
+#define SYNC_SPIN_US		250 //how close to the edge the master stops loop() and waits for it
+#define SYNC_SAMPLE_EVERY	10 //pulses between the ones handed to the clock fit
+#define SYNC_EDGE_QUEUE		4
+
+//Binary command parser
+#define CMD_BUFF_SIZE		512 //bytes read from USB and waiting to be decoded. Bigger than the largest packet
+#define CMD_MAX_PER_LOOP	2048 //most bytes decoded per pass through loop() so a flood can't starve the buses
+#define CMD_TIMEOUT		50 //mS a half received packet is waited on before decoding moves past it
+#define CMD_MAX_PROTO		64 //protocol bytes the handler table can index
+
+struct BUS_SETTINGS { //everything stored for one bus - about 100 bytes
+    uint32_t speed;
+    boolean enabled;
+    boolean listenOnly; //if true we don't allow any messing with the bus but rather just passively monitor.
+    FILTER filters[NUM_BUS_FILTERS];
+};
+
+struct EEPROMSettings { //Spans two EEPROM pages - currently somewhere around 380 bytes
     uint8_t version;
 
-    uint32_t CAN0Speed;
-    uint32_t CAN1Speed;
-    uint32_t SWCANSpeed;
-    boolean CAN0_Enabled;
-    boolean CAN1_Enabled;
+    BUS_SETTINGS buses[NUM_BUSES];
     boolean singleWire_Enabled; //On older hardware tries to turn CAN1 into SW, newer hardware has dedicated chips for it
-    FILTER CAN0Filters[8]; // filters for our 8 mailboxes - 10*8 = 80 bytes
-    FILTER CAN1Filters[8]; // filters for our 8 mailboxes - 10*8 = 80 bytes
 
     boolean useBinarySerialComm; //use a binary protocol on the serial link or human readable format?
     FILEOUTPUTTYPE fileOutputType; //what format should we use for file output?
@@ -76,9 +140,6 @@ struct EEPROMSettings { //Must stay under 256 - currently somewhere around 222
 
     uint16_t valid; //stores a validity token to make sure EEPROM is not corrupt
 
-    boolean CAN0ListenOnly; //if true we don't allow any messing with the bus but rather just passively monitor.
-    boolean CAN1ListenOnly;
-    boolean SWCANListenOnly;
 };
 
 struct DigitalCANToggleSettings { //16 bytes
@@ -109,8 +170,7 @@ struct DigitalCANToggleSettings { //16 bytes
 
 struct SystemSettings {
     uint8_t eepromWPPin;
-    uint8_t CAN0EnablePin;
-    uint8_t CAN1EnablePin;
+    uint8_t busEnablePin[NUM_BUSES]; //transceiver enable for each bus, 255 if there is none
     uint8_t SWCANMode0Pin;
     uint8_t SWCANMode1Pin;
     boolean useSD; //should we attempt to use the SDCard? (No logging possible otherwise)
@@ -148,10 +208,76 @@ extern DigitalCANToggleSettings digToggleSettings;
 //The host should be polling every 1ms or so and so this time should be a small multiple of that
 #define SER_BUFF_FLUSH_INTERVAL	2000
 
+//bit change tracker. A busy vehicle bus carries 100 - 200 IDs, each one costs 24 bytes of RAM
+#define BITTRACK_MAX_IDS	256 //distinct (bus, ID) pairs followed at once
+#define BITTRACK_MAX_COUNTED	48 //IDs that can have per bit toggle counts (128 bytes each). Only IDs whose data changes use one
+#define BITTRACK_MAX_PROBES	8 //hash slots looked at before a frame is counted as untracked
+
+//periodic transmit table. The timer is programmed for the next deadline so the period is not quantized
+#define PERIODIC_MAX_ENTRIES	16
+#define PERIODIC_MIN_PERIOD		100 //uS. Anything faster than this would swamp the bus and the CPU
+#define PERIODIC_MAX_PERIOD		600000000ul //uS, longest period or phase. Keeps deadlines well inside the 32 bit micros() window
+#define PERIODIC_MAX_WAIT		1000000 //uS the timer is programmed for at most. Later deadlines re-arm it until they come up
+#define PERIODIC_TIMER			TC1 //TC1 channel 0 is TC3 in the Due's numbering
+#define PERIODIC_TIMER_CH		0
+#define PERIODIC_TIMER_ID		ID_TC3
+#define PERIODIC_TIMER_IRQ		TC3_IRQn
+#define PERIODIC_TIMER_HANDLER	TC3_Handler
+
+//transmit queues. Frames wait here (in CAN priority order) until the controller has a free mailbox
+#define TXQ_MAX_DEPTH	64 //upper limit, the active depth can be lowered at run time
+#define TXQ_TIMEOUT		250 //ms a frame may wait for a mailbox before we give up on it
+
+//single wire CAN high voltage wake up. The transceiver is held in wake mode this long before and after the wake frame
+#define SWCAN_WAKE_SETTLE	1000 //uS
+#define SWCAN_WAKE_QUEUE	4 //wake frames that can be waiting at once
+#define SWCAN_WAKE_TIMER		TC1 //TC1 channel 1 is TC4 in the Due's numbering. Times the settle periods
+#define SWCAN_WAKE_TIMER_CH		1
+#define SWCAN_WAKE_TIMER_ID		ID_TC4
+#define SWCAN_WAKE_TIMER_IRQ	TC4_IRQn
+#define SWCAN_WAKE_TIMER_HANDLER	TC4_Handler
+
+//bulk transmit command. One batch can carry this many frames (18 bytes each worst case)
+#define BULK_MAX_FRAMES		64 //no point going past TXQ_MAX_DEPTH, an untimed batch has to fit in the queue
+#define BULK_BUFF_SIZE		(3 + BULK_MAX_FRAMES * 18 + 2)
+
+//SD card replay
+#define REPLAY_READ_BUFF	1024 //bytes read from the card at a time
+#define REPLAY_LINE_LEN		128 //longest text log line we parse
+#define REPLAY_QUEUE_LEN	32 //parsed frames waiting for their send time
+#define REPLAY_MAX_REMAP	8
+#define REPLAY_HIST_BUCKETS	8
+#define REPLAY_NAME_LEN		32
+#define REPLAY_LOOP_GAP		1000 //uS between the end of the file and the start of the next pass
+#define REPLAY_TIMEOUT		250000 //uS past its send time a frame may wait for a busy controller before it is dropped
+
+//triggered capture
+#define CAPTURE_RING_LEN	512 //frames of history kept in RAM (20 bytes each)
+#define CAPTURE_FLUSH_FRAMES	16 //frames saved per loop() pass once triggered
+#define CAPTURE_DEFAULT_PRE	2000 //ms
+#define CAPTURE_DEFAULT_POST	1000 //ms
+
+//ISO-TP. Each channel holds one PDU being reassembled, sending shares one more buffer
+#define ISOTP_MAX_CHANNELS	4
+#define ISOTP_MAX_PDU		1024 //protocol allows 4095 but that is a lot of RAM per channel
+#define ISOTP_TIMEOUT		1000 //ms, N_Bs and N_Cr
+
+//J1939 transport protocol reassembly and per PGN statistics
+#define J1939_MAX_SESSIONS	4 //BAM or RTS/CTS transfers followed at once
+#define J1939_MAX_LEN		1785 //255 packets of 7 bytes
+#define J1939_MAX_PGNS		64
+#define J1939_TIMEOUT		1250 //ms without a packet before a transfer is dropped (T1 is 750, T2 1250)
+
+//on device signal decoding from a compiled DBC table
+#define SIGNALS_MAX			256 //about 40 bytes each
+#define SIGNALS_MAX_MSGS	128 //distinct (bus, ID) pairs carrying signals
+#define SIGNALS_PER_RECORD	32 //values packed into one binary record
+
 #define CFG_BUILD_NUM	343
 #define CFG_VERSION "GVRET alpha 2017-11-09"
 #define EEPROM_PAGE		275 //this is within an eeprom space currently unused on GEVCU so it's safe
-#define EEPROM_VER		0x17
+#define EEPROM_TOGGLE_PAGE	277 //the main settings take two pages now
+#define EEPROM_VER		0x1A
 
 #define CANDUE_EEPROM_WP_PIN	18
 #define CANDUE_CAN0_EN_PIN		50
@@ -161,6 +161,13 @@ boolean getDigital(uint8_t which)
     return !(digitalRead(dig[which]));
 }
 
+//Arduino pin behind one of the 4 digital inputs
+uint8_t getDigitalPin(uint8_t which)
+{
+    if (which >= NUM_DIGITAL) which = 0;
+    return dig[which];
+}
+
 //set output high or not
 void setOutput(uint8_t which, boolean active)
 {
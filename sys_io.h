@@ -44,6 +44,7 @@ uint16_t getAnalog(uint8_t which); //get value of one of the 4 analog inputs
 uint16_t getDiffADC(uint8_t which);
 uint16_t getRawADC(uint8_t which);
 boolean getDigital(uint8_t which); //get value of one of the 4 digital inputs
+uint8_t getDigitalPin(uint8_t which); //Arduino pin behind one of the 4 digital inputs, for attachInterrupt
 void setOutput(uint8_t which, boolean active); //set output high or not
 boolean getOutput(uint8_t which); //get current value of output state (high?)
 void setupFastADC();